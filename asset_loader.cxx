@@ -0,0 +1,441 @@
+#include "asset_loader.hxx"
+#include "mesh_file.hxx"
+#include "obj_reader.hxx"
+#include "renderer.hxx"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+
+typedef AssetLoadTimes::Clock Clock;
+
+// Goes into the hash of every OBJ source, so that cooked files are made
+// again once this changes.  Bump it whenever build_obj_meshes() builds
+// something different.
+static constexpr u64 obj_cook_version = 2u;
+
+// An asset on its way through the stages.  Each stage hands it on to the
+// next, so only one thread has it at a time.
+struct AssetLoader::Load {
+  std::string data;
+  u64 source_hash = 0u;
+  std::unique_ptr<ObjReader> reader;
+  LoadedAsset asset;
+};
+
+// OBJ files are Y-up and the scene is Z-up, this swaps the two axes.
+static constexpr Matrix4x4 obj_to_scene = [] {
+  Matrix4x4 mat(0.0f);
+  mat.set_row(0, 1.0f, 0.0f, 0.0f, 0.0f);
+  mat.set_row(1, 0.0f, 0.0f, 1.0f, 0.0f);
+  mat.set_row(2, 0.0f, 1.0f, 0.0f, 0.0f);
+  mat.set_row(3, 0.0f, 0.0f, 0.0f, 1.0f);
+  return mat;
+}();
+static_assert(obj_to_scene.transform_vector(Vector3(1.0f, 2.0f, 3.0f)) == Vector3(1.0f, 3.0f, 2.0f));
+
+// Vertex and index data come from the renderer, or are plain CPU-side data
+// when there is none, for cooking only.
+static VertexData *
+make_vertex_data(RendererVk *render, const VertexFormat &format) {
+  if (render != nullptr) {
+    return render->make_vertex_data(format);
+  }
+  VertexData *data = new VertexData;
+  data->format = format;
+  data->array_buffers.resize(format.arrays.size());
+  data->dirty_ranges.resize(format.arrays.size());
+  return data;
+}
+
+static IndexData *
+make_index_data(RendererVk *render, MaterialEnums::IndexType type) {
+  if (render != nullptr) {
+    return render->make_index_data(type);
+  }
+  IndexData *data = new IndexData;
+  data->type = type;
+  return data;
+}
+
+static bool
+read_source(const std::string &filename, std::string &data) {
+  std::ifstream stream(filename);
+  if (!stream.good()) {
+    return false;
+  }
+  std::ostringstream ss;
+  ss << stream.rdbuf();
+  data = ss.str();
+  return true;
+}
+
+static u64
+hash_obj_source(const std::string &data) {
+  return hash_bytes(data.data(), data.size(), obj_cook_version);
+}
+
+// Welds the vertices of the OBJ file's faces, and makes a mesh of every
+// object, all sharing one vertex and one index buffer.
+void
+build_obj_meshes(const ObjReader &reader, RendererVk *render, LoadedAsset &asset) {
+  struct VertexKey {
+    float vertex[3];
+    float normal[3];
+    float texcoord[2];
+
+    // Lexicographic, which std::map needs to find equal keys.
+    bool operator<(const VertexKey &other) const {
+      for (int i = 0; i < 3; ++i) {
+        if (vertex[i] != other.vertex[i]) {
+          return vertex[i] < other.vertex[i];
+        }
+      }
+      for (int i = 0; i < 3; ++i) {
+        if (normal[i] != other.normal[i]) {
+          return normal[i] < other.normal[i];
+        }
+      }
+      for (int i = 0; i < 2; ++i) {
+        if (texcoord[i] != other.texcoord[i]) {
+          return texcoord[i] < other.texcoord[i];
+        }
+      }
+      return false;
+    }
+  };
+  std::map<VertexKey, int> vertex_map;
+  std::map<const ObjFaceVert *, int> face_vert_map;
+
+  int vtx_count = 0;
+  int index_count = 0;
+  for (const ObjObject &obj : reader.objects) {
+    for (const ObjFace &face : obj.faces) {
+      index_count += (face.verts.size() - 2) * 3;
+      for (const ObjFaceVert &vert : face.verts) {
+        VertexKey key;
+        const float *obj_pos = reader.vertex[vert.vertex].data();
+        Vector3 pos = obj_to_scene.transform_point(Vector3(obj_pos[0], obj_pos[1], obj_pos[2]));
+        key.vertex[0] = pos[0];
+        key.vertex[1] = pos[1];
+        key.vertex[2] = pos[2];
+        key.normal[0] = 0.0f;
+        key.normal[1] = 0.0f;
+        key.normal[2] = 0.0f;
+        if (vert.normal != -1) {
+          const float *obj_normal = reader.normal[vert.normal].data();
+          Vector3 normal = obj_to_scene.transform_vector(Vector3(obj_normal[0], obj_normal[1], obj_normal[2]));
+          key.normal[0] = normal[0];
+          key.normal[1] = normal[1];
+          key.normal[2] = normal[2];
+        }
+        key.texcoord[0] = 0.0f;
+        key.texcoord[1] = 0.0f;
+        if (vert.texcoord != -1) {
+          key.texcoord[0] = reader.texcoord[vert.texcoord][0];
+          key.texcoord[1] = reader.texcoord[vert.texcoord][1];
+        }
+        auto it = vertex_map.find(key);
+        if (it == vertex_map.end()) {
+          face_vert_map.insert({ &vert, vtx_count });
+          vertex_map.insert({ key, vtx_count++ });
+        } else {
+          face_vert_map.insert({ &vert, it->second });
+        }
+      }
+    }
+  }
+
+  MaterialEnums::VertexArrayFormat format = 0u;
+  if (reader.vertex.size() > 0u) {
+    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_position);
+  }
+  if (reader.normal.size() > 0u) {
+    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_normal);
+  }
+  if (reader.texcoord.size() > 0u) {
+    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_texcoord);
+  }
+  VertexData *vdata = make_vertex_data(render, {{format}});
+
+  VertexWriter vwriter(vdata, MaterialEnums::VC_position);
+  vwriter.set_num_rows(vertex_map.size());
+
+  for (auto it : vertex_map) {
+    vwriter.set_row(it.second);
+    vwriter.set_data_3f(it.first.vertex[0], it.first.vertex[1],
+                        it.first.vertex[2]);
+  }
+
+  if (reader.normal.size() > 0u) {
+    VertexWriter nwriter(vdata, MaterialEnums::VC_normal);
+    for (auto it : vertex_map) {
+      nwriter.set_row(it.second);
+      nwriter.set_data_3f(it.first.normal[0], it.first.normal[1],
+                          it.first.normal[2]);
+    }
+  }
+
+  if (reader.texcoord.size() > 0u) {
+    VertexWriter twriter(vdata, MaterialEnums::VC_texcoord);
+    for (auto it : vertex_map) {
+      twriter.set_row(it.second);
+      twriter.set_data_2f(it.first.texcoord[0], it.first.texcoord[1]);
+    }
+  }
+
+  // Now build indices
+  IndexData *idata = make_index_data(render, MaterialEnums::IT_uint16);
+  idata->buffer.resize(index_count * sizeof(u16));
+  u16 *iptr = (u16 *)idata->buffer.data();
+  int index_ptr = 0;
+  for (const ObjObject &obj : reader.objects) {
+    Mesh m;
+    m.vertex_data = vdata;
+    m.index_data = idata;
+    m.first_vertex = index_ptr;
+    for (const ObjFace &face : obj.faces) {
+      for (int i = 0; i < face.verts.size() - 2; ++i) {
+        *iptr++ = face_vert_map[&face.verts[0]];
+        *iptr++ = face_vert_map[&face.verts[i + 1]];
+        *iptr++ = face_vert_map[&face.verts[i + 2]];
+        index_ptr += 3;
+      }
+    }
+    m.num_vertices = index_ptr - m.first_vertex;
+    m.topology = MaterialEnums::PT_triangle_list;
+    m.compute_bounds();
+    asset.meshes.push_back(std::move(m));
+  }
+
+  asset.vertex_datas.push_back(vdata);
+  asset.index_datas.push_back(idata);
+}
+
+static double
+get_ms(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// The pool must outlive the loader.
+AssetLoader::
+AssetLoader(RendererVk *render, ThreadPool *pool) :
+  _render(render),
+  _pool(pool) {
+}
+
+// Waits for the loads in flight, and drops them.
+AssetLoader::
+~AssetLoader() {
+  _pool->wait(_jobs);
+  Load *load;
+  while (_loaded.pop(load)) {
+    delete load;
+  }
+}
+
+// Starts loading the OBJ file in the background.  It turns up in
+// receive() once it is built.
+void AssetLoader::
+load_obj(const std::string &filename) {
+  Load *load = new Load;
+  load->asset.filename = filename;
+  load->asset.times.requested = Clock::now();
+  _num_loading.fetch_add(1);
+  run_stage(&AssetLoader::read, load, "asset read");
+}
+
+// Hands over the next built asset, if there is one.  The caller queues its
+// buffers for upload, and update_uploads() tells when they are done.
+bool AssetLoader::
+receive(LoadedAsset &asset) {
+  Load *load;
+  if (!_loaded.pop(load)) {
+    return false;
+  }
+  asset = std::move(load->asset);
+  delete load;
+  _num_loading.fetch_sub(1);
+
+  asset.times.received = Clock::now();
+  if (!asset.ok) {
+    std::cerr << "Failed to load " << asset.filename << "\n";
+  } else {
+    _uploading.push_back({ asset.filename, asset.cooked, asset.meshes, asset.times });
+  }
+  return true;
+}
+
+// Reports the received assets whose buffers all finished uploading as of
+// the start of the frame.
+void AssetLoader::
+update_uploads(const RendererVk *render) {
+  for (size_t i = 0; i < _uploading.size(); ) {
+    Upload &upload = _uploading[i];
+    bool resident = true;
+    for (const Mesh &mesh : upload.meshes) {
+      if (!render->is_mesh_resident(&mesh)) {
+        resident = false;
+        break;
+      }
+    }
+    if (!resident) {
+      ++i;
+      continue;
+    }
+
+    AssetLoadTimes &times = upload.times;
+    times.resident = Clock::now();
+    std::cerr << "Loaded " << upload.filename << " in "
+              << get_ms(times.requested, times.resident) << " ms: "
+              << get_ms(times.requested, times.read_begin) << " waiting, "
+              << get_ms(times.read_begin, times.read_end) << " reading, "
+              << get_ms(times.read_end, times.parse_end) << " parsing, "
+              << get_ms(times.parse_end, times.build_end) << " building, "
+              << get_ms(times.build_end, times.received) << " handing off, "
+              << get_ms(times.received, times.resident) << " uploading"
+              << (upload.cooked ? ", from the cache\n" : "\n");
+
+    _uploading[i] = std::move(_uploading.back());
+    _uploading.pop_back();
+  }
+}
+
+// Runs the stage as a job, or right away if the pool has no workers, since
+// jobs submitted from outside the pool would then only run in wait().
+void AssetLoader::
+run_stage(void (AssetLoader::*stage)(Load *), Load *load, const char *name) {
+  if (_pool->get_num_threads() == 0) {
+    (this->*stage)(load);
+  } else {
+    _pool->submit([this, stage, load]() { (this->*stage)(load); }, &_jobs, name);
+  }
+}
+
+// Reads the source, and looks its hash up in the cache.  A cooked asset
+// is read right here, and done.
+void AssetLoader::
+read(Load *load) {
+  LoadedAsset &asset = load->asset;
+  asset.times.read_begin = Clock::now();
+  if (!read_source(asset.filename, load->data)) {
+    asset.times.read_end = Clock::now();
+    finish(load);
+    return;
+  }
+  load->source_hash = hash_obj_source(load->data);
+  asset.times.read_end = Clock::now();
+
+  if (read_cooked(load->source_hash, asset)) {
+    load->data = std::string();
+    asset.ok = true;
+    asset.cooked = true;
+    asset.times.parse_end = asset.times.read_end;
+    asset.times.build_end = Clock::now();
+    finish(load);
+    return;
+  }
+  run_stage(&AssetLoader::parse, load, "asset parse");
+}
+
+// Parses in chunks on the pool as well.
+void AssetLoader::
+parse(Load *load) {
+  load->reader = std::make_unique<ObjReader>(load->data, _pool);
+  load->data = std::string();
+  load->asset.times.parse_end = Clock::now();
+  run_stage(&AssetLoader::build, load, "asset build");
+}
+
+// make_vertex_data() and make_index_data() don't touch the renderer's
+// state, so the vertex and index data are made here, off the render thread.
+// Cooking the asset is part of building it.
+void AssetLoader::
+build(Load *load) {
+  build_obj_meshes(*load->reader, _render, load->asset);
+  load->reader.reset();
+  write_cooked(load->source_hash, load->asset);
+  load->asset.ok = true;
+  load->asset.times.build_end = Clock::now();
+  finish(load);
+}
+
+void AssetLoader::
+finish(Load *load) {
+  _loaded.push(load);
+}
+
+// Cooks the OBJ file into the cache right away, whether it was cooked
+// already or not, for cooking offline.  The loader needs no renderer for
+// it.  Returns false if the file could not be read or cooked.
+bool AssetLoader::
+cook_obj(const std::string &filename) {
+  std::string data;
+  if (_cache_dir.empty() || !read_source(filename, data)) {
+    return false;
+  }
+  u64 source_hash = hash_obj_source(data);
+  LoadedAsset asset;
+  {
+    ObjReader reader(data, _pool);
+    build_obj_meshes(reader, _render, asset);
+  }
+  std::string cooked_filename = get_cooked_filename(source_hash);
+  bool ok = MeshFile::write(cooked_filename, source_hash, asset.vertex_datas[0],
+                            asset.index_datas[0], asset.meshes, _compress_cache);
+  if (ok) {
+    std::cerr << "Cooked " << filename << " into " << cooked_filename << "\n";
+  }
+
+  if (_render == nullptr) {
+    for (VertexData *vdata : asset.vertex_datas) {
+      delete vdata;
+    }
+    for (IndexData *idata : asset.index_datas) {
+      delete idata;
+    }
+  }
+  return ok;
+}
+
+// Fills in the asset from the cooked file of the source, if there is a
+// valid one.
+bool AssetLoader::
+read_cooked(u64 source_hash, LoadedAsset &asset) {
+  if (_cache_dir.empty()) {
+    return false;
+  }
+  MeshFile file;
+  if (!file.open(get_cooked_filename(source_hash), source_hash)) {
+    return false;
+  }
+  VertexData *vdata = make_vertex_data(_render, file.get_vertex_format());
+  IndexData *idata = make_index_data(_render, file.get_index_type());
+  file.read(vdata, idata, asset.meshes, _pool);
+  asset.vertex_datas.push_back(vdata);
+  asset.index_datas.push_back(idata);
+  return true;
+}
+
+// Failing to cook only makes the next load slower, so it is not an error.
+void AssetLoader::
+write_cooked(u64 source_hash, const LoadedAsset &asset) {
+  if (_cache_dir.empty()) {
+    return;
+  }
+  assert(asset.vertex_datas.size() == 1u && asset.index_datas.size() == 1u);
+  MeshFile::write(get_cooked_filename(source_hash), source_hash,
+                  asset.vertex_datas[0], asset.index_datas[0], asset.meshes,
+                  _compress_cache);
+}
+
+std::string AssetLoader::
+get_cooked_filename(u64 source_hash) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)source_hash);
+  return (std::filesystem::path(_cache_dir) / name).string();
+}
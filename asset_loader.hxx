@@ -0,0 +1,121 @@
+#ifndef ASSET_LOADER_HXX
+#define ASSET_LOADER_HXX
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "material.hxx"
+#include "mpsc_queue.hxx"
+#include "thread_pool.hxx"
+
+class ObjReader;
+class RendererVk;
+
+// When each stage of loading an asset ended, from the request on.
+struct AssetLoadTimes {
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::time_point requested;
+  Clock::time_point read_begin;
+  Clock::time_point read_end;
+  Clock::time_point parse_end;
+  Clock::time_point build_end;
+  // Picked up by the render thread, and its buffers queued for upload.
+  Clock::time_point received;
+  // All of its buffers finished uploading.
+  Clock::time_point resident;
+};
+
+// Meshes of a loaded asset, and the vertex and index data they draw from,
+// which have not been queued for upload yet.
+struct LoadedAsset {
+  std::string filename;
+  bool ok = false;
+  // Loaded from the cooked cache instead of the source.
+  bool cooked = false;
+  std::vector<Mesh> meshes;
+  std::vector<VertexData *> vertex_datas;
+  std::vector<IndexData *> index_datas;
+  AssetLoadTimes times;
+};
+
+// Makes the meshes of a parsed OBJ file, in scene space.  Without a
+// renderer the vertex and index data are plain CPU-side data, which the
+// caller deletes.
+void build_obj_meshes(const ObjReader &reader, RendererVk *render, LoadedAsset &asset);
+
+// Loads assets in the background, on a ThreadPool.
+//
+// Each asset goes through a read, a parse and a build stage, each a job of
+// its own, so the stages of different assets overlap.  Built assets are
+// handed to the render thread through a lock-free queue, and the render
+// thread queues their buffers for upload, which the renderer does on the
+// transfer queue over the following frames.  Until then the meshes aren't
+// resident, and the renderer skips them, so frames keep coming while
+// assets stream in.
+//
+// Built assets are cooked into a cache of mesh files, keyed by the hash of
+// their source.  When an asset's source is found there, the parse and build
+// stages are skipped, and its vertex and index data are copied straight
+// out of the mapped mesh file instead, or decoded on the pool where the
+// streams are compressed.
+//
+// The latency of every stage is reported once an asset's buffers are all
+// resident.  With a pool that has no workers, load_obj() loads right away.
+class AssetLoader {
+public:
+  AssetLoader(RendererVk *render, ThreadPool *pool);
+  ~AssetLoader();
+
+  // An empty directory turns the cache off.  Not while loading.
+  inline void set_cache_dir(const std::string &dir) { _cache_dir = dir; }
+  // Whether cooked files compress their streams, on by default.
+  inline void set_cache_compression(bool compress) { _compress_cache = compress; }
+
+  void load_obj(const std::string &filename);
+  bool cook_obj(const std::string &filename);
+
+  // Render thread only.
+  bool receive(LoadedAsset &asset);
+  void update_uploads(const RendererVk *render);
+
+  // Loads that were not received yet, and received ones still uploading.
+  inline int get_num_loading() const { return _num_loading.load(); }
+  inline size_t get_num_uploading() const { return _uploading.size(); }
+
+private:
+  struct Load;
+
+  void run_stage(void (AssetLoader::*stage)(Load *), Load *load, const char *name);
+  void read(Load *load);
+  void parse(Load *load);
+  void build(Load *load);
+  void finish(Load *load);
+
+  bool read_cooked(u64 source_hash, LoadedAsset &asset);
+  void write_cooked(u64 source_hash, const LoadedAsset &asset);
+  std::string get_cooked_filename(u64 source_hash) const;
+
+private:
+  RendererVk *_render;
+  ThreadPool *_pool;
+  std::string _cache_dir = "cache";
+  bool _compress_cache = true;
+  // Counts the stage jobs in flight.
+  JobCounter _jobs;
+  std::atomic<int> _num_loading { 0 };
+
+  MpscQueue<Load *> _loaded;
+
+  // Received assets, with copies of their meshes to check residency with.
+  struct Upload {
+    std::string filename;
+    bool cooked;
+    std::vector<Mesh> meshes;
+    AssetLoadTimes times;
+  };
+  std::vector<Upload> _uploading;
+};
+
+#endif // ASSET_LOADER_HXX
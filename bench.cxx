@@ -0,0 +1,942 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asset_loader.hxx"
+#include "bounds.hxx"
+#include "culling.hxx"
+#include "linmath.hxx"
+#include "linmath_simd.hxx"
+#include "mesh_bvh.hxx"
+#include "mesh_codec.hxx"
+#include "numeric_types.hxx"
+#include "obj_reader.hxx"
+#include "renderer.hxx"
+#include "scene_bvh.hxx"
+#include "scene_graph.hxx"
+#include "thread_pool.hxx"
+#include "transform.hxx"
+
+// Benchmarks of the CPU side of the renderer, built as bench.exe by the
+// bench target of the Makefile.
+//
+//   bench [name ...]
+//
+// runs the named benchmarks, or all of them in order.  Every measurement
+// is the fastest of a few runs, which is the one least disturbed by the
+// rest of the system.
+
+typedef std::chrono::steady_clock Clock;
+
+static constexpr int num_reps = 5;
+
+// Results are summed in here so the compiler can't drop the work.
+static volatile double sink;
+
+static void
+keep(double value) {
+  sink = sink + value;
+}
+
+// Workers for a pool that the calling thread completes, as main.cxx does.
+static int
+get_num_workers() {
+  return std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+}
+
+template<class Func>
+static double
+time_best_ms(int reps, const Func &func) {
+  double best = DBL_MAX;
+  for (int i = 0; i < reps; ++i) {
+    Clock::time_point begin = Clock::now();
+    func();
+    Clock::time_point end = Clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(end - begin).count());
+  }
+  return best;
+}
+
+// The same, running setup untimed before every run.
+template<class Setup, class Func>
+static double
+time_best_ms(int reps, const Setup &setup, const Func &func) {
+  double best = DBL_MAX;
+  for (int i = 0; i < reps; ++i) {
+    setup();
+    Clock::time_point begin = Clock::now();
+    func();
+    Clock::time_point end = Clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(end - begin).count());
+  }
+  return best;
+}
+
+static void
+report(const std::string &what, double value, const char *unit) {
+  std::cout << "  " << std::left << std::setw(44) << what << std::right
+            << std::setw(12) << std::fixed << std::setprecision(2) << value
+            << " " << unit << "\n";
+}
+
+// Boxes of 1 to 10 units scattered through a cube 2000 units across, which
+// with the camera below leaves about a tenth of them in view.
+static void
+make_random_boxes(size_t count, u32 seed, std::vector<BoundingBox> &boxes) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+  std::uniform_real_distribution<float> extent(0.5f, 5.0f);
+  boxes.resize(count);
+  for (BoundingBox &box : boxes) {
+    Vector3 center(position(rng), position(rng), position(rng));
+    Vector3 extents(extent(rng), extent(rng), extent(rng));
+    box = BoundingBox();
+    box.extend(center - extents);
+    box.extend(center + extents);
+  }
+}
+
+static BoundingSphere
+get_bounding_sphere(const BoundingBox &box) {
+  BoundingSphere sphere;
+  sphere.center = box.get_center();
+  sphere.radius = box.get_extents().length();
+  return sphere;
+}
+
+// A camera at the center of the boxes, turned a little off the axes.
+static Frustum
+make_bench_frustum() {
+  Matrix4x4 view = Transform(Vector3(0.0f), Quaternion::from_axis_angle(0.5f, Vector3::up()))
+                     .to_matrix().inverted();
+  Matrix4x4 proj = Matrix4x4::make_perspective_projection(1.0f, 16.0f / 9.0f, 1.0f, 1000.0f);
+  return Frustum::from_matrix(view * proj);
+}
+
+// Frustum culling of 1M objects with the SIMD kernel, flat, without a
+// hierarchy.
+static void
+bench_cull() {
+  static constexpr size_t num_objects = 1000000u;
+  std::vector<BoundingBox> boxes;
+  make_random_boxes(num_objects, 1u, boxes);
+  CullBounds bounds;
+  bounds.resize(num_objects);
+  for (size_t i = 0; i < num_objects; ++i) {
+    bounds.set(i, boxes[i], get_bounding_sphere(boxes[i]));
+  }
+
+  Frustum frustum = make_bench_frustum();
+  std::vector<u32> visible;
+  visible.reserve(num_objects);
+  size_t num_visible = 0u;
+  double ms = time_best_ms(num_reps, [&]() {
+    num_visible = cull_frustum(frustum, bounds, visible);
+  });
+  keep(num_visible);
+
+  report("visible", 100.0 * num_visible / num_objects, "%");
+  report("cull 1M objects", ms, "ms");
+  report("cull rate", num_objects / ms, "objects/ms");
+}
+
+// The scalar Matrix4x4 operations from before they used SIMD, to compare
+// against.
+static Matrix4x4
+scalar_multiply(const Matrix4x4 &a, const Matrix4x4 &b) {
+  Matrix4x4 out;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      out.set_cell(i, j, a.get_cell(i, 0) * b.get_cell(0, j) + a.get_cell(i, 1) * b.get_cell(1, j) +
+                         a.get_cell(i, 2) * b.get_cell(2, j) + a.get_cell(i, 3) * b.get_cell(3, j));
+    }
+  }
+  return out;
+}
+
+static Matrix4x4
+scalar_transpose(const Matrix4x4 &m) {
+  Matrix4x4 out;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      out.set_cell(i, j, m.get_cell(j, i));
+    }
+  }
+  return out;
+}
+
+// Cofactor expansion along the first row.
+static Matrix4x4
+scalar_inverse(const Matrix4x4 &mat) {
+  const float *m = mat.get_data();
+  float a2323 = m[10] * m[15] - m[11] * m[14];
+  float a1323 = m[9] * m[15] - m[11] * m[13];
+  float a1223 = m[9] * m[14] - m[10] * m[13];
+  float a0323 = m[8] * m[15] - m[11] * m[12];
+  float a0223 = m[8] * m[14] - m[10] * m[12];
+  float a0123 = m[8] * m[13] - m[9] * m[12];
+  float a2313 = m[6] * m[15] - m[7] * m[14];
+  float a1313 = m[5] * m[15] - m[7] * m[13];
+  float a1213 = m[5] * m[14] - m[6] * m[13];
+  float a2312 = m[6] * m[11] - m[7] * m[10];
+  float a1312 = m[5] * m[11] - m[7] * m[9];
+  float a1212 = m[5] * m[10] - m[6] * m[9];
+  float a0313 = m[4] * m[15] - m[7] * m[12];
+  float a0213 = m[4] * m[14] - m[6] * m[12];
+  float a0312 = m[4] * m[11] - m[7] * m[8];
+  float a0212 = m[4] * m[10] - m[6] * m[8];
+  float a0113 = m[4] * m[13] - m[5] * m[12];
+  float a0112 = m[4] * m[9] - m[5] * m[8];
+
+  float det = m[0] * (m[5] * a2323 - m[6] * a1323 + m[7] * a1223)
+            - m[1] * (m[4] * a2323 - m[6] * a0323 + m[7] * a0223)
+            + m[2] * (m[4] * a1323 - m[5] * a0323 + m[7] * a0123)
+            - m[3] * (m[4] * a1223 - m[5] * a0223 + m[6] * a0123);
+  if (fabsf(det) < FLT_EPSILON) {
+    return Matrix4x4();
+  }
+  det = 1.0f / det;
+
+  Matrix4x4 out;
+  out.set_cell(0, 0, det * (m[5] * a2323 - m[6] * a1323 + m[7] * a1223));
+  out.set_cell(0, 1, det * -(m[1] * a2323 - m[2] * a1323 + m[3] * a1223));
+  out.set_cell(0, 2, det * (m[1] * a2313 - m[2] * a1313 + m[3] * a1213));
+  out.set_cell(0, 3, det * -(m[1] * a2312 - m[2] * a1312 + m[3] * a1212));
+  out.set_cell(1, 0, det * -(m[4] * a2323 - m[6] * a0323 + m[7] * a0223));
+  out.set_cell(1, 1, det * (m[0] * a2323 - m[2] * a0323 + m[3] * a0223));
+  out.set_cell(1, 2, det * -(m[0] * a2313 - m[2] * a0313 + m[3] * a0213));
+  out.set_cell(1, 3, det * (m[0] * a2312 - m[2] * a0312 + m[3] * a0212));
+  out.set_cell(2, 0, det * (m[4] * a1323 - m[5] * a0323 + m[7] * a0123));
+  out.set_cell(2, 1, det * -(m[0] * a1323 - m[1] * a0323 + m[3] * a0123));
+  out.set_cell(2, 2, det * (m[0] * a1313 - m[1] * a0313 + m[3] * a0113));
+  out.set_cell(2, 3, det * -(m[0] * a1312 - m[1] * a0312 + m[3] * a0112));
+  out.set_cell(3, 0, det * -(m[4] * a1223 - m[5] * a0223 + m[6] * a0123));
+  out.set_cell(3, 1, det * (m[0] * a1223 - m[1] * a0223 + m[2] * a0123));
+  out.set_cell(3, 2, det * -(m[0] * a1213 - m[1] * a0213 + m[2] * a0113));
+  out.set_cell(3, 3, det * (m[0] * a1212 - m[1] * a0212 + m[2] * a0112));
+  return out;
+}
+
+// Runs op over every matrix of in, a number of times, and returns the
+// time per call in nanoseconds.  The second operand is another matrix of
+// in, whose count must be a power of two.
+template<class Op>
+static double
+time_matrix_op(const std::vector<Matrix4x4> &in, std::vector<Matrix4x4> &out, const Op &op) {
+  static constexpr int num_rounds = 64;
+  double ms = time_best_ms(num_reps, [&]() {
+    for (int round = 0; round < num_rounds; ++round) {
+      for (size_t i = 0; i < in.size(); ++i) {
+        out[i] = op(in[i], in[(i + round) & (in.size() - 1u)]);
+      }
+    }
+  });
+  keep(out[0].get_cell(0, 0));
+  return ms * 1e6 / ((double)num_rounds * in.size());
+}
+
+// Matrix4x4 operations, SIMD against scalar, over random affine transforms
+// that stay in cache.
+static void
+bench_matrix() {
+  static constexpr size_t num_matrices = 4096u;
+  std::mt19937 rng(4u);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::uniform_real_distribution<float> scale(0.5f, 2.0f);
+  std::vector<Matrix4x4> in(num_matrices);
+  std::vector<Matrix4x4> out(num_matrices);
+  for (Matrix4x4 &mat : in) {
+    Vector3 axis = Vector3(unit(rng), unit(rng), unit(rng)).normalized();
+    mat = Transform(Vector3(unit(rng), unit(rng), unit(rng)) * 100.0f,
+                    Quaternion::from_axis_angle(unit(rng) * 3.0f, axis),
+                    Vector3(scale(rng), scale(rng), scale(rng))).to_matrix();
+  }
+
+  auto compare = [](const char *what, double simd_ns, double scalar_ns, const char *against) {
+    report(std::string(what), simd_ns, "ns/op");
+    report(std::string(against), scalar_ns, "ns/op");
+    report("speedup", scalar_ns / simd_ns, "x");
+  };
+
+  compare("multiply",
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &b) { return a * b; }),
+          time_matrix_op(in, out, scalar_multiply), "scalar multiply");
+  compare("inverted",
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return a.inverted(); }),
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return scalar_inverse(a); }),
+          "scalar cofactor inverse");
+  compare("inverted_affine",
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return a.inverted_affine(); }),
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return a.inverted(); }),
+          "inverted");
+  compare("transposed",
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return a.transposed(); }),
+          time_matrix_op(in, out, [](const Matrix4x4 &a, const Matrix4x4 &) { return scalar_transpose(a); }),
+          "scalar transpose");
+}
+
+// Batched point transforms, in place, at sizes from in cache to well past
+// it.  Per point transform_point() calls over the same points are the
+// baseline.
+static void
+bench_transform() {
+  static constexpr size_t sizes[] = { 1000000u, 10000000u, 100000000u };
+  static constexpr const char *labels[] = { "1M", "10M", "100M" };
+  // A small rotation, so that the points stay put over many runs.
+  Matrix4x4 mat = Transform(Vector3(0.0f), Quaternion::from_axis_angle(0.01f, Vector3::up()))
+                    .to_matrix();
+
+  for (int n = 0; n < 3; ++n) {
+    size_t count = sizes[n];
+    std::string label = labels[n];
+    {
+      std::vector<Vector3> points(count);
+      for (size_t i = 0; i < count; ++i) {
+        points[i] = Vector3((float)(i % 1000u), (float)(i / 1000u % 1000u), (float)(i / 1000000u));
+      }
+      double ms = time_best_ms(num_reps, [&]() {
+        transform_points(mat, points, points);
+      });
+      report("transform_points " + label, count / ms * 1e-6, "Gpoints/s");
+
+      ms = time_best_ms(num_reps, [&]() {
+        for (Vector3 &point : points) {
+          point = mat.transform_point(point);
+        }
+      });
+      report("transform_point loop " + label, count / ms * 1e-6, "Gpoints/s");
+      keep(points[count - 1u][0]);
+    }
+    {
+      std::vector<float> x(count), y(count), z(count);
+      for (size_t i = 0; i < count; ++i) {
+        x[i] = (float)(i % 1000u);
+        y[i] = (float)(i / 1000u % 1000u);
+        z[i] = (float)(i / 1000000u);
+      }
+      double ms = time_best_ms(num_reps, [&]() {
+        transform_points_soa(mat, x.data(), y.data(), z.data(), x.data(), y.data(), z.data(), count);
+      });
+      report("transform_points_soa " + label, count / ms * 1e-6, "Gpoints/s");
+      keep(x[count - 1u]);
+    }
+  }
+}
+
+// Vector3x8 packets against Vector3 one at a time, over 1M vectors:
+// normalizing, and the bounds of packed and of interleaved positions.
+static void
+bench_packet() {
+  static constexpr size_t count = 1000000u;
+  static constexpr int width = Vector3x8::width;
+  static_assert(count % width == 0u);
+
+  // Positions interleaved with a normal and texcoord, as in vertex data.
+  struct Vertex {
+    float position[3];
+    float normal[3];
+    float texcoord[2];
+  };
+
+  std::mt19937 rng(5u);
+  std::uniform_real_distribution<float> unit(-100.0f, 100.0f);
+  std::vector<Vector3> in(count);
+  std::vector<Vector3> out(count);
+  std::vector<Vertex> vertices(count);
+  for (size_t i = 0; i < count; ++i) {
+    in[i] = Vector3(unit(rng), unit(rng), unit(rng));
+    vertices[i] = { { in[i][0], in[i][1], in[i][2] }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f } };
+  }
+
+  auto compare = [](const char *what, double packet_ms, double scalar_ms) {
+    report(std::string(what), count / packet_ms * 1e-6, "Gvectors/s");
+    report(std::string(what) + " scalar", count / scalar_ms * 1e-6, "Gvectors/s");
+  };
+
+  compare("normalize",
+    time_best_ms(num_reps, [&]() {
+      for (size_t i = 0; i < count; i += width) {
+        Vector3x8::load(&in[i]).normalized().store(&out[i]);
+      }
+    }),
+    time_best_ms(num_reps, [&]() {
+      for (size_t i = 0; i < count; ++i) {
+        out[i] = in[i].normalized();
+      }
+    }));
+  keep(out[count - 1u][0]);
+
+  auto reduce = [](const Vector3x8 &min, const Vector3x8 &max) {
+    BoundingBox box;
+    for (int lane = 0; lane < width; ++lane) {
+      box.extend(min.get_lane(lane));
+      box.extend(max.get_lane(lane));
+    }
+    return box;
+  };
+
+  // The boxes are kept on every run, or the compiler could hoist them out
+  // of the timing loop.
+  BoundingBox box;
+  compare("bounds",
+    time_best_ms(num_reps, [&]() {
+      Vector3x8 min(Vector3(FLT_MAX));
+      Vector3x8 max(Vector3(-FLT_MAX));
+      for (size_t i = 0; i < count; i += width) {
+        Vector3x8 p = Vector3x8::load(&in[i]);
+        min = Vector3x8::min(min, p);
+        max = Vector3x8::max(max, p);
+      }
+      box = reduce(min, max);
+      keep(box.max[0]);
+    }),
+    time_best_ms(num_reps, [&]() {
+      box = BoundingBox();
+      for (const Vector3 &p : in) {
+        box.extend(p);
+      }
+      keep(box.max[0]);
+    }));
+
+  compare("bounds of a vertex column",
+    time_best_ms(num_reps, [&]() {
+      Vector3x8 min(Vector3(FLT_MAX));
+      Vector3x8 max(Vector3(-FLT_MAX));
+      for (size_t i = 0; i < count; i += width) {
+        Vector3x8 p = Vector3x8::load_strided(vertices[i].position, sizeof(Vertex));
+        min = Vector3x8::min(min, p);
+        max = Vector3x8::max(max, p);
+      }
+      box = reduce(min, max);
+      keep(box.max[0]);
+    }),
+    time_best_ms(num_reps, [&]() {
+      box = BoundingBox();
+      for (const Vertex &v : vertices) {
+        box.extend(Vector3(v.position[0], v.position[1], v.position[2]));
+      }
+      keep(box.max[0]);
+    }));
+}
+
+// Build, cull and pick on the scene BVH.  Picking casts rays from the
+// camera position in random directions.
+static void
+bench_bvh_size(size_t num_objects, const char *label, ThreadPool *pool) {
+  static constexpr size_t num_rays = 10000u;
+  std::vector<BoundingBox> boxes;
+  make_random_boxes(num_objects, 2u, boxes);
+
+  SceneBvh bvh;
+  double build_ms = time_best_ms(num_reps, [&]() {
+    bvh.build(boxes.data(), boxes.size(), pool);
+  });
+  report(std::string("build ") + label + " objects", build_ms, "ms");
+
+  Frustum frustum = make_bench_frustum();
+  std::vector<u32> visible;
+  visible.reserve(num_objects);
+  size_t num_visible = 0u;
+  double cull_ms = time_best_ms(num_reps, [&]() {
+    num_visible = bvh.cull_frustum(frustum, visible);
+  });
+  keep(num_visible);
+  report(std::string("cull ") + label + " objects", cull_ms, "ms");
+  report("cull rate", num_objects / cull_ms, "objects/ms");
+
+  // Moving 1% of the objects, and refitting.
+  std::mt19937 rng(3u);
+  std::uniform_real_distribution<float> offset(-5.0f, 5.0f);
+  double refit_ms = time_best_ms(num_reps, [&]() {
+    for (size_t i = 0; i < num_objects / 100u; ++i) {
+      u32 object = (u32)(rng() % num_objects);
+      Vector3 move(offset(rng), offset(rng), offset(rng));
+      BoundingBox &box = boxes[object];
+      box.min += move;
+      box.max += move;
+      bvh.update(object, box);
+    }
+    bvh.refit(pool);
+  });
+  report("update 1% and refit", refit_ms, "ms");
+
+  std::vector<Vector3> dirs(num_rays);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  for (Vector3 &dir : dirs) {
+    dir = Vector3(unit(rng), unit(rng), unit(rng)).normalized();
+  }
+  size_t num_hits = 0u;
+  double pick_ms = time_best_ms(num_reps, [&]() {
+    num_hits = 0u;
+    for (const Vector3 &dir : dirs) {
+      float t_hit;
+      num_hits += bvh.pick(Vector3(0.0f), dir, t_hit) != UINT32_MAX;
+    }
+  });
+  keep(num_hits);
+  report("pick", pick_ms * 1e6 / num_rays, "ns/ray");
+}
+
+static void
+bench_bvh() {
+  ThreadPool pool(get_num_workers());
+  bench_bvh_size(100000u, "100k", &pool);
+  bench_bvh_size(1000000u, "1M", &pool);
+}
+
+// Ray queries on the triangles of the cottage, loaded as the asset loader
+// loads it, but without a renderer.  Primary rays go from a camera in
+// front of the model through a grid over its bounds, random rays from
+// random points within its bounds in random directions.
+static void
+bench_mesh_bvh() {
+  static const char *filename = "models/cottage_obj.obj";
+  static constexpr int grid_size = 256;
+  static constexpr size_t num_random_rays = grid_size * grid_size;
+
+  std::ifstream stream(filename);
+  if (!stream.good()) {
+    std::cerr << "Could not read " << filename << "\n";
+    return;
+  }
+  std::ostringstream data;
+  data << stream.rdbuf();
+
+  ThreadPool pool(get_num_workers());
+  LoadedAsset asset;
+  {
+    ObjReader reader(data.str(), &pool);
+    build_obj_meshes(reader, nullptr, asset);
+  }
+
+  MeshBvh bvh;
+  double build_ms = time_best_ms(num_reps, [&]() {
+    bvh.build(asset.meshes.data(), asset.meshes.size(), &pool);
+  });
+  report("build " + std::to_string(bvh.get_num_triangles()) + " triangles", build_ms, "ms");
+
+  BoundingBox bounds;
+  for (const Mesh &mesh : asset.meshes) {
+    bounds.extend(mesh.bounds);
+  }
+  Vector3 center = bounds.get_center();
+  Vector3 extents = bounds.get_extents();
+
+  struct Ray {
+    Vector3 origin;
+    Vector3 dir;
+  };
+  std::vector<Ray> primary_rays;
+  primary_rays.reserve(grid_size * grid_size);
+  Vector3 eye = center - Vector3::forward() * (extents.length() * 3.0f);
+  for (int y = 0; y < grid_size; ++y) {
+    for (int x = 0; x < grid_size; ++x) {
+      float s = (x + 0.5f) / grid_size * 2.0f - 1.0f;
+      float t = (y + 0.5f) / grid_size * 2.0f - 1.0f;
+      Vector3 target = center + Vector3::right() * (s * extents[0]) + Vector3::up() * (t * extents[2]);
+      primary_rays.push_back({ eye, (target - eye).normalized() });
+    }
+  }
+
+  std::vector<Ray> random_rays(num_random_rays);
+  std::mt19937 rng(7u);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  for (Ray &ray : random_rays) {
+    ray.origin = center + Vector3(unit(rng) * extents[0], unit(rng) * extents[1], unit(rng) * extents[2]);
+    ray.dir = Vector3(unit(rng), unit(rng), unit(rng)).normalized();
+  }
+
+  auto trace = [&](const std::string &what, const std::vector<Ray> &rays) {
+    size_t num_hits = 0u;
+    double ms = time_best_ms(num_reps, [&]() {
+      num_hits = 0u;
+      for (const Ray &ray : rays) {
+        MeshBvh::Hit hit;
+        num_hits += bvh.intersect(ray.origin, ray.dir, hit);
+      }
+      keep(num_hits);
+    });
+    report(what + " rays hitting", 100.0 * num_hits / rays.size(), "%");
+    report(what + " intersect", rays.size() / ms * 1e-3, "Mrays/s");
+
+    ms = time_best_ms(num_reps, [&]() {
+      num_hits = 0u;
+      for (const Ray &ray : rays) {
+        num_hits += bvh.occluded(ray.origin, ray.dir);
+      }
+      keep(num_hits);
+    });
+    report(what + " occluded", rays.size() / ms * 1e-3, "Mrays/s");
+  };
+  trace("primary", primary_rays);
+  trace("random", random_rays);
+
+  for (VertexData *vdata : asset.vertex_datas) {
+    delete vdata;
+  }
+  for (IndexData *idata : asset.index_datas) {
+    delete idata;
+  }
+}
+
+// A frame of scene graph updates over 1M nodes, as 10k roots with 9
+// children of 10 leaves each, with 1% of them moved at random.  Moving a
+// root or a child moves its subtree as well, so more than 1% of the world
+// matrices are recomputed.
+static void
+bench_scene_graph() {
+  static constexpr u32 num_roots = 10000u;
+  SceneGraph graph;
+  for (u32 root = 0u; root < num_roots; ++root) {
+    u32 root_node = graph.add_node(SceneGraph::no_parent, Transform(Vector3((float)root, 0.0f, 0.0f), Quaternion()));
+    for (u32 child = 0u; child < 9u; ++child) {
+      u32 child_node = graph.add_node(root_node, Transform(Vector3(0.0f, (float)child, 0.0f), Quaternion()));
+      for (u32 leaf = 0u; leaf < 10u; ++leaf) {
+        graph.add_node(child_node, Transform(Vector3(0.0f, 0.0f, (float)leaf), Quaternion()));
+      }
+    }
+  }
+  size_t num_nodes = graph.get_num_nodes();
+  graph.update();
+
+  std::mt19937 rng(6u);
+  auto move_some = [&]() {
+    for (size_t i = 0; i < num_nodes / 100u; ++i) {
+      u32 node = (u32)(rng() % num_nodes);
+      Transform local = graph.get_local(node);
+      local.set_rotation(Quaternion::from_axis_angle(0.01f * (float)(rng() % 100u), Vector3::up()));
+      graph.set_local(node, local);
+    }
+  };
+  auto move_all = [&]() {
+    for (u32 node = 0u; node < num_nodes; node = graph.get_subtree_end(node)) {
+      graph.set_local(node, graph.get_local(node));
+    }
+  };
+  auto count_updated = [&]() {
+    size_t count = 0u;
+    for (const SceneGraph::NodeRange &range : graph.get_updated_ranges()) {
+      count += range.end - range.begin;
+    }
+    return count;
+  };
+
+  ThreadPool pool(get_num_workers());
+  double ms = time_best_ms(num_reps, move_some, [&]() { graph.update(&pool); });
+  report("update 1M nodes, 1% set", ms, "ms");
+  report("world matrices recomputed", 100.0 * count_updated() / num_nodes, "%");
+  ms = time_best_ms(num_reps, move_some, [&]() { graph.update(); });
+  report("update 1M nodes, 1% set, one thread", ms, "ms");
+  ms = time_best_ms(num_reps, move_all, [&]() { graph.update(&pool); });
+  report("update 1M nodes, every root set", ms, "ms");
+  keep(graph.get_world((u32)num_nodes - 1u).get_cell(3, 0));
+}
+
+// A grid of size x size quads as OBJ text, with normals and texcoords.
+static std::string
+make_grid_obj(int size) {
+  std::ostringstream out;
+  out << "o grid\n";
+  for (int y = 0; y <= size; ++y) {
+    for (int x = 0; x <= size; ++x) {
+      out << "v " << x * 0.01f << " " << y * 0.01f << " " << (x ^ y) * 0.001f << "\n";
+      out << "vn 0.0 0.0 1.0\n";
+      out << "vt " << (float)x / size << " " << (float)y / size << "\n";
+    }
+  }
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      int v = y * (size + 1) + x + 1;
+      int corners[4] = { v, v + 1, v + size + 2, v + size + 1 };
+      out << "f";
+      for (int c : corners) {
+        out << " " << c << "/" << c << "/" << c;
+      }
+      out << "\n";
+    }
+  }
+  return out.str();
+}
+
+// Scaling of the thread pool from one thread to every hardware thread, on
+// three workloads: a parallel_for over compute-bound items, a batch of
+// empty jobs, which is all overhead, and ObjReader parsing a 500x500 grid
+// in chunks.
+static void
+bench_thread_pool() {
+  static constexpr size_t num_items = 1u << 20u;
+  static constexpr size_t num_jobs = 100000u;
+  std::string obj = make_grid_obj(500);
+  std::vector<float> values(num_items);
+
+  int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  double base_for_ms = 0.0;
+  double base_obj_ms = 0.0;
+  for (int num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads)) {
+    ThreadPool pool(num_threads - 1);
+    std::string threads = std::to_string(num_threads) + (num_threads == 1 ? " thread" : " threads");
+
+    double for_ms = time_best_ms(num_reps, [&]() {
+      parallel_for(&pool, num_items, 1024u, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          float x = (float)i;
+          for (int k = 0; k < 32; ++k) {
+            x = sqrtf(x * 0.5f + 1.0f);
+          }
+          values[i] = x;
+        }
+      });
+    });
+    keep(values[num_items - 1u]);
+
+    double jobs_ms = time_best_ms(num_reps, [&]() {
+      JobCounter counter;
+      for (size_t i = 0; i < num_jobs; ++i) {
+        pool.submit([]() { }, &counter);
+      }
+      pool.wait(counter);
+    });
+
+    double obj_ms = time_best_ms(num_reps, [&]() {
+      ObjReader reader(obj, &pool);
+      keep((double)reader.vertex.size());
+    });
+
+    if (num_threads == 1) {
+      base_for_ms = for_ms;
+      base_obj_ms = obj_ms;
+    }
+    report("parallel_for, " + threads, for_ms, "ms");
+    report("  speedup", base_for_ms / for_ms, "x");
+    report("empty jobs, " + threads, jobs_ms * 1e6 / num_jobs, "ns/job");
+    report("ObjReader, " + threads, obj.size() / obj_ms * 1e-3, "MB/s");
+    report("  speedup", base_obj_ms / obj_ms, "x");
+
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+}
+
+// Codes a stream, and decodes it on one thread and by blocks on the pool,
+// the way MeshFile reads cooked meshes.
+static void
+bench_codec_stream(const char *what, MeshStreamCodec codec, const std::vector<ubyte> &data,
+                   size_t row_stride, ThreadPool *pool) {
+  size_t num_rows = data.size() / row_stride;
+  size_t num_blocks = get_mesh_codec_num_blocks(num_rows);
+  std::vector<ubyte> encoded;
+  double encode_ms = time_best_ms(num_reps, [&]() {
+    encoded.clear();
+    encode_mesh_stream(codec, data.data(), num_rows, row_stride, encoded);
+  });
+  if (!check_mesh_stream(encoded.data(), encoded.size(), num_rows, row_stride)) {
+    std::cerr << "Coded " << what << " stream does not check\n";
+    return;
+  }
+
+  std::vector<ubyte> decoded(data.size());
+  double decode_ms = time_best_ms(num_reps, [&]() {
+    decode_mesh_stream(codec, encoded.data(), num_rows, row_stride, 0u, num_blocks, decoded.data());
+  });
+  double parallel_ms = time_best_ms(num_reps, [&]() {
+    parallel_for(pool, num_blocks, 4u, [&](size_t begin, size_t end) {
+      decode_mesh_stream(codec, encoded.data(), num_rows, row_stride, begin, end, decoded.data());
+    });
+  });
+  if (decoded != data) {
+    std::cerr << "Decoded " << what << " stream differs\n";
+  }
+
+  std::string name = what;
+  report(name + " size", data.size() / 1e6, "MB");
+  report(name + " compression ratio", (double)data.size() / encoded.size(), ": 1");
+  report(name + " encode", data.size() / encode_ms * 1e-6, "GB/s");
+  report(name + " decode", data.size() / decode_ms * 1e-6, "GB/s");
+  report(name + " decode on the pool", data.size() / parallel_ms * 1e-6, "GB/s");
+}
+
+// The vertex and index codecs on a 1024x1024 UV sphere, with position,
+// normal and texcoord in 32-byte rows as the OBJ loader makes them, and
+// 32-bit indices.  Ratios and speeds are of the decoded size.
+static void
+bench_codec() {
+  static constexpr int size = 1024;
+  struct Vertex {
+    float position[3];
+    float normal[3];
+    float texcoord[2];
+  };
+  std::vector<ubyte> vertices((size + 1) * (size + 1) * sizeof(Vertex));
+  Vertex *vertex = (Vertex *)vertices.data();
+  for (int y = 0; y <= size; ++y) {
+    float theta = 3.14159265f * y / size;
+    for (int x = 0; x <= size; ++x) {
+      float phi = 2.0f * 3.14159265f * x / size;
+      Vector3 normal(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+      *vertex++ = { { normal[0] * 10.0f, normal[1] * 10.0f, normal[2] * 10.0f },
+                    { normal[0], normal[1], normal[2] },
+                    { (float)x / size, (float)y / size } };
+    }
+  }
+
+  std::vector<ubyte> indices(size * size * 6 * sizeof(u32));
+  u32 *index = (u32 *)indices.data();
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      u32 v = y * (size + 1) + x;
+      u32 quad[6] = { v, v + 1u, v + size + 2u, v, v + size + 2u, v + size + 1u };
+      for (u32 i : quad) {
+        *index++ = i;
+      }
+    }
+  }
+
+  ThreadPool pool(get_num_workers());
+  bench_codec_stream("vertex", MSC_vertex, vertices, sizeof(Vertex), &pool);
+  bench_codec_stream("index", MSC_index, indices, sizeof(u32), &pool);
+}
+
+// Recording 50k draws of a mesh into secondary command buffers with
+// draw_meshes_parallel(), from one thread up to every hardware thread.  The
+// renderer is headless and on a CPU device, so this runs the same with no
+// window and no GPU.  Only the recording is timed, not the rest of the
+// frame around it.
+static void
+bench_record() {
+  static constexpr size_t num_draws = 50000u;
+  int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  ThreadPool pool(max_threads - 1);
+
+  RendererOptionsVk options;
+  options.headless = true;
+  options.prefer_cpu_device = true;
+  options.thread_pool = &pool;
+  // Every draw takes its camera parameters out of the uniform ring.
+  options.uniform_ring_size = 64u << 20;
+  RendererVk render;
+  if (!render.initialize(nullptr, options)) {
+    std::cerr << "Could not make a headless renderer\n";
+    return;
+  }
+
+  // A single triangle, loaded the way OBJ files are.
+  LoadedAsset asset;
+  {
+    ObjReader reader("o triangle\nv 0 0 0\nv 1 0 0\nv 0 1 0\nvn 0 0 1\nvt 0 0\n"
+                     "f 1/1/1 2/1/1 3/1/1\n");
+    build_obj_meshes(reader, &render, asset);
+  }
+  const Mesh *mesh = &asset.meshes[0];
+  render.queue_vertex_data(asset.vertex_datas[0]);
+  render.queue_index_data(asset.index_datas[0]);
+  for (int frame = 0; frame < 100 && !render.is_mesh_resident(mesh); ++frame) {
+    render.begin_prepare();
+    render.process_uploads();
+    render.end_prepare();
+    render.begin_frame();
+    render.end_frame();
+  }
+  if (!render.is_mesh_resident(mesh)) {
+    std::cerr << "Mesh did not upload\n";
+    return;
+  }
+
+  // Every draw has a transform of its own, as in a scene.
+  std::vector<Matrix4x4> matrices(num_draws);
+  std::vector<const Matrix4x4 *> transforms(num_draws);
+  std::vector<const Mesh *> meshes(num_draws, mesh);
+  for (size_t i = 0; i < num_draws; ++i) {
+    Vector3 pos((float)(i % 250u) - 125.0f, 100.0f + (float)(i / 250u), 0.0f);
+    matrices[i] = Transform(pos, Quaternion()).to_matrix();
+    transforms[i] = &matrices[i];
+  }
+
+  double base_ms = 0.0;
+  for (int num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads)) {
+    render.set_num_record_threads(num_threads);
+    std::string threads = std::to_string(num_threads) + (num_threads == 1 ? " thread" : " threads");
+
+    double ms = DBL_MAX;
+    for (int i = 0; i < num_reps; ++i) {
+      render.begin_frame();
+      if (!render.begin_frame_surface(true)) {
+        return;
+      }
+      Clock::time_point begin = Clock::now();
+      bool ok = render.draw_meshes_parallel(meshes.data(), transforms.data(), num_draws);
+      Clock::time_point end = Clock::now();
+      render.end_frame_surface();
+      render.end_frame();
+      if (!ok || render.get_frame_stats().draw_calls != num_draws) {
+        std::cerr << "Recorded " << render.get_frame_stats().draw_calls << " of "
+                  << num_draws << " draws\n";
+        return;
+      }
+      ms = std::min(ms, std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+
+    if (num_threads == 1) {
+      base_ms = ms;
+    }
+    report("record 50k draws, " + threads, ms, "ms");
+    report("  speedup", base_ms / ms, "x");
+
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+}
+
+struct Benchmark {
+  const char *name;
+  void (*func)();
+};
+
+static const Benchmark benchmarks[] = {
+  { "cull", bench_cull },
+  { "bvh", bench_bvh },
+  { "mesh_bvh", bench_mesh_bvh },
+  { "scene_graph", bench_scene_graph },
+  { "thread_pool", bench_thread_pool },
+  { "codec", bench_codec },
+  { "matrix", bench_matrix },
+  { "transform", bench_transform },
+  { "packet", bench_packet },
+  { "record", bench_record },
+};
+
+int
+main(int argc, char *argv[]) {
+  std::vector<const Benchmark *> selected;
+  for (int i = 1; i < argc; ++i) {
+    const Benchmark *found = nullptr;
+    for (const Benchmark &bench : benchmarks) {
+      if (std::string(argv[i]) == bench.name) {
+        found = &bench;
+      }
+    }
+    if (found == nullptr) {
+      std::cerr << "Unknown benchmark " << argv[i] << "\n";
+      return 1;
+    }
+    selected.push_back(found);
+  }
+  if (selected.empty()) {
+    for (const Benchmark &bench : benchmarks) {
+      selected.push_back(&bench);
+    }
+  }
+
+  for (const Benchmark *bench : selected) {
+    std::cout << bench->name << "\n";
+    bench->func();
+  }
+  return 0;
+}
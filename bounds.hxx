@@ -0,0 +1,96 @@
+#ifndef BOUNDS_HXX
+#define BOUNDS_HXX
+
+#include <algorithm>
+
+#include "linmath.hxx"
+
+// Axis-aligned bounding box.  Empty until a point is added.
+struct BoundingBox {
+  Vector3 min = Vector3(FLT_MAX);
+  Vector3 max = Vector3(-FLT_MAX);
+
+  inline bool is_empty() const {
+    return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+  }
+
+  inline void extend(const Vector3 &point) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], point[i]);
+      max[i] = std::max(max[i], point[i]);
+    }
+  }
+
+  inline void extend(const BoundingBox &box) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], box.min[i]);
+      max[i] = std::max(max[i], box.max[i]);
+    }
+  }
+
+  inline Vector3 get_center() const {
+    return Vector3((min[0] + max[0]) * 0.5f, (min[1] + max[1]) * 0.5f,
+                   (min[2] + max[2]) * 0.5f);
+  }
+
+  // Half the size of the box along each axis.
+  inline Vector3 get_extents() const {
+    return Vector3((max[0] - min[0]) * 0.5f, (max[1] - min[1]) * 0.5f,
+                   (max[2] - min[2]) * 0.5f);
+  }
+
+  // Returns the box around this box transformed by the given matrix.  The
+  // extents of the new box are the absolute matrix applied to the old
+  // extents (Arvo).
+  inline BoundingBox transformed(const Matrix4x4 &mat) const {
+    if (is_empty()) {
+      return *this;
+    }
+    Vector3 center = get_center();
+    Vector3 extents = get_extents();
+    BoundingBox out;
+    for (int j = 0; j < 3; ++j) {
+      float c = mat.get_cell(3, j);
+      float e = 0.0f;
+      for (int i = 0; i < 3; ++i) {
+        c += center[i] * mat.get_cell(i, j);
+        e += extents[i] * fabsf(mat.get_cell(i, j));
+      }
+      out.min[j] = c - e;
+      out.max[j] = c + e;
+    }
+    return out;
+  }
+};
+
+// Bounding sphere.  Empty if the radius is negative.
+struct BoundingSphere {
+  Vector3 center;
+  float radius = -1.0f;
+
+  inline bool is_empty() const { return radius < 0.0f; }
+
+  // Returns the sphere around this sphere transformed by the given matrix.
+  // The radius is scaled by the largest axis scale.
+  inline BoundingSphere transformed(const Matrix4x4 &mat) const {
+    if (is_empty()) {
+      return *this;
+    }
+    BoundingSphere out;
+    float scale_sq = 0.0f;
+    for (int j = 0; j < 3; ++j) {
+      float c = mat.get_cell(3, j);
+      for (int i = 0; i < 3; ++i) {
+        c += center[i] * mat.get_cell(i, j);
+      }
+      out.center[j] = c;
+
+      const float *row = mat.get_row(j);
+      scale_sq = std::max(scale_sq, row[0] * row[0] + row[1] * row[1] + row[2] * row[2]);
+    }
+    out.radius = radius * sqrtf(scale_sq);
+    return out;
+  }
+};
+
+#endif // BOUNDS_HXX
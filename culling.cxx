@@ -0,0 +1,223 @@
+#include "culling.hxx"
+#include "simd.hxx"
+
+#include <bit>
+
+// Extracts the planes from a view-projection matrix.  With row vectors,
+// clip space coordinate i is the dot product with column i of the matrix,
+// and Vulkan clip space is -w <= x, y <= w, 0 <= z <= w.  Passing a
+// model-view-projection matrix gives the planes in model space.
+Frustum Frustum::
+from_matrix(const Matrix4x4 &view_proj) {
+  Frustum out;
+  for (int i = 0; i < 4; ++i) {
+    float x = view_proj.get_cell(i, 0);
+    float y = view_proj.get_cell(i, 1);
+    float z = view_proj.get_cell(i, 2);
+    float w = view_proj.get_cell(i, 3);
+    out.planes[P_left][i] = w + x;
+    out.planes[P_right][i] = w - x;
+    out.planes[P_bottom][i] = w + y;
+    out.planes[P_top][i] = w - y;
+    out.planes[P_near][i] = z;
+    out.planes[P_far][i] = w - z;
+  }
+  for (int p = 0; p < 6; ++p) {
+    float *plane = out.planes[p];
+    float len = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+    if (len > FLT_EPSILON) {
+      for (int i = 0; i < 4; ++i) {
+        plane[i] /= len;
+      }
+    }
+  }
+  return out;
+}
+
+void CullBounds::
+clear() {
+  resize(0u);
+}
+
+// Sets the number of objects.  New objects have empty bounds until set.
+void CullBounds::
+resize(size_t count) {
+  _count = count;
+  size_t padded = (count + batch_size - 1u) & ~(batch_size - 1u);
+  _center_x.resize(padded, 0.0f);
+  _center_y.resize(padded, 0.0f);
+  _center_z.resize(padded, 0.0f);
+  _extent_x.resize(padded, 0.0f);
+  _extent_y.resize(padded, 0.0f);
+  _extent_z.resize(padded, 0.0f);
+  _radius.resize(padded, -FLT_MAX);
+}
+
+// Sets the bounds of object n.  The object is tested against both the box
+// and the sphere, whichever is tighter for each plane.  Both are tested
+// around the box center, so a sphere centered elsewhere is grown to stay
+// conservative.  Empty bounds are never visible.
+void CullBounds::
+set(size_t n, const BoundingBox &box, const BoundingSphere &sphere) {
+  assert(n < _count);
+  if (box.is_empty()) {
+    _center_x[n] = _center_y[n] = _center_z[n] = 0.0f;
+    _extent_x[n] = _extent_y[n] = _extent_z[n] = 0.0f;
+    _radius[n] = -FLT_MAX;
+    return;
+  }
+
+  Vector3 center = box.get_center();
+  Vector3 extents = box.get_extents();
+  _center_x[n] = center[0];
+  _center_y[n] = center[1];
+  _center_z[n] = center[2];
+  _extent_x[n] = extents[0];
+  _extent_y[n] = extents[1];
+  _extent_z[n] = extents[2];
+
+  if (sphere.is_empty()) {
+    _radius[n] = FLT_MAX;
+  } else {
+    Vector3 offset = sphere.center;
+    offset -= center;
+    _radius[n] = sphere.radius + offset.length();
+  }
+}
+
+u32 CullBounds::
+add(const BoundingBox &box, const BoundingSphere &sphere) {
+  size_t n = _count;
+  resize(n + 1u);
+  set(n, box, sphere);
+  return (u32)n;
+}
+
+// Tests the bounds against the frustum and writes the indices of the
+// objects that may be visible to visible, in increasing order.  Returns the
+// number of visible objects.
+size_t
+cull_frustum(const Frustum &frustum, const CullBounds &bounds,
+             std::vector<u32> &visible) {
+  visible.resize(bounds.size());
+  size_t num_visible = cull_frustum(frustum, bounds, 0u, bounds.size(), visible.data());
+  visible.resize(num_visible);
+  return num_visible;
+}
+
+// Same for the objects in [begin, end) only, writing their indices to
+// visible, which must have room for all of them.
+//
+// An object is culled if its bounds are entirely behind any plane.  The
+// distance of the box to a plane is dot(n, c) + d + dot(|n|, e), and the
+// sphere's is the same with the radius in place of dot(|n|, e), so both
+// are tested at the cost of a min.  With AVX2, 8 objects are tested at a
+// time, with SSE, 4.
+size_t
+cull_frustum(const Frustum &frustum, const CullBounds &bounds,
+             size_t begin, size_t end, u32 *visible) {
+  assert(begin <= end && end <= bounds._count);
+  u32 *out = visible;
+  size_t num_visible = 0u;
+
+  const float *cx = bounds._center_x.data();
+  const float *cy = bounds._center_y.data();
+  const float *cz = bounds._center_z.data();
+  const float *ex = bounds._extent_x.data();
+  const float *ey = bounds._extent_y.data();
+  const float *ez = bounds._extent_z.data();
+  const float *radius = bounds._radius.data();
+
+#if SIMD_FLOAT_WIDTH > 1
+#if defined(SIMD_AVX2)
+  typedef __m256 vfloat;
+#define V_SET1 _mm256_set1_ps
+#define V_LOADU _mm256_loadu_ps
+#define V_ADD _mm256_add_ps
+#define V_MUL _mm256_mul_ps
+#define V_MIN _mm256_min_ps
+#define V_AND _mm256_and_ps
+#define V_GE(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define V_MOVEMASK _mm256_movemask_ps
+#else
+  typedef __m128 vfloat;
+#define V_SET1 _mm_set1_ps
+#define V_LOADU _mm_loadu_ps
+#define V_ADD _mm_add_ps
+#define V_MUL _mm_mul_ps
+#define V_MIN _mm_min_ps
+#define V_AND _mm_and_ps
+#define V_GE(a, b) _mm_cmpge_ps(a, b)
+#define V_MOVEMASK _mm_movemask_ps
+#endif
+  constexpr size_t width = SIMD_FLOAT_WIDTH;
+  static_assert(CullBounds::batch_size % width == 0u, "batches must be a multiple of the vector width");
+
+  vfloat nx[6], ny[6], nz[6], nd[6], anx[6], any[6], anz[6];
+  for (int p = 0; p < 6; ++p) {
+    nx[p] = V_SET1(frustum.planes[p][0]);
+    ny[p] = V_SET1(frustum.planes[p][1]);
+    nz[p] = V_SET1(frustum.planes[p][2]);
+    nd[p] = V_SET1(frustum.planes[p][3]);
+    anx[p] = V_SET1(fabsf(frustum.planes[p][0]));
+    any[p] = V_SET1(fabsf(frustum.planes[p][1]));
+    anz[p] = V_SET1(fabsf(frustum.planes[p][2]));
+  }
+  vfloat zero = V_SET1(0.0f);
+
+  // Vectors start on multiples of the width, which the arrays are padded
+  // to, and lanes outside of the range are masked off.
+  for (size_t i = begin & ~(width - 1u); i < end; i += width) {
+    vfloat x = V_LOADU(cx + i);
+    vfloat y = V_LOADU(cy + i);
+    vfloat z = V_LOADU(cz + i);
+    vfloat bx = V_LOADU(ex + i);
+    vfloat by = V_LOADU(ey + i);
+    vfloat bz = V_LOADU(ez + i);
+    vfloat r = V_LOADU(radius + i);
+
+    vfloat inside = V_GE(r, V_SET1(-FLT_MAX * 0.5f));
+    for (int p = 0; p < 6; ++p) {
+      vfloat dist = V_ADD(V_ADD(V_MUL(nx[p], x), V_MUL(ny[p], y)), V_ADD(V_MUL(nz[p], z), nd[p]));
+      vfloat box_r = V_ADD(V_ADD(V_MUL(anx[p], bx), V_MUL(any[p], by)), V_MUL(anz[p], bz));
+      inside = V_AND(inside, V_GE(V_ADD(dist, V_MIN(box_r, r)), zero));
+    }
+
+    unsigned int mask = (unsigned int)V_MOVEMASK(inside);
+    if (i < begin) {
+      mask &= ~((1u << (begin - i)) - 1u);
+    }
+    if (i + width > end) {
+      mask &= (1u << (end - i)) - 1u;
+    }
+    while (mask != 0u) {
+      out[num_visible++] = (u32)(i + std::countr_zero(mask));
+      mask &= mask - 1u;
+    }
+  }
+
+#undef V_SET1
+#undef V_LOADU
+#undef V_ADD
+#undef V_MUL
+#undef V_MIN
+#undef V_AND
+#undef V_GE
+#undef V_MOVEMASK
+#else
+  for (size_t i = begin; i < end; ++i) {
+    bool inside = radius[i] >= -FLT_MAX * 0.5f;
+    for (int p = 0; p < 6 && inside; ++p) {
+      const float *plane = frustum.planes[p];
+      float dist = plane[0] * cx[i] + plane[1] * cy[i] + plane[2] * cz[i] + plane[3];
+      float box_r = fabsf(plane[0]) * ex[i] + fabsf(plane[1]) * ey[i] + fabsf(plane[2]) * ez[i];
+      inside = dist + std::min(box_r, radius[i]) >= 0.0f;
+    }
+    if (inside) {
+      out[num_visible++] = (u32)i;
+    }
+  }
+#endif
+
+  return num_visible;
+}
@@ -0,0 +1,57 @@
+#ifndef CULLING_HXX
+#define CULLING_HXX
+
+#include <vector>
+
+#include "bounds.hxx"
+#include "numeric_types.hxx"
+
+// The six planes of a view frustum, pointing inwards, as (normal, distance)
+// with unit normals.  A point p is inside a plane if dot(n, p) + d >= 0.
+struct Frustum {
+  enum Plane {
+    P_left,
+    P_right,
+    P_bottom,
+    P_top,
+    P_near,
+    P_far,
+  };
+
+  float planes[6][4];
+
+  static Frustum from_matrix(const Matrix4x4 &view_proj);
+};
+
+// World space bounds of a set of objects, stored as structure of arrays so
+// cull_frustum() can test a full SIMD vector of objects at a time.  The
+// arrays are padded to a multiple of the vector width.
+class CullBounds {
+public:
+  // Objects are tested in batches of this many.
+  static constexpr size_t batch_size = 8u;
+
+  void clear();
+  void resize(size_t count);
+  void set(size_t n, const BoundingBox &box, const BoundingSphere &sphere);
+  u32 add(const BoundingBox &box, const BoundingSphere &sphere);
+
+  inline size_t size() const { return _count; }
+
+private:
+  size_t _count = 0u;
+  // Box centers and half-extents.
+  std::vector<float> _center_x, _center_y, _center_z;
+  std::vector<float> _extent_x, _extent_y, _extent_z;
+  std::vector<float> _radius;
+
+  friend size_t cull_frustum(const Frustum &frustum, const CullBounds &bounds,
+                             size_t begin, size_t end, u32 *visible);
+};
+
+size_t cull_frustum(const Frustum &frustum, const CullBounds &bounds,
+                    std::vector<u32> &visible);
+size_t cull_frustum(const Frustum &frustum, const CullBounds &bounds,
+                    size_t begin, size_t end, u32 *visible);
+
+#endif // CULLING_HXX
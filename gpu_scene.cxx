@@ -0,0 +1,711 @@
+#include "gpu_scene.hxx"
+#include "culling.hxx"
+
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+
+// Camera block of the GPU scene vertex shader.
+struct GpuSceneCamera {
+  Matrix4x4 view_mat;
+  Matrix4x4 proj_mat;
+};
+
+// Push constants of the culling shader.
+struct GpuCullParams {
+  float frustum_planes[6][4];
+  uint32_t num_objects;
+  // Nonzero if visible draws are packed, with a count, for
+  // vkCmdDrawIndexedIndirectCount().
+  uint32_t compact;
+  // Occlusion culling pass, 1 for early and 2 for late.
+  uint32_t phase;
+  // std430 aligns the uvec2 that follows to 8 bytes.
+  uint32_t pad;
+  uint32_t depth_size[2];
+};
+static_assert(offsetof(GpuCullParams, depth_size) == 112u && sizeof(GpuCullParams) == 120u,
+              "GpuCullParams must match CullParams in cull.comp.glsl");
+
+// The draw commands follow the draw and occluded counts, padded for
+// alignment.
+static constexpr VkDeviceSize draw_commands_offset = 16u;
+static constexpr VkDeviceSize occluded_count_offset = 4u;
+
+bool GpuScene::
+initialize(RendererVk *render) {
+  _render = render;
+
+  if (!render->_supports_multi_draw_indirect) {
+    std::cerr << "Device lacks multiDrawIndirect/drawIndirectFirstInstance, "
+                 "no GPU-driven rendering\n";
+    return false;
+  }
+
+  uint32_t num_frames = render->_num_frames;
+  _draw_buffers.resize(num_frames, nullptr);
+  _draw_allocs.resize(num_frames, nullptr);
+  _draw_capacities.resize(num_frames, 0u);
+  _draw_region_sizes.resize(num_frames, 0u);
+
+  if (!create_pipelines()) {
+    return false;
+  }
+  if (!create_readback_buffers()) {
+    return false;
+  }
+
+  render->add_dynamic_buffer(&_object_buffer, &_object_bytes, &_object_dirty,
+                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  return true;
+}
+
+bool GpuScene::
+create_pipelines() {
+  VkDevice device = _render->_device;
+  uint32_t num_frames = _render->_num_frames;
+  VkResult result;
+
+  // Bindings 3 and 4 are only used by the occlusion culling pipeline.
+  VkDescriptorSetLayoutBinding bindings[5] = { };
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[2].binding = 2;
+  bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  bindings[2].descriptorCount = 1;
+  bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[3].binding = 3;
+  bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  bindings[3].descriptorCount = 1;
+  bindings[3].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[4].binding = 4;
+  bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[4].descriptorCount = 1;
+  bindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  VkDescriptorSetLayoutCreateInfo desc_info = { };
+  desc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  desc_info.pNext = nullptr;
+  desc_info.bindingCount = 5;
+  desc_info.pBindings = bindings;
+  result = vkCreateDescriptorSetLayout(device, &desc_info, nullptr, &_desc_set_layout);
+  if (!vk_error_check(result, "create GPU scene descriptor set layout")) {
+    return false;
+  }
+
+  VkPushConstantRange push_range = { };
+  push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_range.offset = 0;
+  push_range.size = sizeof(GpuCullParams);
+  VkPipelineLayoutCreateInfo layout_info = { };
+  layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layout_info.pNext = nullptr;
+  layout_info.setLayoutCount = 1;
+  layout_info.pSetLayouts = &_desc_set_layout;
+  layout_info.pushConstantRangeCount = 1;
+  layout_info.pPushConstantRanges = &push_range;
+  result = vkCreatePipelineLayout(device, &layout_info, nullptr, &_pipeline_layout);
+  if (!vk_error_check(result, "create GPU scene pipeline layout")) {
+    return false;
+  }
+
+  // One set per frame in flight, since the object and draw buffers are.
+  VkDescriptorPoolSize pool_sizes[4];
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_sizes[0].descriptorCount = num_frames;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  pool_sizes[1].descriptorCount = num_frames * 2u;
+  pool_sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  pool_sizes[2].descriptorCount = num_frames;
+  pool_sizes[3].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[3].descriptorCount = num_frames;
+  VkDescriptorPoolCreateInfo pool_info = { };
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.pNext = nullptr;
+  pool_info.maxSets = num_frames;
+  pool_info.poolSizeCount = 4;
+  pool_info.pPoolSizes = pool_sizes;
+  result = vkCreateDescriptorPool(device, &pool_info, nullptr, &_desc_pool);
+  if (!vk_error_check(result, "create GPU scene descriptor pool")) {
+    return false;
+  }
+
+  std::vector<VkDescriptorSetLayout> set_layouts(num_frames, _desc_set_layout);
+  _descriptor_sets.resize(num_frames);
+  VkDescriptorSetAllocateInfo alloc_info = { };
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.pNext = nullptr;
+  alloc_info.descriptorPool = _desc_pool;
+  alloc_info.descriptorSetCount = num_frames;
+  alloc_info.pSetLayouts = set_layouts.data();
+  result = vkAllocateDescriptorSets(device, &alloc_info, _descriptor_sets.data());
+  if (!vk_error_check(result, "alloc GPU scene descriptor sets")) {
+    return false;
+  }
+
+  // The camera block never moves, only its dynamic offset does.
+  VkDescriptorBufferInfo camera_info = { };
+  camera_info.buffer = _render->_uniform_ring.get_buffer();
+  camera_info.offset = 0;
+  camera_info.range = sizeof(GpuSceneCamera);
+  for (VkDescriptorSet set : _descriptor_sets) {
+    VkWriteDescriptorSet write = { };
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = nullptr;
+    write.dstSet = set;
+    write.dstBinding = 0;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    write.pBufferInfo = &camera_info;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+  }
+
+  VkShaderModule cull_module = _render->make_shader_module(read_binary_file("shaders\\cull.comp.spirv"));
+  VkShaderModule vtx_module = _render->make_shader_module(read_binary_file("shaders\\gpu_scene.vert.spirv"));
+  VkShaderModule frag_module = _render->make_shader_module(read_binary_file("shaders\\simple.frag.spirv"));
+  if (cull_module == nullptr || vtx_module == nullptr || frag_module == nullptr) {
+    std::cerr << "Failed to load GPU scene shaders\n";
+    return false;
+  }
+
+  VkComputePipelineCreateInfo cull_info = { };
+  cull_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  cull_info.pNext = nullptr;
+  cull_info.flags = 0;
+  cull_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  cull_info.stage.pNext = nullptr;
+  cull_info.stage.flags = 0;
+  cull_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  cull_info.stage.module = cull_module;
+  cull_info.stage.pName = "main";
+  cull_info.stage.pSpecializationInfo = nullptr;
+  cull_info.layout = _pipeline_layout;
+  cull_info.basePipelineHandle = VK_NULL_HANDLE;
+  cull_info.basePipelineIndex = 0;
+  result = vkCreateComputePipelines(device, nullptr, 1, &cull_info, nullptr, &_cull_pipeline);
+  if (!vk_error_check(result, "create cull pipeline")) {
+    return false;
+  }
+
+  // The same shader with the two-pass occlusion test compiled in.  Only
+  // needed if the renderer can build a depth pyramid.
+  if (_render->_supports_depth_pyramid) {
+    VkShaderModule occlusion_module = _render->make_shader_module(read_binary_file("shaders\\cull_occlusion.comp.spirv"));
+    if (occlusion_module == nullptr) {
+      std::cerr << "Failed to load occlusion culling shader\n";
+      return false;
+    }
+    cull_info.stage.module = occlusion_module;
+    result = vkCreateComputePipelines(device, nullptr, 1, &cull_info, nullptr, &_occlusion_cull_pipeline);
+    vkDestroyShaderModule(device, occlusion_module, nullptr);
+    if (!vk_error_check(result, "create occlusion cull pipeline")) {
+      return false;
+    }
+  }
+
+  if (!_render->create_mesh_pipeline(_pipeline_layout, vtx_module, frag_module, nullptr, _draw_pipeline)) {
+    return false;
+  }
+
+  vkDestroyShaderModule(device, cull_module, nullptr);
+  vkDestroyShaderModule(device, vtx_module, nullptr);
+  vkDestroyShaderModule(device, frag_module, nullptr);
+  return true;
+}
+
+// Copies the mesh's geometry into the mega-buffers, and returns the id to
+// create objects of it with, or UINT32_MAX if the mesh can't be added.
+// Meshes sharing vertex data share its copy.  The mesh's buffers aren't
+// referenced afterwards.
+uint32_t GpuScene::
+add_mesh(const Mesh *mesh) {
+  if (_geometry_committed) {
+    std::cerr << "Can't add meshes to a GPU scene after commit_geometry()\n";
+    return UINT32_MAX;
+  }
+
+  const VertexData *vdata = mesh->vertex_data;
+  const IndexData *idata = mesh->index_data;
+  // The draw pipeline takes the regular single-array mesh vertex format.
+  size_t stride = sizeof(float) * 8u;
+  if (vdata->array_buffers.size() != 1u ||
+      MaterialEnums::vertex_row_stride(vdata->format.arrays[0]) != stride) {
+    std::cerr << "GPU scene meshes must have a single interleaved vertex array\n";
+    return UINT32_MAX;
+  }
+
+  auto it = _vertex_bases.find(vdata);
+  if (it == _vertex_bases.end()) {
+    const vector<ubyte> &array = vdata->array_buffers[0];
+    it = _vertex_bases.insert({ vdata, (int32_t)(_vertex_bytes.size() / stride) }).first;
+    _vertex_bytes.insert(_vertex_bytes.end(), array.begin(), array.end());
+  }
+
+  GpuMesh gmesh;
+  gmesh.vertex_offset = it->second;
+  gmesh.first_index = (uint32_t)(_index_bytes.size() / sizeof(uint32_t));
+
+  int num_indices = (int)mesh->num_vertices;
+  if (num_indices <= 0) {
+    num_indices = ((idata != nullptr) ? idata->get_num_indices() : vdata->get_num_vertices()) - (int)mesh->first_vertex;
+  }
+  gmesh.index_count = (uint32_t)num_indices;
+
+  // Indices are widened to 32 bits.  Non-indexed meshes get a sequential
+  // index list.
+  _index_bytes.resize(_index_bytes.size() + num_indices * sizeof(uint32_t));
+  uint32_t *indices = (uint32_t *)(_index_bytes.data() + gmesh.first_index * sizeof(uint32_t));
+  for (int i = 0; i < num_indices; ++i) {
+    uint32_t n = mesh->first_vertex + i;
+    indices[i] = (idata != nullptr) ? idata->get_index(n) : n;
+  }
+
+  BoundingSphere sphere = mesh->sphere;
+  if (sphere.is_empty()) {
+    BoundingBox box;
+    Mesh::compute_mesh_bounds(mesh, box, sphere);
+  }
+  for (int c = 0; c < 3; ++c) {
+    gmesh.bounds[c] = sphere.is_empty() ? 0.0f : sphere.center[c];
+  }
+  gmesh.bounds[3] = std::max(sphere.radius, 0.0f);
+
+  _meshes.push_back(gmesh);
+  return (uint32_t)(_meshes.size() - 1u);
+}
+
+// Queues the mega-buffers for upload.  No more meshes can be added after
+// this.
+void GpuScene::
+commit_geometry() {
+  if (_geometry_committed || _index_bytes.empty()) {
+    return;
+  }
+  _geometry_committed = true;
+  _render->queue_buffer_upload(&_vertex_buffer, &_vertex_bytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0.0f);
+  _render->queue_buffer_upload(&_index_buffer, &_index_bytes, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 0.0f);
+}
+
+uint32_t GpuScene::
+add_object(uint32_t mesh, const Matrix4x4 &transform) {
+  assert(mesh < _meshes.size());
+  const GpuMesh &gmesh = _meshes[mesh];
+
+  GpuObject obj;
+  obj.transform = transform;
+  memcpy(obj.bounds, gmesh.bounds, sizeof(obj.bounds));
+  obj.first_index = gmesh.first_index;
+  obj.index_count = gmesh.index_count;
+  obj.vertex_offset = gmesh.vertex_offset;
+  obj.pad = 0u;
+
+  size_t offset = _num_objects * sizeof(GpuObject);
+  _object_bytes.resize(offset + sizeof(GpuObject));
+  memcpy(_object_bytes.data() + offset, &obj, sizeof(GpuObject));
+  _object_dirty.add(offset, offset + sizeof(GpuObject));
+  return (uint32_t)_num_objects++;
+}
+
+void GpuScene::
+set_transform(uint32_t object, const Matrix4x4 &transform) {
+  assert(object < _num_objects);
+  size_t offset = object * sizeof(GpuObject) + offsetof(GpuObject, transform);
+  memcpy(_object_bytes.data() + offset, &transform, sizeof(Matrix4x4));
+  _object_dirty.add(offset, offset + sizeof(Matrix4x4));
+}
+
+// Returns true if the mega-buffers finished uploading.
+bool GpuScene::
+is_resident() const {
+  return _render->get_buffer_state(&_vertex_buffer) == BS_resident &&
+         _render->get_buffer_state(&_index_buffer) == BS_resident &&
+         _render->get_buffer_state(&_object_buffer) == BS_resident;
+}
+
+// Makes sure the frame's draw buffer fits the draw commands of num_objects
+// objects, in both passes.
+bool GpuScene::
+create_draw_buffer(uint32_t frame, size_t num_objects) {
+  if (num_objects <= _draw_capacities[frame]) {
+    return true;
+  }
+
+  if (_draw_buffers[frame] != nullptr) {
+    // May still be read by the frame's previous submission.
+    VkDeletionRequest req;
+    req.buffer = _draw_buffers[frame];
+    req.alloc = _draw_allocs[frame];
+    _render->enqueue_deletion(req);
+    _draw_buffers[frame] = nullptr;
+    _draw_allocs[frame] = nullptr;
+    _draw_capacities[frame] = 0u;
+  }
+
+  // Leave some room to grow.  The passes pick their region with a dynamic
+  // offset, so regions are aligned for it.
+  size_t capacity = num_objects + num_objects / 2u;
+  VkDeviceSize alignment = _render->_physical_device_properties[_render->_device_index].limits.minStorageBufferOffsetAlignment;
+  VkDeviceSize region_size = draw_commands_offset + capacity * sizeof(VkDrawIndexedIndirectCommand);
+  region_size = (region_size + alignment - 1u) / alignment * alignment;
+
+  VkBufferCreateInfo create_info = { };
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = nullptr;
+  create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  create_info.size = region_size * 2u;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = nullptr;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VkResult result = vmaCreateBuffer(_render->_alloc, &create_info, &alloc_info,
+                                    &_draw_buffers[frame], &_draw_allocs[frame], nullptr);
+  if (!vk_error_check(result, "create draw buffer")) {
+    return false;
+  }
+  _draw_capacities[frame] = capacity;
+  _draw_region_sizes[frame] = region_size;
+  return true;
+}
+
+// Makes sure the visibility buffer has a flag for num_objects objects.  A
+// new buffer starts out with every object invisible, which the late pass
+// sorts out in the first frame.
+bool GpuScene::
+create_visibility_buffer(size_t num_objects) {
+  if (num_objects <= _visibility_capacity) {
+    return true;
+  }
+
+  if (_visibility_buffer != nullptr) {
+    VkDeletionRequest req;
+    req.buffer = _visibility_buffer;
+    req.alloc = _visibility_alloc;
+    _render->enqueue_deletion(req);
+    _visibility_buffer = nullptr;
+    _visibility_alloc = nullptr;
+    _visibility_capacity = 0u;
+  }
+
+  size_t capacity = num_objects + num_objects / 2u;
+  VkBufferCreateInfo create_info = { };
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = nullptr;
+  create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  create_info.size = capacity * sizeof(uint32_t);
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = nullptr;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VkResult result = vmaCreateBuffer(_render->_alloc, &create_info, &alloc_info,
+                                    &_visibility_buffer, &_visibility_alloc, nullptr);
+  if (!vk_error_check(result, "create visibility buffer")) {
+    return false;
+  }
+  _visibility_capacity = capacity;
+  _visibility_reset = true;
+  return true;
+}
+
+// Creates the per-frame buffers the occluded count is copied back into.
+bool GpuScene::
+create_readback_buffers() {
+  uint32_t num_frames = _render->_num_frames;
+  _readback_buffers.resize(num_frames, nullptr);
+  _readback_allocs.resize(num_frames, nullptr);
+  _readback_data.resize(num_frames, nullptr);
+  _readback_pending.resize(num_frames, false);
+
+  for (uint32_t i = 0; i < num_frames; ++i) {
+    VkBufferCreateInfo create_info = { };
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.pNext = nullptr;
+    create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    create_info.size = sizeof(uint32_t);
+    create_info.queueFamilyIndexCount = 0;
+    create_info.pQueueFamilyIndices = nullptr;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    create_info.flags = 0;
+    VmaAllocationCreateInfo alloc_info = { };
+    alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT |
+                       VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    VmaAllocationInfo info;
+    VkResult result = vmaCreateBuffer(_render->_alloc, &create_info, &alloc_info,
+                                      &_readback_buffers[i], &_readback_allocs[i], &info);
+    if (!vk_error_check(result, "create occlusion readback buffer")) {
+      return false;
+    }
+    _readback_data[i] = (const uint32_t *)info.pMappedData;
+  }
+  return true;
+}
+
+// Records the culling that fills the frame's draw buffer.  Must be called
+// after begin_frame() and before begin_frame_surface(), since dispatches
+// can't be recorded while rendering.  With occlusion culling, this is the
+// early pass, and draw() runs the late pass.
+bool GpuScene::
+cull() {
+  _cull_num_objects = 0u;
+  _cull_occlusion = false;
+
+  uint32_t frame = _render->_frame_cycle_index;
+  if (_readback_pending[frame]) {
+    // begin_frame() waited for the frame's last submission, so the count it
+    // copied back is in.
+    vmaInvalidateAllocation(_render->_alloc, _readback_allocs[frame], 0, VK_WHOLE_SIZE);
+    _num_occluded = *_readback_data[frame];
+    _readback_pending[frame] = false;
+  }
+
+  if (_num_objects == 0u || !is_resident()) {
+    return true;
+  }
+
+  if (!create_draw_buffer(frame, _num_objects)) {
+    return false;
+  }
+  VkBuffer draw_buffer = _draw_buffers[frame];
+  VkDeviceSize region_size = _draw_region_sizes[frame];
+
+  bool occlusion = _occlusion_culling && _occlusion_cull_pipeline != nullptr;
+  if (occlusion && !create_visibility_buffer(_num_objects)) {
+    return false;
+  }
+
+  GpuSceneCamera *camera = (GpuSceneCamera *)_render->_uniform_ring.allocate(sizeof(GpuSceneCamera), _cull_camera_offset);
+  if (camera == nullptr) {
+    return false;
+  }
+  camera->view_mat = _render->get_view_matrix();
+  camera->proj_mat = _render->get_projection_matrix();
+
+  // The frame's object copy and draw buffer may have been reallocated since
+  // the frame last came around, and so may the depth pyramid.  The GPU is
+  // done with the set by now.
+  VkDescriptorBufferInfo buffer_infos[3] = { };
+  buffer_infos[0].buffer = _object_buffer.gpu_buffer;
+  buffer_infos[0].offset = 0;
+  buffer_infos[0].range = VK_WHOLE_SIZE;
+  buffer_infos[1].buffer = draw_buffer;
+  buffer_infos[1].offset = 0;
+  buffer_infos[1].range = region_size;
+  buffer_infos[2].buffer = _visibility_buffer;
+  buffer_infos[2].offset = 0;
+  buffer_infos[2].range = VK_WHOLE_SIZE;
+  VkDescriptorImageInfo pyramid_info = { };
+  pyramid_info.sampler = _render->_depth_pyramid_sampler;
+  pyramid_info.imageView = _render->_depth_pyramid_view;
+  pyramid_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  VkWriteDescriptorSet writes[4] = { };
+  for (int i = 0; i < 4; ++i) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].pNext = nullptr;
+    writes[i].dstSet = _descriptor_sets[frame];
+    writes[i].dstBinding = 1 + i;
+    writes[i].dstArrayElement = 0;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  }
+  writes[0].pBufferInfo = &buffer_infos[0];
+  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  writes[1].pBufferInfo = &buffer_infos[1];
+  writes[2].pBufferInfo = &buffer_infos[2];
+  writes[3].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  writes[3].pImageInfo = &pyramid_info;
+  vkUpdateDescriptorSets(_render->_device, occlusion ? 4 : 2, writes, 0, nullptr);
+
+  VkCommandBuffer cmd = _render->_current_command_buffer;
+
+  if (occlusion) {
+    // The last frame's late pass wrote the visibility flags.
+    VkMemoryBarrier mem_barrier = { };
+    mem_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    mem_barrier.pNext = nullptr;
+    mem_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    mem_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT |
+                                VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &mem_barrier, 0, nullptr, 0, nullptr);
+  }
+
+  // Reset the counts of both passes.
+  vkCmdFillBuffer(cmd, draw_buffer, 0, sizeof(uint32_t) * 2u, 0u);
+  vkCmdFillBuffer(cmd, draw_buffer, region_size, sizeof(uint32_t) * 2u, 0u);
+  VkBufferMemoryBarrier barriers[2] = { };
+  barriers[0].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barriers[0].pNext = nullptr;
+  barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barriers[0].buffer = draw_buffer;
+  barriers[0].offset = 0;
+  barriers[0].size = VK_WHOLE_SIZE;
+  uint32_t num_barriers = 1u;
+  if (occlusion && _visibility_reset) {
+    vkCmdFillBuffer(cmd, _visibility_buffer, 0, VK_WHOLE_SIZE, 0u);
+    barriers[1] = barriers[0];
+    barriers[1].buffer = _visibility_buffer;
+    num_barriers = 2u;
+    _visibility_reset = false;
+  }
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, nullptr, num_barriers, barriers, 0, nullptr);
+
+  _cull_num_objects = (uint32_t)_num_objects;
+  _cull_occlusion = occlusion;
+  _cull_pyramid_view = _render->_depth_pyramid_view;
+  dispatch_cull(occlusion ? 1u : 0u);
+  return true;
+}
+
+// Records a culling dispatch into the frame's draw buffer.  Phase 0 is
+// frustum culling alone, into the first region.  Phases 1 and 2 are the
+// early and late occlusion culling passes, into the first and second
+// regions.
+void GpuScene::
+dispatch_cull(uint32_t phase) {
+  uint32_t frame = _render->_frame_cycle_index;
+  VkCommandBuffer cmd = _render->_current_command_buffer;
+  VkBuffer draw_buffer = _draw_buffers[frame];
+
+  GpuCullParams params = { };
+  Frustum frustum = Frustum::from_matrix(_render->get_view_matrix() * _render->get_projection_matrix());
+  memcpy(params.frustum_planes, frustum.planes, sizeof(params.frustum_planes));
+  params.num_objects = _cull_num_objects;
+  params.compact = _render->_supports_draw_indirect_count ? 1u : 0u;
+  params.phase = phase;
+  params.depth_size[0] = _render->_surface_extents.width;
+  params.depth_size[1] = _render->_surface_extents.height;
+
+  uint32_t offsets[2] = { _cull_camera_offset, 0u };
+  if (phase == 2u) {
+    offsets[1] = (uint32_t)_draw_region_sizes[frame];
+  }
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, (phase != 0u) ? _occlusion_cull_pipeline : _cull_pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline_layout,
+                          0, 1, &_descriptor_sets[frame], 2, offsets);
+  vkCmdPushConstants(cmd, _pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                     sizeof(GpuCullParams), &params);
+  vkCmdDispatch(cmd, (_cull_num_objects + cull_group_size - 1u) / cull_group_size, 1, 1);
+
+  // The draw commands are read by the indirect draw, and the occluded count
+  // is copied back.
+  VkBufferMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.pNext = nullptr;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = draw_buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+// Draws the objects that passed the last cull(), with a single indirect
+// draw per pass.  Must be called between begin_frame_surface() and
+// end_frame_surface(), with primary contents.  With occlusion culling,
+// rendering is suspended in between the passes to build the depth pyramid
+// and run the late pass.
+bool GpuScene::
+draw() {
+  if (_cull_num_objects == 0u) {
+    return true;
+  }
+  assert(!_render->_surface_secondary_contents);
+
+  draw_pass(0u);
+  if (!_cull_occlusion) {
+    return true;
+  }
+  if (_render->_depth_pyramid_view != _cull_pyramid_view) {
+    // The surface was resized by begin_frame_surface(), and the set points
+    // at the old pyramid.  Skip the late pass this once, it would only draw
+    // what became visible this frame.
+    return true;
+  }
+
+  uint32_t frame = _render->_frame_cycle_index;
+  VkCommandBuffer cmd = _render->_current_command_buffer;
+  VkDeviceSize region_size = _draw_region_sizes[frame];
+
+  _render->suspend_frame_surface();
+  _render->build_depth_pyramid();
+  dispatch_cull(2u);
+
+  VkBufferCopy copy;
+  copy.srcOffset = region_size + occluded_count_offset;
+  copy.dstOffset = 0u;
+  copy.size = sizeof(uint32_t);
+  vkCmdCopyBuffer(cmd, _draw_buffers[frame], _readback_buffers[frame], 1, &copy);
+  VkBufferMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.pNext = nullptr;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = _readback_buffers[frame];
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 0, nullptr, 1, &barrier, 0, nullptr);
+  _readback_pending[frame] = true;
+
+  _render->resume_frame_surface();
+  draw_pass(1u);
+  return true;
+}
+
+// Records the indirect draw of one region of the frame's draw buffer.
+void GpuScene::
+draw_pass(uint32_t pass) {
+  uint32_t frame = _render->_frame_cycle_index;
+  VkCommandState *state = _render->_current_command_state;
+  VkCommandBuffer cmd = state->get_command_buffer();
+  VkBuffer draw_buffer = _draw_buffers[frame];
+  VkDeviceSize region_offset = pass * _draw_region_sizes[frame];
+
+  // The draw pipeline doesn't read the draw buffer, but the set's dynamic
+  // offsets have to be valid.
+  uint32_t offsets[2] = { _cull_camera_offset, 0u };
+  state->bind_pipeline(_draw_pipeline);
+  state->bind_descriptor_sets(_pipeline_layout, 0, 1, &_descriptor_sets[frame], 2, offsets);
+  state->bind_index_buffer(_index_buffer.gpu_buffer, 0, VK_INDEX_TYPE_UINT32);
+  VkDeviceSize offset = 0u;
+  state->bind_vertex_buffers(0, 1, &_vertex_buffer.gpu_buffer, &offset);
+  state->wait_for_transfer(_vertex_buffer.upload_value);
+  state->wait_for_transfer(_index_buffer.upload_value);
+
+  if (_render->_supports_draw_indirect_count) {
+    vkCmdDrawIndexedIndirectCount(cmd, draw_buffer, region_offset + draw_commands_offset,
+                                  draw_buffer, region_offset, _cull_num_objects,
+                                  sizeof(VkDrawIndexedIndirectCommand));
+  } else {
+    vkCmdDrawIndexedIndirect(cmd, draw_buffer, region_offset + draw_commands_offset,
+                             _cull_num_objects, sizeof(VkDrawIndexedIndirectCommand));
+  }
+  state->get_stats().draw_calls++;
+}
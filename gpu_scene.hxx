@@ -0,0 +1,144 @@
+#ifndef GPU_SCENE_HXX
+#define GPU_SCENE_HXX
+
+#include <vector>
+#include <unordered_map>
+
+#include "renderer.hxx"
+
+// Per-object data, read by the culling shader and the vertex shader.  Must
+// match GpuObject in shaders/cull.comp.glsl and shaders/gpu_scene.vert.glsl.
+struct GpuObject {
+  Matrix4x4 transform;
+  // Bounding sphere of the mesh in model space, center and radius.
+  float bounds[4];
+  uint32_t first_index;
+  uint32_t index_count;
+  int32_t vertex_offset;
+  uint32_t pad;
+};
+
+// Range of a mesh in the mega-buffers of a GpuScene.
+struct GpuMesh {
+  uint32_t first_index;
+  uint32_t index_count;
+  int32_t vertex_offset;
+  float bounds[4];
+};
+
+// Draws a large number of static meshes with a CPU cost that doesn't depend
+// on how many there are.
+//
+// The geometry of all meshes is packed into a single vertex buffer and a
+// single 32-bit index buffer.  Each object is a mesh with a transform,
+// stored in a storage buffer.  Every frame, a compute shader culls the
+// objects against the view frustum and writes an indexed indirect draw
+// command for each visible one, and the whole scene is drawn with a single
+// vkCmdDrawIndexedIndirectCount().  On devices without drawIndirectCount,
+// there is one command per object, and culled objects get an instance
+// count of 0.
+//
+// With occlusion culling on, objects are also culled against the depth of
+// the scene, in two passes.  The early pass draws the objects that were
+// visible last frame.  A depth pyramid is built from what that drew, and
+// the late pass tests every object in the frustum against it, drawing the
+// ones that weren't drawn yet.  Its results are what the next frame's early
+// pass draws.
+//
+// Meshes are added first, then committed with commit_geometry(), which
+// uploads the mega-buffers.  Objects can be added and moved at any time,
+// but only outside of begin_frame()/end_frame(), since their buffer is
+// updated by begin_frame() like any other dynamic buffer.
+class GpuScene {
+public:
+  // Objects culled per workgroup, must match local_size_x in cull.comp.
+  static constexpr uint32_t cull_group_size = 64u;
+
+  bool initialize(RendererVk *render);
+
+  uint32_t add_mesh(const Mesh *mesh);
+  void commit_geometry();
+
+  uint32_t add_object(uint32_t mesh, const Matrix4x4 &transform);
+  void set_transform(uint32_t object, const Matrix4x4 &transform);
+
+  inline size_t get_num_meshes() const { return _meshes.size(); }
+  inline size_t get_num_objects() const { return _num_objects; }
+  bool is_resident() const;
+
+  inline void set_occlusion_culling(bool enable) { _occlusion_culling = enable; }
+  inline bool get_occlusion_culling() const { return _occlusion_culling; }
+  // Objects the late pass found occluded.  Read back from the GPU, so it is
+  // a few frames old.
+  inline uint32_t get_num_occluded() const { return _num_occluded; }
+
+  bool cull();
+  bool draw();
+
+private:
+  bool create_pipelines();
+  bool create_draw_buffer(uint32_t frame, size_t num_objects);
+  bool create_visibility_buffer(size_t num_objects);
+  bool create_readback_buffers();
+  void dispatch_cull(uint32_t phase);
+  void draw_pass(uint32_t pass);
+
+private:
+  RendererVk *_render = nullptr;
+
+  // Mega-buffers, with their CPU-side data.
+  VkBufferBase _vertex_buffer;
+  VkBufferBase _index_buffer;
+  vector<ubyte> _vertex_bytes;
+  vector<ubyte> _index_bytes;
+  bool _geometry_committed = false;
+  // Base vertex of the vertex data already copied in.
+  std::unordered_map<const VertexData *, int32_t> _vertex_bases;
+  std::vector<GpuMesh> _meshes;
+
+  // Array of GpuObject, mirrored to the GPU as a dynamic buffer.
+  VkBufferBase _object_buffer;
+  vector<ubyte> _object_bytes;
+  DirtyRanges _object_dirty;
+  size_t _num_objects = 0u;
+
+  // Per frame in flight.  The draw buffer has a region for each pass, both
+  // holding the draw and occluded counts, padded to 16 bytes, followed by
+  // the draw commands.
+  std::vector<VkBuffer> _draw_buffers;
+  std::vector<VmaAllocation> _draw_allocs;
+  std::vector<size_t> _draw_capacities;
+  std::vector<VkDeviceSize> _draw_region_sizes;
+  std::vector<VkDescriptorSet> _descriptor_sets;
+
+  // Occlusion culling state.  The visibility buffer holds a flag per
+  // object, written by the late pass and read by the next early pass, so
+  // it is shared by all frames.
+  bool _occlusion_culling = false;
+  VkBuffer _visibility_buffer = nullptr;
+  VmaAllocation _visibility_alloc = nullptr;
+  size_t _visibility_capacity = 0u;
+  // Set when the visibility buffer needs to be cleared before use.
+  bool _visibility_reset = false;
+  // Per frame, the occluded count copied back from the late pass.
+  std::vector<VkBuffer> _readback_buffers;
+  std::vector<VmaAllocation> _readback_allocs;
+  std::vector<const uint32_t *> _readback_data;
+  std::vector<bool> _readback_pending;
+  uint32_t _num_occluded = 0u;
+
+  // What the last cull() set up for draw().
+  uint32_t _cull_num_objects = 0u;
+  uint32_t _cull_camera_offset = 0u;
+  bool _cull_occlusion = false;
+  VkImageView _cull_pyramid_view = nullptr;
+
+  VkDescriptorSetLayout _desc_set_layout = nullptr;
+  VkDescriptorPool _desc_pool = nullptr;
+  VkPipelineLayout _pipeline_layout = nullptr;
+  VkPipeline _cull_pipeline = nullptr;
+  VkPipeline _occlusion_cull_pipeline = nullptr;
+  VkPipeline _draw_pipeline = nullptr;
+};
+
+#endif // GPU_SCENE_HXX
@@ -0,0 +1,157 @@
+#include "linmath.hxx"
+#include "linmath_simd.hxx"
+
+// Compile-time checks of the constexpr parts of linmath.hxx.  Values are
+// chosen to be exact in float, so that results compare equal.
+namespace {
+constexpr Vector3 a(1.0f, 2.0f, 3.0f);
+constexpr Vector3 b(-2.0f, 0.5f, 4.0f);
+static_assert(a + b == Vector3(-1.0f, 2.5f, 7.0f));
+static_assert(a - b == Vector3(3.0f, 1.5f, -1.0f));
+static_assert(a * 2.0f == Vector3(2.0f, 4.0f, 6.0f));
+static_assert(a.dot(b) == 11.0f);
+static_assert(a.length_squared() == 14.0f);
+static_assert(Vector3::right().cross(Vector3::forward()) == Vector3::up());
+static_assert(Vector3::forward().cross(Vector3::up()) == Vector3::right());
+
+constexpr Matrix4x4 scale = Matrix4x4::scale_shear_mat(Vector3(2.0f, 4.0f, 8.0f), 0.0f);
+constexpr Matrix4x4 translate = [] {
+  Matrix4x4 mat = Matrix4x4::identity();
+  mat.set_row(3, 1.0f, -2.0f, 3.0f, 1.0f);
+  return mat;
+}();
+constexpr Matrix4x4 scale_translate = scale * translate;
+static_assert(Matrix4x4::identity() * scale == scale);
+static_assert(scale * Matrix4x4::identity() == scale);
+static_assert(scale_translate.transform_point(1.0f) == Vector3(3.0f, 2.0f, 11.0f));
+static_assert(scale_translate.transform_vector(1.0f) == Vector3(2.0f, 4.0f, 8.0f));
+static_assert(scale_translate.transposed().transposed() == scale_translate);
+static_assert(scale_translate.transposed().get_cell(0, 3) == 1.0f);
+static_assert(scale_translate.inverted_affine() * scale_translate == Matrix4x4::identity());
+static_assert(scale_translate * scale_translate.inverted_affine() == Matrix4x4::identity());
+
+constexpr Matrix4x4 ortho = Matrix4x4::make_orthographic_projection(-2.0f, 2.0f, -1.0f, 1.0f, 0.0f, 4.0f);
+static_assert(ortho.transform_point(Vector3(2.0f, 1.0f, -4.0f)) == Vector3(1.0f, 1.0f, 1.0f));
+static_assert(ortho.transform_point(Vector3(-2.0f, -1.0f, 0.0f)) == Vector3(-1.0f, -1.0f, -1.0f));
+
+// A half turn about up, and a third of a turn about (1, 1, 1), which takes
+// right to forward to up.
+constexpr Quaternion half_up(0.0f, 0.0f, 1.0f, 0.0f);
+constexpr Quaternion third_diagonal(0.5f, 0.5f, 0.5f, 0.5f);
+static_assert(half_up.rotate(Vector3::right()) == Vector3::left());
+static_assert((half_up * half_up).rotate(Vector3::right()) == Vector3::right());
+static_assert((half_up * half_up.conjugate()).get_w() == 1.0f);
+static_assert(third_diagonal.rotate(Vector3::right()) == Vector3::forward());
+static_assert(third_diagonal.rotate(Vector3::up()) == Vector3::right());
+static_assert(Matrix4x4::rotate_mat(third_diagonal).transform_vector(Vector3::forward()) == Vector3::up());
+// Products apply the left rotation first.
+static_assert((third_diagonal * half_up).rotate(Vector3::up()) == Vector3::left());
+static_assert((half_up * third_diagonal).rotate(Vector3::up()) == Vector3::right());
+}
+
+template<bool points, class T>
+static inline Vector3Packet<T>
+transform_packet(const Matrix4x4Packet<T> &mat, const Vector3Packet<T> &v) {
+  return points ? mat.transform_point(v) : mat.transform_vector(v);
+}
+
+// Transforms one vector like Matrix4x4Packet does a lane.
+template<bool points>
+static inline void
+transform_one(const Matrix4x4 &mat, float x, float y, float z, float out[3]) {
+  for (int c = 0; c < 3; ++c) {
+    out[c] = (x * mat.get_cell(0, c) + y * mat.get_cell(1, c)) + z * mat.get_cell(2, c);
+    if (points) {
+      out[c] = out[c] + mat.get_cell(3, c);
+    }
+  }
+}
+
+// Transforms count points or vectors, given as separate component arrays,
+// 8 then 4 at a time and the rest one by one.  Every path sums the same
+// terms in the same order, so they agree to the bit, as long as the
+// compiler does not contract them into fused multiply-adds.
+template<bool points>
+static void
+transform_soa(const Matrix4x4 &mat, const float *x, const float *y, const float *z,
+              float *out_x, float *out_y, float *out_z, size_t count) {
+  size_t i = 0u;
+
+  Matrix4x4Packet<f32x8> mat8(mat);
+  for (; i + 8u <= count; i += 8u) {
+    Vector3x8 v(f32x8_loadu(x + i), f32x8_loadu(y + i), f32x8_loadu(z + i));
+    v = transform_packet<points>(mat8, v);
+    f32x8_storeu(out_x + i, v.x);
+    f32x8_storeu(out_y + i, v.y);
+    f32x8_storeu(out_z + i, v.z);
+  }
+
+  Matrix4x4Packet<f32x4> mat4(mat);
+  for (; i + 4u <= count; i += 4u) {
+    Vector3x4 v(f32x4_loadu(x + i), f32x4_loadu(y + i), f32x4_loadu(z + i));
+    v = transform_packet<points>(mat4, v);
+    f32x4_storeu(out_x + i, v.x);
+    f32x4_storeu(out_y + i, v.y);
+    f32x4_storeu(out_z + i, v.z);
+  }
+
+  for (; i < count; ++i) {
+    float o[3];
+    transform_one<points>(mat, x[i], y[i], z[i], o);
+    out_x[i] = o[0];
+    out_y[i] = o[1];
+    out_z[i] = o[2];
+  }
+}
+
+// The same over packed Vector3s.  Each packet is loaded whole before it is
+// stored, so in and out may be the same array.
+template<bool points>
+static void
+transform_aos(const Matrix4x4 &mat, const Vector3 *in, Vector3 *out, size_t count) {
+  size_t i = 0u;
+
+  Matrix4x4Packet<f32x8> mat8(mat);
+  for (; i + 8u <= count; i += 8u) {
+    transform_packet<points>(mat8, Vector3x8::load(in + i)).store(out + i);
+  }
+
+  Matrix4x4Packet<f32x4> mat4(mat);
+  for (; i + 4u <= count; i += 4u) {
+    transform_packet<points>(mat4, Vector3x4::load(in + i)).store(out + i);
+  }
+
+  for (; i < count; ++i) {
+    float o[3];
+    transform_one<points>(mat, in[i][0], in[i][1], in[i][2], o);
+    out[i] = Vector3(o[0], o[1], o[2]);
+  }
+}
+
+void
+transform_points(const Matrix4x4 &mat, std::span<const Vector3> in, std::span<Vector3> out) {
+  assert(out.size() >= in.size());
+  if (!in.empty()) {
+    transform_aos<true>(mat, in.data(), out.data(), in.size());
+  }
+}
+
+void
+transform_vectors(const Matrix4x4 &mat, std::span<const Vector3> in, std::span<Vector3> out) {
+  assert(out.size() >= in.size());
+  if (!in.empty()) {
+    transform_aos<false>(mat, in.data(), out.data(), in.size());
+  }
+}
+
+void
+transform_points_soa(const Matrix4x4 &mat, const float *x, const float *y, const float *z,
+                     float *out_x, float *out_y, float *out_z, size_t count) {
+  transform_soa<true>(mat, x, y, z, out_x, out_y, out_z, count);
+}
+
+void
+transform_vectors_soa(const Matrix4x4 &mat, const float *x, const float *y, const float *z,
+                      float *out_x, float *out_y, float *out_z, size_t count) {
+  transform_soa<false>(mat, x, y, z, out_x, out_y, out_z, count);
+}
@@ -7,96 +7,104 @@
 #include <math.h>
 #include <float.h>
 #include <iostream>
+#include <span>
+#include <type_traits>
 
-inline float deg_2_rad(float deg) { return deg * (M_PI / 180.0f); }
-inline float rad_2_deg(float rad) { return rad * (180.0f / M_PI); }
+#include "simd.hxx"
+
+constexpr float deg_2_rad(float deg) { return deg * (M_PI / 180.0f); }
+constexpr float rad_2_deg(float rad) { return rad * (180.0f / M_PI); }
 
 class Vector3 {
 public:
-  inline Vector3() : _x(0.0f), _y(0.0f), _z(0.0f) { }
-  inline Vector3(float fill) : _x(fill), _y(fill), _z(fill) { }
-  inline Vector3(float x, float y, float z) : _x(x), _y(y), _z(z) { }
-
-  inline static Vector3 right() { return Vector3(1.0f, 0.0f, 0.0f); }
-  inline static Vector3 left() { return Vector3(-1.0f, 0.0f, 0.0f); }
-  inline static Vector3 up() { return Vector3(0.0f, 0.0f, 1.0f); }
-  inline static Vector3 down() { return Vector3(0.0f, 0.0f, -1.0f); }
-  inline static Vector3 forward() { return Vector3(0.0f, 1.0f, 0.0f); }
-  inline static Vector3 back() { return Vector3(0.0f, -1.0f, 0.0f); }
-
-  inline const float *get_data() const { return _data; }
-  inline float get_x() { return _data[0]; }
-  inline float get_y() { return _data[1]; }
-  inline float get_z() { return _data[2]; }
-  inline float &operator[] (int i) { assert(i >= 0 && i <= 2); return _data[i]; }
-  inline const float &operator[] (int i) const { assert(i >= 0 && i <= 2); return _data[i]; }
-
-  inline Vector3 &operator *= (float scalar) {
-    _x *= scalar;
-    _y *= scalar;
-    _z *= scalar;
+  constexpr Vector3() : _data{0.0f, 0.0f, 0.0f} { }
+  constexpr Vector3(float fill) : _data{fill, fill, fill} { }
+  constexpr Vector3(float x, float y, float z) : _data{x, y, z} { }
+
+  constexpr static Vector3 right() { return Vector3(1.0f, 0.0f, 0.0f); }
+  constexpr static Vector3 left() { return Vector3(-1.0f, 0.0f, 0.0f); }
+  constexpr static Vector3 up() { return Vector3(0.0f, 0.0f, 1.0f); }
+  constexpr static Vector3 down() { return Vector3(0.0f, 0.0f, -1.0f); }
+  constexpr static Vector3 forward() { return Vector3(0.0f, 1.0f, 0.0f); }
+  constexpr static Vector3 back() { return Vector3(0.0f, -1.0f, 0.0f); }
+
+  constexpr const float *get_data() const { return _data; }
+  constexpr float get_x() const { return _data[0]; }
+  constexpr float get_y() const { return _data[1]; }
+  constexpr float get_z() const { return _data[2]; }
+  constexpr float &operator[] (int i) { assert(i >= 0 && i <= 2); return _data[i]; }
+  constexpr const float &operator[] (int i) const { assert(i >= 0 && i <= 2); return _data[i]; }
+
+  constexpr bool operator == (const Vector3 &other) const {
+    return _data[0] == other._data[0] && _data[1] == other._data[1] && _data[2] == other._data[2];
+  }
+
+  constexpr Vector3 &operator *= (float scalar) {
+    _data[0] *= scalar;
+    _data[1] *= scalar;
+    _data[2] *= scalar;
     return *this;
   }
-  inline Vector3 operator * (float scalar) const {
+  constexpr Vector3 operator * (float scalar) const {
     Vector3 out(*this);
     out *= scalar;
     return out;
   }
-  inline Vector3 &operator /= (float scalar) {
-    _x /= scalar;
-    _y /= scalar;
-    _z /= scalar;
+  constexpr Vector3 &operator /= (float scalar) {
+    _data[0] /= scalar;
+    _data[1] /= scalar;
+    _data[2] /= scalar;
     return *this;
   }
-  inline Vector3 operator /= (float scalar) const {
+  constexpr Vector3 operator /= (float scalar) const {
     Vector3 out(*this);
     out /= scalar;
     return out;
   }
-  inline Vector3 &operator -= (const Vector3 &other) {
-    _x -= other._x;
-    _y -= other._y;
-    _z -= other._z;
+  constexpr Vector3 &operator -= (const Vector3 &other) {
+    _data[0] -= other._data[0];
+    _data[1] -= other._data[1];
+    _data[2] -= other._data[2];
     return *this;
   }
-  inline Vector3 operator - (const Vector3 &other) {
+  constexpr Vector3 operator - (const Vector3 &other) const {
     Vector3 out(*this);
     out -= other;
     return out;
   }
-  inline Vector3 &operator += (const Vector3 &other) {
-    _x += other._x;
-    _y += other._y;
-    _z += other._z;
+  constexpr Vector3 &operator += (const Vector3 &other) {
+    _data[0] += other._data[0];
+    _data[1] += other._data[1];
+    _data[2] += other._data[2];
     return *this;
   }
-  inline Vector3 operator + (const Vector3 &other) {
+  constexpr Vector3 operator + (const Vector3 &other) const {
     Vector3 out(*this);
     out += other;
     return out;
   }
 
-  inline float dot(const Vector3 &other) const {
-    return _x * other._x + _y * other._y + _z * other._z;
+  constexpr float dot(const Vector3 &other) const {
+    return _data[0] * other._data[0] + _data[1] * other._data[1] + _data[2] * other._data[2];
   }
 
-  inline Vector3 cross(const Vector3 &other) const {
+  constexpr Vector3 cross(const Vector3 &other) const {
     Vector3 out;
-    out._x = _y * other._z - _z * other._y;
-    out._y = -(_x * other._z - _z * other._x);
-    out._z = _x * other._y - _y * other._x;
+    out._data[0] = _data[1] * other._data[2] - _data[2] * other._data[1];
+    out._data[1] = -(_data[0] * other._data[2] - _data[2] * other._data[0]);
+    out._data[2] = _data[0] * other._data[1] - _data[1] * other._data[0];
     return out;
   }
 
-  inline float length_squared() const { return dot(*this); }
+  constexpr float length_squared() const { return dot(*this); }
   inline float length() const { return sqrt(length_squared()); }
 
   inline bool normalize() {
     float len = length();
     if (len > FLT_EPSILON) {
-      _x /= len;
-      _y /= len;
-      _z /= len;
+      _data[0] /= len;
+      _data[1] /= len;
+      _data[2] /= len;
       return true;
     } else {
       return false;
@@ -110,18 +118,100 @@ public:
   }
 
 private:
-  union {
-    float _data[3];
-    struct {
-      float _x, _y, _z;
-    };
-  };
+  float _data[3];
 };
 
-class Matrix4x4 {
+// Rotation as a unit quaternion, with x, y and z the vector part and w the
+// scalar part.  Products compose the way matrices do on row vectors: a * b
+// rotates by a, then by b.
+class Quaternion {
+public:
+  constexpr Quaternion() : _x(0.0f), _y(0.0f), _z(0.0f), _w(1.0f) { }
+  constexpr Quaternion(float x, float y, float z, float w) : _x(x), _y(y), _z(z), _w(w) { }
+
+  constexpr static Quaternion identity() { return Quaternion(); }
+
+  /**
+   * Rotation by angle degrees about the given unit axis, counter-clockwise
+   * looking down the axis, like Matrix4x4::rotate_mat_normaxis().
+   */
+  inline static Quaternion from_axis_angle(float angle, const Vector3 &axis) {
+    float half = deg_2_rad(angle) * 0.5f;
+    float s = std::sin(half);
+    return Quaternion(axis[0] * s, axis[1] * s, axis[2] * s, std::cos(half));
+  }
+
+  /**
+   * Rotation by roll about forward, then pitch about right, then heading
+   * about up, all in degrees, like Matrix4x4::from_components().
+   */
+  inline static Quaternion from_hpr(const Vector3 &hpr) {
+    return from_axis_angle(hpr[2], Vector3::forward()) *
+           from_axis_angle(hpr[1], Vector3::right()) *
+           from_axis_angle(hpr[0], Vector3::up());
+  }
+
+  constexpr float get_x() const { return _x; }
+  constexpr float get_y() const { return _y; }
+  constexpr float get_z() const { return _z; }
+  constexpr float get_w() const { return _w; }
+
+  constexpr Quaternion operator * (const Quaternion &other) const {
+    // The Hamilton product other * this.
+    const Quaternion &a = other;
+    const Quaternion &b = *this;
+    return Quaternion(a._w * b._x + a._x * b._w + a._y * b._z - a._z * b._y,
+                      a._w * b._y - a._x * b._z + a._y * b._w + a._z * b._x,
+                      a._w * b._z + a._x * b._y - a._y * b._x + a._z * b._w,
+                      a._w * b._w - a._x * b._x - a._y * b._y - a._z * b._z);
+  }
+  constexpr Quaternion &operator *= (const Quaternion &other) {
+    *this = *this * other;
+    return *this;
+  }
+
+  // The inverse rotation, for unit quaternions.
+  constexpr Quaternion conjugate() const { return Quaternion(-_x, -_y, -_z, _w); }
+
+  constexpr float dot(const Quaternion &other) const {
+    return _x * other._x + _y * other._y + _z * other._z + _w * other._w;
+  }
+  constexpr float length_squared() const { return dot(*this); }
+
+  inline bool normalize() {
+    float len = std::sqrt(length_squared());
+    if (len > FLT_EPSILON) {
+      _x /= len;
+      _y /= len;
+      _z /= len;
+      _w /= len;
+      return true;
+    } else {
+      return false;
+    }
+  }
+  inline Quaternion normalized() const {
+    Quaternion copy(*this);
+    copy.normalize();
+    return copy;
+  }
+
+  constexpr Vector3 rotate(const Vector3 &vec) const {
+    Vector3 axis(_x, _y, _z);
+    Vector3 t = axis.cross(vec) * 2.0f;
+    return vec + t * _w + axis.cross(t);
+  }
+
+private:
+  float _x, _y, _z, _w;
+};
+
+// Row-major 4x4 matrix, applied to row vectors on its left.  Rows are
+// 16-byte aligned so that they load straight into 4-wide vectors.
+class alignas(16) Matrix4x4 {
 public:
   Matrix4x4() = default;
-  Matrix4x4(float fill) {
+  constexpr Matrix4x4(float fill) {
     for (int i = 0; i < 4; ++i) {
       for (int j = 0; j < 4; ++j) {
         _data[i][j] = fill;
@@ -129,7 +219,7 @@ public:
     }
   }
 
-  inline static Matrix4x4 identity() {
+  constexpr static Matrix4x4 identity() {
     Matrix4x4 out(0.0f);
     out._data[0][0] = 1.0f;
     out._data[1][1] = 1.0f;
@@ -138,113 +228,175 @@ public:
     return out;
   }
 
-  inline void set_cell(int row, int col, float val) { _data[row][col] = val; }
-  inline float get_cell(int row, int col) const { return _data[row][col]; }
+  constexpr void set_cell(int row, int col, float val) { _data[row][col] = val; }
+  constexpr float get_cell(int row, int col) const { return _data[row][col]; }
 
-  inline void set_row(int row, float x, float y, float z, float w) {
+  constexpr void set_row(int row, float x, float y, float z, float w) {
     _data[row][0] = x;
     _data[row][1] = y;
     _data[row][2] = z;
     _data[row][3] = w;
   }
-  inline const float *get_row(int row) const {
+  constexpr const float *get_row(int row) const {
     return _data[row];
   }
 
   inline const float *get_data() const { return (const float *)_data; }
 
-  inline Matrix4x4 transposed() const {
-    Matrix4x4 out;
-    // Flip rows and columns.
+  inline f32x4 get_row_x4(int row) const { return f32x4_load(_data[row]); }
+  inline void set_row_x4(int row, f32x4 val) { f32x4_store(_data[row], val); }
+
+  constexpr bool operator == (const Matrix4x4 &other) const {
     for (int i = 0; i < 4; ++i) {
       for (int j = 0; j < 4; ++j) {
-        out._data[i][j] = _data[j][i];
+        if (_data[i][j] != other._data[i][j]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Row vectors times the matrix, with w = 1 for points and 0 for vectors,
+  // not divided by w.  Summed in the same order as Matrix4x4Packet.
+  constexpr Vector3 transform_point(const Vector3 &p) const {
+    Vector3 out;
+    for (int c = 0; c < 3; ++c) {
+      out[c] = ((p[0] * _data[0][c] + p[1] * _data[1][c]) + p[2] * _data[2][c]) + _data[3][c];
+    }
+    return out;
+  }
+  constexpr Vector3 transform_vector(const Vector3 &v) const {
+    Vector3 out;
+    for (int c = 0; c < 3; ++c) {
+      out[c] = (v[0] * _data[0][c] + v[1] * _data[1][c]) + v[2] * _data[2][c];
+    }
+    return out;
+  }
+
+  // The methods below that use SIMD have a scalar path for constant
+  // evaluation, which gives the same results unless noted.
+  constexpr Matrix4x4 transposed() const {
+    if (std::is_constant_evaluated()) {
+      Matrix4x4 out;
+      for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+          out._data[i][j] = _data[j][i];
+        }
       }
+      return out;
     }
+    f32x4 r0 = get_row_x4(0);
+    f32x4 r1 = get_row_x4(1);
+    f32x4 r2 = get_row_x4(2);
+    f32x4 r3 = get_row_x4(3);
+    f32x4_transpose(r0, r1, r2, r3);
+    Matrix4x4 out;
+    out.set_row_x4(0, r0);
+    out.set_row_x4(1, r1);
+    out.set_row_x4(2, r2);
+    out.set_row_x4(3, r3);
     return out;
   }
-  inline Matrix4x4 &transpose() {
+  constexpr Matrix4x4 &transpose() {
     *this = transposed();
     return *this;
   }
 
-  inline Matrix4x4 operator * (const Matrix4x4 &other) const {
+  // Each row of the product is the rows of other weighted by the matching
+  // row of this one, summed in column order.  All four rows are computed
+  // before any is stored, so that the product is built in registers rather
+  // than stored and copied back out.  With FMA the terms after the first
+  // are fused, so the result may differ in the last bit from the constant
+  // evaluated one.
+  constexpr Matrix4x4 operator * (const Matrix4x4 &other) const {
+    if (std::is_constant_evaluated()) {
+      Matrix4x4 out;
+      for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+          out._data[i][j] = _data[i][0] * other._data[0][j] + _data[i][1] * other._data[1][j] +
+                            _data[i][2] * other._data[2][j] + _data[i][3] * other._data[3][j];
+        }
+      }
+      return out;
+    }
+    f32x4 b0 = other.get_row_x4(0);
+    f32x4 b1 = other.get_row_x4(1);
+    f32x4 b2 = other.get_row_x4(2);
+    f32x4 b3 = other.get_row_x4(3);
+    auto mul_row = [&](int i) {
+      f32x4 row = f32x4_set1(_data[i][0]) * b0;
+      row = f32x4_madd(f32x4_set1(_data[i][1]), b1, row);
+      row = f32x4_madd(f32x4_set1(_data[i][2]), b2, row);
+      return f32x4_madd(f32x4_set1(_data[i][3]), b3, row);
+    };
+    f32x4 r0 = mul_row(0);
+    f32x4 r1 = mul_row(1);
+    f32x4 r2 = mul_row(2);
+    f32x4 r3 = mul_row(3);
     Matrix4x4 out;
-    // 1st row.
-    out._data[0][0] = _data[0][0] * other._data[0][0] + _data[0][1] * other._data[1][0] + _data[0][2] * other._data[2][0] + _data[0][3] * other._data[3][0];
-    out._data[0][1] = _data[0][0] * other._data[0][1] + _data[0][1] * other._data[1][1] + _data[0][2] * other._data[2][1] + _data[0][3] * other._data[3][1];
-    out._data[0][2] = _data[0][0] * other._data[0][2] + _data[0][1] * other._data[1][2] + _data[0][2] * other._data[2][2] + _data[0][3] * other._data[3][2];
-    out._data[0][3] = _data[0][0] * other._data[0][3] + _data[0][1] * other._data[1][3] + _data[0][2] * other._data[2][3] + _data[0][3] * other._data[3][3];
-    // 2nd row.
-    out._data[1][0] = _data[1][0] * other._data[0][0] + _data[1][1] * other._data[1][0] + _data[1][2] * other._data[2][0] + _data[1][3] * other._data[3][0];
-    out._data[1][1] = _data[1][0] * other._data[0][1] + _data[1][1] * other._data[1][1] + _data[1][2] * other._data[2][1] + _data[1][3] * other._data[3][1];
-    out._data[1][2] = _data[1][0] * other._data[0][2] + _data[1][1] * other._data[1][2] + _data[1][2] * other._data[2][2] + _data[1][3] * other._data[3][2];
-    out._data[1][3] = _data[1][0] * other._data[0][3] + _data[1][1] * other._data[1][3] + _data[1][2] * other._data[2][3] + _data[1][3] * other._data[3][3];
-    // 3rd row.
-    out._data[2][0] = _data[2][0] * other._data[0][0] + _data[2][1] * other._data[1][0] + _data[2][2] * other._data[2][0] + _data[2][3] * other._data[3][0];
-    out._data[2][1] = _data[2][0] * other._data[0][1] + _data[2][1] * other._data[1][1] + _data[2][2] * other._data[2][1] + _data[2][3] * other._data[3][1];
-    out._data[2][2] = _data[2][0] * other._data[0][2] + _data[2][1] * other._data[1][2] + _data[2][2] * other._data[2][2] + _data[2][3] * other._data[3][2];
-    out._data[2][3] = _data[2][0] * other._data[0][3] + _data[2][1] * other._data[1][3] + _data[2][2] * other._data[2][3] + _data[2][3] * other._data[3][3];
-    // 4th row.
-    out._data[3][0] = _data[3][0] * other._data[0][0] + _data[3][1] * other._data[1][0] + _data[3][2] * other._data[2][0] + _data[3][3] * other._data[3][0];
-    out._data[3][1] = _data[3][0] * other._data[0][1] + _data[3][1] * other._data[1][1] + _data[3][2] * other._data[2][1] + _data[3][3] * other._data[3][1];
-    out._data[3][2] = _data[3][0] * other._data[0][2] + _data[3][1] * other._data[1][2] + _data[3][2] * other._data[2][2] + _data[3][3] * other._data[3][2];
-    out._data[3][3] = _data[3][0] * other._data[0][3] + _data[3][1] * other._data[1][3] + _data[3][2] * other._data[2][3] + _data[3][3] * other._data[3][3];
+    out.set_row_x4(0, r0);
+    out.set_row_x4(1, r1);
+    out.set_row_x4(2, r2);
+    out.set_row_x4(3, r3);
     return out;
   }
-  inline Matrix4x4 &operator *= (const Matrix4x4 &other) {
+  constexpr Matrix4x4 &operator *= (const Matrix4x4 &other) {
     *this = (*this) * other;
     return *this;
   }
 
+  // Inverts the matrix by splitting it into 2x2 blocks, and taking the
+  // inverse of each through the adjugates of the others.  The blocks are
+  // held in one vector each, as (m00 m01 m10 m11).
   inline Matrix4x4 inverted() const {
-    float a2323 = _data[2][2] * _data[3][3] - _data[2][3] * _data[3][2];
-    float a1323 = _data[2][1] * _data[3][3] - _data[2][3] * _data[3][1];
-    float a1223 = _data[2][1] * _data[3][2] - _data[2][2] * _data[3][1];
-    float a0323 = _data[2][0] * _data[3][3] - _data[2][3] * _data[3][0];
-    float a0223 = _data[2][0] * _data[3][2] - _data[2][2] * _data[3][0];
-    float a0123 = _data[2][0] * _data[3][1] - _data[2][1] * _data[3][0];
-    float a2313 = _data[1][2] * _data[3][3] - _data[1][3] * _data[3][2];
-    float a1313 = _data[1][1] * _data[3][3] - _data[1][3] * _data[3][1];
-    float a1213 = _data[1][1] * _data[3][2] - _data[1][2] * _data[3][1];
-    float a2312 = _data[1][2] * _data[2][3] - _data[1][3] * _data[2][2];
-    float a1312 = _data[1][1] * _data[2][3] - _data[1][3] * _data[2][1];
-    float a1212 = _data[1][1] * _data[2][2] - _data[1][2] * _data[2][1];
-    float a0313 = _data[1][0] * _data[3][3] - _data[1][3] * _data[3][0];
-    float a0213 = _data[1][0] * _data[3][2] - _data[1][2] * _data[3][0];
-    float a0312 = _data[1][0] * _data[2][3] - _data[1][3] * _data[2][0];
-    float a0212 = _data[1][0] * _data[2][2] - _data[1][2] * _data[2][0];
-    float a0113 = _data[1][0] * _data[3][1] - _data[1][1] * _data[3][0];
-    float a0112 = _data[1][0] * _data[2][1] - _data[1][1] * _data[2][0];
-
-    float det =
-        _data[0][0] * (_data[1][1] * a2323 - _data[1][2] * a1323 + _data[1][3] * a1223)
-      - _data[0][1] * (_data[1][0] * a2323 - _data[1][2] * a0323 + _data[1][3] * a0223)
-      + _data[0][2] * (_data[1][0] * a1323 - _data[1][1] * a0323 + _data[1][3] * a0123)
-      - _data[0][3] * (_data[1][0] * a1223 - _data[1][1] * a0223 + _data[1][2] * a0123);
-    if (abs(det) < FLT_EPSILON) {
+    f32x4 r0 = get_row_x4(0);
+    f32x4 r1 = get_row_x4(1);
+    f32x4 r2 = get_row_x4(2);
+    f32x4 r3 = get_row_x4(3);
+
+    // [A B]
+    // [C D]
+    f32x4 a = f32x4_shuffle<0, 1, 0, 1>(r0, r1);
+    f32x4 b = f32x4_shuffle<2, 3, 2, 3>(r0, r1);
+    f32x4 c = f32x4_shuffle<0, 1, 0, 1>(r2, r3);
+    f32x4 d = f32x4_shuffle<2, 3, 2, 3>(r2, r3);
+
+    // Determinants of A, B, C and D.
+    f32x4 det_sub = f32x4_shuffle<0, 2, 0, 2>(r0, r2) * f32x4_shuffle<1, 3, 1, 3>(r1, r3) -
+                    f32x4_shuffle<1, 3, 1, 3>(r0, r2) * f32x4_shuffle<0, 2, 0, 2>(r1, r3);
+    f32x4 det_a = f32x4_splat<0>(det_sub);
+    f32x4 det_b = f32x4_splat<1>(det_sub);
+    f32x4 det_c = f32x4_splat<2>(det_sub);
+    f32x4 det_d = f32x4_splat<3>(det_sub);
+
+    f32x4 d_c = mat2_adj_mul(d, c);
+    f32x4 a_b = mat2_adj_mul(a, b);
+    f32x4 x = det_d * a - mat2_mul(b, d_c);
+    f32x4 w = det_a * d - mat2_mul(c, a_b);
+    f32x4 y = det_b * c - mat2_mul_adj(d, a_b);
+    f32x4 z = det_c * b - mat2_mul_adj(a, d_c);
+
+    // det = |A||D| + |B||C| - tr((A#B)(D#C))
+    f32x4 tr = a_b * f32x4_swizzle<0, 2, 1, 3>(d_c);
+    tr = tr + f32x4_swizzle<1, 0, 3, 2>(tr);
+    tr = tr + f32x4_swizzle<2, 3, 0, 1>(tr);
+    f32x4 det = det_a * det_d + det_b * det_c - tr;
+    if (std::abs(f32x4_get_x(det)) < FLT_EPSILON) {
       return Matrix4x4();
     }
-    det = 1.0f / det;
 
-    Matrix4x4 out;
-    out._data[0][0] = det * (_data[1][1] * a2323 - _data[1][2] * a1323 + _data[1][3] * a1223);
-    out._data[0][1] = det * -(_data[0][1] * a2323 - _data[0][2] * a1323 + _data[0][3] * a1223);
-    out._data[0][2] = det * (_data[0][1] * a2313 - _data[0][2] * a1313 + _data[0][3] * a1213);
-    out._data[0][3] = det * -(_data[0][1] * a2312 - _data[0][2] * a1312 + _data[0][3] * a1212);
-    out._data[1][0] = det * -(_data[1][0] * a2323 - _data[1][2] * a0323 + _data[1][3] * a0223);
-    out._data[1][1] = det * (_data[0][0] * a2323 - _data[0][2] * a0323 + _data[0][3] * a0223);
-    out._data[1][2] = det * -(_data[0][0] * a2313 - _data[0][2] * a0313 + _data[0][3] * a0213);
-    out._data[1][3] = det * (_data[0][0] * a2312 - _data[0][2] * a0312 + _data[0][3] * a0212);
-    out._data[2][0] = det * (_data[1][0] * a1323 - _data[1][2] * a0323 + _data[1][3] * a0123);
-    out._data[2][1] = det * -(_data[0][0] * a1323 - _data[0][1] * a0323 + _data[0][3] * a0123);
-    out._data[2][2] = det * (_data[0][0] * a1313 - _data[0][1] * a0313 + _data[0][3] * a0113);
-    out._data[2][3] = det * -(_data[0][0] * a1323 - _data[0][1] * a0312 + _data[0][3] * a0112);
-    out._data[3][0] = det * -(_data[1][0] * a1223 - _data[1][1] * a0223 + _data[1][2] * a0123);
-    out._data[3][1] = det * (_data[0][0] * a1223 - _data[0][1] * a0223 + _data[0][2] * a0123);
-    out._data[3][2] = det * -(_data[0][0] * a1213 - _data[0][1] * a0213 + _data[0][2] * a0123);
-    out._data[3][3] = det * (_data[0][0] * a1212 - _data[0][1] * a0212 + _data[0][2] * a0112);
+    f32x4 inv_det = f32x4_set(1.0f, -1.0f, -1.0f, 1.0f) / det;
+    x = x * inv_det;
+    y = y * inv_det;
+    z = z * inv_det;
+    w = w * inv_det;
 
+    Matrix4x4 out;
+    out.set_row_x4(0, f32x4_shuffle<3, 1, 3, 1>(x, y));
+    out.set_row_x4(1, f32x4_shuffle<2, 0, 2, 0>(x, y));
+    out.set_row_x4(2, f32x4_shuffle<3, 1, 3, 1>(z, w));
+    out.set_row_x4(3, f32x4_shuffle<2, 0, 2, 0>(z, w));
     return out;
   }
 
@@ -253,6 +405,72 @@ public:
     return *this;
   }
 
+  // Inverts a matrix whose last column is (0, 0, 0, 1), that is any linear
+  // transform followed by a translation.  Cheaper than inverted(), and
+  // wrong for projections.
+  constexpr Matrix4x4 inverted_affine() const {
+    if (std::is_constant_evaluated()) {
+      Vector3 r0(_data[0][0], _data[0][1], _data[0][2]);
+      Vector3 r1(_data[1][0], _data[1][1], _data[1][2]);
+      Vector3 r2(_data[2][0], _data[2][1], _data[2][2]);
+      Vector3 c0 = r1.cross(r2);
+      Vector3 c1 = r2.cross(r0);
+      Vector3 c2 = r0.cross(r1);
+      float det = r0.dot(c0);
+      if (det > -FLT_EPSILON && det < FLT_EPSILON) {
+        return Matrix4x4();
+      }
+      Matrix4x4 out = identity();
+      float inv_det = 1.0f / det;
+      for (int i = 0; i < 3; ++i) {
+        out._data[i][0] = c0[i] * inv_det;
+        out._data[i][1] = c1[i] * inv_det;
+        out._data[i][2] = c2[i] * inv_det;
+      }
+      for (int j = 0; j < 3; ++j) {
+        out._data[3][j] = 0.0f - ((_data[3][0] * out._data[0][j] + _data[3][1] * out._data[1][j]) +
+                                  _data[3][2] * out._data[2][j]);
+      }
+      return out;
+    }
+    f32x4 r0 = get_row_x4(0);
+    f32x4 r1 = get_row_x4(1);
+    f32x4 r2 = get_row_x4(2);
+    f32x4 t = get_row_x4(3);
+
+    // The columns of the inverse of the upper 3x3 are the cross products of
+    // its rows, over its determinant.
+    f32x4 c0 = cross3(r1, r2);
+    f32x4 c1 = cross3(r2, r0);
+    f32x4 c2 = cross3(r0, r1);
+    f32x4 dot = r0 * c0;
+    f32x4 det = f32x4_splat<0>(dot) + f32x4_splat<1>(dot) + f32x4_splat<2>(dot);
+    if (std::abs(f32x4_get_x(det)) < FLT_EPSILON) {
+      return Matrix4x4();
+    }
+    f32x4 inv_det = f32x4_set1(1.0f) / det;
+    c0 = c0 * inv_det;
+    c1 = c1 * inv_det;
+    c2 = c2 * inv_det;
+    f32x4 c3 = f32x4_set1(0.0f);
+    f32x4_transpose(c0, c1, c2, c3);
+
+    // The translation goes through the inverse and flips.
+    f32x4 tr = f32x4_splat<0>(t) * c0 + f32x4_splat<1>(t) * c1 + f32x4_splat<2>(t) * c2;
+
+    Matrix4x4 out;
+    out.set_row_x4(0, c0);
+    out.set_row_x4(1, c1);
+    out.set_row_x4(2, c2);
+    out.set_row_x4(3, f32x4_set(0.0f, 0.0f, 0.0f, 1.0f) - tr);
+    return out;
+  }
+
+  constexpr Matrix4x4 &invert_affine() {
+    *this = inverted_affine();
+    return *this;
+  }
+
   /**
    * Builds a perpsective projection matrix from the given lens parameters.
    */
@@ -274,7 +492,7 @@ public:
   /**
    * Builds an orthographic projection matrix from the given parameters.
    */
-  inline static Matrix4x4 make_orthographic_projection(float left, float right, float bottom, float top, float near_dist, float far_dist) {
+  constexpr static Matrix4x4 make_orthographic_projection(float left, float right, float bottom, float top, float near_dist, float far_dist) {
     Matrix4x4 out(0.0f);
     out._data[0][0] = 2.0f / (right - left);
     out._data[1][1] = 2.0f / (top - bottom);
@@ -286,8 +504,8 @@ public:
     return out;
   }
 
-  inline static Matrix4x4 scale_shear_mat(const Vector3 &scale,
-                                          const Vector3 &shear) {
+  constexpr static Matrix4x4 scale_shear_mat(const Vector3 &scale,
+                                             const Vector3 &shear) {
     Matrix4x4 out = identity();
     out._data[0][0] = scale[0];
     out._data[0][1] = shear[0] * scale[0];
@@ -305,8 +523,8 @@ public:
                                               const Vector3 &axis) {
 
     float angle_rad = deg_2_rad(angle);
-    float s = std::sin(angle);
-    float c = std::cos(angle);
+    float s = std::sin(angle_rad);
+    float c = std::cos(angle_rad);
     float t = 1.0f - c;
 
     float t0, t1, t2, s0, s1, s2;
@@ -331,24 +549,40 @@ public:
     return out;
   }
 
+  /**
+   * Rotation matrix of a unit quaternion.  Row i is the rotated i axis.
+   */
+  constexpr static Matrix4x4 rotate_mat(const Quaternion &quat) {
+    float x = quat.get_x();
+    float y = quat.get_y();
+    float z = quat.get_z();
+    float w = quat.get_w();
+
+    Matrix4x4 out = identity();
+    out._data[0][0] = 1.0f - 2.0f * (y * y + z * z);
+    out._data[0][1] = 2.0f * (x * y + w * z);
+    out._data[0][2] = 2.0f * (x * z - w * y);
+    out._data[1][0] = 2.0f * (x * y - w * z);
+    out._data[1][1] = 1.0f - 2.0f * (x * x + z * z);
+    out._data[1][2] = 2.0f * (y * z + w * x);
+    out._data[2][0] = 2.0f * (x * z + w * y);
+    out._data[2][1] = 2.0f * (y * z - w * x);
+    out._data[2][2] = 1.0f - 2.0f * (x * x + y * y);
+    return out;
+  }
+
+  /**
+   * Scale and shear, then rotation by roll, pitch and heading in degrees,
+   * then translation.  See also Transform, which composes without building
+   * matrices.
+   */
   inline static Matrix4x4 from_components(const Vector3 &scale,
                                           const Vector3 &shear,
                                           const Vector3 &hpr,
                                           const Vector3 &translate) {
-    Matrix4x4 out;
-
-    // Scale and shear.
-    out = scale_shear_mat(scale, shear);
-
-    // Rotate.
-    if (hpr[2] != 0.0f) {
-      out *= rotate_mat_normaxis(hpr[2], Vector3::forward());
-    }
-    if (hpr[1] != 0.0f) {
-      out *= rotate_mat_normaxis(hpr[1], Vector3::right());
-    }
-    if (hpr[0] != 0.0f) {
-      out *= rotate_mat_normaxis(hpr[0], Vector3::up());
+    Matrix4x4 out = scale_shear_mat(scale, shear);
+    if (hpr[0] != 0.0f || hpr[1] != 0.0f || hpr[2] != 0.0f) {
+      out *= rotate_mat(Quaternion::from_hpr(hpr));
     }
 
     // Translate
@@ -359,11 +593,46 @@ public:
     return out;
   }
 
+private:
+  // 2x2 matrix helpers of inverted(), on matrices packed as (m00 m01 m10
+  // m11).  a * b, a# * b and a * b#, where # is the adjugate.
+  static inline f32x4 mat2_mul(f32x4 a, f32x4 b) {
+    return a * f32x4_swizzle<0, 3, 0, 3>(b) +
+           f32x4_swizzle<1, 0, 3, 2>(a) * f32x4_swizzle<2, 1, 2, 1>(b);
+  }
+  static inline f32x4 mat2_adj_mul(f32x4 a, f32x4 b) {
+    return f32x4_swizzle<3, 3, 0, 0>(a) * b -
+           f32x4_swizzle<1, 1, 2, 2>(a) * f32x4_swizzle<2, 3, 0, 1>(b);
+  }
+  static inline f32x4 mat2_mul_adj(f32x4 a, f32x4 b) {
+    return a * f32x4_swizzle<3, 0, 3, 0>(b) -
+           f32x4_swizzle<1, 0, 3, 2>(a) * f32x4_swizzle<2, 1, 2, 1>(b);
+  }
+
+  // Cross product of the first three lanes, the last lane is a.w * b.w -
+  // a.w * b.w.
+  static inline f32x4 cross3(f32x4 a, f32x4 b) {
+    return f32x4_swizzle<1, 2, 0, 3>(a) * f32x4_swizzle<2, 0, 1, 3>(b) -
+           f32x4_swizzle<2, 0, 1, 3>(a) * f32x4_swizzle<1, 2, 0, 3>(b);
+  }
+
 private:
   // [row][column]
   float _data[4][4];
 };
 
+// Transforms arrays of points or vectors as row vectors times the matrix.
+// Points take the translation and vectors don't, neither is divided by w.
+// The output may be the input, but may not otherwise overlap it.
+void transform_points(const Matrix4x4 &mat, std::span<const Vector3> in, std::span<Vector3> out);
+void transform_vectors(const Matrix4x4 &mat, std::span<const Vector3> in, std::span<Vector3> out);
+
+// The same over separate arrays of each component.
+void transform_points_soa(const Matrix4x4 &mat, const float *x, const float *y, const float *z,
+                          float *out_x, float *out_y, float *out_z, size_t count);
+void transform_vectors_soa(const Matrix4x4 &mat, const float *x, const float *y, const float *z,
+                           float *out_x, float *out_y, float *out_z, size_t count);
+
 inline std::ostream &operator << (std::ostream &out, const Vector3 &vec) {
   out << "(" << vec[0] << ", " << vec[1] << ", " << vec[2] << ")";
   return out;
@@ -0,0 +1,254 @@
+#ifndef LINMATH_SIMD_HXX
+#define LINMATH_SIMD_HXX
+
+#include <stddef.h>
+
+#include "linmath.hxx"
+#include "numeric_types.hxx"
+#include "simd.hxx"
+
+static_assert(sizeof(Vector3) == 3 * sizeof(float), "Vector3 arrays must be packed floats");
+
+// The operations of a float vector type, for the packet templates below.
+template<class T>
+struct FloatOps;
+
+template<>
+struct FloatOps<f32x4> {
+  static constexpr int width = 4;
+
+  static inline f32x4 set1(float x) { return f32x4_set1(x); }
+  static inline f32x4 loadu(const float *p) { return f32x4_loadu(p); }
+  static inline void storeu(float *p, f32x4 a) { f32x4_storeu(p, a); }
+  static inline f32x4 min(f32x4 a, f32x4 b) { return f32x4_min(a, b); }
+  static inline f32x4 max(f32x4 a, f32x4 b) { return f32x4_max(a, b); }
+  static inline f32x4 sqrt(f32x4 a) { return f32x4_sqrt(a); }
+  static inline f32x4 madd(f32x4 a, f32x4 b, f32x4 c) { return f32x4_madd(a, b, c); }
+  static inline f32x4 cmpgt(f32x4 a, f32x4 b) { return f32x4_cmpgt(a, b); }
+  static inline f32x4 select(f32x4 mask, f32x4 a, f32x4 b) { return f32x4_select(mask, a, b); }
+
+  // Splits four packed xyz triples, (x0 y0 z0 x1) (y1 z1 x2 y2)
+  // (z2 x3 y3 z3), into a vector per component.
+  static inline void load_xyz(const float *p, f32x4 &x, f32x4 &y, f32x4 &z) {
+    f32x4 a = f32x4_loadu(p);
+    f32x4 b = f32x4_loadu(p + 4);
+    f32x4 c = f32x4_loadu(p + 8);
+    x = f32x4_shuffle<0, 3, 0, 2>(a, f32x4_shuffle<2, 3, 1, 2>(b, c));
+    y = f32x4_shuffle<0, 2, 0, 2>(f32x4_shuffle<1, 1, 0, 0>(a, b), f32x4_shuffle<3, 3, 2, 2>(b, c));
+    z = f32x4_shuffle<0, 2, 0, 2>(f32x4_shuffle<2, 2, 1, 1>(a, b), f32x4_shuffle<0, 0, 3, 3>(c, c));
+  }
+
+  static inline void store_xyz(float *p, f32x4 x, f32x4 y, f32x4 z) {
+    f32x4_storeu(p, f32x4_shuffle<0, 2, 0, 2>(f32x4_shuffle<0, 0, 0, 0>(x, y),
+                                              f32x4_shuffle<0, 0, 1, 1>(z, x)));
+    f32x4_storeu(p + 4, f32x4_shuffle<0, 2, 0, 2>(f32x4_shuffle<1, 1, 1, 1>(y, z),
+                                                  f32x4_shuffle<2, 2, 2, 2>(x, y)));
+    f32x4_storeu(p + 8, f32x4_shuffle<0, 2, 0, 2>(f32x4_shuffle<2, 2, 3, 3>(z, x),
+                                                  f32x4_shuffle<3, 3, 3, 3>(y, z)));
+  }
+};
+
+template<>
+struct FloatOps<f32x8> {
+  static constexpr int width = 8;
+
+  static inline f32x8 set1(float x) { return f32x8_set1(x); }
+  static inline f32x8 loadu(const float *p) { return f32x8_loadu(p); }
+  static inline void storeu(float *p, f32x8 a) { f32x8_storeu(p, a); }
+  static inline f32x8 min(f32x8 a, f32x8 b) { return f32x8_min(a, b); }
+  static inline f32x8 max(f32x8 a, f32x8 b) { return f32x8_max(a, b); }
+  static inline f32x8 sqrt(f32x8 a) { return f32x8_sqrt(a); }
+  static inline f32x8 madd(f32x8 a, f32x8 b, f32x8 c) { return f32x8_madd(a, b, c); }
+  static inline f32x8 cmpgt(f32x8 a, f32x8 b) { return f32x8_cmpgt(a, b); }
+  static inline f32x8 select(f32x8 mask, f32x8 a, f32x8 b) { return f32x8_select(mask, a, b); }
+
+  // Splits eight packed xyz triples into a vector per component.
+  static inline void load_xyz(const float *p, f32x8 &x, f32x8 &y, f32x8 &z) {
+#if defined(SIMD_AVX2)
+    // Loaded in halves, so that each 128-bit lane holds the same part of
+    // four triples.
+    __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+    __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+    __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+    __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+    __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+    x.v = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    y.v = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    z.v = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+#else
+    FloatOps<f32x4>::load_xyz(p, x.lo, y.lo, z.lo);
+    FloatOps<f32x4>::load_xyz(p + 12, x.hi, y.hi, z.hi);
+#endif
+  }
+
+  static inline void store_xyz(float *p, f32x8 x, f32x8 y, f32x8 z) {
+#if defined(SIMD_AVX2)
+    __m256 rxy = _mm256_shuffle_ps(x.v, y.v, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 ryz = _mm256_shuffle_ps(y.v, z.v, _MM_SHUFFLE(3, 1, 3, 1));
+    __m256 rzx = _mm256_shuffle_ps(z.v, x.v, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 m03 = _mm256_shuffle_ps(rxy, rzx, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 m14 = _mm256_shuffle_ps(ryz, rxy, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 m25 = _mm256_shuffle_ps(rzx, ryz, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(p, _mm256_castps256_ps128(m03));
+    _mm_storeu_ps(p + 4, _mm256_castps256_ps128(m14));
+    _mm_storeu_ps(p + 8, _mm256_castps256_ps128(m25));
+    _mm_storeu_ps(p + 12, _mm256_extractf128_ps(m03, 1));
+    _mm_storeu_ps(p + 16, _mm256_extractf128_ps(m14, 1));
+    _mm_storeu_ps(p + 20, _mm256_extractf128_ps(m25, 1));
+#else
+    FloatOps<f32x4>::store_xyz(p, x.lo, y.lo, z.lo);
+    FloatOps<f32x4>::store_xyz(p + 12, x.hi, y.hi, z.hi);
+#endif
+  }
+};
+
+// A packet of Vector3s, one per lane, stored as a float vector per
+// component.  Arithmetic matches Vector3's lane by lane, except for
+// madd(), which is fused where the target has it.
+template<class T>
+struct Vector3Packet {
+  typedef FloatOps<T> Ops;
+  static constexpr int width = Ops::width;
+
+  T x;
+  T y;
+  T z;
+
+  Vector3Packet() = default;
+  inline Vector3Packet(T x, T y, T z) : x(x), y(y), z(z) { }
+  // Every lane set to v.
+  inline explicit Vector3Packet(const Vector3 &v) :
+    x(Ops::set1(v[0])), y(Ops::set1(v[1])), z(Ops::set1(v[2])) { }
+
+  // Loads and stores width consecutive Vector3s.
+  static inline Vector3Packet load(const Vector3 *p) {
+    Vector3Packet out;
+    Ops::load_xyz(p->get_data(), out.x, out.y, out.z);
+    return out;
+  }
+  inline void store(Vector3 *p) const {
+    Ops::store_xyz((float *)p, x, y, z);
+  }
+
+  // Loads width triples of floats stride bytes apart, such as a column of
+  // interleaved vertex data.
+  static inline Vector3Packet load_strided(const void *p, size_t stride) {
+    float lanes[3][width];
+    for (int i = 0; i < width; ++i) {
+      const float *v = (const float *)((const ubyte *)p + i * stride);
+      lanes[0][i] = v[0];
+      lanes[1][i] = v[1];
+      lanes[2][i] = v[2];
+    }
+    return Vector3Packet(Ops::loadu(lanes[0]), Ops::loadu(lanes[1]), Ops::loadu(lanes[2]));
+  }
+
+  // Loads the triples of floats at base + indices[i] * stride, such as the
+  // vertices of an indexed mesh.
+  static inline Vector3Packet gather(const void *base, size_t stride, const u32 *indices) {
+    float lanes[3][width];
+    for (int i = 0; i < width; ++i) {
+      const float *v = (const float *)((const ubyte *)base + indices[i] * stride);
+      lanes[0][i] = v[0];
+      lanes[1][i] = v[1];
+      lanes[2][i] = v[2];
+    }
+    return Vector3Packet(Ops::loadu(lanes[0]), Ops::loadu(lanes[1]), Ops::loadu(lanes[2]));
+  }
+
+  inline Vector3 get_lane(int lane) const {
+    assert(lane >= 0 && lane < width);
+    float lanes[3][width];
+    Ops::storeu(lanes[0], x);
+    Ops::storeu(lanes[1], y);
+    Ops::storeu(lanes[2], z);
+    return Vector3(lanes[0][lane], lanes[1][lane], lanes[2][lane]);
+  }
+
+  inline Vector3Packet operator + (const Vector3Packet &other) const {
+    return Vector3Packet(x + other.x, y + other.y, z + other.z);
+  }
+  inline Vector3Packet operator - (const Vector3Packet &other) const {
+    return Vector3Packet(x - other.x, y - other.y, z - other.z);
+  }
+  inline Vector3Packet operator * (const Vector3Packet &other) const {
+    return Vector3Packet(x * other.x, y * other.y, z * other.z);
+  }
+  inline Vector3Packet operator * (T scalar) const {
+    return Vector3Packet(x * scalar, y * scalar, z * scalar);
+  }
+  inline Vector3Packet operator / (T scalar) const {
+    return Vector3Packet(x / scalar, y / scalar, z / scalar);
+  }
+
+  inline T dot(const Vector3Packet &other) const {
+    return x * other.x + y * other.y + z * other.z;
+  }
+
+  inline Vector3Packet cross(const Vector3Packet &other) const {
+    return Vector3Packet(y * other.z - z * other.y,
+                         z * other.x - x * other.z,
+                         x * other.y - y * other.x);
+  }
+
+  inline T length_squared() const { return dot(*this); }
+  inline T length() const { return Ops::sqrt(length_squared()); }
+
+  // Lanes no longer than FLT_EPSILON are left as they are, like
+  // Vector3::normalize().
+  inline Vector3Packet normalized() const {
+    T len = length();
+    T mask = Ops::cmpgt(len, Ops::set1(FLT_EPSILON));
+    return Vector3Packet(Ops::select(mask, x / len, x),
+                         Ops::select(mask, y / len, y),
+                         Ops::select(mask, z / len, z));
+  }
+
+  static inline Vector3Packet min(const Vector3Packet &a, const Vector3Packet &b) {
+    return Vector3Packet(Ops::min(a.x, b.x), Ops::min(a.y, b.y), Ops::min(a.z, b.z));
+  }
+  static inline Vector3Packet max(const Vector3Packet &a, const Vector3Packet &b) {
+    return Vector3Packet(Ops::max(a.x, b.x), Ops::max(a.y, b.y), Ops::max(a.z, b.z));
+  }
+
+  // Returns a * s + c.
+  static inline Vector3Packet madd(const Vector3Packet &a, T s, const Vector3Packet &c) {
+    return Vector3Packet(Ops::madd(a.x, s, c.x), Ops::madd(a.y, s, c.y), Ops::madd(a.z, s, c.z));
+  }
+};
+
+typedef Vector3Packet<f32x4> Vector3x4;
+typedef Vector3Packet<f32x8> Vector3x8;
+
+// The cells of a matrix, each broadcast to every lane, for transforming
+// packets.
+template<class T>
+struct Matrix4x4Packet {
+  typedef FloatOps<T> Ops;
+
+  T m[4][4];
+
+  inline explicit Matrix4x4Packet(const Matrix4x4 &mat) {
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        m[i][j] = Ops::set1(mat.get_cell(i, j));
+      }
+    }
+  }
+
+  // Row vectors times the matrix, with w = 1 for points and 0 for vectors.
+  // The result is not divided by w.  Terms are summed in row order, as
+  // ((x * m0 + y * m1) + z * m2) + m3.
+  inline Vector3Packet<T> transform_point(const Vector3Packet<T> &p) const {
+    return Vector3Packet<T>(((p.x * m[0][0] + p.y * m[1][0]) + p.z * m[2][0]) + m[3][0],
+                            ((p.x * m[0][1] + p.y * m[1][1]) + p.z * m[2][1]) + m[3][1],
+                            ((p.x * m[0][2] + p.y * m[1][2]) + p.z * m[2][2]) + m[3][2]);
+  }
+  inline Vector3Packet<T> transform_vector(const Vector3Packet<T> &v) const {
+    return Vector3Packet<T>((v.x * m[0][0] + v.y * m[1][0]) + v.z * m[2][0],
+                            (v.x * m[0][1] + v.y * m[1][1]) + v.z * m[2][1],
+                            (v.x * m[0][2] + v.y * m[1][2]) + v.z * m[2][2]);
+  }
+};
+
+#endif // LINMATH_SIMD_HXX
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <fstream>
 #include <unordered_set>
+#include <unordered_map>
 #include <map>
 #include <sstream>
 
@@ -26,7 +27,14 @@ using std::vector;
 #include <windows.h>
 
 #include "renderer.hxx"
-#include "obj_reader.hxx"
+#include "asset_loader.hxx"
+#include "render_queue.hxx"
+#include "gpu_scene.hxx"
+#include "culling.hxx"
+#include "mesh_bvh.hxx"
+#include "scene_bvh.hxx"
+#include "scene_graph.hxx"
+#include "thread_pool.hxx"
 
 #include "linmath.hxx"
 
@@ -35,6 +43,11 @@ WNDCLASS wc = { };
 const char *wnd_class_name = "gfxwndclass";
 HWND hwnd = nullptr;
 bool window_closed = false;
+bool window_resized = false;
+// Set by a left click, the mesh under the cursor is picked next frame.
+bool pick_pending = false;
+int pick_x = 0;
+int pick_y = 0;
 
 LRESULT APIENTRY
 window_proc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
@@ -42,6 +55,14 @@ window_proc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
   case WM_CLOSE:
     DestroyWindow(hwnd);
     return 0;
+  case WM_SIZE:
+    window_resized = true;
+    return 0;
+  case WM_LBUTTONDOWN:
+    pick_x = (short)LOWORD(lParam);
+    pick_y = (short)HIWORD(lParam);
+    pick_pending = true;
+    return 0;
   case WM_DESTROY:
     std::cerr << "Window destroyed\n";
     window_closed = true;
@@ -81,212 +102,436 @@ update_window() {
 std::unordered_set<VertexData *> queued_vertex_data;
 std::unordered_set<IndexData *> queued_index_data;
 
-std::vector<Mesh> make_obj_meshes(const std::string &filename, RendererVk *render) {
-  std::vector<Mesh> out;
-
-  std::ifstream stream(filename);
-  if (!stream.good()) {
-    return out;
+std::vector<Mesh> meshes;
+RenderQueue render_queue;
+int frame_count = 0;
+
+// Hierarchy over the world space bounds of meshes, and the ones that
+// passed culling this frame.
+SceneBvh scene_bvh;
+std::vector<u32> visible_meshes;
+// Hierarchy over the triangles of meshes, in model space, for picking.
+MeshBvh mesh_bvh;
+
+// Transforms of everything drawn.  The meshes of every loaded model hang
+// off a root of their own, and those of each GPU-driven copy off one root
+// per copy.
+SceneGraph scene_graph;
+std::vector<u32> mesh_nodes;
+// Mesh of each scene graph node, UINT32_MAX for none.
+std::vector<u32> node_meshes;
+// Models are turned the way the renderer's default model matrix is, with
+// all of their meshes in the same place.
+Transform model_transform;
+
+// Copies of the model drawn through the GPU scene instead of the render
+// queue, 0 to use the render queue.
+int gpu_scene_copies = 0;
+GpuScene gpu_scene;
+bool use_gpu_scene = false;
+bool gpu_scene_occlusion = true;
+// GPU scene object of each scene graph node, UINT32_MAX for none.
+std::vector<u32> node_objects;
+// One in this many copies spins in place, 0 for none.
+int gpu_scene_spin = 0;
+std::vector<u32> spinning_nodes;
+
+// Lays out gpu_scene_copies copies of the model on a square grid.
+void
+make_gpu_scene(RendererVk *render) {
+  if (!gpu_scene.initialize(render)) {
+    return;
   }
+  gpu_scene.set_occlusion_culling(gpu_scene_occlusion);
+  std::vector<uint32_t> mesh_ids;
+  for (const Mesh &mesh : meshes) {
+    uint32_t id = gpu_scene.add_mesh(&mesh);
+    if (id != UINT32_MAX) {
+      mesh_ids.push_back(id);
+    }
+  }
+  gpu_scene.commit_geometry();
+
+  // The objects get their transforms from the scene graph on the next
+  // update.
+  int side = (int)ceilf(sqrtf((float)gpu_scene_copies));
+  for (int i = 0; i < gpu_scene_copies; ++i) {
+    Vector3 pos((float)(i % side - side / 2) * 20.0f, (float)(i / side) * 20.0f, 0.0f);
+    u32 copy_node = scene_graph.add_node(SceneGraph::no_parent, Transform(pos, Quaternion()));
+    if (gpu_scene_spin > 0 && (i % gpu_scene_spin) == 0) {
+      spinning_nodes.push_back(copy_node);
+    }
+    for (uint32_t id : mesh_ids) {
+      u32 node = scene_graph.add_node(copy_node);
+      node_objects.resize(scene_graph.get_num_nodes(), UINT32_MAX);
+      node_objects[node] = gpu_scene.add_object(id, Matrix4x4::identity());
+    }
+  }
+  use_gpu_scene = true;
+}
 
-  std::ostringstream ss;
-  ss << stream.rdbuf();
-  std::string data = ss.str();
-
-  ObjReader reader(data);
+// Moves what is animated, updates the world transforms that changed, and
+// passes them on to the scene BVH and the GPU scene.  Has to happen
+// outside of a frame.
+void
+update_scene(ThreadPool *pool) {
+  if (!spinning_nodes.empty()) {
+    Quaternion spin = Quaternion::from_axis_angle((float)(frame_count % 360), Vector3::up());
+    for (u32 node : spinning_nodes) {
+      Transform local = scene_graph.get_local(node);
+      local.set_rotation(spin);
+      scene_graph.set_local(node, local);
+    }
+  }
 
-  struct VertexKey {
-    float vertex[4];
-    float normal[3];
-    float texcoord[2];
+  scene_graph.update(pool);
 
-    bool operator<(const VertexKey &other) const {
-      for (int i = 0; i < 4; ++i) {
-        if (vertex[i] < other.vertex[i]) {
-          return true;
-        }
-      }
-      for (int i = 0; i < 3; ++i) {
-        if (normal[i] < other.normal[i]) {
-          return true;
-        }
-      }
-      for (int i = 0; i < 2; ++i) {
-        if (texcoord[i] < other.texcoord[i]) {
-          return true;
-        }
+  bool meshes_moved = false;
+  for (const SceneGraph::NodeRange &range : scene_graph.get_updated_ranges()) {
+    for (u32 node = range.begin; node < std::min(range.end, (u32)node_meshes.size()); ++node) {
+      u32 mesh = node_meshes[node];
+      if (mesh != UINT32_MAX) {
+        scene_bvh.update(mesh, meshes[mesh].bounds.transformed(scene_graph.get_world(node)));
+        meshes_moved = true;
       }
-      return false;
     }
-  };
-  std::map<VertexKey, int> vertex_map;
-  std::map<const ObjFaceVert *, int> face_vert_map;
-
-  int vtx_count = 0;
-  int index_count = 0;
-  for (const ObjObject &obj : reader.objects) {
-    for (const ObjFace &face : obj.faces) {
-      index_count += (face.verts.size() - 2) * 3;
-      for (const ObjFaceVert &vert : face.verts) {
-        VertexKey key;
-        key.vertex[0] = reader.vertex[vert.vertex][0];
-        key.vertex[1] = reader.vertex[vert.vertex][2];
-        key.vertex[2] = reader.vertex[vert.vertex][1];
-        //float *pos = reader.vertex[vert.vertex];
-        key.normal[0] = 0.0f;
-        key.normal[1] = 0.0f;
-        key.normal[2] = 0.0f;
-        if (vert.normal != -1) {
-          key.normal[0] = reader.normal[vert.normal][0];
-          key.normal[1] = reader.normal[vert.normal][2];
-          key.normal[2] = reader.normal[vert.normal][1];
-        }
-        key.texcoord[0] = 0.0f;
-        key.texcoord[1] = 0.0f;
-        if (vert.texcoord != -1) {
-          key.texcoord[0] = reader.texcoord[vert.texcoord][0];
-          key.texcoord[1] = reader.texcoord[vert.texcoord][1];
-        }
-        auto it = vertex_map.find(key);
-        if (it == vertex_map.end()) {
-          face_vert_map.insert({ &vert, vtx_count });
-          vertex_map.insert({ key, vtx_count++ });
-        } else {
-          face_vert_map.insert({ &vert, it->second });
+  }
+  if (meshes_moved) {
+    scene_bvh.refit(pool);
+  }
+
+  if (use_gpu_scene) {
+    for (const SceneGraph::NodeRange &range : scene_graph.get_updated_ranges()) {
+      for (u32 node = range.begin; node < std::min(range.end, (u32)node_objects.size()); ++node) {
+        if (node_objects[node] != UINT32_MAX) {
+          gpu_scene.set_transform(node_objects[node], scene_graph.get_world(node));
         }
       }
     }
   }
+}
 
-  MaterialEnums::VertexArrayFormat format = 0u;
-  if (reader.vertex.size() > 0u) {
-    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_position);
+// Unprojects the clip space position at the near and far planes, with the
+// inverse of a view-projection matrix.
+void
+unproject(float x, float y, const Matrix4x4 &inv_view_proj, Vector3 points[2]) {
+  for (int p = 0; p < 2; ++p) {
+    float clip[4] = { x, y, (float)p, 1.0f };
+    float world[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 4; ++i) {
+        world[j] += clip[i] * inv_view_proj.get_cell(i, j);
+      }
+    }
+    points[p] = Vector3(world[0] / world[3], world[1] / world[3], world[2] / world[3]);
   }
-  if (reader.normal.size() > 0u) {
-    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_normal);
+}
+
+// Prints the mesh under the cursor position of the last click.
+void
+pick_mesh(RendererVk *render) {
+  RECT rect;
+  GetClientRect(hwnd, &rect);
+  if (rect.right <= 0 || rect.bottom <= 0) {
+    return;
   }
-  if (reader.texcoord.size() > 0u) {
-    format |= MaterialEnums::vertex_column_flag(MaterialEnums::VC_texcoord);
+  float x = 2.0f * ((float)pick_x + 0.5f) / (float)rect.right - 1.0f;
+  float y = 2.0f * ((float)pick_y + 0.5f) / (float)rect.bottom - 1.0f;
+
+  // A ray that misses the world space bounds of every mesh can't hit any
+  // of their triangles.
+  Matrix4x4 view_proj = render->get_view_matrix() * render->get_projection_matrix();
+  Vector3 points[2];
+  unproject(x, y, view_proj.inverted(), points);
+  float t_box;
+  if (scene_bvh.pick(points[0], (points[1] - points[0]).normalized(), t_box) == UINT32_MAX) {
+    std::cerr << "Picked nothing\n";
+    return;
   }
-  VertexData *vdata = render->make_vertex_data({{format}});
 
-  VertexWriter vwriter(vdata, MaterialEnums::VC_position);
-  vwriter.set_num_rows(vertex_map.size());
+  // The triangles are in the model space the meshes are in.
+  unproject(x, y, (model_transform.to_matrix() * view_proj).inverted(), points);
+  Vector3 dir = (points[1] - points[0]).normalized();
+  MeshBvh::Hit hit;
+  if (mesh_bvh.intersect(points[0], dir, hit)) {
+    std::cerr << "Picked mesh " << hit.mesh << " triangle " << hit.triangle
+              << " at distance " << hit.t << "\n";
+  } else {
+    std::cerr << "Picked nothing\n";
+  }
+}
 
-  for (auto it : vertex_map) {
-    vwriter.set_row(it.second);
-    vwriter.set_data_3f(it.first.vertex[0], it.first.vertex[1],
-                        it.first.vertex[2]);
+// Adds the meshes of a loaded model to the scene, and queues its buffers
+// for upload.  The meshes are drawn once the upload is done.
+void
+add_loaded_asset(LoadedAsset &asset, RendererVk *render, ThreadPool *pool) {
+  for (VertexData *data : asset.vertex_datas) {
+    queued_vertex_data.insert(data);
+  }
+  for (IndexData *data : asset.index_datas) {
+    queued_index_data.insert(data);
   }
 
-  std::cout << "vertex map:\n";
-  for (auto it : vertex_map) {
-    std::cout << it.first.vertex[0] << ", " << it.first.vertex[1] << ", " << it.first.vertex[2] << "\n";
+  u32 model_node = scene_graph.add_node(SceneGraph::no_parent, model_transform);
+  for (Mesh &mesh : asset.meshes) {
+    u32 node = scene_graph.add_node(model_node);
+    node_meshes.resize(scene_graph.get_num_nodes(), UINT32_MAX);
+    node_meshes[node] = (u32)meshes.size();
+    meshes.push_back(std::move(mesh));
+    mesh_nodes.push_back(node);
   }
+  scene_graph.update(pool);
 
-  std::cout << "texcoord map:\n";
-  for (auto it : vertex_map) {
-    std::cout << it.first.texcoord[0] << ", " << it.first.texcoord[1] << "\n";
+  // The hierarchies are rebuilt over all meshes, which is cheap next to
+  // loading a model.
+  std::vector<BoundingBox> mesh_boxes;
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    mesh_boxes.push_back(meshes[i].bounds.transformed(scene_graph.get_world(mesh_nodes[i])));
   }
+  scene_bvh.build(mesh_boxes.data(), mesh_boxes.size(), pool);
+  mesh_bvh.build(meshes.data(), meshes.size(), pool);
 
-  std::cout << "normal map:\n";
-  for (auto it : vertex_map) {
-    std::cout << it.first.normal[0] << ", " << it.first.normal[1] << ", " << it.first.normal[2] << "\n";
+  // The GPU scene is made of the first model, its geometry can't grow once
+  // committed.
+  if (gpu_scene_copies > 0 && !use_gpu_scene) {
+    make_gpu_scene(render);
   }
+}
 
-  if (reader.normal.size() > 0u) {
-    VertexWriter nwriter(vdata, MaterialEnums::VC_normal);
-    for (auto it : vertex_map) {
-      nwriter.set_row(it.second);
-      nwriter.set_data_3f(it.first.normal[0], it.first.normal[1],
-                          it.first.normal[2]);
+// Takes in the models the loader finished since the last frame.  Has to
+// happen outside of a frame.
+void
+receive_assets(AssetLoader *loader, RendererVk *render, ThreadPool *pool) {
+  LoadedAsset asset;
+  while (loader->receive(asset)) {
+    if (asset.ok) {
+      add_loaded_asset(asset, render, pool);
     }
   }
+  loader->update_uploads(render);
+}
 
-  if (reader.texcoord.size() > 0u) {
-    VertexWriter twriter(vdata, MaterialEnums::VC_texcoord);
-    for (auto it : vertex_map) {
-      twriter.set_row(it.second);
-      twriter.set_data_2f(it.first.texcoord[0], it.first.texcoord[1]);
-    }
+// Returns the distance from the point to the closest point of the box, 0
+// if it is inside.
+float
+get_distance(const Vector3 &point, const BoundingBox &box) {
+  float dist_sq = 0.0f;
+  for (int i = 0; i < 3; ++i) {
+    float d = std::max(std::max(box.min[i] - point[i], point[i] - box.max[i]), 0.0f);
+    dist_sq += d * d;
   }
+  return sqrtf(dist_sq);
+}
 
-  // Now build indices
-  IndexData *idata = render->make_index_data(MaterialEnums::IT_uint16);
-  idata->buffer.resize(index_count * sizeof(u16));
-  u16 *iptr = (u16 *)idata->buffer.data();
-  int index_ptr = 0;
-  for (ObjObject &obj : reader.objects) {
-    Mesh m;
-    m.vertex_data = vdata;
-    m.index_data = idata;
-    m.first_vertex = index_ptr;
-    for (ObjFace &face : obj.faces) {
-      for (int i = 0; i < face.verts.size() - 2; ++i) {
-        *iptr++ = face_vert_map[&face.verts[0]];
-        *iptr++ = face_vert_map[&face.verts[i + 1]];
-        *iptr++ = face_vert_map[&face.verts[i + 2]];
-        index_ptr += 3;
-      }
+// Queues the buffers of newly loaded models for upload.  The priority of a
+// buffer is the distance from the camera to the closest mesh that draws
+// from it, so that nearby geometry streams in first.
+void
+queue_uploads(RendererVk *render) {
+  const float *eye = render->get_view_matrix().inverted_affine().get_row(3);
+  Vector3 camera(eye[0], eye[1], eye[2]);
+  std::unordered_map<const void *, float> distances;
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    BoundingBox box = meshes[i].bounds.transformed(scene_graph.get_world(mesh_nodes[i]));
+    float distance = get_distance(camera, box);
+    for (const void *data : { (const void *)meshes[i].vertex_data, (const void *)meshes[i].index_data }) {
+      auto it = distances.insert({ data, distance }).first;
+      it->second = std::min(it->second, distance);
     }
-    m.num_vertices = index_ptr - m.first_vertex;
-    m.topology = MaterialEnums::PT_triangle_list;
-    out.push_back(std::move(m));
   }
+  // Buffers no mesh draws from go last.
+  auto get_priority = [&](const void *data) {
+    auto it = distances.find(data);
+    return (it != distances.end()) ? it->second : FLT_MAX;
+  };
 
-  queued_vertex_data.insert(vdata);
-  queued_index_data.insert(idata);
-
-  return out;
+  for (VertexData *data : queued_vertex_data) {
+    render->queue_vertex_data(data, get_priority(data));
+  }
+  queued_vertex_data.clear();
+  for (IndexData *data : queued_index_data) {
+    render->queue_index_data(data, get_priority(data));
+  }
+  queued_index_data.clear();
 }
 
-std::vector<Mesh> meshes;
-
 void
-render_frame(RendererVk *render) {
-  render->begin_prepare();
-  if (queued_vertex_data.size() > 0u) {
-    for (VertexData *data : queued_vertex_data) {
-      render->prepare_vertex_data(data);
-    }
-    queued_vertex_data.clear();
+render_frame(RendererVk *render, ThreadPool *pool) {
+  if (window_resized) {
+    render->notify_resized();
+    window_resized = false;
   }
-  if (queued_index_data.size() > 0u) {
-    for (IndexData *data : queued_index_data) {
-      render->prepare_index_data(data);
-    }
-    queued_index_data.clear();
+  if (!render->update_graphics_output()) {
+    // Minimized, nothing to draw to until the window comes back.
+    WaitMessage();
+    return;
+  }
+
+  render->begin_prepare();
+  if (queued_vertex_data.size() > 0u || queued_index_data.size() > 0u) {
+    queue_uploads(render);
   }
+  render->process_uploads();
   render->end_prepare();
 
+  if (pick_pending) {
+    pick_mesh(render);
+    pick_pending = false;
+  }
+
+  update_scene(pool);
+
   render->begin_frame();
 
-  render->begin_frame_surface();
+  if (use_gpu_scene) {
+    // Culling is a dispatch, which has to go before rendering begins.
+    gpu_scene.cull();
+    if (render->begin_frame_surface()) {
+      gpu_scene.draw();
+      render->end_frame_surface();
+    }
+  } else {
+    Frustum frustum = Frustum::from_matrix(render->get_view_matrix() * render->get_projection_matrix());
+    scene_bvh.cull_frustum(frustum, visible_meshes);
+
+    // View space looks down +Y, so the depth of a draw is the view-space Y
+    // of its world bounds centre.
+    Matrix4x4 view = render->get_view_matrix();
+    render_queue.clear();
+    for (u32 i : visible_meshes) {
+      const Matrix4x4 &world = scene_graph.get_world(mesh_nodes[i]);
+      Vector3 center = world.transform_point(meshes[i].bounds.get_center());
+      float depth = view.transform_point(center)[1];
+      render_queue.add_mesh(&meshes[i], nullptr, depth, &world);
+    }
+    render_queue.sort();
 
-  for (const Mesh &mesh : meshes) {
-    render->draw_mesh(&mesh);
+    bool parallel = render->use_parallel_recording(render_queue.get_num_items());
+    if (render->begin_frame_surface(parallel)) {
+      render_queue.execute(render, parallel);
+      render->end_frame_surface();
+    }
   }
 
-  render->end_frame_surface();
-
   render->end_frame();
+
+  if ((++frame_count % 1000) == 0) {
+    const VkFrameStats &stats = render->get_frame_stats();
+    std::cerr << "Frame " << frame_count << ": " << stats.draw_calls << " draws, "
+              << stats.instances_drawn << " instances, "
+              << stats.binds_issued << " binds issued, "
+              << stats.binds_skipped << " binds skipped, "
+              << stats.meshes_not_resident << " meshes not resident, "
+              << meshes.size() - visible_meshes.size() << " meshes culled";
+    if (use_gpu_scene) {
+      std::cerr << ", " << gpu_scene.get_num_occluded() << " objects occluded";
+    }
+    std::cerr << "\n";
+  }
+}
+
+// Reads renderer options from the command line:
+//   -frames <n>        number of frames in flight
+//   -images <n>        number of swapchain images
+//   -present <mode>    immediate, mailbox, fifo or fifo_relaxed
+//   -gpuscene <n>      draw n copies of the model GPU-driven
+//   -occlusion <0|1>   occlusion cull the GPU-driven copies, on by default
+//   -spin <n>          spin one in n of the GPU-driven copies
+//   -cook <file>       cook the OBJ file into the cache and exit, see
+//                      cook_models()
+RendererOptionsVk
+parse_renderer_options(int argc, char *argv[]) {
+  RendererOptionsVk options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    std::string value = argv[i + 1];
+    if (arg == "-frames") {
+      options.num_frames_in_flight = (uint32_t)atoi(value.c_str());
+    } else if (arg == "-images") {
+      options.num_swapchain_images = (uint32_t)atoi(value.c_str());
+    } else if (arg == "-present") {
+      if (value == "immediate") {
+        options.present_mode = RendererOptionsVk::PM_immediate;
+      } else if (value == "mailbox") {
+        options.present_mode = RendererOptionsVk::PM_mailbox;
+      } else if (value == "fifo") {
+        options.present_mode = RendererOptionsVk::PM_fifo;
+      } else if (value == "fifo_relaxed") {
+        options.present_mode = RendererOptionsVk::PM_fifo_relaxed;
+      } else {
+        std::cerr << "Unknown present mode " << value << "\n";
+      }
+    } else if (arg == "-gpuscene") {
+      gpu_scene_copies = atoi(value.c_str());
+    } else if (arg == "-occlusion") {
+      gpu_scene_occlusion = atoi(value.c_str()) != 0;
+    } else if (arg == "-spin") {
+      gpu_scene_spin = atoi(value.c_str());
+    } else if (arg == "-cook") {
+      // Handled by cook_models().
+    } else {
+      std::cerr << "Unknown option " << arg << "\n";
+    }
+  }
+  return options;
+}
+
+// Cooks the OBJ files given with -cook into the cache, offline, so that
+// even the first run loads them cooked.  Returns false if there were none.
+bool
+cook_models(int argc, char *argv[], int &result) {
+  std::vector<std::string> filenames;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::string(argv[i]) == "-cook") {
+      filenames.push_back(argv[i + 1]);
+    }
+  }
+  if (filenames.empty()) {
+    return false;
+  }
+
+  ThreadPool pool(std::max(1, (int)std::thread::hardware_concurrency()) - 1);
+  AssetLoader loader(nullptr, &pool);
+  result = 0;
+  for (const std::string &filename : filenames) {
+    if (!loader.cook_obj(filename)) {
+      std::cerr << "Failed to cook " << filename << "\n";
+      result = 1;
+    }
+  }
+  return true;
 }
 
 int
 main(int argc, char *argv[]) {
+  int cook_result;
+  if (cook_models(argc, argv, cook_result)) {
+    return cook_result;
+  }
+
   make_window_class();
   make_window();
 
+  // One pool for all of the application's parallel work, the renderer's
+  // included, declared first so that it outlives the renderer.
+  ThreadPool pool(std::max(1, (int)std::thread::hardware_concurrency()) - 1);
+
+  RendererOptionsVk options = parse_renderer_options(argc, argv);
+  options.thread_pool = &pool;
   RendererVk render;
-  if (!render.initialize(hwnd)) {
+  if (!render.initialize(hwnd, options)) {
     return 1;
   }
 
-  meshes = make_obj_meshes("models\\cottage_obj.obj", &render);
+  model_transform = Transform::from_components(1.0f, Vector3(45.0f, 0.0f, 45.0f), 0.0f);
+
+  AssetLoader loader(&render, &pool);
+  loader.load_obj("models\\cottage_obj.obj");
 
   while (!window_closed) {
     update_window();
-    render_frame(&render);
+    receive_assets(&loader, &render, &pool);
+    render_frame(&render, &pool);
   }
 
   return 0;
@@ -1,4 +1,5 @@
 #include "material.hxx"
+#include "linmath_simd.hxx"
 
 MaterialEnums::VertexColumnInfo MaterialEnums::vertex_column_info[] = {
     // VC_position
@@ -26,3 +27,87 @@ MaterialEnums::VertexColumnInfo MaterialEnums::vertex_column_info[] = {
     // VCF_user2
     {MaterialEnums::CT_float32, 4, false},
 };
+
+// Computes the bounds of the vertices drawn by the mesh, from the position
+// column of its vertex data.  The sphere is centered on the box, so it is
+// not the tightest possible, but fits it closer than the box's own sphere.
+void Mesh::
+compute_mesh_bounds(const Mesh *mesh, BoundingBox &box, BoundingSphere &sphere) {
+  box = BoundingBox();
+  sphere = BoundingSphere();
+
+  const VertexData *vdata = mesh->vertex_data;
+  size_t stride;
+  size_t num_vertices;
+  const ubyte *positions = vdata->find_column(MaterialEnums::VC_position, stride, num_vertices);
+  if (positions == nullptr) {
+    return;
+  }
+
+  const IndexData *idata = mesh->index_data;
+  int count = (int)mesh->num_vertices;
+  if (count <= 0) {
+    count = ((idata != nullptr) ? idata->get_num_indices() : (int)num_vertices) - (int)mesh->first_vertex;
+  }
+
+  // Whole packets of vertices go through the SIMD path, the rest one by
+  // one.
+  constexpr int width = Vector3x8::width;
+  int num_packed = std::max(count, 0) / width * width;
+
+  auto load_positions = [&](int n) {
+    if (idata == nullptr) {
+      assert(mesh->first_vertex + n + width <= num_vertices);
+      return Vector3x8::load_strided(positions + (mesh->first_vertex + n) * stride, stride);
+    }
+    u32 indices[width];
+    for (int i = 0; i < width; ++i) {
+      indices[i] = idata->get_index(mesh->first_vertex + n + i);
+      assert(indices[i] < num_vertices);
+    }
+    return Vector3x8::gather(positions, stride, indices);
+  };
+
+  auto get_position = [&](int n) {
+    u32 vertex = (idata != nullptr) ? idata->get_index(mesh->first_vertex + n) : mesh->first_vertex + n;
+    assert(vertex < num_vertices);
+    const float *pos = (const float *)(positions + vertex * stride);
+    return Vector3(pos[0], pos[1], pos[2]);
+  };
+
+  if (num_packed > 0) {
+    Vector3x8 lo = load_positions(0);
+    Vector3x8 hi = lo;
+    for (int i = width; i < num_packed; i += width) {
+      Vector3x8 pos = load_positions(i);
+      lo = Vector3x8::min(lo, pos);
+      hi = Vector3x8::max(hi, pos);
+    }
+    for (int lane = 0; lane < width; ++lane) {
+      box.extend(lo.get_lane(lane));
+      box.extend(hi.get_lane(lane));
+    }
+  }
+  for (int i = num_packed; i < count; ++i) {
+    box.extend(get_position(i));
+  }
+  if (box.is_empty()) {
+    return;
+  }
+
+  sphere.center = box.get_center();
+  Vector3x8 center(sphere.center);
+  f32x8 packed_radius_sq = f32x8_set1(0.0f);
+  for (int i = 0; i < num_packed; i += width) {
+    packed_radius_sq = f32x8_max(packed_radius_sq, (load_positions(i) - center).length_squared());
+  }
+  float lanes[width];
+  f32x8_storeu(lanes, packed_radius_sq);
+  float radius_sq = *std::max_element(lanes, lanes + width);
+  for (int i = num_packed; i < count; ++i) {
+    Vector3 pos = get_position(i);
+    pos -= sphere.center;
+    radius_sq = std::max(radius_sq, pos.length_squared());
+  }
+  sphere.radius = sqrtf(radius_sq);
+}
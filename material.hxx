@@ -6,6 +6,7 @@
 #include <algorithm>
 
 #include "numeric_types.hxx"
+#include "bounds.hxx"
 
 using std::vector;
 
@@ -21,6 +22,14 @@ public:
     IT_uint32,
   };
 
+  enum BufferUsage : uint8_t {
+    // Written once, uploaded to GPU-local memory.
+    BU_static,
+    // Rewritten often, possibly every frame.  Kept in host-visible memory,
+    // one copy per frame in flight, and only changed bytes are copied.
+    BU_dynamic,
+  };
+
   enum PrimitiveTopology : uint8_t {
     PT_triangle_list,
     PT_triangle_strip,
@@ -211,28 +220,118 @@ struct VertexFormat {
   vector<MaterialEnums::VertexArrayFormat> arrays;
 };
 
+// Byte ranges of a buffer that were written since they were last uploaded.
+// Writes are merged into the last range when they touch or nearly touch it,
+// so sequential writes from a writer, even of a single interleaved column,
+// stay down to a single range.  Past max_ranges, the ranges collapse into
+// one that covers all of them.
+class DirtyRanges {
+public:
+  struct Range {
+    size_t begin;
+    size_t end;
+  };
+
+  static constexpr size_t max_ranges = 16u;
+  // Writes less than this many bytes apart are merged, copying the gap is
+  // cheaper than another copy region.
+  static constexpr size_t merge_gap = 256u;
+
+  inline void add(size_t begin, size_t end) {
+    if (!_ranges.empty()) {
+      Range &last = _ranges.back();
+      if (begin <= last.end + merge_gap && end + merge_gap >= last.begin) {
+        last.begin = std::min(last.begin, begin);
+        last.end = std::max(last.end, end);
+        return;
+      }
+    }
+    if (_ranges.size() == max_ranges) {
+      Range bounds = { begin, end };
+      for (const Range &range : _ranges) {
+        bounds.begin = std::min(bounds.begin, range.begin);
+        bounds.end = std::max(bounds.end, range.end);
+      }
+      _ranges.clear();
+      _ranges.push_back(bounds);
+      return;
+    }
+    _ranges.push_back({ begin, end });
+  }
+
+  inline void add(const DirtyRanges &other) {
+    for (const Range &range : other._ranges) {
+      add(range.begin, range.end);
+    }
+  }
+
+  inline void clear() { _ranges.clear(); }
+  inline bool empty() const { return _ranges.empty(); }
+  inline const vector<Range> &get_ranges() const { return _ranges; }
+
+private:
+  vector<Range> _ranges;
+};
+
 struct VertexData {
   VertexFormat format;
   vector<vector<ubyte>> array_buffers;
+  MaterialEnums::BufferUsage usage = MaterialEnums::BU_static;
+  // Written ranges of each array buffer, consumed by the renderer for
+  // dynamic buffers.  Writes through VertexWriter are tracked
+  // automatically, other writes must be added by hand.
+  vector<DirtyRanges> dirty_ranges;
 
   inline int get_num_vertices() const {
     return array_buffers[0].size() / MaterialEnums::vertex_row_stride(format.arrays[0]);
   }
+
+  // Returns the column in the first vertex of the array that holds it, or
+  // null if no array does, along with the stride between vertices and the
+  // number of vertices in the array.
+  inline const ubyte *find_column(MaterialEnums::VertexColumn column,
+                                  size_t &stride, size_t &count) const {
+    for (size_t i = 0; i < format.arrays.size(); ++i) {
+      MaterialEnums::VertexArrayFormat array = format.arrays[i];
+      if (array & MaterialEnums::vertex_column_flag(column)) {
+        stride = MaterialEnums::vertex_row_stride(array);
+        count = array_buffers[i].size() / stride;
+        return array_buffers[i].data() + MaterialEnums::vertex_column_offset(array, column);
+      }
+    }
+    return nullptr;
+  }
 };
 
 struct IndexData {
   MaterialEnums::IndexType type;
   vector<ubyte> buffer;
+  MaterialEnums::BufferUsage usage = MaterialEnums::BU_static;
+  // Written ranges of the buffer, see VertexData::dirty_ranges.
+  DirtyRanges dirty_ranges;
 
   inline int get_num_indices() const {
     return buffer.size() / MaterialEnums::index_type_size(type);
   }
+
+  inline u32 get_index(int n) const {
+    switch (type) {
+    case MaterialEnums::IT_uint8:
+      return ((const u8 *)buffer.data())[n];
+    case MaterialEnums::IT_uint16:
+      return ((const u16 *)buffer.data())[n];
+    case MaterialEnums::IT_uint32:
+      return ((const u32 *)buffer.data())[n];
+    }
+    return 0u;
+  }
 };
 
 class IndexWriter {
 public:
   IndexWriter(IndexData *idata) {
     _buf = &idata->buffer;
+    _dirty = &idata->dirty_ranges;
     _data = idata;
   }
 
@@ -259,6 +358,7 @@ public:
   }
 
   inline void write(u32 val) {
+    _dirty->add(_position, _position + MaterialEnums::index_type_size(_data->type));
     switch (_data->type) {
     case MaterialEnums::IT_uint8:
       *(u8 *)&_buf->at(_position) = val;
@@ -309,6 +409,7 @@ public:
 private:
   const IndexData *_data;
   vector<ubyte> *_buf;
+  DirtyRanges *_dirty;
   size_t _position;
 };
 
@@ -336,7 +437,12 @@ public:
         MaterialEnums::vertex_column_offset(vdata->format.arrays[array], c);
     _offset = _position;
     _buf = &vdata->array_buffers[array];
+    if (vdata->dirty_ranges.size() < vdata->array_buffers.size()) {
+      vdata->dirty_ranges.resize(vdata->array_buffers.size());
+    }
+    _dirty = &vdata->dirty_ranges[array];
     _column_info = &MaterialEnums::vertex_column_info[c];
+    _column_size = MaterialEnums::vertex_column_stride(c);
   }
 
   inline ubyte *data(ubyte ofs = 0u) { return &_buf->at(_position + ofs); }
@@ -348,6 +454,7 @@ public:
   }
 
   inline void write_data_iv(int *vals, int count) {
+    _dirty->add(_position, _position + _column_size);
     switch (_column_info->component_type) {
 
     case MaterialEnums::CT_float32: {
@@ -373,6 +480,7 @@ public:
   }
 
   inline void write_data_fv(float *vals, int count) {
+    _dirty->add(_position, _position + _column_size);
     switch (_column_info->component_type) {
 
     case MaterialEnums::CT_float32: {
@@ -501,9 +609,11 @@ public:
 
 private:
   vector<ubyte> *_buf;
+  DirtyRanges *_dirty;
   const MaterialEnums::VertexColumnInfo *_column_info;
   int _offset;
   int _row_stride;
+  int _column_size;
   // Byte position.
   size_t _position;
 };
@@ -519,10 +629,21 @@ struct Mesh {
   uint32_t first_vertex;
   uint32_t num_vertices;
   MaterialEnums::PrimitiveTopology topology;
+  // Model space bounds of the vertices the mesh draws, see
+  // compute_bounds().
+  BoundingBox bounds;
+  BoundingSphere sphere;
 
   inline bool is_indexed() const {
     return index_data != nullptr;
   }
+
+  inline void compute_bounds() {
+    compute_mesh_bounds(this, bounds, sphere);
+  }
+
+  static void compute_mesh_bounds(const Mesh *mesh, BoundingBox &box,
+                                  BoundingSphere &sphere);
 };
 
 class Renderer {
@@ -559,9 +680,9 @@ class Material : public MaterialEnums {
 public:
 
 public:
-  inline Shader *get_shader() const { return _shader; }
+  inline Shader *get_shader() const { return _static_data->_shader; }
 
-  inline StaticMaterialData *get_static_data() const { return _static_data; }
+  inline const StaticMaterialData *get_static_data() const { return _static_data; }
 
 private:
   const StaticMaterialData *_static_data;
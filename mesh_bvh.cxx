@@ -0,0 +1,603 @@
+#include "mesh_bvh.hxx"
+#include "material.hxx"
+#include "simd.hxx"
+#include "thread_pool.hxx"
+
+#include <algorithm>
+#include <bit>
+#include <string.h>
+
+// Below this many triangles per task, splitting work up costs more than it
+// saves.
+static constexpr size_t min_triangles_per_task = 4096u;
+
+// Number of bins the centroids are sorted into along each axis when
+// searching for a split.
+static constexpr int num_bins = 16;
+
+// Leaves are made at or below one packet, and are allowed up to this many
+// triangles when the heuristic finds them cheaper than splitting.
+static constexpr u32 max_leaf_triangles = 4u * MeshBvh::packet_size;
+
+// Cost of visiting a node, relative to intersecting a packet.
+static constexpr float traversal_cost = 1.0f;
+
+// Deepest tree the traversal stack has room for, far deeper than the
+// heuristic builds in practice.
+static constexpr int max_stack_depth = 128;
+
+// Bounds of a triangle, and the triangle it is for.
+struct MeshBvh::PrimRef {
+  float min[3];
+  u32 triangle;
+  float max[3];
+
+  // Twice the centroid, which sorts the same.
+  inline float get_centroid(int axis) const {
+    return min[axis] + max[axis];
+  }
+};
+
+// A subtree whose build is handed off to the pool.
+struct MeshBvh::BuildJob {
+  u32 node;
+  u32 begin;
+  u32 end;
+};
+
+struct Bin {
+  float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  u32 count = 0u;
+
+  inline void extend(const float *bmin, const float *bmax) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], bmin[i]);
+      max[i] = std::max(max[i], bmax[i]);
+    }
+  }
+
+  inline float get_half_area() const {
+    float dx = max[0] - min[0];
+    float dy = max[1] - min[1];
+    float dz = max[2] - min[2];
+    return dx * dy + dy * dz + dz * dx;
+  }
+};
+
+static inline u32
+num_packets(u32 num_triangles) {
+  return (num_triangles + MeshBvh::packet_size - 1u) / MeshBvh::packet_size;
+}
+
+// Where the position column of a mesh is and how to walk its triangles.
+struct TriangleSource {
+  // Position of the first vertex.
+  const ubyte *vertices;
+  size_t stride;
+  size_t num_vertices;
+  const IndexData *idata;
+  u32 first_vertex;
+  bool strip;
+
+  inline Vector3 get_position(u32 n) const {
+    u32 vertex = (idata != nullptr) ? idata->get_index(first_vertex + n) : first_vertex + n;
+    assert(vertex < num_vertices);
+    const float *pos = (const float *)(vertices + vertex * stride);
+    return Vector3(pos[0], pos[1], pos[2]);
+  }
+
+  inline void get_triangle(u32 triangle, Vector3 *out) const {
+    u32 first = strip ? triangle : triangle * 3u;
+    for (u32 i = 0; i < 3u; ++i) {
+      out[i] = get_position(first + i);
+    }
+  }
+};
+
+// Returns the number of triangles the mesh draws, and fills in where to
+// read them from.
+static u32
+get_triangle_source(const Mesh *mesh, TriangleSource &source) {
+  bool strip = mesh->topology == MaterialEnums::PT_triangle_strip;
+  if (!strip && mesh->topology != MaterialEnums::PT_triangle_list) {
+    return 0u;
+  }
+
+  const VertexData *vdata = mesh->vertex_data;
+  source.vertices = vdata->find_column(MaterialEnums::VC_position, source.stride, source.num_vertices);
+  if (source.vertices == nullptr) {
+    return 0u;
+  }
+  source.idata = mesh->index_data;
+  source.first_vertex = mesh->first_vertex;
+  source.strip = strip;
+
+  const IndexData *idata = mesh->index_data;
+  int count = (int)mesh->num_vertices;
+  if (count <= 0) {
+    count = ((idata != nullptr) ? idata->get_num_indices() : (int)source.num_vertices) - (int)mesh->first_vertex;
+  }
+  if (count < 3) {
+    return 0u;
+  }
+  return strip ? (u32)count - 2u : (u32)count / 3u;
+}
+
+void MeshBvh::
+clear() {
+  _nodes.clear();
+  _packets.clear();
+  _mesh_first_triangles.clear();
+  _num_triangles = 0u;
+}
+
+// Reads the triangles of all meshes, numbered in mesh order.
+void MeshBvh::
+gather_triangles(const Mesh *meshes, size_t num_meshes,
+                 std::vector<Vector3> &positions, std::vector<PrimRef> &refs,
+                 ThreadPool *pool) {
+  std::vector<TriangleSource> sources(num_meshes);
+  _mesh_first_triangles.resize(num_meshes);
+  size_t total = 0u;
+  for (size_t i = 0; i < num_meshes; ++i) {
+    _mesh_first_triangles[i] = (u32)total;
+    total += get_triangle_source(&meshes[i], sources[i]);
+  }
+  assert(total < UINT32_MAX);
+  _num_triangles = total;
+
+  positions.resize(total * 3u);
+  refs.resize(total);
+  parallel_for(pool, total, min_triangles_per_task, [&](size_t begin, size_t end) {
+    // Last mesh starting at or before begin.  Meshes without triangles
+    // share their first triangle with the next mesh, and are skipped.
+    size_t mesh = std::upper_bound(_mesh_first_triangles.begin(),
+                                   _mesh_first_triangles.end(), (u32)begin) -
+                  _mesh_first_triangles.begin() - 1u;
+    for (size_t i = begin; i < end; ++i) {
+      while (mesh + 1u < num_meshes && _mesh_first_triangles[mesh + 1u] <= i) {
+        ++mesh;
+      }
+      Vector3 *tri = &positions[i * 3u];
+      sources[mesh].get_triangle((u32)(i - _mesh_first_triangles[mesh]), tri);
+
+      PrimRef &ref = refs[i];
+      ref.triangle = (u32)i;
+      for (int a = 0; a < 3; ++a) {
+        ref.min[a] = std::min(std::min(tri[0][a], tri[1][a]), tri[2][a]);
+        ref.max[a] = std::max(std::max(tri[0][a], tri[1][a]), tri[2][a]);
+      }
+    }
+  });
+}
+
+// Builds the tree over the triangles of the given meshes.  The meshes'
+// vertex and index data are only read during the build.
+void MeshBvh::
+build(const Mesh *meshes, size_t num_meshes, ThreadPool *pool) {
+  clear();
+
+  std::vector<Vector3> positions;
+  std::vector<PrimRef> refs;
+  gather_triangles(meshes, num_meshes, positions, refs, pool);
+  u32 count = (u32)refs.size();
+  if (count == 0u) {
+    return;
+  }
+
+  _nodes.reserve(2u * num_packets(count));
+  _nodes.resize(1u);
+
+  int num_threads = (pool != nullptr) ? pool->get_num_threads() + 1 : 1;
+  if (num_threads <= 1 || count < min_triangles_per_task) {
+    build_node(_nodes, 0u, refs.data(), 0u, count, 0u, nullptr);
+
+  } else {
+    // Split serially until the subtrees are small enough that there are a
+    // few per thread, so that uneven ones even out.
+    u32 defer_size = std::max(count / (u32)(num_threads * 4), (u32)min_triangles_per_task);
+    std::vector<BuildJob> jobs;
+    build_node(_nodes, 0u, refs.data(), 0u, count, defer_size, &jobs);
+    std::sort(jobs.begin(), jobs.end(), [](const BuildJob &a, const BuildJob &b) {
+      return a.end - a.begin > b.end - b.begin;
+    });
+
+    std::vector<std::vector<Node>> subtrees(jobs.size());
+    pool->run((int)jobs.size(), [&](int j) {
+      const BuildJob &job = jobs[j];
+      std::vector<Node> &nodes = subtrees[j];
+      nodes.reserve(2u * num_packets(job.end - job.begin));
+      nodes.resize(1u);
+      build_node(nodes, 0u, refs.data(), job.begin, job.end, 0u, nullptr);
+    });
+
+    // Append the subtrees, with their roots in place of the deferred
+    // nodes.  Local node i > 0 lands at base + i - 1.
+    for (size_t j = 0; j < jobs.size(); ++j) {
+      const std::vector<Node> &nodes = subtrees[j];
+      u32 base = (u32)_nodes.size();
+      for (size_t i = 0; i < nodes.size(); ++i) {
+        Node node = nodes[i];
+        if (!node.is_leaf()) {
+          node.first = base + node.first - 1u;
+        }
+        if (i == 0u) {
+          _nodes[jobs[j].node] = node;
+        } else {
+          _nodes.push_back(node);
+        }
+      }
+    }
+  }
+
+  make_packets(positions, refs);
+}
+
+// Builds node n over refs [begin, end).  The node must already exist.
+// Leaves are left pointing at their range of refs, see make_packets().
+//
+// If deferred is given, nodes of at most defer_size triangles are not built
+// but added to it instead.
+void MeshBvh::
+build_node(std::vector<Node> &nodes, u32 n, PrimRef *refs, u32 begin, u32 end,
+           u32 defer_size, std::vector<BuildJob> *deferred) {
+  Bin box;
+  float cmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float cmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  for (u32 i = begin; i < end; ++i) {
+    box.extend(refs[i].min, refs[i].max);
+    for (int a = 0; a < 3; ++a) {
+      float c = refs[i].get_centroid(a);
+      cmin[a] = std::min(cmin[a], c);
+      cmax[a] = std::max(cmax[a], c);
+    }
+  }
+  for (int a = 0; a < 3; ++a) {
+    nodes[n].min[a] = box.min[a];
+    nodes[n].max[a] = box.max[a];
+  }
+
+  u32 count = end - begin;
+  if (deferred != nullptr && count <= defer_size) {
+    nodes[n].first = 0u;
+    nodes[n].count = 0u;
+    deferred->push_back({ n, begin, end });
+    return;
+  }
+  if (count <= (u32)packet_size) {
+    nodes[n].first = begin;
+    nodes[n].count = count;
+    return;
+  }
+
+  // Find the cheapest split between bins along any axis.  The costs are
+  // left scaled by the node's area, which is the same for all of them.
+  float best_cost = FLT_MAX;
+  int best_axis = -1;
+  int best_split = 0;
+  float bin_scale[3];
+  for (int a = 0; a < 3; ++a) {
+    float extent = cmax[a] - cmin[a];
+    bin_scale[a] = (extent > 0.0f) ? (float)num_bins / extent : 0.0f;
+  }
+
+  // Bin along all axes in one pass.  An axis without extent puts
+  // everything in its first bin, which is never split.
+  Bin bins[3][num_bins];
+  for (u32 i = begin; i < end; ++i) {
+    const PrimRef &ref = refs[i];
+    for (int a = 0; a < 3; ++a) {
+      int b = std::min((int)((ref.get_centroid(a) - cmin[a]) * bin_scale[a]), num_bins - 1);
+      bins[a][b].extend(ref.min, ref.max);
+      ++bins[a][b].count;
+    }
+  }
+
+  for (int a = 0; a < 3; ++a) {
+    if (bin_scale[a] == 0.0f) {
+      continue;
+    }
+
+    // Cost of everything right of each split, then sweep from the left.
+    float right_cost[num_bins];
+    Bin right;
+    for (int b = num_bins - 1; b > 0; --b) {
+      right.extend(bins[a][b].min, bins[a][b].max);
+      right.count += bins[a][b].count;
+      right_cost[b] = (right.count > 0u) ? right.get_half_area() * (float)num_packets(right.count) : 0.0f;
+    }
+    Bin left;
+    for (int b = 0; b < num_bins - 1; ++b) {
+      left.extend(bins[a][b].min, bins[a][b].max);
+      left.count += bins[a][b].count;
+      if (left.count == 0u || left.count == count) {
+        continue;
+      }
+      float cost = left.get_half_area() * (float)num_packets(left.count) + right_cost[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = a;
+        best_split = b + 1;
+      }
+    }
+  }
+
+  float area = box.get_half_area();
+  float leaf_cost = area * (float)num_packets(count);
+  if (count <= max_leaf_triangles &&
+      (best_axis < 0 || leaf_cost <= area * traversal_cost + best_cost)) {
+    nodes[n].first = begin;
+    nodes[n].count = count;
+    return;
+  }
+
+  u32 mid;
+  if (best_axis >= 0) {
+    float cm = cmin[best_axis];
+    float scale = bin_scale[best_axis];
+    PrimRef *split = std::partition(refs + begin, refs + end, [&](const PrimRef &ref) {
+      int b = std::min((int)((ref.get_centroid(best_axis) - cm) * scale), num_bins - 1);
+      return b < best_split;
+    });
+    mid = (u32)(split - refs);
+
+  } else {
+    // All centroids in the same place, any split is as good as another.
+    mid = begin + count / 2u;
+  }
+
+  u32 left = (u32)nodes.size();
+  nodes.resize(nodes.size() + 2u);
+  nodes[n].first = left;
+  nodes[n].count = 0u;
+  build_node(nodes, left, refs, begin, mid, defer_size, deferred);
+  build_node(nodes, left + 1u, refs, mid, end, defer_size, deferred);
+}
+
+// Packs the triangles of every leaf into packets, and points the leaves at
+// them instead of at their refs.
+void MeshBvh::
+make_packets(const std::vector<Vector3> &positions, const std::vector<PrimRef> &refs) {
+  size_t total = 0u;
+  for (const Node &node : _nodes) {
+    if (node.is_leaf()) {
+      total += num_packets(node.count);
+    }
+  }
+  _packets.resize(total);
+
+  u32 next = 0u;
+  for (Node &node : _nodes) {
+    if (!node.is_leaf()) {
+      continue;
+    }
+    u32 first_ref = node.first;
+    u32 num_refs = node.count;
+    node.first = next;
+    node.count = num_packets(num_refs);
+    next += node.count;
+
+    for (u32 p = 0; p < node.count; ++p) {
+      TrianglePacket &packet = _packets[node.first + p];
+      memset(&packet, 0, sizeof(TrianglePacket));
+      for (u32 lane = 0; lane < (u32)packet_size; ++lane) {
+        u32 r = p * packet_size + lane;
+        if (r >= num_refs) {
+          // Degenerate, zero edges never hit.
+          packet.triangles[lane] = UINT32_MAX;
+          continue;
+        }
+        u32 triangle = refs[first_ref + r].triangle;
+        const Vector3 *tri = &positions[triangle * 3u];
+        for (int a = 0; a < 3; ++a) {
+          packet.v0[a][lane] = tri[0][a];
+          packet.e1[a][lane] = tri[1][a] - tri[0][a];
+          packet.e2[a][lane] = tri[2][a] - tri[0][a];
+        }
+        packet.triangles[lane] = triangle;
+      }
+    }
+  }
+}
+
+// Returns the distance along the ray to where it enters the node, or
+// FLT_MAX if it misses the node or enters it past max_t.
+static inline float
+intersect_node(const MeshBvh::Node &node, const float origin[3],
+               const float inv_dir[3], float max_t) {
+  float t_min = 0.0f;
+  float t_max = max_t;
+  for (int i = 0; i < 3; ++i) {
+    float t0 = (node.min[i] - origin[i]) * inv_dir[i];
+    float t1 = (node.max[i] - origin[i]) * inv_dir[i];
+    t_min = std::max(t_min, std::min(t0, t1));
+    t_max = std::min(t_max, std::max(t0, t1));
+  }
+  return (t_min <= t_max) ? t_min : FLT_MAX;
+}
+
+// Intersects the ray with every lane of the packet (Moller-Trumbore), and
+// returns a mask of the lanes hit closer than max_t, with their distances
+// and barycentrics.
+static inline unsigned int
+intersect_packet(const MeshBvh::TrianglePacket &packet, const float origin[3],
+                 const float dir[3], float max_t, float t[4], float u[4],
+                 float v[4]) {
+#if defined(SIMD_SSE2)
+  __m128 dx = _mm_set1_ps(dir[0]);
+  __m128 dy = _mm_set1_ps(dir[1]);
+  __m128 dz = _mm_set1_ps(dir[2]);
+  __m128 e1x = _mm_load_ps(packet.e1[0]);
+  __m128 e1y = _mm_load_ps(packet.e1[1]);
+  __m128 e1z = _mm_load_ps(packet.e1[2]);
+  __m128 e2x = _mm_load_ps(packet.e2[0]);
+  __m128 e2y = _mm_load_ps(packet.e2[1]);
+  __m128 e2z = _mm_load_ps(packet.e2[2]);
+
+  // p = dir x e2
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+  // s = origin - v0
+  __m128 sx = _mm_sub_ps(_mm_set1_ps(origin[0]), _mm_load_ps(packet.v0[0]));
+  __m128 sy = _mm_sub_ps(_mm_set1_ps(origin[1]), _mm_load_ps(packet.v0[1]));
+  __m128 sz = _mm_sub_ps(_mm_set1_ps(origin[2]), _mm_load_ps(packet.v0[2]));
+  __m128 vu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+  // q = s x e1
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+  __m128 vt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 hit = _mm_cmpneq_ps(det, zero);
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(vu, zero));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(vu, vv), _mm_set1_ps(1.0f)));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(vt, zero));
+  hit = _mm_and_ps(hit, _mm_cmplt_ps(vt, _mm_set1_ps(max_t)));
+
+  _mm_storeu_ps(t, vt);
+  _mm_storeu_ps(u, vu);
+  _mm_storeu_ps(v, vv);
+  return (unsigned int)_mm_movemask_ps(hit);
+#else
+  unsigned int mask = 0u;
+  for (int lane = 0; lane < MeshBvh::packet_size; ++lane) {
+    Vector3 d(dir[0], dir[1], dir[2]);
+    Vector3 e1(packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane]);
+    Vector3 e2(packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane]);
+    Vector3 p = d.cross(e2);
+    float det = e1.dot(p);
+    if (det == 0.0f) {
+      continue;
+    }
+    float inv_det = 1.0f / det;
+    Vector3 s(origin[0] - packet.v0[0][lane], origin[1] - packet.v0[1][lane],
+              origin[2] - packet.v0[2][lane]);
+    Vector3 q = s.cross(e1);
+    u[lane] = s.dot(p) * inv_det;
+    v[lane] = d.dot(q) * inv_det;
+    t[lane] = e2.dot(q) * inv_det;
+    if (u[lane] >= 0.0f && v[lane] >= 0.0f && u[lane] + v[lane] <= 1.0f &&
+        t[lane] >= 0.0f && t[lane] < max_t) {
+      mask |= 1u << lane;
+    }
+  }
+  return mask;
+#endif
+}
+
+template<bool any_hit>
+bool MeshBvh::
+traverse(const Vector3 &origin, const Vector3 &dir, Hit &hit, float max_t) const {
+  if (_nodes.empty()) {
+    return false;
+  }
+
+  float org[3] = { origin[0], origin[1], origin[2] };
+  float d[3] = { dir[0], dir[1], dir[2] };
+  float inv_dir[3];
+  for (int i = 0; i < 3; ++i) {
+    inv_dir[i] = 1.0f / dir[i];
+  }
+
+  struct Entry {
+    u32 node;
+    float t;
+  };
+  Entry stack[max_stack_depth];
+  int top = 0;
+  float t_hit = max_t;
+  u32 best = UINT32_MAX;
+
+  float t_root = intersect_node(_nodes[0], org, inv_dir, t_hit);
+  if (t_root != FLT_MAX) {
+    stack[top++] = { 0u, t_root };
+  }
+
+  while (top > 0) {
+    Entry entry = stack[--top];
+    if (entry.t >= t_hit) {
+      continue;
+    }
+    const Node *node = &_nodes[entry.node];
+
+    // Descend into the nearer child, leaving the farther one for later.
+    while (!node->is_leaf()) {
+      const Node &child0 = _nodes[node->first];
+      const Node &child1 = _nodes[node->first + 1u];
+      float t0 = intersect_node(child0, org, inv_dir, t_hit);
+      float t1 = intersect_node(child1, org, inv_dir, t_hit);
+      u32 near_child = node->first;
+      u32 far_child = node->first + 1u;
+      if (t1 < t0) {
+        std::swap(t0, t1);
+        std::swap(near_child, far_child);
+      }
+      if (t0 == FLT_MAX) {
+        node = nullptr;
+        break;
+      }
+      if (t1 != FLT_MAX) {
+        assert(top < max_stack_depth);
+        stack[top++] = { far_child, t1 };
+      }
+      node = &_nodes[near_child];
+    }
+    if (node == nullptr) {
+      continue;
+    }
+
+    for (u32 p = node->first; p < node->first + node->count; ++p) {
+      const TrianglePacket &packet = _packets[p];
+      float t[packet_size], u[packet_size], v[packet_size];
+      unsigned int mask = intersect_packet(packet, org, d, t_hit, t, u, v);
+      while (mask != 0u) {
+        int lane = std::countr_zero(mask);
+        mask &= mask - 1u;
+        if (t[lane] < t_hit) {
+          t_hit = t[lane];
+          best = packet.triangles[lane];
+          hit.u = u[lane];
+          hit.v = v[lane];
+          if (any_hit) {
+            return true;
+          }
+        }
+      }
+    }
+  }
+
+  if (best == UINT32_MAX) {
+    return false;
+  }
+  size_t mesh = std::upper_bound(_mesh_first_triangles.begin(),
+                                 _mesh_first_triangles.end(), best) -
+                _mesh_first_triangles.begin() - 1u;
+  hit.t = t_hit;
+  hit.mesh = (u32)mesh;
+  hit.triangle = best - _mesh_first_triangles[mesh];
+  return true;
+}
+
+// Finds the closest triangle the ray hits before max_t.  The direction
+// does not have to be normalized, distances are in units of it.
+bool MeshBvh::
+intersect(const Vector3 &origin, const Vector3 &dir, Hit &hit, float max_t) const {
+  return traverse<false>(origin, dir, hit, max_t);
+}
+
+// Returns whether the ray hits any triangle before max_t, which stops at
+// the first one found.
+bool MeshBvh::
+occluded(const Vector3 &origin, const Vector3 &dir, float max_t) const {
+  Hit hit;
+  return traverse<true>(origin, dir, hit, max_t);
+}
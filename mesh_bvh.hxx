@@ -0,0 +1,103 @@
+#ifndef MESH_BVH_HXX
+#define MESH_BVH_HXX
+
+#include <vector>
+
+#include "linmath.hxx"
+#include "numeric_types.hxx"
+
+struct Mesh;
+class ThreadPool;
+
+// Bounding volume hierarchy over the triangles of a set of meshes, for ray
+// queries on the CPU: picking, baking and collision probes.
+//
+// Positions are read straight from the meshes' vertex data, through the
+// position column of whichever array has it, and indices from their index
+// data.  Triangle lists and strips are supported, other topologies have no
+// triangles.  All meshes are taken to be in the same space, rays are given
+// in that space.
+//
+// The tree is built top-down with a binned surface area heuristic.  The top
+// of the tree is split on the calling thread until there are enough
+// subtrees to keep a ThreadPool busy, which then build in parallel.
+//
+// Leaf triangles are stored in packets of four, laid out so that a packet
+// is intersected with a single ray in one go with SSE.  The padding lanes
+// of a partial packet are degenerate and never hit.
+class MeshBvh {
+public:
+  static constexpr int packet_size = 4;
+
+  struct Node {
+    float min[3];
+    // Internal nodes: index of the first child, the second follows it.
+    // Leaves: index of the first packet.
+    u32 first;
+    float max[3];
+    // Number of packets, 0 for internal nodes.
+    u32 count;
+
+    inline bool is_leaf() const { return count != 0u; }
+  };
+
+  // Triangle corner v0 and edges v1 - v0 and v2 - v0, one lane per
+  // triangle.
+  struct alignas(16) TrianglePacket {
+    float v0[3][packet_size];
+    float e1[3][packet_size];
+    float e2[3][packet_size];
+    // Triangle of each lane, UINT32_MAX for padding.
+    u32 triangles[packet_size];
+  };
+
+  struct Hit {
+    float t;
+    // Barycentrics of the hit point along the edges to v1 and v2.
+    float u;
+    float v;
+    u32 mesh;
+    // Triangle within the mesh.
+    u32 triangle;
+  };
+
+  void build(const Mesh *meshes, size_t num_meshes, ThreadPool *pool = nullptr);
+  void clear();
+
+  bool intersect(const Vector3 &origin, const Vector3 &dir, Hit &hit,
+                 float max_t = FLT_MAX) const;
+  bool occluded(const Vector3 &origin, const Vector3 &dir,
+                float max_t = FLT_MAX) const;
+
+  inline size_t get_num_triangles() const { return _num_triangles; }
+  inline size_t get_num_nodes() const { return _nodes.size(); }
+  inline size_t get_num_packets() const { return _packets.size(); }
+
+private:
+  struct PrimRef;
+  struct BuildJob;
+
+  void gather_triangles(const Mesh *meshes, size_t num_meshes,
+                        std::vector<Vector3> &positions,
+                        std::vector<PrimRef> &refs, ThreadPool *pool);
+  static void build_node(std::vector<Node> &nodes, u32 n, PrimRef *refs,
+                         u32 begin, u32 end, u32 defer_size,
+                         std::vector<BuildJob> *deferred);
+  void make_packets(const std::vector<Vector3> &positions,
+                    const std::vector<PrimRef> &refs);
+
+  template<bool any_hit>
+  bool traverse(const Vector3 &origin, const Vector3 &dir, Hit &hit,
+                float max_t) const;
+
+private:
+  std::vector<Node> _nodes;
+  std::vector<TrianglePacket> _packets;
+
+  // Triangles are numbered over all meshes in order, this is the first
+  // triangle of each mesh.
+  std::vector<u32> _mesh_first_triangles;
+  size_t _num_triangles = 0u;
+};
+
+#endif // MESH_BVH_HXX
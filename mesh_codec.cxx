@@ -0,0 +1,500 @@
+#include "mesh_codec.hxx"
+#include "simd.hxx"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <type_traits>
+
+static constexpr size_t group_size = 16u;
+
+// Bytes a group of 16 values packs to, by its two-bit width code.
+static constexpr size_t group_bytes[4] = { 0u, 4u, 8u, 16u };
+
+inline static size_t
+get_block_rows(size_t num_rows, size_t block) {
+  return std::min(num_rows - block * mesh_codec_block_rows, mesh_codec_block_rows);
+}
+
+inline static size_t
+get_num_groups(size_t rows) {
+  return (rows + group_size - 1u) / group_size;
+}
+
+// Four width codes to a byte.
+inline static size_t
+get_header_size(size_t num_groups) {
+  return (num_groups + 3u) / 4u;
+}
+
+inline static int
+get_group_code(const ubyte *header, size_t group) {
+  return (header[group / 4u] >> ((group % 4u) * 2u)) & 3;
+}
+
+inline static u32
+get_block_end(const ubyte *data, size_t block) {
+  u32 end;
+  memcpy(&end, data + block * sizeof(u32), sizeof(u32));
+  return end;
+}
+
+inline static ubyte
+zigzag_byte(ubyte d) {
+  return (ubyte)((d << 1) ^ ((sbyte)d >> 7));
+}
+
+inline static ubyte
+unzigzag_byte(ubyte z) {
+  return (ubyte)((z >> 1) ^ (0u - (z & 1u)));
+}
+
+template<class T>
+inline static T
+zigzag(T d) {
+  typedef std::make_signed_t<T> S;
+  return (T)((T)(d << 1) ^ (T)((S)d >> (sizeof(T) * 8u - 1u)));
+}
+
+template<class T>
+inline static T
+unzigzag(T z) {
+  return (T)((z >> 1) ^ (T)(0u - (z & 1u)));
+}
+
+template<class T>
+static void
+filter_indices(const ubyte *data, size_t rows, ubyte *out) {
+  T prev = 0u;
+  for (size_t r = 0; r < rows; ++r) {
+    T index;
+    memcpy(&index, data + r * sizeof(T), sizeof(T));
+    T z = zigzag<T>((T)(index - prev));
+    memcpy(out + r * sizeof(T), &z, sizeof(T));
+    prev = index;
+  }
+}
+
+// Adds the differences of rows [begin, rows) of a block back up.
+template<class T>
+static void
+unfilter_indices(ubyte *data, size_t begin, size_t rows) {
+  T prev = 0u;
+  if (begin > 0u) {
+    memcpy(&prev, data + (begin - 1u) * sizeof(T), sizeof(T));
+  }
+  for (size_t r = begin; r < rows; ++r) {
+    T z;
+    memcpy(&z, data + r * sizeof(T), sizeof(T));
+    prev = (T)(prev + unzigzag<T>(z));
+    memcpy(data + r * sizeof(T), &prev, sizeof(T));
+  }
+}
+
+// Turns the rows of a block into the values its planes are packed from,
+// in the same layout.
+static void
+filter_block(MeshStreamCodec codec, const ubyte *data, size_t rows, size_t row_stride,
+             ubyte *out) {
+  if (codec == MSC_vertex) {
+    for (size_t p = 0; p < row_stride; ++p) {
+      ubyte prev = 0u;
+      for (size_t r = 0; r < rows; ++r) {
+        ubyte value = data[r * row_stride + p];
+        out[r * row_stride + p] = zigzag_byte((ubyte)(value - prev));
+        prev = value;
+      }
+    }
+    return;
+  }
+
+  switch (row_stride) {
+  case 1u:
+    filter_indices<u8>(data, rows, out);
+    break;
+  case 2u:
+    filter_indices<u16>(data, rows, out);
+    break;
+  case 4u:
+    filter_indices<u32>(data, rows, out);
+    break;
+  }
+}
+
+static void
+pack_group(const ubyte *values, int code, std::vector<ubyte> &out) {
+  switch (code) {
+  case 1:
+    for (size_t j = 0; j < 4u; ++j) {
+      const ubyte *v = values + j * 4u;
+      out.push_back((ubyte)(v[0] | (v[1] << 2) | (v[2] << 4) | (v[3] << 6)));
+    }
+    break;
+  case 2:
+    for (size_t j = 0; j < 8u; ++j) {
+      const ubyte *v = values + j * 2u;
+      out.push_back((ubyte)(v[0] | (v[1] << 4)));
+    }
+    break;
+  case 3:
+    out.insert(out.end(), values, values + group_size);
+    break;
+  }
+}
+
+// Blocks are laid out as their end offsets from the start of the stream,
+// then for each block, for each plane, the width codes of its groups and
+// the groups packed to those widths.
+void
+encode_mesh_stream(MeshStreamCodec codec, const ubyte *data, size_t num_rows,
+                   size_t row_stride, std::vector<ubyte> &out) {
+  assert(codec == MSC_vertex ||
+         (codec == MSC_index && (row_stride == 1u || row_stride == 2u || row_stride == 4u)));
+  size_t num_blocks = get_mesh_codec_num_blocks(num_rows);
+  out.assign(num_blocks * sizeof(u32), 0u);
+
+  std::vector<ubyte> filtered(mesh_codec_block_rows * row_stride);
+  ubyte values[mesh_codec_block_rows];
+  for (size_t b = 0; b < num_blocks; ++b) {
+    size_t rows = get_block_rows(num_rows, b);
+    filter_block(codec, data + b * mesh_codec_block_rows * row_stride, rows, row_stride,
+                 filtered.data());
+
+    size_t num_groups = get_num_groups(rows);
+    for (size_t p = 0; p < row_stride; ++p) {
+      // The last group is padded with zeros, which pack to nothing.
+      memset(values, 0, sizeof(values));
+      for (size_t r = 0; r < rows; ++r) {
+        values[r] = filtered[r * row_stride + p];
+      }
+
+      size_t header = out.size();
+      out.resize(header + get_header_size(num_groups), 0u);
+      for (size_t g = 0; g < num_groups; ++g) {
+        const ubyte *group = values + g * group_size;
+        ubyte max = *std::max_element(group, group + group_size);
+        int code = (max == 0u) ? 0 : (max < 4u) ? 1 : (max < 16u) ? 2 : 3;
+        out[header + g / 4u] |= (ubyte)(code << ((g % 4u) * 2u));
+        pack_group(group, code, out);
+      }
+    }
+
+    assert(out.size() <= UINT32_MAX);
+    u32 end = (u32)out.size();
+    memcpy(out.data() + b * sizeof(u32), &end, sizeof(u32));
+  }
+}
+
+bool
+check_mesh_stream(const ubyte *data, size_t size, size_t num_rows, size_t row_stride) {
+  size_t num_blocks = get_mesh_codec_num_blocks(num_rows);
+  size_t begin = num_blocks * sizeof(u32);
+  if (size < begin) {
+    return false;
+  }
+  for (size_t b = 0; b < num_blocks; ++b) {
+    size_t end = get_block_end(data, b);
+    if (end < begin || end > size) {
+      return false;
+    }
+    size_t num_groups = get_num_groups(get_block_rows(num_rows, b));
+    size_t header_size = get_header_size(num_groups);
+    size_t pos = begin;
+    for (size_t p = 0; p < row_stride; ++p) {
+      if (end - pos < header_size) {
+        return false;
+      }
+      const ubyte *header = data + pos;
+      pos += header_size;
+      for (size_t g = 0; g < num_groups; ++g) {
+        pos += group_bytes[get_group_code(header, g)];
+      }
+      if (pos > end) {
+        return false;
+      }
+    }
+    if (pos != end) {
+      return false;
+    }
+    begin = end;
+  }
+  return begin == size;
+}
+
+#if defined(SIMD_SSE2)
+inline static __m128i
+unpack_group(const ubyte *&src, int code) {
+  switch (code) {
+  case 1: {
+    int bits;
+    memcpy(&bits, src, 4u);
+    src += 4u;
+    __m128i x = _mm_cvtsi32_si128(bits);
+    __m128i mask = _mm_set1_epi8(3);
+    __m128i a0 = _mm_and_si128(x, mask);
+    __m128i a1 = _mm_and_si128(_mm_srli_epi16(x, 2), mask);
+    __m128i a2 = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    __m128i a3 = _mm_and_si128(_mm_srli_epi16(x, 6), mask);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(a0, a1), _mm_unpacklo_epi8(a2, a3));
+  }
+  case 2: {
+    __m128i x = _mm_loadl_epi64((const __m128i *)src);
+    src += 8u;
+    __m128i mask = _mm_set1_epi8(15);
+    __m128i lo = _mm_and_si128(x, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    return _mm_unpacklo_epi8(lo, hi);
+  }
+  case 3: {
+    __m128i x = _mm_loadu_si128((const __m128i *)src);
+    src += 16u;
+    return x;
+  }
+  }
+  return _mm_setzero_si128();
+}
+
+// Unpacks the groups of a plane into a column of the block's planes, and
+// for vertex planes, adds the differences back up.  Returns the end of the
+// packed groups.
+static const ubyte *
+decode_plane(bool delta, const ubyte *header, const ubyte *src, size_t num_groups,
+             ubyte *plane) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i one = _mm_set1_epi8(1);
+  __m128i low7 = _mm_set1_epi8(0x7f);
+  // The previous byte, in every lane.
+  __m128i prev = zero;
+  for (size_t g = 0; g < num_groups; ++g) {
+    __m128i v = unpack_group(src, get_group_code(header, g));
+    if (delta) {
+      v = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(v, 1), low7),
+                        _mm_sub_epi8(zero, _mm_and_si128(v, one)));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+      v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+      v = _mm_add_epi8(v, prev);
+      prev = _mm_unpackhi_epi8(v, v);
+      prev = _mm_shufflehi_epi16(prev, 0xff);
+      prev = _mm_unpackhi_epi64(prev, prev);
+    }
+    _mm_storeu_si128((__m128i *)(plane + g * group_size), v);
+  }
+  return src;
+}
+#else
+static const ubyte *
+decode_plane(bool delta, const ubyte *header, const ubyte *src, size_t num_groups,
+             ubyte *plane) {
+  ubyte prev = 0u;
+  for (size_t g = 0; g < num_groups; ++g) {
+    ubyte *v = plane + g * group_size;
+    switch (get_group_code(header, g)) {
+    case 0:
+      memset(v, 0, group_size);
+      break;
+    case 1:
+      for (size_t i = 0; i < group_size; ++i) {
+        v[i] = (src[i / 4u] >> ((i % 4u) * 2u)) & 3u;
+      }
+      src += 4u;
+      break;
+    case 2:
+      for (size_t i = 0; i < group_size; ++i) {
+        v[i] = (src[i / 2u] >> ((i % 2u) * 4u)) & 15u;
+      }
+      src += 8u;
+      break;
+    case 3:
+      memcpy(v, src, group_size);
+      src += 16u;
+      break;
+    }
+    if (delta) {
+      for (size_t i = 0; i < group_size; ++i) {
+        prev = (ubyte)(prev + unzigzag_byte(v[i]));
+        v[i] = prev;
+      }
+    }
+  }
+  return src;
+}
+#endif
+
+// Adds the differences of the indices of a block back up, as many as fill
+// whole vectors, and returns how many that was.
+#if defined(SIMD_SSE2)
+template<class T>
+static size_t
+unfilter_indices_simd(ubyte *data, size_t rows) {
+  constexpr size_t width = 16u / sizeof(T);
+  __m128i zero = _mm_setzero_si128();
+  __m128i prev = zero;
+  size_t r = 0u;
+  for (; r + width <= rows; r += width) {
+    __m128i z = _mm_loadu_si128((const __m128i *)(data + r * sizeof(T)));
+    __m128i v;
+    if constexpr (sizeof(T) == 2u) {
+      v = _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(zero, _mm_and_si128(z, _mm_set1_epi16(1))));
+      v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+      v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+      v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+      v = _mm_add_epi16(v, prev);
+      prev = _mm_shufflehi_epi16(v, 0xff);
+      prev = _mm_unpackhi_epi64(prev, prev);
+    } else {
+      v = _mm_xor_si128(_mm_srli_epi32(z, 1), _mm_sub_epi32(zero, _mm_and_si128(z, _mm_set1_epi32(1))));
+      v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+      v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+      v = _mm_add_epi32(v, prev);
+      prev = _mm_shuffle_epi32(v, 0xff);
+    }
+    _mm_storeu_si128((__m128i *)(data + r * sizeof(T)), v);
+  }
+  return r;
+}
+#else
+template<class T>
+static size_t
+unfilter_indices_simd(ubyte *, size_t) {
+  return 0u;
+}
+#endif
+
+// Puts the planes of a block back together into rows.  Each plane holds
+// mesh_codec_block_rows bytes, decoded up to rows rounded up to a group.
+static void
+interleave_rows(const ubyte *planes, size_t rows, size_t row_stride, ubyte *out) {
+  size_t p = 0u;
+#if defined(SIMD_SSE2)
+  if (row_stride == 2u) {
+    for (size_t r = 0; r < rows; r += group_size) {
+      __m128i p0 = _mm_loadu_si128((const __m128i *)(planes + r));
+      __m128i p1 = _mm_loadu_si128((const __m128i *)(planes + mesh_codec_block_rows + r));
+      alignas(16) ubyte pairs[group_size * 2u];
+      _mm_store_si128((__m128i *)pairs, _mm_unpacklo_epi8(p0, p1));
+      _mm_store_si128((__m128i *)(pairs + group_size), _mm_unpackhi_epi8(p0, p1));
+      memcpy(out + r * 2u, pairs, std::min(rows - r, group_size) * 2u);
+    }
+    return;
+  }
+
+  // Sixteen planes at a time, transposed into sixteen bytes of each row.
+  for (; p + 16u <= row_stride; p += 16u) {
+    const ubyte *src = planes + p * mesh_codec_block_rows;
+    for (size_t r = 0; r < rows; r += group_size) {
+      __m128i a[16], b[16];
+      for (int k = 0; k < 16; ++k) {
+        a[k] = _mm_loadu_si128((const __m128i *)(src + k * mesh_codec_block_rows + r));
+      }
+      // Bytes of planes 2k, 2k+1, then words of 4k..4k+3, then double words
+      // of 8k..8k+7, for rows 0-7 in the even and rows 8-15 in the odd.
+      for (int k = 0; k < 8; ++k) {
+        b[2 * k] = _mm_unpacklo_epi8(a[2 * k], a[2 * k + 1]);
+        b[2 * k + 1] = _mm_unpackhi_epi8(a[2 * k], a[2 * k + 1]);
+      }
+      for (int k = 0; k < 4; ++k) {
+        a[4 * k] = _mm_unpacklo_epi16(b[4 * k], b[4 * k + 2]);
+        a[4 * k + 1] = _mm_unpackhi_epi16(b[4 * k], b[4 * k + 2]);
+        a[4 * k + 2] = _mm_unpacklo_epi16(b[4 * k + 1], b[4 * k + 3]);
+        a[4 * k + 3] = _mm_unpackhi_epi16(b[4 * k + 1], b[4 * k + 3]);
+      }
+      // a[4k + j] now holds rows 4j..4j+3 of planes 4k..4k+3.
+      for (int j = 0; j < 4; ++j) {
+        for (int h = 0; h < 2; ++h) {
+          b[8 * h + 2 * j] = _mm_unpacklo_epi32(a[8 * h + j], a[8 * h + 4 + j]);
+          b[8 * h + 2 * j + 1] = _mm_unpackhi_epi32(a[8 * h + j], a[8 * h + 4 + j]);
+        }
+      }
+      // b[8h + i] holds rows 2i, 2i+1 of planes 8h..8h+7.
+      size_t n = std::min(rows - r, group_size);
+      alignas(16) ubyte tail[group_size * group_size];
+      ubyte *dst = (n == group_size) ? out + r * row_stride + p : tail;
+      size_t dst_stride = (n == group_size) ? row_stride : group_size;
+      for (int i = 0; i < 8; ++i) {
+        _mm_storeu_si128((__m128i *)(dst + (2 * i) * dst_stride),
+                         _mm_unpacklo_epi64(b[i], b[8 + i]));
+        _mm_storeu_si128((__m128i *)(dst + (2 * i + 1) * dst_stride),
+                         _mm_unpackhi_epi64(b[i], b[8 + i]));
+      }
+      for (size_t i = 0; dst == tail && i < n; ++i) {
+        memcpy(out + (r + i) * row_stride + p, tail + i * group_size, group_size);
+      }
+    }
+  }
+
+  // Four planes at a time, into four bytes of each row.
+  for (; p + 4u <= row_stride; p += 4u) {
+    const ubyte *src = planes + p * mesh_codec_block_rows;
+    for (size_t r = 0; r < rows; r += group_size) {
+      __m128i p0 = _mm_loadu_si128((const __m128i *)(src + r));
+      __m128i p1 = _mm_loadu_si128((const __m128i *)(src + mesh_codec_block_rows + r));
+      __m128i p2 = _mm_loadu_si128((const __m128i *)(src + 2u * mesh_codec_block_rows + r));
+      __m128i p3 = _mm_loadu_si128((const __m128i *)(src + 3u * mesh_codec_block_rows + r));
+      __m128i t0 = _mm_unpacklo_epi8(p0, p1);
+      __m128i t1 = _mm_unpackhi_epi8(p0, p1);
+      __m128i t2 = _mm_unpacklo_epi8(p2, p3);
+      __m128i t3 = _mm_unpackhi_epi8(p2, p3);
+      alignas(16) u32 quads[group_size];
+      _mm_store_si128((__m128i *)quads, _mm_unpacklo_epi16(t0, t2));
+      _mm_store_si128((__m128i *)(quads + 4), _mm_unpackhi_epi16(t0, t2));
+      _mm_store_si128((__m128i *)(quads + 8), _mm_unpacklo_epi16(t1, t3));
+      _mm_store_si128((__m128i *)(quads + 12), _mm_unpackhi_epi16(t1, t3));
+      size_t n = std::min(rows - r, group_size);
+      ubyte *dst = out + r * row_stride + p;
+      if (row_stride == 4u) {
+        memcpy(dst, quads, n * 4u);
+      } else {
+        for (size_t i = 0; i < n; ++i) {
+          memcpy(dst + i * row_stride, &quads[i], 4u);
+        }
+      }
+    }
+  }
+#endif
+  for (; p < row_stride; ++p) {
+    const ubyte *src = planes + p * mesh_codec_block_rows;
+    for (size_t r = 0; r < rows; ++r) {
+      out[r * row_stride + p] = src[r];
+    }
+  }
+}
+
+void
+decode_mesh_stream(MeshStreamCodec codec, const ubyte *data, size_t num_rows,
+                   size_t row_stride, size_t begin_block, size_t end_block,
+                   ubyte *out) {
+  assert(codec == MSC_vertex || codec == MSC_index);
+  size_t num_blocks = get_mesh_codec_num_blocks(num_rows);
+  assert(end_block <= num_blocks);
+  std::vector<ubyte> planes(row_stride * mesh_codec_block_rows);
+
+  for (size_t b = begin_block; b < end_block; ++b) {
+    const ubyte *src = data + ((b == 0u) ? num_blocks * sizeof(u32) : get_block_end(data, b - 1u));
+    size_t rows = get_block_rows(num_rows, b);
+    size_t num_groups = get_num_groups(rows);
+    size_t header_size = get_header_size(num_groups);
+    for (size_t p = 0; p < row_stride; ++p) {
+      const ubyte *header = src;
+      src = decode_plane(codec == MSC_vertex, header, src + header_size, num_groups,
+                         planes.data() + p * mesh_codec_block_rows);
+    }
+
+    ubyte *block = out + b * mesh_codec_block_rows * row_stride;
+    interleave_rows(planes.data(), rows, row_stride, block);
+    if (codec == MSC_index) {
+      switch (row_stride) {
+      case 1u:
+        unfilter_indices<u8>(block, 0u, rows);
+        break;
+      case 2u:
+        unfilter_indices<u16>(block, unfilter_indices_simd<u16>(block, rows), rows);
+        break;
+      case 4u:
+        unfilter_indices<u32>(block, unfilter_indices_simd<u32>(block, rows), rows);
+        break;
+      }
+    }
+  }
+}
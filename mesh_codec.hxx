@@ -0,0 +1,55 @@
+#ifndef MESH_CODEC_HXX
+#define MESH_CODEC_HXX
+
+#include <vector>
+
+#include "numeric_types.hxx"
+
+// Lossless codecs for the vertex and index streams of cooked mesh files.
+//
+// A stream is a run of rows of row_stride bytes each: vertices, or indices
+// of 1, 2 or 4 bytes.  It is coded in blocks of mesh_codec_block_rows rows,
+// and each block in byte planes, one per byte of a row, so that bytes that
+// change alike from row to row sit together.  The codec turns each plane
+// into small values:
+//
+//   MSC_vertex  the difference of each byte from the same byte of the row
+//               before, since neighbouring vertices are alike.
+//   MSC_index   the difference of each index from the index before, as
+//               whole indices, since triangles use nearby vertices.
+//
+// Differences are zigzag coded, so small negative ones are small as well,
+// and each plane is then packed in groups of 16 values, to 0, 2, 4 or 8
+// bits each, whichever is the fewest that holds the whole group.  This is
+// not as tight as an entropy coder, but unpacks a group at a time with a
+// few SSE2 instructions.
+//
+// Blocks are coded on their own, and the stream starts with the end offset
+// of every block, so blocks can be decoded in any order, and in parallel.
+enum MeshStreamCodec : u8 {
+  MSC_none,
+  MSC_vertex,
+  MSC_index,
+};
+
+static constexpr size_t mesh_codec_block_rows = 256u;
+
+inline size_t
+get_mesh_codec_num_blocks(size_t num_rows) {
+  return (num_rows + mesh_codec_block_rows - 1u) / mesh_codec_block_rows;
+}
+
+void encode_mesh_stream(MeshStreamCodec codec, const ubyte *data, size_t num_rows,
+                        size_t row_stride, std::vector<ubyte> &out);
+
+// Checks that the blocks of a coded stream are laid out as their plane
+// headers say, so that decoding stays within it.
+bool check_mesh_stream(const ubyte *data, size_t size, size_t num_rows, size_t row_stride);
+
+// Decodes blocks [begin_block, end_block) of a checked stream into out,
+// which holds the whole decoded stream.
+void decode_mesh_stream(MeshStreamCodec codec, const ubyte *data, size_t num_rows,
+                        size_t row_stride, size_t begin_block, size_t end_block,
+                        ubyte *out);
+
+#endif // MESH_CODEC_HXX
@@ -0,0 +1,428 @@
+#include "mesh_file.hxx"
+#include "thread_pool.hxx"
+#include "wininclude.hxx"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(MeshFileHeader) == 72u);
+static_assert(sizeof(MeshFileArray) == 40u);
+static_assert(sizeof(MeshFileMesh) == 52u);
+
+static constexpr size_t stream_alignment = 16u;
+
+// A block of vertices decodes in a few microseconds, so tasks are made of
+// a few thousand rows at least, to be worth handing to another thread.
+static constexpr size_t min_blocks_per_task = 16u;
+
+inline static size_t
+align_up(size_t offset, size_t alignment) {
+  return (offset + alignment - 1u) & ~(alignment - 1u);
+}
+
+inline static u64
+mix_bits(u64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Non-cryptographic 64-bit hash, to tell files apart.  Runs four lanes of
+// 8-byte words side by side, so it hashes several bytes per cycle.
+u64
+hash_bytes(const void *data, size_t size, u64 seed) {
+  constexpr u64 prime = 0x9e3779b97f4a7c15ull;
+  const ubyte *bytes = (const ubyte *)data;
+  u64 lanes[4] = { seed, seed + 1u, seed + 2u, seed + 3u };
+
+  size_t i = 0u;
+  for (; i + 32u <= size; i += 32u) {
+    for (int l = 0; l < 4; ++l) {
+      u64 word;
+      memcpy(&word, bytes + i + l * 8u, 8u);
+      lanes[l] = (lanes[l] ^ word) * prime;
+    }
+  }
+
+  u64 h = size;
+  for (int l = 0; l < 4; ++l) {
+    h = mix_bits(h ^ lanes[l]);
+  }
+  for (; i < size; ++i) {
+    h = (h ^ bytes[i]) * prime;
+  }
+  return mix_bits(h);
+}
+
+// Whether a stream, stored as it is or coded with the codec of its kind,
+// holds size bytes worth of whole rows.
+inline static bool
+check_stream(const ubyte *data, u8 codec, MeshStreamCodec kind, u64 encoded_size, u64 size,
+             size_t row_stride) {
+  if (row_stride == 0u || (size % row_stride) != 0u) {
+    return false;
+  }
+  if (codec == MSC_none) {
+    return encoded_size == size;
+  }
+  return codec == kind && check_mesh_stream(data, encoded_size, size / row_stride, row_stride);
+}
+
+// Codes the stream, if that makes it smaller by enough to be worth decoding
+// it, and returns the codec it ended up with.  Block offsets are 32-bit, so
+// streams near 4GB are stored as they are.
+static MeshStreamCodec
+encode_stream(MeshStreamCodec codec, const std::vector<ubyte> &data, size_t row_stride,
+              std::vector<ubyte> &out) {
+  out.clear();
+  if (data.empty() || data.size() > UINT32_MAX / 2u) {
+    return MSC_none;
+  }
+  encode_mesh_stream(codec, data.data(), data.size() / row_stride, row_stride, out);
+  if (out.size() > data.size() - data.size() / 16u) {
+    out.clear();
+    return MSC_none;
+  }
+  return codec;
+}
+
+MeshFile::
+~MeshFile() {
+  close();
+}
+
+// Maps the file, and checks that it is a complete mesh file of the current
+// version, cooked from the source with the given hash.
+bool MeshFile::
+open(const std::string &filename, u64 source_hash) {
+  close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  _file = file;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    close();
+    return false;
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    close();
+    return false;
+  }
+  _mapping = mapping;
+  _data = (const ubyte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  _size = (size_t)size.QuadPart;
+#else
+  _fd = ::open(filename.c_str(), O_RDONLY);
+  if (_fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(_fd, &st) != 0 || st.st_size == 0) {
+    close();
+    return false;
+  }
+  void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+  _data = (data != MAP_FAILED) ? (const ubyte *)data : nullptr;
+  _size = (size_t)st.st_size;
+#endif
+
+  if (_data == nullptr || !validate(filename, source_hash)) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void MeshFile::
+close() {
+#ifdef _WIN32
+  if (_data != nullptr) {
+    UnmapViewOfFile(_data);
+  }
+  if (_mapping != nullptr) {
+    CloseHandle((HANDLE)_mapping);
+  }
+  if (_file != nullptr) {
+    CloseHandle((HANDLE)_file);
+  }
+#else
+  if (_data != nullptr) {
+    munmap((void *)_data, _size);
+  }
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+#endif
+  _file = nullptr;
+  _mapping = nullptr;
+  _fd = -1;
+  _data = nullptr;
+  _size = 0u;
+}
+
+// A file that doesn't match is not an error, it is simply cooked again,
+// but one that is damaged is worth a note.
+bool MeshFile::
+validate(const std::string &filename, u64 source_hash) const {
+  if (_size < sizeof(MeshFileHeader)) {
+    return false;
+  }
+  const MeshFileHeader *header = get_header();
+  if (header->magic != MeshFileHeader::magic_value ||
+      header->version != MeshFileHeader::current_version ||
+      header->source_hash != source_hash) {
+    return false;
+  }
+
+  size_t tables_end = sizeof(MeshFileHeader) +
+                      (size_t)header->num_arrays * sizeof(MeshFileArray) +
+                      (size_t)header->num_meshes * sizeof(MeshFileMesh);
+  bool valid = header->file_size == _size && tables_end <= _size &&
+               header->index_offset <= _size &&
+               header->index_encoded_size <= _size - header->index_offset &&
+               header->index_type <= MaterialEnums::IT_uint32;
+  for (u32 i = 0u; valid && i < header->num_arrays; ++i) {
+    const MeshFileArray &array = get_arrays()[i];
+    valid = array.offset <= _size && array.encoded_size <= _size - array.offset &&
+            (array.offset % stream_alignment) == 0u;
+  }
+  if (valid) {
+    valid = hash_bytes(_data + sizeof(MeshFileHeader), _size - sizeof(MeshFileHeader)) == header->content_hash;
+  }
+  // Coded streams are checked block by block, so decoding them can't run
+  // off their end.
+  if (valid) {
+    valid = check_stream(_data + header->index_offset, header->index_codec, MSC_index,
+                         header->index_encoded_size, header->index_size,
+                         MaterialEnums::index_type_size((MaterialEnums::IndexType)header->index_type));
+  }
+  for (u32 i = 0u; valid && i < header->num_arrays; ++i) {
+    const MeshFileArray &array = get_arrays()[i];
+    valid = check_stream(_data + array.offset, array.codec, MSC_vertex, array.encoded_size,
+                         array.size, array.row_stride);
+  }
+  if (!valid) {
+    std::cerr << "Damaged mesh file " << filename << "\n";
+    return false;
+  }
+
+  // Cooked with a vertex format layout that has since changed.
+  for (u32 i = 0u; i < header->num_arrays; ++i) {
+    const MeshFileArray &array = get_arrays()[i];
+    if (MaterialEnums::vertex_row_stride(array.format) != array.row_stride) {
+      return false;
+    }
+  }
+  return true;
+}
+
+VertexFormat MeshFile::
+get_vertex_format() const {
+  VertexFormat format;
+  for (u32 i = 0u; i < get_header()->num_arrays; ++i) {
+    format.arrays.push_back(get_arrays()[i].format);
+  }
+  return format;
+}
+
+MaterialEnums::IndexType MeshFile::
+get_index_type() const {
+  return (MaterialEnums::IndexType)get_header()->index_type;
+}
+
+// Copies the data into vertex and index data made with the file's format
+// and index type, and adds the meshes drawn from them, with their bounds.
+// Coded streams are decoded straight into the vertex and index data, with
+// the blocks of all of them split over the pool together, so that small
+// streams don't leave threads idle.
+void MeshFile::
+read(VertexData *vdata, IndexData *idata, std::vector<Mesh> &meshes,
+     ThreadPool *pool) const {
+  struct StreamDecode {
+    MeshStreamCodec codec;
+    const ubyte *data;
+    size_t num_rows;
+    size_t row_stride;
+    ubyte *out;
+    // Of the blocks of all the streams.
+    size_t first_block;
+    size_t num_blocks;
+  };
+  std::vector<StreamDecode> decodes;
+  size_t num_blocks = 0u;
+  auto read_stream = [&](u8 codec, u64 offset, u64 size, size_t row_stride,
+                         std::vector<ubyte> &out) {
+    const ubyte *begin = _data + offset;
+    if (codec == MSC_none) {
+      out.assign(begin, begin + size);
+      return;
+    }
+    out.resize(size);
+    size_t num_rows = size / row_stride;
+    size_t stream_blocks = get_mesh_codec_num_blocks(num_rows);
+    decodes.push_back({ (MeshStreamCodec)codec, begin, num_rows, row_stride, out.data(),
+                        num_blocks, stream_blocks });
+    num_blocks += stream_blocks;
+  };
+
+  const MeshFileHeader *header = get_header();
+  assert(vdata->format.arrays.size() == header->num_arrays);
+  vdata->array_buffers.resize(header->num_arrays);
+  vdata->dirty_ranges.resize(header->num_arrays);
+  for (u32 i = 0u; i < header->num_arrays; ++i) {
+    const MeshFileArray &array = get_arrays()[i];
+    read_stream(array.codec, array.offset, array.size, array.row_stride,
+                vdata->array_buffers[i]);
+  }
+  idata->type = (MaterialEnums::IndexType)header->index_type;
+  read_stream(header->index_codec, header->index_offset, header->index_size,
+              MaterialEnums::index_type_size(idata->type), idata->buffer);
+
+  parallel_for(pool, num_blocks, min_blocks_per_task, [&](size_t begin, size_t end) {
+    size_t s = 0u;
+    while (begin < end) {
+      while (decodes[s].first_block + decodes[s].num_blocks <= begin) {
+        ++s;
+      }
+      const StreamDecode &decode = decodes[s];
+      size_t stream_end = std::min(end, decode.first_block + decode.num_blocks);
+      decode_mesh_stream(decode.codec, decode.data, decode.num_rows, decode.row_stride,
+                         begin - decode.first_block, stream_end - decode.first_block,
+                         decode.out);
+      begin = stream_end;
+    }
+  });
+
+  for (u32 i = 0u; i < header->num_meshes; ++i) {
+    const MeshFileMesh &in = get_meshes()[i];
+    Mesh mesh;
+    mesh.vertex_data = vdata;
+    mesh.index_data = idata;
+    mesh.first_vertex = in.first_vertex;
+    mesh.num_vertices = in.num_vertices;
+    mesh.topology = (MaterialEnums::PrimitiveTopology)in.topology;
+    mesh.bounds.min = Vector3(in.box_min[0], in.box_min[1], in.box_min[2]);
+    mesh.bounds.max = Vector3(in.box_max[0], in.box_max[1], in.box_max[2]);
+    mesh.sphere.center = Vector3(in.sphere_center[0], in.sphere_center[1], in.sphere_center[2]);
+    mesh.sphere.radius = in.sphere_radius;
+    meshes.push_back(mesh);
+  }
+}
+
+// Writes the meshes, which must all draw from vdata and idata, to the file,
+// with the streams that compress well coded if compress is set.  The file
+// is written under another name and then renamed, so that a reader never
+// sees it half-written.
+bool MeshFile::
+write(const std::string &filename, u64 source_hash, const VertexData *vdata,
+      const IndexData *idata, const std::vector<Mesh> &meshes, bool compress) {
+  MeshFileHeader header = { };
+  header.magic = MeshFileHeader::magic_value;
+  header.version = MeshFileHeader::current_version;
+  header.source_hash = source_hash;
+  header.num_arrays = (u32)vdata->array_buffers.size();
+  header.num_meshes = (u32)meshes.size();
+  header.index_type = idata->type;
+
+  size_t offset = sizeof(MeshFileHeader) +
+                  header.num_arrays * sizeof(MeshFileArray) +
+                  header.num_meshes * sizeof(MeshFileMesh);
+  // Coded streams, empty where a stream is stored as it is.
+  std::vector<std::vector<ubyte>> encoded(header.num_arrays + 1u);
+  std::vector<MeshFileArray> arrays(header.num_arrays);
+  for (u32 i = 0u; i < header.num_arrays; ++i) {
+    MeshFileArray &array = arrays[i];
+    array.format = vdata->format.arrays[i];
+    array.row_stride = MaterialEnums::vertex_row_stride(array.format);
+    array.offset = align_up(offset, stream_alignment);
+    array.size = vdata->array_buffers[i].size();
+    array.codec = compress ? encode_stream(MSC_vertex, vdata->array_buffers[i], array.row_stride, encoded[i])
+                           : MSC_none;
+    array.encoded_size = (array.codec != MSC_none) ? encoded[i].size() : array.size;
+    offset = array.offset + array.encoded_size;
+  }
+  std::vector<ubyte> &encoded_indices = encoded[header.num_arrays];
+  header.index_offset = align_up(offset, stream_alignment);
+  header.index_size = idata->buffer.size();
+  header.index_codec = compress ? encode_stream(MSC_index, idata->buffer,
+                                                MaterialEnums::index_type_size(idata->type),
+                                                encoded_indices)
+                                : MSC_none;
+  header.index_encoded_size = (header.index_codec != MSC_none) ? encoded_indices.size()
+                                                               : header.index_size;
+  header.file_size = header.index_offset + header.index_encoded_size;
+
+  std::vector<ubyte> data(header.file_size, 0u);
+  ubyte *ptr = data.data() + sizeof(MeshFileHeader);
+  memcpy(ptr, arrays.data(), arrays.size() * sizeof(MeshFileArray));
+  ptr += arrays.size() * sizeof(MeshFileArray);
+  for (const Mesh &mesh : meshes) {
+    assert(mesh.vertex_data == vdata && mesh.index_data == idata);
+    MeshFileMesh out = { };
+    out.first_vertex = mesh.first_vertex;
+    out.num_vertices = mesh.num_vertices;
+    out.topology = mesh.topology;
+    for (int i = 0; i < 3; ++i) {
+      out.box_min[i] = mesh.bounds.min[i];
+      out.box_max[i] = mesh.bounds.max[i];
+      out.sphere_center[i] = mesh.sphere.center[i];
+    }
+    out.sphere_radius = mesh.sphere.radius;
+    memcpy(ptr, &out, sizeof(out));
+    ptr += sizeof(out);
+  }
+  for (u32 i = 0u; i < header.num_arrays; ++i) {
+    const ubyte *stream = (arrays[i].codec != MSC_none) ? encoded[i].data()
+                                                        : vdata->array_buffers[i].data();
+    memcpy(data.data() + arrays[i].offset, stream, arrays[i].encoded_size);
+  }
+  const ubyte *indices = (header.index_codec != MSC_none) ? encoded_indices.data()
+                                                          : idata->buffer.data();
+  memcpy(data.data() + header.index_offset, indices, header.index_encoded_size);
+
+  header.content_hash = hash_bytes(data.data() + sizeof(MeshFileHeader), data.size() - sizeof(MeshFileHeader));
+  memcpy(data.data(), &header, sizeof(header));
+
+  std::error_code ec;
+  std::filesystem::path parent = std::filesystem::path(filename).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent, ec);
+  }
+  // Unique per thread, in case the same source is cooked twice at once.
+  std::string temp_filename = filename + "." +
+    std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+  {
+    std::ofstream stream(temp_filename, std::ios::binary | std::ios::trunc);
+    stream.write((const char *)data.data(), data.size());
+    if (!stream.good()) {
+      std::cerr << "Failed to write mesh file " << temp_filename << "\n";
+      return false;
+    }
+  }
+  std::filesystem::rename(temp_filename, filename, ec);
+  if (ec) {
+    std::cerr << "Failed to write mesh file " << filename << ": " << ec.message() << "\n";
+    std::filesystem::remove(temp_filename, ec);
+    return false;
+  }
+  return true;
+}
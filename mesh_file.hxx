@@ -0,0 +1,120 @@
+#ifndef MESH_FILE_HXX
+#define MESH_FILE_HXX
+
+#include <string>
+#include <vector>
+
+#include "material.hxx"
+#include "mesh_codec.hxx"
+#include "numeric_types.hxx"
+
+class ThreadPool;
+
+u64 hash_bytes(const void *data, size_t size, u64 seed = 0u);
+
+// Cooked mesh file layout.  All offsets are from the start of the file,
+// and all data is in the byte order of the machine that cooked it.
+//
+//   MeshFileHeader
+//   MeshFileArray[num_arrays]
+//   MeshFileMesh[num_meshes]
+//   vertex array data, each starting on a 16-byte boundary
+//   index data, starting on a 16-byte boundary
+//
+// Vertex arrays are stored in the layout the GPU reads them in, so loading
+// is a copy of each array, without any parsing.  Or each array, and the
+// index data, is coded with one of the codecs of mesh_codec.hxx, where that
+// makes it smaller, and decoded in parallel blocks while loading.
+struct MeshFileHeader {
+  static constexpr u32 magic_value = 0x4853454du; // "MESH"
+  // Bumped whenever the layout, or the layout of a vertex format, changes.
+  static constexpr u32 current_version = 2u;
+
+  u32 magic;
+  u32 version;
+  // Hash of what the file was cooked from, which identifies it in the
+  // cache.
+  u64 source_hash;
+  // Hash of everything after the header.
+  u64 content_hash;
+  u64 file_size;
+  u32 num_arrays;
+  u32 num_meshes;
+  u64 index_offset;
+  u64 index_size;
+  // Bytes the index data takes in the file, coded with index_codec.
+  u64 index_encoded_size;
+  u8 index_type;
+  u8 index_codec;
+  u8 pad[6];
+};
+
+struct MeshFileArray {
+  MaterialEnums::VertexArrayFormat format;
+  // Checked against the stride the format has when loading.
+  u32 row_stride;
+  u64 offset;
+  u64 size;
+  // Bytes the array takes in the file, coded with codec.
+  u64 encoded_size;
+  u8 codec;
+  u8 pad[7];
+};
+
+struct MeshFileMesh {
+  u32 first_vertex;
+  u32 num_vertices;
+  u8 topology;
+  u8 pad[3];
+  float box_min[3];
+  float box_max[3];
+  float sphere_center[3];
+  float sphere_radius;
+};
+
+// A cooked mesh file, mapped into memory.  Holds one vertex data and one
+// index data, and the meshes drawn from them.
+class MeshFile {
+public:
+  MeshFile() = default;
+  MeshFile(const MeshFile &) = delete;
+  MeshFile &operator = (const MeshFile &) = delete;
+  ~MeshFile();
+
+  bool open(const std::string &filename, u64 source_hash);
+  void close();
+
+  VertexFormat get_vertex_format() const;
+  MaterialEnums::IndexType get_index_type() const;
+  void read(VertexData *vdata, IndexData *idata, std::vector<Mesh> &meshes,
+            ThreadPool *pool = nullptr) const;
+
+  static bool write(const std::string &filename, u64 source_hash,
+                    const VertexData *vdata, const IndexData *idata,
+                    const std::vector<Mesh> &meshes, bool compress = true);
+
+private:
+  bool validate(const std::string &filename, u64 source_hash) const;
+
+  inline const MeshFileHeader *get_header() const {
+    return (const MeshFileHeader *)_data;
+  }
+  inline const MeshFileArray *get_arrays() const {
+    return (const MeshFileArray *)(_data + sizeof(MeshFileHeader));
+  }
+  inline const MeshFileMesh *get_meshes() const {
+    return (const MeshFileMesh *)(get_arrays() + get_header()->num_arrays);
+  }
+
+private:
+  // Handles of the file and its mapping on Windows, the descriptor of the
+  // file elsewhere.
+  void *_file = nullptr;
+  void *_mapping = nullptr;
+  int _fd = -1;
+
+  const ubyte *_data = nullptr;
+  size_t _size = 0u;
+};
+
+#endif // MESH_FILE_HXX
@@ -0,0 +1,67 @@
+#ifndef MPSC_QUEUE_HXX
+#define MPSC_QUEUE_HXX
+
+#include <atomic>
+#include <utility>
+
+// Unbounded queue that any number of threads push to and a single thread
+// pops from, after Vyukov's intrusive MPSC queue.
+//
+// Pushing is one atomic exchange and never waits on other threads.  Popping
+// never takes a lock either, but may find the queue empty while a push is
+// halfway done, until that push links its node in; the value is popped by a
+// later call.  Nodes are allocated per value, which is fine for the rate
+// things are handed between threads at.
+template<class T>
+class MpscQueue {
+public:
+  MpscQueue() {
+    _tail = new Node;
+    _head.store(_tail, std::memory_order_relaxed);
+  }
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator = (const MpscQueue &) = delete;
+
+  // Values still queued are destroyed.  No thread may push anymore.
+  ~MpscQueue() {
+    while (_tail != nullptr) {
+      Node *next = _tail->next.load(std::memory_order_relaxed);
+      delete _tail;
+      _tail = next;
+    }
+  }
+
+  // Any thread.
+  inline void push(T value) {
+    Node *node = new Node;
+    node->value = std::move(value);
+    Node *prev = _head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Consumer only.  Returns false if there is nothing to pop yet.
+  inline bool pop(T &value) {
+    Node *next = _tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    // The node popped becomes the new stub, its value moved out.
+    value = std::move(next->value);
+    delete _tail;
+    _tail = next;
+    return true;
+  }
+
+private:
+  struct Node {
+    std::atomic<Node *> next { nullptr };
+    T value { };
+  };
+
+  // Last node pushed, shared by producers.
+  alignas(64) std::atomic<Node *> _head;
+  // Stub node before the first value, owned by the consumer.
+  alignas(64) Node *_tail;
+};
+
+#endif // MPSC_QUEUE_HXX
@@ -1,6 +1,7 @@
 #ifndef NUMERIC_TYPES_HXX
 #define NUMERIC_TYPES_HXX
 
+#include <cstddef>
 #include <cstdint>
 
 typedef uint64_t u64;
@@ -1,17 +1,36 @@
 #include "obj_reader.hxx"
+#include "thread_pool.hxx"
 
+#include <algorithm>
+#include <iostream>
+#include <iterator>
 #include <sstream>
 
-std::string get_line(const std::string &data, int &offset) {
+// Files are parsed in chunks of at least this many bytes.
+static constexpr size_t min_chunk_size = 64u * 1024u;
+
+// What one chunk of the file contains.  Indices in faces are absolute, so
+// the chunks only have to be appended to each other, except for faces
+// that come before the chunk's first object, which belong to the last
+// object of the chunks before it.
+struct ObjChunk {
+  std::vector<ObjFace> leading_faces;
+  std::vector<ObjObject> objects;
+  std::vector<std::array<float, 4>> vertex;
+  std::vector<std::array<float, 3>> normal;
+  std::vector<std::array<float, 2>> texcoord;
+};
+
+std::string get_line(const std::string &data, size_t &offset, size_t end) {
   std::ostringstream ss;
 
   bool in_comment = false;
 
-  for (; offset < data.size(); ++offset) {
+  for (; offset < end; ++offset) {
     if (data[offset] == '\n') {
       offset++;
       break;
-    } else if (data[offset] == '\r' && (offset + 1) < data.size() &&
+    } else if (data[offset] == '\r' && (offset + 1) < end &&
                data[offset + 1] == '\n') {
       offset += 2;
       break;
@@ -44,13 +63,19 @@ std::vector<std::string> get_words(const std::string &line, char sep = ' ') {
   return words;
 }
 
-ObjReader::ObjReader(const std::string &data) {
-  int offset = 0;
+// Parses the lines in [begin, end) of data.
+static void
+parse_chunk(const std::string &data, size_t begin, size_t end, ObjChunk &chunk) {
+  size_t offset = begin;
   std::string line;
-  ObjObject *curr_object = nullptr;
-
-  while (offset < data.size()) {
-    line = get_line(data, offset);
+  std::vector<ObjFace> *curr_faces = &chunk.leading_faces;
+  std::vector<ObjObject> &objects = chunk.objects;
+  std::vector<std::array<float, 4>> &vertex = chunk.vertex;
+  std::vector<std::array<float, 3>> &normal = chunk.normal;
+  std::vector<std::array<float, 2>> &texcoord = chunk.texcoord;
+
+  while (offset < end) {
+    line = get_line(data, offset, end);
     std::vector<std::string> words = get_words(line);
     if (words.size() == 0u) {
       continue;
@@ -62,7 +87,7 @@ ObjReader::ObjReader(const std::string &data) {
       ObjObject obj;
       obj.name = words[1];
       objects.push_back(obj);
-      curr_object = &objects[objects.size() - 1u];
+      curr_faces = &objects[objects.size() - 1u].faces;
 
     } else if (cmd == "v") {
       std::array<float, 4> v = { 0.0f, 0.0f, 0.0f, 1.0f };
@@ -104,7 +129,53 @@ ObjReader::ObjReader(const std::string &data) {
         fv.normal = norm_index;
         f.verts.push_back(fv);
       }
-      curr_object->faces.push_back(f);
+      curr_faces->push_back(f);
+    }
+  }
+}
+
+// Returns where the line that offset is in ends, past its newline.
+static size_t
+find_line_end(const std::string &data, size_t offset) {
+  size_t newline = data.find('\n', offset);
+  return (newline == std::string::npos) ? data.size() : newline + 1u;
+}
+
+// Parses data, in chunks of whole lines on the pool if there is one.
+ObjReader::ObjReader(const std::string &data, ThreadPool *pool) {
+  size_t num_threads = (pool != nullptr) ? (size_t)pool->get_num_threads() + 1u : 1u;
+  size_t chunk_size = data.size();
+  if (num_threads > 1u) {
+    // Several chunks per thread, so that they even out.
+    chunk_size = std::max(min_chunk_size, data.size() / (num_threads * 4u));
+  }
+  std::vector<size_t> chunk_begins = { 0u };
+  while (chunk_begins.back() < data.size()) {
+    chunk_begins.push_back(find_line_end(data, chunk_begins.back() + chunk_size));
+  }
+  size_t num_chunks = chunk_begins.size() - 1u;
+
+  std::vector<ObjChunk> chunks(num_chunks);
+  parallel_for(pool, num_chunks, 1u, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      parse_chunk(data, chunk_begins[i], chunk_begins[i + 1u], chunks[i]);
+    }
+  });
+
+  for (ObjChunk &chunk : chunks) {
+    if (!chunk.leading_faces.empty()) {
+      if (!objects.empty()) {
+        std::vector<ObjFace> &faces = objects.back().faces;
+        faces.insert(faces.end(), std::make_move_iterator(chunk.leading_faces.begin()),
+                     std::make_move_iterator(chunk.leading_faces.end()));
+      } else {
+        std::cerr << "OBJ faces before the first object, ignored" << std::endl;
+      }
     }
+    objects.insert(objects.end(), std::make_move_iterator(chunk.objects.begin()),
+                   std::make_move_iterator(chunk.objects.end()));
+    vertex.insert(vertex.end(), chunk.vertex.begin(), chunk.vertex.end());
+    normal.insert(normal.end(), chunk.normal.begin(), chunk.normal.end());
+    texcoord.insert(texcoord.end(), chunk.texcoord.begin(), chunk.texcoord.end());
   }
 }
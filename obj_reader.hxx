@@ -20,9 +20,11 @@ struct ObjObject {
   std::vector<ObjFace> faces;
 };
 
+class ThreadPool;
+
 class ObjReader {
 public:
-  ObjReader(const std::string &data);
+  ObjReader(const std::string &data, ThreadPool *pool = nullptr);
 
 public:
   std::vector<ObjObject> objects;
@@ -0,0 +1,213 @@
+#include "render_queue.hxx"
+#include "renderer.hxx"
+
+#include <bit>
+#include <string.h>
+
+void RenderQueue::
+clear() {
+  _items.clear();
+  _entries.clear();
+}
+
+// Queues a mesh for drawing this frame.  depth is the view-space distance
+// of the mesh from the camera, which orders draws within their pass.
+void RenderQueue::
+add_mesh(const Mesh *mesh, const Material *material, float depth,
+         const Matrix4x4 *transform) {
+  const void *pipeline = nullptr;
+  if (material != nullptr) {
+    // The fixed state of a material is what determines its pipeline.
+    pipeline = material->get_static_data();
+  }
+
+  Entry entry;
+  entry.key = make_key(get_render_pass(material),
+                       get_state_id(pipeline, pipeline_bits),
+                       get_state_id(material, material_bits),
+                       get_state_id(mesh->vertex_data, vertex_buffer_bits),
+                       get_state_id(mesh, mesh_bits),
+                       depth);
+  entry.payload = (u32)_items.size();
+  _entries.push_back(entry);
+
+  Item item;
+  item.mesh = mesh;
+  item.material = material;
+  item.transform = transform;
+  _items.push_back(item);
+}
+
+// Orders the queued draws by key with an LSD radix sort, one byte per pass.
+// Passes over bytes that are the same for every key are skipped, which is
+// common since most scenes only use a handful of pipelines and materials.
+void RenderQueue::
+sort() {
+  size_t count = _entries.size();
+  if (count <= 1u) {
+    return;
+  }
+
+  _sort_scratch.resize(count);
+  Entry *src = _entries.data();
+  Entry *dst = _sort_scratch.data();
+
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t histogram[256] = { };
+    for (size_t i = 0; i < count; ++i) {
+      histogram[(src[i].key >> shift) & 0xff]++;
+    }
+    if (histogram[(src[0].key >> shift) & 0xff] == count) {
+      // Every key has the same byte here.
+      continue;
+    }
+
+    size_t offset = 0u;
+    for (int i = 0; i < 256; ++i) {
+      size_t bucket_count = histogram[i];
+      histogram[i] = offset;
+      offset += bucket_count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      dst[histogram[(src[i].key >> shift) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+
+  if (src != _entries.data()) {
+    memcpy(_entries.data(), src, count * sizeof(Entry));
+  }
+}
+
+// Records the queued draws in sorted order.  If parallel is true, the draws
+// are recorded with RendererVk::draw_meshes_parallel(), which requires the
+// surface to have been begun with secondary contents.
+void RenderQueue::
+execute(RendererVk *render, bool parallel) {
+  build_batches();
+
+  if (parallel) {
+    render->draw_meshes_parallel(_sorted_meshes.data(), _sorted_transforms.data(),
+                                 _sorted_meshes.size(), _instance_counts.data());
+    return;
+  }
+
+  for (size_t i = 0; i < _sorted_meshes.size(); ++i) {
+    if (_instance_counts[i] > 1u) {
+      render->draw_mesh_instanced(_sorted_meshes[i], _sorted_transforms[i],
+                                  _instance_counts[i]);
+    } else {
+      render->draw_mesh(_sorted_meshes[i], _sorted_transforms[i]);
+    }
+  }
+}
+
+// Turns the sorted items into batches.  Consecutive items with the same mesh
+// and material are merged, as long as they all have a transform, since the
+// default model matrix can't go in the instance stream.  Merging only
+// consecutive items keeps the draw order the sort came up with.
+void RenderQueue::
+build_batches() {
+  _sorted_meshes.clear();
+  _sorted_transforms.clear();
+  _instance_counts.clear();
+  _instance_transforms.clear();
+
+  size_t count = _entries.size();
+  size_t i = 0u;
+  while (i < count) {
+    const Item &first = _items[_entries[i].payload];
+    size_t end = i + 1u;
+    if (first.transform != nullptr) {
+      while (end < count) {
+        const Item &item = _items[_entries[end].payload];
+        if (item.mesh != first.mesh || item.material != first.material ||
+            item.transform == nullptr) {
+          break;
+        }
+        ++end;
+      }
+    }
+
+    _sorted_meshes.push_back(first.mesh);
+    _instance_counts.push_back((uint32_t)(end - i));
+    if (end - i > 1u) {
+      // Pointed at the transforms below, once the vector stopped growing.
+      _sorted_transforms.push_back(nullptr);
+      for (; i < end; ++i) {
+        _instance_transforms.push_back(*_items[_entries[i].payload].transform);
+      }
+    } else {
+      _sorted_transforms.push_back(first.transform);
+      ++i;
+    }
+  }
+
+  const Matrix4x4 *next = _instance_transforms.data();
+  for (size_t b = 0; b < _sorted_meshes.size(); ++b) {
+    if (_instance_counts[b] > 1u) {
+      _sorted_transforms[b] = next;
+      next += _instance_counts[b];
+    }
+  }
+}
+
+RenderQueue::RenderPass RenderQueue::
+get_render_pass(const Material *material) {
+  if (material == nullptr) {
+    return RP_opaque;
+  }
+  switch (material->get_static_data()->_transparency) {
+  case MaterialEnums::TM_alpha_blend:
+    return RP_transparent;
+  case MaterialEnums::TM_alpha_test:
+    return RP_alpha_test;
+  default:
+    return RP_opaque;
+  }
+}
+
+u64 RenderQueue::
+make_key(RenderPass pass, u32 pipeline, u32 material, u32 vertex_buffer,
+         u32 mesh, float depth) {
+  // Non-negative IEEE floats order the same as their bit patterns, so the
+  // top bits of the float make a monotonic fixed-width depth.
+  depth = std::max(depth, 0.0f);
+  u64 depth_key = std::bit_cast<u32>(depth) >> (32 - depth_bits);
+
+  u64 state_key = ((u64)pipeline << (material_bits + vertex_buffer_bits + mesh_bits)) |
+                  ((u64)material << (vertex_buffer_bits + mesh_bits)) |
+                  ((u64)vertex_buffer << mesh_bits) |
+                  (u64)mesh;
+  constexpr int state_bits = pipeline_bits + material_bits + vertex_buffer_bits + mesh_bits;
+  constexpr int pass_shift = 64 - pass_bits;
+  static_assert(pass_bits + state_bits + depth_bits == 64, "Key fields must fill 64 bits");
+
+  u64 key = (u64)pass << pass_shift;
+  if (pass == RP_transparent) {
+    // Back-to-front: farther draws must come first.
+    depth_key = ~depth_key & ((1u << depth_bits) - 1u);
+    key |= depth_key << (pass_shift - depth_bits);
+    key |= state_key << (pass_shift - depth_bits - state_bits);
+  } else {
+    // State first, then front-to-back.
+    key |= state_key << (pass_shift - state_bits);
+    key |= depth_key << (pass_shift - state_bits - depth_bits);
+  }
+  return key;
+}
+
+// Returns a small id for the given state object, masked to the number of
+// key bits available for it.  Ids are stable across frames.  If there are
+// more objects than ids, some share an id, which only costs sort quality.
+u32 RenderQueue::
+get_state_id(const void *ptr, int bits) {
+  if (ptr == nullptr) {
+    return 0u;
+  }
+  auto it = _state_ids.find(ptr);
+  if (it == _state_ids.end()) {
+    it = _state_ids.insert({ ptr, (u32)_state_ids.size() + 1u }).first;
+  }
+  return it->second & ((1u << bits) - 1u);
+}
@@ -0,0 +1,95 @@
+#ifndef RENDER_QUEUE_HXX
+#define RENDER_QUEUE_HXX
+
+#include <vector>
+#include <unordered_map>
+
+#include "material.hxx"
+#include "linmath.hxx"
+
+class RendererVk;
+
+// Collects the draws of a frame as 64-bit sort keys and submits them to the
+// renderer in key order instead of submission order.
+//
+// Opaque and alpha-tested draws are keyed state-first (pipeline, material,
+// vertex buffer) and then front-to-back, which keeps state changes to a
+// minimum while still getting early depth rejection inside each state
+// bucket.  Transparent draws are keyed back-to-front first so blending
+// composites correctly, with state only breaking ties.
+//
+// Runs of consecutive sorted draws of the same mesh and material, each with
+// its own transform, are merged into a single instanced draw.
+class RenderQueue {
+public:
+  enum RenderPass : uint8_t {
+    RP_opaque,
+    RP_alpha_test,
+    RP_transparent,
+  };
+
+  // Key layout for opaque/alpha-tested draws, from the most significant bit:
+  //   pass:2 | pipeline:10 | material:12 | vertex buffer:10 | mesh:10 | depth:20
+  // Key layout for transparent draws:
+  //   pass:2 | inverted depth:20 | pipeline:10 | material:12 | vertex buffer:10 | mesh:10
+  //
+  // The mesh is part of the state, so that the draws of one mesh sort next
+  // to each other and can be instanced, even where meshes share a vertex
+  // buffer and material.
+  static constexpr int pass_bits = 2;
+  static constexpr int pipeline_bits = 10;
+  static constexpr int material_bits = 12;
+  static constexpr int vertex_buffer_bits = 10;
+  static constexpr int mesh_bits = 10;
+  static constexpr int depth_bits = 20;
+
+  struct Item {
+    const Mesh *mesh;
+    const Material *material;
+    // Model matrix, or null for the renderer's default.
+    const Matrix4x4 *transform;
+  };
+
+  void clear();
+
+  void add_mesh(const Mesh *mesh, const Material *material, float depth,
+                const Matrix4x4 *transform = nullptr);
+
+  void sort();
+  void execute(RendererVk *render, bool parallel = false);
+
+  inline size_t get_num_items() const { return _entries.size(); }
+  // Valid after sort(); returns the items in draw order.
+  inline const Item &get_sorted_item(size_t n) const { return _items[_entries[n].payload]; }
+
+  static RenderPass get_render_pass(const Material *material);
+  static u64 make_key(RenderPass pass, u32 pipeline, u32 material,
+                      u32 vertex_buffer, u32 mesh, float depth);
+
+private:
+  u32 get_state_id(const void *ptr, int bits);
+  void build_batches();
+
+private:
+  struct Entry {
+    u64 key;
+    u32 payload;
+  };
+
+  std::vector<Item> _items;
+  std::vector<Entry> _entries;
+  // Ping-pong buffer for the radix sort, kept around between frames.
+  std::vector<Entry> _sort_scratch;
+  // Sorted draws handed to the renderer, one per batch.  A batch with an
+  // instance count above 1 has its transforms in _instance_transforms.
+  std::vector<const Mesh *> _sorted_meshes;
+  std::vector<const Matrix4x4 *> _sorted_transforms;
+  std::vector<uint32_t> _instance_counts;
+  std::vector<Matrix4x4> _instance_transforms;
+
+  // Compact ids handed out to pipeline/material/buffer/mesh pointers, so they
+  // fit in the few bits the key has for them.
+  std::unordered_map<const void *, u32> _state_ids;
+};
+
+#endif // RENDER_QUEUE_HXX
@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <fstream>
+#include <thread>
 
 #define VMA_IMPLEMENTATION
 #include "vma/vk_mem_alloc.h"
@@ -87,7 +88,15 @@ VkIndexType get_vk_index_type(MaterialEnums::IndexType type) {
 
 // Initialize vulkan.
 bool RendererVk::
-initialize(WindowHandle hwnd) {
+initialize(WindowHandle hwnd, const RendererOptionsVk &options) {
+  _options = options;
+  _num_frames = std::clamp(options.num_frames_in_flight, 1u, _max_frames);
+  if (_num_frames != options.num_frames_in_flight) {
+    std::cerr << "Clamped frames in flight from " << options.num_frames_in_flight
+              << " to " << _num_frames << "\n";
+  }
+  _options.num_frames_in_flight = _num_frames;
+
   VkApplicationInfo app_info = {
     VK_STRUCTURE_TYPE_APPLICATION_INFO,
     nullptr,
@@ -102,8 +111,9 @@ initialize(WindowHandle hwnd) {
 #else
 #pragma error("don't know vk surf extension name for this platform")
 #endif
-  const char *extension_names[] = { VK_KHR_SURFACE_EXTENSION_NAME, PLAT_SURFACE_EXT_NAME, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME };
-  uint32_t extension_count = 3;
+  // Headless, there is no surface, and only the first one is needed.
+  const char *extension_names[] = { VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME, VK_KHR_SURFACE_EXTENSION_NAME, PLAT_SURFACE_EXT_NAME };
+  uint32_t extension_count = _options.headless ? 1 : 3;
   VkInstanceCreateInfo create_info = {
     VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
     nullptr,
@@ -128,19 +138,21 @@ initialize(WindowHandle hwnd) {
   }
 
 #ifdef _WIN32
-  VkWin32SurfaceCreateInfoKHR surf_info = { };
-  surf_info.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
-  surf_info.pNext = nullptr;
-  surf_info.flags = 0;
-  surf_info.hwnd = hwnd;
-  surf_info.hinstance = GetModuleHandle(nullptr);
-  result = vkCreateWin32SurfaceKHR(_instance, &surf_info, nullptr, &_surface);
-  if (result != VK_SUCCESS) {
-    std::cerr << "Failed to create win32 vulkan surface\n";
-    return false;
-  }
+  if (!_options.headless) {
+    VkWin32SurfaceCreateInfoKHR surf_info = { };
+    surf_info.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
+    surf_info.pNext = nullptr;
+    surf_info.flags = 0;
+    surf_info.hwnd = hwnd;
+    surf_info.hinstance = GetModuleHandle(nullptr);
+    result = vkCreateWin32SurfaceKHR(_instance, &surf_info, nullptr, &_surface);
+    if (result != VK_SUCCESS) {
+      std::cerr << "Failed to create win32 vulkan surface\n";
+      return false;
+    }
 
-  std::cerr << "Win32 surface created\n";
+    std::cerr << "Win32 surface created\n";
+  }
 #endif
 
   if (!create_queues()) {
@@ -169,10 +181,20 @@ initialize(WindowHandle hwnd) {
     return false;
   }
 
+  if (!create_record_command_buffers()) {
+    return false;
+  }
+
   if (!init_temp()) {
     return false;
   }
 
+  if (_supports_depth_pyramid && !create_depth_pyramid_pipeline()) {
+    // Only occlusion culling needs it.
+    std::cerr << "No depth pyramid, occlusion culling is unavailable\n";
+    _supports_depth_pyramid = false;
+  }
+
   _frame_cycle_index = 0;
   update_frame_objects();
 
@@ -186,17 +208,34 @@ struct CamParams {
 };
 CamParams cam_params;
 
-VkBuffer vk_cam_params_buf = nullptr;
-VmaAllocation vk_cam_params_alloc = nullptr;
 VkDescriptorSetLayout vk_desc_set_layout = nullptr;
 VkPipelineLayout vk_pipeline_layout = nullptr;
 VkPipeline vk_pipeline = nullptr;
+// Same as vk_pipeline, but takes the model matrix from a per-instance
+// vertex stream.
+VkPipeline vk_instanced_pipeline = nullptr;
 VkDescriptorPool vk_desc_pool = nullptr;
 VkDescriptorSet vk_desc_set = nullptr;
 VkDescriptorBufferInfo cam_params_desc_buf_info;
 
 VkShaderModule vk_vtx_module = nullptr;
 VkShaderModule vk_frag_module = nullptr;
+VkShaderModule vk_instanced_vtx_module = nullptr;
+
+// Vertex input of meshes: a single interleaved array of position, texcoord
+// and normal.
+static const VkVertexInputBindingDescription mesh_vertex_binding = {
+  0, sizeof(float) * 8, VK_VERTEX_INPUT_RATE_VERTEX
+};
+static const VkVertexInputAttributeDescription mesh_vertex_attribs[3] = {
+  { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
+  { 2, 0, VK_FORMAT_R32G32B32_SFLOAT, 20 },
+  { 1, 0, VK_FORMAT_R32G32_SFLOAT, 12 },
+};
+
+// Vertex binding of the per-instance transforms.  The pipelines only take
+// a single interleaved vertex array, which goes in binding 0.
+static constexpr uint32_t instance_binding = 1u;
 
 bool RendererVk::
 init_temp() {
@@ -208,36 +247,24 @@ init_temp() {
   cam_params.view_mat = Matrix4x4::identity();
   cam_params.view_mat.set_cell(3, 2, 0.0f);
   cam_params.view_mat.set_cell(3, 1, -100.0f);
-  cam_params.view_mat.invert();
+  cam_params.view_mat.invert_affine();
   cam_params.proj_mat = Matrix4x4::make_perspective_projection(0.942478f, (float)_surface_extents.width / (float)_surface_extents.height, 1.0f, 500.0f);
 
-  VkBufferCreateInfo ub_info = { };
-  ub_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  ub_info.pNext = nullptr;
-  ub_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-  ub_info.size = sizeof(CamParams);
-  ub_info.queueFamilyIndexCount = 0;
-  ub_info.pQueueFamilyIndices = nullptr;
-  ub_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  ub_info.flags = 0;
-  VmaAllocationCreateInfo ub_alloc_info = { };
-  ub_alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-  result = vmaCreateBuffer(_alloc, &ub_info, &ub_alloc_info, &vk_cam_params_buf, &vk_cam_params_alloc, nullptr);
-  if (result != VK_SUCCESS) {
-    std::cerr << "Failed to create uniform buffer\n";
+  // The camera parameters are written per draw into the uniform ring, the
+  // descriptor covers one block and is moved around with dynamic offsets.
+  size_t ubo_alignment = _physical_device_properties[_device_index].limits.minUniformBufferOffsetAlignment;
+  if (!_uniform_ring.initialize(_alloc, _options.uniform_ring_size, _num_frames, ubo_alignment)) {
+    std::cerr << "Failed to create uniform ring\n";
     return false;
   }
-  cam_params_desc_buf_info.buffer = vk_cam_params_buf;
-  cam_params_desc_buf_info.offset = 0;
-  cam_params_desc_buf_info.range = sizeof(CamParams);
-  unsigned char *data = nullptr;
-  result = vmaMapMemory(_alloc, vk_cam_params_alloc, (void **)&data);
-  if (result != VK_SUCCESS) {
-    std::cerr << "Failed to map ub memory\n";
+  if (!_instance_ring.initialize(_alloc, _options.instance_ring_size, _num_frames,
+                                 16u, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)) {
+    std::cerr << "Failed to create instance ring\n";
     return false;
   }
-  memcpy(data, (const void *)&cam_params, sizeof(CamParams));
-  vmaUnmapMemory(_alloc, vk_cam_params_alloc);
+  cam_params_desc_buf_info.buffer = _uniform_ring.get_buffer();
+  cam_params_desc_buf_info.offset = 0;
+  cam_params_desc_buf_info.range = sizeof(CamParams);
 
   std::cerr << "Uniform buffer set up\n";
 
@@ -246,7 +273,7 @@ init_temp() {
 
   VkDescriptorSetLayoutBinding layout_binding = { };
   layout_binding.binding = 0;
-  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   layout_binding.descriptorCount = 1;
   layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
   layout_binding.pImmutableSamplers = nullptr;
@@ -264,12 +291,8 @@ init_temp() {
   VkPipelineLayoutCreateInfo pipeline_layout_create_info = { };
   pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   pipeline_layout_create_info.pNext = nullptr;
-  VkPushConstantRange pcr = {};
-  pcr.size = sizeof(Matrix4x4);
-  pcr.offset = 0;
-  pcr.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-  pipeline_layout_create_info.pushConstantRangeCount = 1;
-  pipeline_layout_create_info.pPushConstantRanges = &pcr;
+  pipeline_layout_create_info.pushConstantRangeCount = 0;
+  pipeline_layout_create_info.pPushConstantRanges = nullptr;
   pipeline_layout_create_info.setLayoutCount = 1;
   pipeline_layout_create_info.pSetLayouts = &vk_desc_set_layout;
   result = vkCreatePipelineLayout(_device, &pipeline_layout_create_info, nullptr, &vk_pipeline_layout);
@@ -278,7 +301,7 @@ init_temp() {
   }
 
   VkDescriptorPoolSize type_count[1];
-  type_count[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  type_count[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   type_count[0].descriptorCount = 1;
 
   VkDescriptorPoolCreateInfo descriptor_pool = { };
@@ -310,7 +333,7 @@ init_temp() {
   dswrite.pNext = nullptr;
   dswrite.dstSet = vk_desc_set;
   dswrite.descriptorCount = 1;
-  dswrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  dswrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   dswrite.pBufferInfo = &cam_params_desc_buf_info;
   dswrite.dstArrayElement = 0;
   dswrite.dstBinding = 0;
@@ -318,41 +341,73 @@ init_temp() {
 
   vk_vtx_module = make_shader_module(read_binary_file("shaders\\simple.vert.spirv"));
   vk_frag_module = make_shader_module(read_binary_file("shaders\\simple.frag.spirv"));
+  vk_instanced_vtx_module = make_shader_module(read_binary_file("shaders\\instanced.vert.spirv"));
 
   std::cerr << "Loaded vertex and fragment shaders\n";
 
-  VkVertexInputBindingDescription vi_binding = { };
-  vi_binding.binding = 0;
-  vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-  vi_binding.stride = sizeof(float) * 8;
-  VkVertexInputAttributeDescription vi_attribs[3];
-  vi_attribs[0].binding = 0;
-  vi_attribs[0].location = 0;
-  vi_attribs[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-  vi_attribs[0].offset = 0;
-  vi_attribs[1].binding = 0;
-  vi_attribs[1].location = 2;
-  vi_attribs[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-  vi_attribs[1].offset = 20;
-  vi_attribs[2].binding = 0;
-  vi_attribs[2].location = 1;
-  vi_attribs[2].format = VK_FORMAT_R32G32_SFLOAT;
-  vi_attribs[2].offset = 12;
-
-
-  // PIPELINE
+  if (!create_mesh_pipeline(vk_pipeline_layout, vk_vtx_module, vk_frag_module, nullptr, vk_pipeline)) {
+    return false;
+  }
+  std::cerr << "Pipeline created!\n";
+
+  // The instanced variant adds a per-instance stream with the model matrix,
+  // one vec4 attribute per matrix row.
+  VkVertexInputBindingDescription inst_bindings[2];
+  inst_bindings[0] = mesh_vertex_binding;
+  inst_bindings[1].binding = instance_binding;
+  inst_bindings[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+  inst_bindings[1].stride = sizeof(Matrix4x4);
+  VkVertexInputAttributeDescription inst_attribs[7];
+  for (int i = 0; i < 3; ++i) {
+    inst_attribs[i] = mesh_vertex_attribs[i];
+  }
+  for (int i = 0; i < 4; ++i) {
+    inst_attribs[3 + i].binding = instance_binding;
+    inst_attribs[3 + i].location = 3 + i;
+    inst_attribs[3 + i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    inst_attribs[3 + i].offset = sizeof(float) * 4 * i;
+  }
+  VkPipelineVertexInputStateCreateInfo vi = { };
+  vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vi.flags = 0;
+  vi.vertexBindingDescriptionCount = 2;
+  vi.pVertexBindingDescriptions = inst_bindings;
+  vi.vertexAttributeDescriptionCount = 7;
+  vi.pVertexAttributeDescriptions = inst_attribs;
+  if (!create_mesh_pipeline(vk_pipeline_layout, vk_instanced_vtx_module, vk_frag_module, &vi, vk_instanced_pipeline)) {
+    return false;
+  }
+  std::cerr << "Instanced pipeline created!\n";
+
+  return true;
+}
+
+// Creates a graphics pipeline with the fixed state shared by all pipelines
+// that draw meshes to the surface, using the given layout and shaders.  If
+// vi is null, the pipeline takes the regular mesh vertex input.
+bool RendererVk::
+create_mesh_pipeline(VkPipelineLayout layout, VkShaderModule vtx_module,
+                     VkShaderModule frag_module,
+                     const VkPipelineVertexInputStateCreateInfo *vi,
+                     VkPipeline &pipeline_out) {
+  VkResult result;
+
+  VkPipelineVertexInputStateCreateInfo mesh_vi = { };
+  mesh_vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  mesh_vi.flags = 0;
+  mesh_vi.vertexBindingDescriptionCount = 1;
+  mesh_vi.pVertexBindingDescriptions = &mesh_vertex_binding;
+  mesh_vi.vertexAttributeDescriptionCount = 3;
+  mesh_vi.pVertexAttributeDescriptions = mesh_vertex_attribs;
+  if (vi == nullptr) {
+    vi = &mesh_vi;
+  }
+
   VkDynamicState dynamic_states[2];
   VkPipelineDynamicStateCreateInfo dynamic = { };
   dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
   dynamic.pDynamicStates = dynamic_states;
   dynamic.dynamicStateCount = 0;
-  VkPipelineVertexInputStateCreateInfo vi = { };
-  vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vi.flags = 0;
-  vi.vertexBindingDescriptionCount = 1;
-  vi.pVertexBindingDescriptions = &vi_binding;
-  vi.vertexAttributeDescriptionCount = 3;
-  vi.pVertexAttributeDescriptions = vi_attribs;
   VkPipelineInputAssemblyStateCreateInfo ia = { };
   ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
   ia.pNext = nullptr;
@@ -429,14 +484,14 @@ init_temp() {
   shader_stages[0].pSpecializationInfo = nullptr;
   shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
   shader_stages[0].pName = "main";
-  shader_stages[0].module = vk_vtx_module;
+  shader_stages[0].module = vtx_module;
   shader_stages[0].flags = 0;
   shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   shader_stages[1].pNext = nullptr;
   shader_stages[1].pSpecializationInfo = nullptr;
   shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
   shader_stages[1].pName = "main";
-  shader_stages[1].module = vk_frag_module;
+  shader_stages[1].module = frag_module;
   shader_stages[1].flags = 0;
   VkPipelineRenderingCreateInfo r_info = { };
   r_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
@@ -449,11 +504,11 @@ init_temp() {
   VkGraphicsPipelineCreateInfo pipeline = { };
   pipeline.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   pipeline.pNext = &r_info;
-  pipeline.layout = vk_pipeline_layout;
+  pipeline.layout = layout;
   pipeline.basePipelineHandle = VK_NULL_HANDLE;
   pipeline.basePipelineIndex = 0;
   pipeline.flags = 0;
-  pipeline.pVertexInputState = &vi;
+  pipeline.pVertexInputState = vi;
   pipeline.pInputAssemblyState = &ia;
   pipeline.pRasterizationState = &rs;
   pipeline.pColorBlendState = &cb;
@@ -466,13 +521,31 @@ init_temp() {
   pipeline.stageCount = 2;
   pipeline.renderPass = nullptr;
   pipeline.subpass = 0;
-  result = vkCreateGraphicsPipelines(_device, nullptr, 1, &pipeline, nullptr, &vk_pipeline);
-  if (!vk_error_check(result, "create pipeline")) {
-    return false;
-  }
-  std::cerr << "Pipeline created!\n";
+  result = vkCreateGraphicsPipelines(_device, nullptr, 1, &pipeline, nullptr, &pipeline_out);
+  return vk_error_check(result, "create pipeline");
+}
 
-  return true;
+// Returns the model matrix of draws that don't have a transform.
+const Matrix4x4 &RendererVk::
+get_default_model_matrix() const {
+  return cam_params.model_mat;
+}
+
+const Matrix4x4 &RendererVk::
+get_view_matrix() const {
+  return cam_params.view_mat;
+}
+
+const Matrix4x4 &RendererVk::
+get_projection_matrix() const {
+  return cam_params.proj_mat;
+}
+
+// Updates the projection matrix for the current aspect ratio of the surface.
+// Draws recorded from now on pick it up.
+void RendererVk::
+update_surface_projection() {
+  cam_params.proj_mat = Matrix4x4::make_perspective_projection(0.942478f, (float)_surface_extents.width / (float)_surface_extents.height, 1.0f, 500.0f);
 }
 
 bool RendererVk::
@@ -498,11 +571,19 @@ create_command_buffer() {
   cmd.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   cmd.commandBufferCount = _num_frames;
 
-  result = vkAllocateCommandBuffers(_device, &cmd, _command_buffers);
+  _command_buffers.resize(_num_frames);
+  _acquire_command_buffers.resize(_num_frames);
+  _transfer_command_buffers.resize(_num_frames);
+  _command_states.resize(_num_frames);
+  result = vkAllocateCommandBuffers(_device, &cmd, _command_buffers.data());
   if (result != VK_SUCCESS) {
     std::cerr << "Couldn't create vk command buffers\n";
     return false;
   }
+  result = vkAllocateCommandBuffers(_device, &cmd, _acquire_command_buffers.data());
+  if (!vk_error_check(result, "create acquire cmd buffers")) {
+    return false;
+  }
 
   pool_info.queueFamilyIndex = _transfer_queue_family_index;
   result = vkCreateCommandPool(_device, &pool_info, nullptr, &_transfer_cmd_pool);
@@ -510,7 +591,7 @@ create_command_buffer() {
     return false;
   }
   cmd.commandPool = _transfer_cmd_pool;
-  result = vkAllocateCommandBuffers(_device, &cmd, _transfer_command_buffers);
+  result = vkAllocateCommandBuffers(_device, &cmd, _transfer_command_buffers.data());
   if (!vk_error_check(result, "create transfer cmd buffers")) {
     return false;
   }
@@ -526,7 +607,11 @@ create_command_buffer() {
   fence_info.pNext = nullptr;
   // Start it signaled because we wait on it in begin_frame.
   fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  for (int i = 0; i < _num_frames; ++i) {
+  _image_acquired_semaphores.resize(_num_frames);
+  _draw_semaphores.resize(_num_frames);
+  _draw_fences.resize(_num_frames);
+  _transfer_fences.resize(_num_frames);
+  for (uint32_t i = 0; i < _num_frames; ++i) {
     // This one is signaled when the swapchain image is available.
     result = vkCreateSemaphore(_device, &sema_info, nullptr, &_image_acquired_semaphores[i]);
     if (!vk_error_check(result, "Create img acquired semaphore")) {
@@ -546,12 +631,6 @@ create_command_buffer() {
       return false;
     }
 
-    // This one gets signaled on GPU when the transfer command buffer is completed.
-    result = vkCreateSemaphore(_device, &sema_info, nullptr, &_transfer_semaphores[i]);
-    if (!vk_error_check(result, "transfer semaphore create")) {
-      return false;
-    }
-
     // This one gets signaled by GPU to CPU when the transfer command buffer is completed.
     result = vkCreateFence(_device, &fence_info, nullptr, &_transfer_fences[i]);
     if (!vk_error_check(result, "transfer fence create")) {
@@ -559,6 +638,69 @@ create_command_buffer() {
     }
   }
 
+  // This one counts up on the GPU as transfer command buffers complete.
+  VkSemaphoreTypeCreateInfo timeline_info = { };
+  timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  timeline_info.pNext = nullptr;
+  timeline_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  timeline_info.initialValue = 0u;
+  sema_info.pNext = &timeline_info;
+  result = vkCreateSemaphore(_device, &sema_info, nullptr, &_transfer_timeline);
+  if (!vk_error_check(result, "transfer timeline create")) {
+    return false;
+  }
+
+  return true;
+}
+
+// Sets up the per-frame, per-task command pools used to record draws in
+// parallel, one task per worker of the shared pool and one for the render
+// thread.
+bool RendererVk::
+create_record_command_buffers() {
+  int num_threads = (_options.thread_pool != nullptr) ? _options.thread_pool->get_num_threads() : 0;
+  if (num_threads > 0) {
+    _record_pool = _options.thread_pool;
+  }
+  _num_record_tasks = num_threads + 1;
+
+  VkCommandPoolCreateInfo pool_info = { };
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.pNext = nullptr;
+  pool_info.queueFamilyIndex = _gfx_queue_family_index;
+  // The whole pool is reset at once when the frame comes around again.
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+  VkCommandBufferAllocateInfo cmd = { };
+  cmd.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd.pNext = nullptr;
+  cmd.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  cmd.commandBufferCount = 1;
+
+  VkResult result;
+
+  _record_cmd_pools.resize(_num_frames);
+  _record_command_buffers.resize(_num_frames);
+  _record_command_states.resize(_num_frames);
+  for (uint32_t i = 0; i < _num_frames; ++i) {
+    _record_cmd_pools[i].resize(_num_record_tasks);
+    _record_command_buffers[i].resize(_num_record_tasks);
+    _record_command_states[i].resize(_num_record_tasks);
+    for (int j = 0; j < _num_record_tasks; ++j) {
+      result = vkCreateCommandPool(_device, &pool_info, nullptr, &_record_cmd_pools[i][j]);
+      if (!vk_error_check(result, "create record cmd pool")) {
+        return false;
+      }
+      cmd.commandPool = _record_cmd_pools[i][j];
+      result = vkAllocateCommandBuffers(_device, &cmd, &_record_command_buffers[i][j]);
+      if (!vk_error_check(result, "create record cmd buffer")) {
+        return false;
+      }
+    }
+  }
+
+  std::cerr << "Recording draws with up to " << _num_record_tasks << " threads\n";
+
   return true;
 }
 
@@ -599,27 +741,36 @@ create_device() {
               << VK_API_VERSION_PATCH(device_props.apiVersion) << "\n";
   }
 
+  // Returns the first device of the type, or UINT32_MAX.
+  auto find_device = [&](VkPhysicalDeviceType type) {
+    for (uint32_t i = 0; i < device_count; ++i) {
+      if (_physical_device_properties[i].deviceType == type) {
+        return i;
+      }
+    }
+    return UINT32_MAX;
+  };
+
   _device_index = UINT32_MAX;
 
-  // First look for discrete.
-  for (int i = 0; i < (int)_physical_device_properties.size(); ++i) {
-    if (_physical_device_properties[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-      _device_index = i;
-      break;
-    }
+  if (_options.prefer_cpu_device) {
+    _device_index = find_device(VK_PHYSICAL_DEVICE_TYPE_CPU);
+  }
+  if (_device_index == UINT32_MAX) {
+    // First look for discrete.
+    _device_index = find_device(VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU);
   }
   if (_device_index == UINT32_MAX) {
     // Don't have a discrete, look for integrated.
-    for (int i = 0; i < (int)_physical_device_properties.size(); ++i) {
-      if (_physical_device_properties[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU) {
-        _device_index = i;
-        break;
-      }
-    }
+    _device_index = find_device(VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU);
+  }
+  if (_device_index == UINT32_MAX) {
+    // Fall back to a software implementation, such as lavapipe.
+    _device_index = find_device(VK_PHYSICAL_DEVICE_TYPE_CPU);
   }
   if (_device_index == UINT32_MAX) {
     // Didn't get a discrete or integrated chip.  Fail.
-    std::cerr << "No discrete or integrated graphics device available!\n";
+    std::cerr << "No discrete, integrated or CPU graphics device available!\n";
     return false;
   }
 
@@ -642,7 +793,10 @@ create_queues() {
   VkBool32 *supports_present = (VkBool32 *)alloca(queue_family_count * sizeof(VkBool32));
   // Find present queue.
   for (uint32_t i = 0; i < queue_family_count; ++i) {
-    vkGetPhysicalDeviceSurfaceSupportKHR(_active_physical_device, i, _surface, &supports_present[i]);
+    supports_present[i] = VK_FALSE;
+    if (_surface != nullptr) {
+      vkGetPhysicalDeviceSurfaceSupportKHR(_active_physical_device, i, _surface, &supports_present[i]);
+    }
   }
   for (size_t i = 0; i < queue_family_count; ++i) {
     if (_queue_family_properties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
@@ -657,6 +811,10 @@ create_queues() {
     }
   }
 
+  if (_surface == nullptr) {
+    // Headless, nothing is presented, so any graphics family will do.
+    _present_queue_family_index = _gfx_queue_family_index;
+  }
   if (_present_queue_family_index == -1) {
     // Present queue wasn't in gfx queue family.  Find another
     // queue for present.
@@ -672,17 +830,29 @@ create_queues() {
     return false;
   }
 
-  // Find a transfer queue.
+  // Find a transfer queue.  A family that does nothing but transfers is
+  // usually backed by a DMA engine that copies while the graphics queue
+  // renders, so prefer that, then a compute family.  Otherwise, transfers
+  // go on the graphics family, which always supports them.
   _transfer_queue_family_index = -1;
+  int transfer_family_rank = 0;
   for (size_t i = 0; i < queue_family_count; ++i) {
-    if (_queue_family_properties[i].queueFlags & VK_QUEUE_TRANSFER_BIT) {
+    VkQueueFlags flags = _queue_family_properties[i].queueFlags;
+    int rank = 0;
+    if (flags & VK_QUEUE_GRAPHICS_BIT) {
+      continue;
+    } else if (flags & VK_QUEUE_COMPUTE_BIT) {
+      rank = 1;
+    } else if (flags & VK_QUEUE_TRANSFER_BIT) {
+      rank = 2;
+    }
+    if (rank > transfer_family_rank) {
       _transfer_queue_family_index = (int)i;
-      break;
+      transfer_family_rank = rank;
     }
   }
   if (_transfer_queue_family_index == -1) {
-    std::cerr << "Couldn't find a transfer queue family!\n";
-    return false;
+    _transfer_queue_family_index = _gfx_queue_family_index;
   }
 
   std::cerr << "Chose graphics queue family " << _gfx_queue_family_index << "\n";
@@ -701,30 +871,54 @@ create_queues() {
   queue_infos[0].queueFamilyIndex = _gfx_queue_family_index;
   queue_infos[0].flags = 0;
   if (pres_separate_from_gfx) {
+    queue_infos[queue_count].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_infos[queue_count].pNext = nullptr;
+    queue_infos[queue_count].queueCount = 1;
+    queue_infos[queue_count].pQueuePriorities = queue_prior;
+    queue_infos[queue_count].queueFamilyIndex = _present_queue_family_index;
+    queue_infos[queue_count].flags = 0;
     ++queue_count;
-    queue_infos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_infos[1].pNext = nullptr;
-    queue_infos[1].queueCount = 1;
-    queue_infos[1].pQueuePriorities = queue_prior;
-    queue_infos[1].queueFamilyIndex = _present_queue_family_index;
-    queue_infos[1].flags = 0;
-  }
-  if (_transfer_queue_family_index != _gfx_queue_family_index) {
+  }
+  if (_transfer_queue_family_index != _gfx_queue_family_index &&
+      _transfer_queue_family_index != _present_queue_family_index) {
+    queue_infos[queue_count].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_infos[queue_count].pNext = nullptr;
+    queue_infos[queue_count].queueCount = 1;
+    queue_infos[queue_count].pQueuePriorities = queue_prior;
+    queue_infos[queue_count].queueFamilyIndex = _transfer_queue_family_index;
+    queue_infos[queue_count].flags = 0;
     ++queue_count;
-    queue_infos[2].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_infos[2].pNext = nullptr;
-    queue_infos[2].queueCount = 1;
-    queue_infos[2].pQueuePriorities = queue_prior;
-    queue_infos[2].queueFamilyIndex = _transfer_queue_family_index;
-    queue_infos[2].flags = 0;
   }
 
-  const char *device_extensions[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME };
-  uint32_t device_extension_count = 2;
+  // No swapchain when headless, only the first one is needed.
+  const char *device_extensions[] = { VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+  uint32_t device_extension_count = _options.headless ? 1 : 2;
+
+  // Optional features, used by GPU-driven rendering if present.
+  VkPhysicalDeviceVulkan12Features supported_vk12_features = { };
+  supported_vk12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  supported_vk12_features.pNext = nullptr;
+  VkPhysicalDeviceFeatures2 supported_features = { };
+  supported_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  supported_features.pNext = &supported_vk12_features;
+  vkGetPhysicalDeviceFeatures2(_active_physical_device, &supported_features);
+  _supports_multi_draw_indirect = supported_features.features.multiDrawIndirect &&
+                                  supported_features.features.drawIndirectFirstInstance;
+  _supports_draw_indirect_count = _supports_multi_draw_indirect &&
+                                  supported_vk12_features.drawIndirectCount;
+  VkPhysicalDeviceFeatures enabled_features = { };
+  enabled_features.multiDrawIndirect = _supports_multi_draw_indirect;
+  enabled_features.drawIndirectFirstInstance = _supports_multi_draw_indirect;
+
   VkDeviceCreateInfo device_info = { };
   VkPhysicalDeviceDynamicRenderingFeatures dynamic_features = { };
+  VkPhysicalDeviceVulkan12Features vk12_features = { };
+  vk12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  vk12_features.pNext = nullptr;
+  vk12_features.timelineSemaphore = VK_TRUE;
+  vk12_features.drawIndirectCount = _supports_draw_indirect_count;
   dynamic_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
-  dynamic_features.pNext = nullptr;
+  dynamic_features.pNext = &vk12_features;
   dynamic_features.dynamicRendering = VK_TRUE;
   device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
   device_info.pNext = &dynamic_features;
@@ -734,7 +928,7 @@ create_queues() {
   device_info.ppEnabledExtensionNames = device_extensions;
   device_info.enabledLayerCount = 0;
   device_info.ppEnabledLayerNames = nullptr;
-  device_info.pEnabledFeatures = nullptr;
+  device_info.pEnabledFeatures = &enabled_features;
 
   result = vkCreateDevice(_active_physical_device, &device_info, nullptr, &_device);
   if (result != VK_SUCCESS) {
@@ -760,51 +954,103 @@ create_graphics_output(WindowHandle hwnd) {
 
   VkResult result;
 
-  // Query the available surface color formats.
-  uint32_t format_count = 0;
-  result = vkGetPhysicalDeviceSurfaceFormatsKHR(_active_physical_device, _surface, &format_count, nullptr);
-  assert(!result);
-  vector<VkSurfaceFormatKHR> surf_formats;
-  surf_formats.resize(format_count);
-  result = vkGetPhysicalDeviceSurfaceFormatsKHR(_active_physical_device, _surface, &format_count, surf_formats.data());
-  assert(!result);
-
-  std::cerr << "Got surface formats\n";
-
-  // We can use any of these surface formats.
-  // TODO(brian): make desired surface format configurable?
-  // For example, if we want alpha in the surface?
-  VkFormat potential_surf_formats[] = {
-    VK_FORMAT_R8G8B8A8_SRGB,
-    VK_FORMAT_R8G8B8_SRGB,
-    VK_FORMAT_B8G8R8A8_SRGB,
-    VK_FORMAT_B8G8R8_SRGB,
-  };
-
-  VkFormat surf_format = VK_FORMAT_UNDEFINED;
-  if (format_count == 1u && surf_formats[0].format == VK_FORMAT_UNDEFINED) {
-    // Don't know, so use one of our preferred formats.
-    surf_format = potential_surf_formats[0];
+  if (_options.headless) {
+    // Every device can render to this one, there is no surface to ask.
+    _surface_color_format = VK_FORMAT_R8G8B8A8_UNORM;
   } else {
-    assert(format_count >= 1u);
-    // Match on one of the supported formats.
-    for (size_t i = 0; i < surf_formats.size(); ++i) {
-      for (size_t j = 0; j < ARRAYSIZE(potential_surf_formats); ++j) {
-        if (surf_formats[i].format == potential_surf_formats[j]) {
-          surf_format = surf_formats[i].format;
+    // Query the available surface color formats.
+    uint32_t format_count = 0;
+    result = vkGetPhysicalDeviceSurfaceFormatsKHR(_active_physical_device, _surface, &format_count, nullptr);
+    assert(!result);
+    vector<VkSurfaceFormatKHR> surf_formats;
+    surf_formats.resize(format_count);
+    result = vkGetPhysicalDeviceSurfaceFormatsKHR(_active_physical_device, _surface, &format_count, surf_formats.data());
+    assert(!result);
+
+    std::cerr << "Got surface formats\n";
+
+    // We can use any of these surface formats.
+    // TODO(brian): make desired surface format configurable?
+    // For example, if we want alpha in the surface?
+    VkFormat potential_surf_formats[] = {
+      VK_FORMAT_R8G8B8A8_SRGB,
+      VK_FORMAT_R8G8B8_SRGB,
+      VK_FORMAT_B8G8R8A8_SRGB,
+      VK_FORMAT_B8G8R8_SRGB,
+    };
+
+    VkFormat surf_format = VK_FORMAT_UNDEFINED;
+    if (format_count == 1u && surf_formats[0].format == VK_FORMAT_UNDEFINED) {
+      // Don't know, so use one of our preferred formats.
+      surf_format = potential_surf_formats[0];
+    } else {
+      assert(format_count >= 1u);
+      // Match on one of the supported formats.
+      for (size_t i = 0; i < surf_formats.size(); ++i) {
+        for (size_t j = 0; j < ARRAYSIZE(potential_surf_formats); ++j) {
+          if (surf_formats[i].format == potential_surf_formats[j]) {
+            surf_format = surf_formats[i].format;
+          }
         }
       }
+      surf_format = surf_formats[0].format;
+    }
+
+    _surface_color_format = surf_format;
+  }
+
+  // Depth buffer format.
+  VkFormat depth_format = VK_FORMAT_D16_UNORM;
+  _surface_depth_format = depth_format;
+  VkFormatProperties fmt_props;
+  vkGetPhysicalDeviceFormatProperties(_active_physical_device, depth_format, &fmt_props);
+  if (fmt_props.linearTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+    _surface_depth_tiling = VK_IMAGE_TILING_LINEAR;
+  } else if (fmt_props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+    _surface_depth_tiling = VK_IMAGE_TILING_OPTIMAL;
+  } else {
+    std::cerr << "Unsupported depth format D16 unorm\n";
+    return false;
+  }
+  // Occlusion culling reads the depth buffer back in a compute shader.
+  VkFormatFeatureFlags depth_features = (_surface_depth_tiling == VK_IMAGE_TILING_LINEAR) ?
+    fmt_props.linearTilingFeatures : fmt_props.optimalTilingFeatures;
+  _supports_depth_pyramid = (depth_features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0;
+
+  if (_options.headless) {
+    if (!create_offscreen_image()) {
+      return false;
     }
-    surf_format = surf_formats[0].format;
+  } else if (!create_swapchain()) {
+    return false;
   }
 
-  _surface_color_format = surf_format;
+  if (!create_depth_buffer()) {
+    return false;
+  }
+
+  std::cerr << "Make framebuffer\n";
+
+  return true;
+}
+
+// Creates the swapchain and its image views at the current size of the
+// surface.  If a swapchain already exists, it is handed to the new one as
+// oldSwapchain, which lets the presentation engine reuse its resources and
+// keep showing its images until the new swapchain presents.  The caller is
+// responsible for retiring the old swapchain objects.
+//
+// Returns false if the swapchain could not be created, which includes the
+// surface currently having a zero size (a minimized window).
+bool RendererVk::
+create_swapchain() {
+  VkResult result;
 
   VkSurfaceCapabilitiesKHR surf_caps;
   result = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_active_physical_device, _surface, &surf_caps);
-  assert(!result);
-
-  std::cerr << "Got surface caps\n";
+  if (!vk_error_check(result, "get surface caps")) {
+    return false;
+  }
 
   uint32_t present_mode_count = 0;
   result = vkGetPhysicalDeviceSurfacePresentModesKHR(_active_physical_device, _surface, &present_mode_count, nullptr);
@@ -814,8 +1060,6 @@ create_graphics_output(WindowHandle hwnd) {
   result = vkGetPhysicalDeviceSurfacePresentModesKHR(_active_physical_device, _surface, &present_mode_count, present_modes.data());
   assert(!result);
 
-  std::cerr << "Got present modes\n";
-
   VkExtent2D swapchain_extent;
   // currentExtent looks to be the current window size.
   if (surf_caps.currentExtent.width == 0xFFFFFFFF) {
@@ -826,14 +1070,24 @@ create_graphics_output(WindowHandle hwnd) {
     swapchain_extent = surf_caps.currentExtent;
   }
 
-  _surface_extents.width = swapchain_extent.width;
-  _surface_extents.height = swapchain_extent.height;
+  if (swapchain_extent.width == 0u || swapchain_extent.height == 0u) {
+    // The window is minimized, there is nothing to present to.
+    return false;
+  }
 
-  // V-Sync where if frame rate drops below v-sync, it simply stops v-syncing.
-  VkPresentModeKHR swapchain_present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  VkPresentModeKHR swapchain_present_mode = choose_present_mode(present_modes);
 
-  // Don't do more than double-buffering.
-  uint32_t num_swapchain_images = std::clamp(2u, surf_caps.minImageCount, surf_caps.maxImageCount);
+  // A maxImageCount of 0 means there is no upper limit.
+  uint32_t num_swapchain_images = std::max(_options.num_swapchain_images, surf_caps.minImageCount);
+  if (surf_caps.maxImageCount != 0u) {
+    num_swapchain_images = std::min(num_swapchain_images, surf_caps.maxImageCount);
+  }
+  if (num_swapchain_images != _options.num_swapchain_images && _swapchain == nullptr) {
+    std::cerr << "Surface supports " << surf_caps.minImageCount << "-"
+              << surf_caps.maxImageCount << " swapchain images, using "
+              << num_swapchain_images << " instead of "
+              << _options.num_swapchain_images << "\n";
+  }
 
   VkSurfaceTransformFlagBitsKHR pre_transform;
   if (surf_caps.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR) {
@@ -861,14 +1115,14 @@ create_graphics_output(WindowHandle hwnd) {
   swapchain_ci.pNext = nullptr;
   swapchain_ci.surface = _surface;
   swapchain_ci.minImageCount = num_swapchain_images;
-  swapchain_ci.imageFormat = surf_format;
+  swapchain_ci.imageFormat = _surface_color_format;
   swapchain_ci.imageExtent.width = swapchain_extent.width;
   swapchain_ci.imageExtent.height = swapchain_extent.height;
   swapchain_ci.preTransform = pre_transform;
   swapchain_ci.compositeAlpha = composite_alpha;
   swapchain_ci.imageArrayLayers = 1;
   swapchain_ci.presentMode = swapchain_present_mode;
-  swapchain_ci.oldSwapchain = VK_NULL_HANDLE;
+  swapchain_ci.oldSwapchain = _swapchain;
   swapchain_ci.clipped = true;
   swapchain_ci.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
   swapchain_ci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
@@ -884,13 +1138,18 @@ create_graphics_output(WindowHandle hwnd) {
     swapchain_ci.pQueueFamilyIndices = queue_family_indices;
   }
 
-  result = vkCreateSwapchainKHR(_device, &swapchain_ci, nullptr, &_swapchain);
+  VkSwapchainKHR swapchain;
+  result = vkCreateSwapchainKHR(_device, &swapchain_ci, nullptr, &swapchain);
   if (result != VK_SUCCESS) {
     std::cerr << "Failed to create vulkan swapchain\n";
     return false;
   }
+  _swapchain = swapchain;
+  _surface_extents.width = swapchain_extent.width;
+  _surface_extents.height = swapchain_extent.height;
 
-  std::cerr << "Created swapchain\n";
+  std::cerr << "Created swapchain " << _surface_extents.width << "x"
+            << _surface_extents.height << "\n";
 
   // Create swapchain images.
   uint32_t swapchain_image_count = 0;
@@ -910,7 +1169,7 @@ create_graphics_output(WindowHandle hwnd) {
     color_image_view.flags = 0;
     color_image_view.image = _swapchain_images[i];
     color_image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    color_image_view.format = surf_format;
+    color_image_view.format = _surface_color_format;
     color_image_view.components.r = VK_COMPONENT_SWIZZLE_R;
     color_image_view.components.g = VK_COMPONENT_SWIZZLE_G;
     color_image_view.components.b = VK_COMPONENT_SWIZZLE_B;
@@ -928,32 +1187,97 @@ create_graphics_output(WindowHandle hwnd) {
     }
   }
 
-  // Depth buffer.
-  VkImageCreateInfo d_image_info = { };
-  VkFormat depth_format = VK_FORMAT_D16_UNORM;
-  _surface_depth_format = depth_format;
-  VkFormatProperties fmt_props;
-  vkGetPhysicalDeviceFormatProperties(_active_physical_device, depth_format, &fmt_props);
-  if (fmt_props.linearTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
-    d_image_info.tiling = VK_IMAGE_TILING_LINEAR;
-  } else if (fmt_props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
-    d_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
-  } else {
-    std::cerr << "Unsupported depth format D16 unorm\n";
+  return true;
+}
+
+// Creates the color image that headless rendering draws into, at the size
+// given in the options.  It takes the place of the swapchain's images, so
+// that the rest of the frame doesn't tell the two apart.
+bool RendererVk::
+create_offscreen_image() {
+  VkResult result;
+
+  _surface_extents.width = _options.headless_width;
+  _surface_extents.height = _options.headless_height;
+  _surface_extents.depth = 1;
+
+  VkImageCreateInfo image_info = { };
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.pNext = nullptr;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = _surface_color_format;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.extent = _surface_extents;
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  image_info.queueFamilyIndexCount = 0;
+  image_info.pQueueFamilyIndices = nullptr;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+  result = vmaCreateImage(_alloc, &image_info, &alloc_info, &_offscreen_image, &_offscreen_image_alloc, nullptr);
+  if (!vk_error_check(result, "create offscreen image")) {
+    return false;
+  }
+
+  VkImageViewCreateInfo view_info = { };
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.pNext = nullptr;
+  view_info.flags = 0;
+  view_info.image = _offscreen_image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = _surface_color_format;
+  view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+  view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+  view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+  view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.baseMipLevel = 0;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.baseArrayLayer = 0;
+  view_info.subresourceRange.layerCount = 1;
+  VkImageView view;
+  result = vkCreateImageView(_device, &view_info, nullptr, &view);
+  if (!vk_error_check(result, "create offscreen image view")) {
     return false;
   }
+
+  _swapchain_images.assign(1, _offscreen_image);
+  _swapchain_image_views.assign(1, view);
+  _curr_swapchain_image_index = 0u;
+
+  std::cerr << "Created offscreen image " << _surface_extents.width << "x"
+            << _surface_extents.height << "\n";
+
+  return true;
+}
+
+// Creates the depth buffer at the current surface extents.
+bool RendererVk::
+create_depth_buffer() {
+  VkResult result;
+
+  VkImageCreateInfo d_image_info = { };
   d_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   d_image_info.pNext = nullptr;
   d_image_info.imageType = VK_IMAGE_TYPE_2D;
-  d_image_info.format = depth_format;
-  d_image_info.extent.width = swapchain_extent.width;
-  d_image_info.extent.height = swapchain_extent.height;
+  d_image_info.format = _surface_depth_format;
+  d_image_info.tiling = _surface_depth_tiling;
+  d_image_info.extent.width = _surface_extents.width;
+  d_image_info.extent.height = _surface_extents.height;
   d_image_info.extent.depth = 1;
   d_image_info.mipLevels = 1;
   d_image_info.arrayLayers = 1;
   d_image_info.samples = VK_SAMPLE_COUNT_1_BIT;
   d_image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
   d_image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  if (_supports_depth_pyramid) {
+    d_image_info.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+  }
   d_image_info.queueFamilyIndexCount = 0;
   d_image_info.pQueueFamilyIndices = nullptr;
   d_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -962,7 +1286,7 @@ create_graphics_output(WindowHandle hwnd) {
   VkImageViewCreateInfo d_image_view = { };
   d_image_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   d_image_view.pNext = nullptr;
-  d_image_view.format = depth_format;
+  d_image_view.format = _surface_depth_format;
   d_image_view.components.r = VK_COMPONENT_SWIZZLE_R;
   d_image_view.components.g = VK_COMPONENT_SWIZZLE_G;
   d_image_view.components.b = VK_COMPONENT_SWIZZLE_B;
@@ -990,12 +1314,197 @@ create_graphics_output(WindowHandle hwnd) {
     return false;
   }
 
+  if (_supports_depth_pyramid && !create_depth_pyramid()) {
+    return false;
+  }
 
-  std::cerr << "Make framebuffer\n";
+  return true;
+}
+
+// Creates the depth pyramid for the current depth buffer.  Level 0 is half
+// the size of the depth buffer, rounded up, and every level halves the one
+// before it down to 1x1.  Each texel holds the farthest depth of the area it
+// covers.
+//
+// Depth formats can't be storage images, so the mip chain is a separate
+// R32 float image rather than mips of the depth buffer itself.
+bool RendererVk::
+create_depth_pyramid() {
+  VkResult result;
+
+  uint32_t width = (_surface_extents.width + 1u) / 2u;
+  uint32_t height = (_surface_extents.height + 1u) / 2u;
+  _depth_pyramid_extents.width = width;
+  _depth_pyramid_extents.height = height;
+  uint32_t levels = 1u;
+  while ((width > 1u || height > 1u) && levels < _max_depth_pyramid_levels) {
+    width = (width + 1u) / 2u;
+    height = (height + 1u) / 2u;
+    ++levels;
+  }
+  _depth_pyramid_levels = levels;
+
+  VkImageCreateInfo image_info = { };
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.pNext = nullptr;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = VK_FORMAT_R32_SFLOAT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.extent.width = _depth_pyramid_extents.width;
+  image_info.extent.height = _depth_pyramid_extents.height;
+  image_info.extent.depth = 1;
+  image_info.mipLevels = levels;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.queueFamilyIndexCount = 0;
+  image_info.pQueueFamilyIndices = nullptr;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+  result = vmaCreateImage(_alloc, &image_info, &alloc_info, &_depth_pyramid_image, &_depth_pyramid_alloc, nullptr);
+  if (!vk_error_check(result, "create depth pyramid image")) {
+    return false;
+  }
+  _depth_pyramid_initialized = false;
+
+  // A view of the whole chain for sampling, and one per level for the
+  // reduction to write to and read from.
+  VkImageViewCreateInfo view_info = { };
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.pNext = nullptr;
+  view_info.image = _depth_pyramid_image;
+  view_info.format = VK_FORMAT_R32_SFLOAT;
+  view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+  view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+  view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+  view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.baseMipLevel = 0;
+  view_info.subresourceRange.levelCount = levels;
+  view_info.subresourceRange.baseArrayLayer = 0;
+  view_info.subresourceRange.layerCount = 1;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.flags = 0;
+  result = vkCreateImageView(_device, &view_info, nullptr, &_depth_pyramid_view);
+  if (!vk_error_check(result, "create depth pyramid view")) {
+    return false;
+  }
+
+  _depth_pyramid_mip_views.resize(levels);
+  view_info.subresourceRange.levelCount = 1;
+  for (uint32_t i = 0; i < levels; ++i) {
+    view_info.subresourceRange.baseMipLevel = i;
+    result = vkCreateImageView(_device, &view_info, nullptr, &_depth_pyramid_mip_views[i]);
+    if (!vk_error_check(result, "create depth pyramid level view")) {
+      return false;
+    }
+  }
+
+  return true;
+}
 
+// Replaces the swapchain and depth buffer with ones matching the current
+// surface size.  Nothing waits for the device to go idle: the old objects
+// may still be in use by frames in flight, so they are handed to the
+// deletion queue and destroyed once the GPU is done with them.
+//
+// Returns false if the surface has a zero size, in which case the old
+// objects are kept and the recreation should be retried later.
+bool RendererVk::
+recreate_graphics_output() {
+  _graphics_output_dirty = true;
+
+  VkSwapchainKHR old_swapchain = _swapchain;
+  vector<VkImageView> old_image_views = _swapchain_image_views;
+  VkExtent3D old_extents = _surface_extents;
+
+  if (!create_swapchain()) {
+    // Keep the old objects until the surface can be presented to again.
+    return false;
+  }
+
+  // Queued ahead of its image views: requests are processed back to front,
+  // so the views are destroyed before the swapchain that owns the images.
+  VkDeletionRequest req;
+  req.swapchain = old_swapchain;
+  enqueue_deletion(req);
+  for (VkImageView view : old_image_views) {
+    req = VkDeletionRequest();
+    req.image_view = view;
+    enqueue_deletion(req);
+  }
+
+  // A swapchain that went suboptimal may come back at the same size, in
+  // which case the depth buffer is still good.
+  if (_surface_extents.width != old_extents.width ||
+      _surface_extents.height != old_extents.height) {
+    req = VkDeletionRequest();
+    req.image = _depth_image;
+    req.alloc = _depth_image_alloc;
+    enqueue_deletion(req);
+    req = VkDeletionRequest();
+    req.image_view = _depth_image_view;
+    enqueue_deletion(req);
+    if (_depth_pyramid_image != nullptr) {
+      req = VkDeletionRequest();
+      req.image = _depth_pyramid_image;
+      req.alloc = _depth_pyramid_alloc;
+      enqueue_deletion(req);
+      req = VkDeletionRequest();
+      req.image_view = _depth_pyramid_view;
+      enqueue_deletion(req);
+      for (VkImageView view : _depth_pyramid_mip_views) {
+        req = VkDeletionRequest();
+        req.image_view = view;
+        enqueue_deletion(req);
+      }
+      _depth_pyramid_image = nullptr;
+      _depth_pyramid_mip_views.clear();
+    }
+
+    if (!create_depth_buffer()) {
+      return false;
+    }
+
+    update_surface_projection();
+  }
+
+  _graphics_output_dirty = false;
   return true;
 }
 
+// Returns the Vulkan present mode to use for the configured one.  If the
+// surface doesn't support it, falls back to FIFO, which every surface must
+// support.
+VkPresentModeKHR RendererVk::
+choose_present_mode(const vector<VkPresentModeKHR> &supported) const {
+  VkPresentModeKHR mode;
+  switch (_options.present_mode) {
+  case RendererOptionsVk::PM_immediate:
+    mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    break;
+  case RendererOptionsVk::PM_mailbox:
+    mode = VK_PRESENT_MODE_MAILBOX_KHR;
+    break;
+  case RendererOptionsVk::PM_fifo_relaxed:
+    mode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+    break;
+  case RendererOptionsVk::PM_fifo:
+  default:
+    mode = VK_PRESENT_MODE_FIFO_KHR;
+    break;
+  }
+
+  if (std::find(supported.begin(), supported.end(), mode) == supported.end()) {
+    std::cerr << "Present mode " << mode << " not supported by surface, falling back to FIFO\n";
+    mode = VK_PRESENT_MODE_FIFO_KHR;
+  }
+  return mode;
+}
+
 // Marks the beginning of the pre-rendering transfer phase.
 // Allows any CPU to GPU transfers to be queued and submitted before
 // rendering work begins.
@@ -1003,17 +1512,16 @@ bool RendererVk::
 begin_prepare() {
   VkResult result;
 
+  poll_transfer_timeline();
   process_deletions();
 
-  // Wait for the transfer command buffer to be ready.
+  // Wait for the transfer command buffer to be ready.  The fence is only
+  // reset once there is something to submit.
   result = vkWaitForFences(_device, 1, &_current_transfer_fence, VK_TRUE, UINT64_MAX);
   if (!vk_error_check(result, "wait for transfer cmd buf")) {
     return false;
   }
-  result = vkResetFences(_device, 1, &_current_transfer_fence);
-  if (!vk_error_check(result, "reset transfer fence")) {
-    return false;
-  }
+  _num_prepared_uploads = 0u;
   result = vkResetCommandBuffer(_current_transfer_command_buffer, 0);
   if (!vk_error_check(result, "reset transfer cmd buf")) {
     return false;
@@ -1042,14 +1550,31 @@ end_prepare() {
     return false;
   }
 
-  // Now submit the transfer(s).
+  if (_num_prepared_uploads == 0u) {
+    // Nothing to transfer, and nothing will wait on it.
+    return true;
+  }
+
+  result = vkResetFences(_device, 1, &_current_transfer_fence);
+  if (!vk_error_check(result, "reset transfer fence")) {
+    return false;
+  }
+
+  // Now submit the transfer(s).  The buffers uploaded in here were tagged
+  // with the timeline value that this submission signals.
+  ++_transfer_timeline_value;
+  VkTimelineSemaphoreSubmitInfo timeline_info = { };
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.pNext = nullptr;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &_transfer_timeline_value;
   VkSubmitInfo submit_info = { };
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.pNext = nullptr;
+  submit_info.pNext = &timeline_info;
   submit_info.commandBufferCount = 1;
   submit_info.pCommandBuffers = &_current_transfer_command_buffer;
   submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = &_current_transfer_semaphore;
+  submit_info.pSignalSemaphores = &_transfer_timeline;
   submit_info.waitSemaphoreCount = 0;
   submit_info.pWaitSemaphores = nullptr;
   submit_info.pWaitDstStageMask = nullptr;
@@ -1077,11 +1602,27 @@ begin_frame() {
     return false;
   }
 
+  poll_transfer_timeline();
+  // The GPU is done with this frame's copies of the dynamic buffers and
+  // uniform data too.
+  update_dynamic_buffers();
+  _uniform_ring.begin_frame(_frame_cycle_index);
+  _instance_ring.begin_frame(_frame_cycle_index);
+
   // Okay, the GPU is no longer using this command buffer.  We're ready!
   result = vkResetCommandBuffer(_current_command_buffer, 0);
   if (!vk_error_check(result, "reset cmd buf")) {
     return false;
   }
+  // Same goes for the secondary command buffers recorded in parallel, all
+  // of them, as fewer tasks may be in use than last time around.
+  for (size_t i = 0; i < _record_cmd_pools[_frame_cycle_index].size(); ++i) {
+    result = vkResetCommandPool(_device, _record_cmd_pools[_frame_cycle_index][i], 0);
+    if (!vk_error_check(result, "reset record cmd pool")) {
+      return false;
+    }
+    _record_command_states[_frame_cycle_index][i].reset(_record_command_buffers[_frame_cycle_index][i]);
+  }
 
   VkCommandBufferBeginInfo begin_info = { };
   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1093,38 +1634,80 @@ begin_frame() {
     return false;
   }
 
+  // Nothing is bound to a freshly begun command buffer.
+  _current_command_state->reset(_current_command_buffer);
+
   return true;
 }
 
-// Begins drawing to the surface/graphics output.
+// Begins drawing to the surface/graphics output.  If secondary_contents is
+// true, the draws must be recorded through draw_meshes_parallel().
 bool RendererVk::
-begin_frame_surface() {
+begin_frame_surface(bool secondary_contents) {
   VkResult result;
 
-  // Get a swapchain image.
-  result = vkAcquireNextImageKHR(_device, _swapchain, UINT64_MAX, _current_image_acquired_semaphore, VK_NULL_HANDLE, &_curr_swapchain_image_index);
-  if (!vk_error_check(result, "acquire swapchain image")) {
-    return false;
-  }
-
-  // Transition the swapchain color image.
-  VkImageMemoryBarrier render_barrier = { };
-  render_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  render_barrier.pNext = nullptr;
-  render_barrier.image = _swapchain_images[_curr_swapchain_image_index];
-  render_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  render_barrier.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-  render_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  render_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  render_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  render_barrier.subresourceRange.baseMipLevel = 0;
-  render_barrier.subresourceRange.levelCount = 1;
-  render_barrier.subresourceRange.baseArrayLayer = 0;
-  render_barrier.subresourceRange.layerCount = 1;
-  render_barrier.srcAccessMask = 0;
-  render_barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-  vkCmdPipelineBarrier(_current_command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr, 1, &render_barrier);
+  // Get a swapchain image.  Headless, there is just the one image, and as
+  // none is acquired, end_frame() presents nothing.
+  _image_acquired = false;
+  if (_options.headless) {
+    _curr_swapchain_image_index = 0u;
+  } else {
+    result = vkAcquireNextImageKHR(_device, _swapchain, UINT64_MAX, _current_image_acquired_semaphore, VK_NULL_HANDLE, &_curr_swapchain_image_index);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      // The surface changed since the last update_graphics_output().  Nothing
+      // refers to the swapchain yet in this frame, so swap it out and retry.
+      if (!recreate_graphics_output()) {
+        return false;
+      }
+      result = vkAcquireNextImageKHR(_device, _swapchain, UINT64_MAX, _current_image_acquired_semaphore, VK_NULL_HANDLE, &_curr_swapchain_image_index);
+    }
+    if (result == VK_SUBOPTIMAL_KHR) {
+      // Still presentable, recreate it before the next frame.
+      _graphics_output_dirty = true;
+    } else if (!vk_error_check(result, "acquire swapchain image")) {
+      return false;
+    }
+    _image_acquired = true;
+  }
+
+  // Transition the swapchain color image.  The depth buffer is cleared, so
+  // its old contents are discarded, but the depth pyramid of the previous
+  // frame may still be reading it.
+  VkImageMemoryBarrier render_barriers[2] = { };
+  render_barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  render_barriers[0].pNext = nullptr;
+  render_barriers[0].image = _swapchain_images[_curr_swapchain_image_index];
+  render_barriers[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  render_barriers[0].newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  render_barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  render_barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  render_barriers[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  render_barriers[0].subresourceRange.baseMipLevel = 0;
+  render_barriers[0].subresourceRange.levelCount = 1;
+  render_barriers[0].subresourceRange.baseArrayLayer = 0;
+  render_barriers[0].subresourceRange.layerCount = 1;
+  render_barriers[0].srcAccessMask = 0;
+  render_barriers[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  render_barriers[1] = render_barriers[0];
+  render_barriers[1].image = _depth_image;
+  render_barriers[1].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  render_barriers[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  render_barriers[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                     VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  vkCmdPipelineBarrier(_current_command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr, 1, &render_barriers[0]);
+  vkCmdPipelineBarrier(_current_command_buffer,
+                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &render_barriers[1]);
+
+  begin_surface_rendering(VK_ATTACHMENT_LOAD_OP_CLEAR, secondary_contents);
+  return true;
+}
 
+// Records vkCmdBeginRendering() with the surface attachments.  The depth
+// buffer is always stored, so that rendering can be suspended to read it.
+void RendererVk::
+begin_surface_rendering(VkAttachmentLoadOp load_op, bool secondary_contents) {
   // Bind our framebuffer attachments, clear information, load/store ops, etc.
   VkRenderingAttachmentInfo color_attach = { };
   color_attach.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
@@ -1134,7 +1717,7 @@ begin_frame_surface() {
   color_attach.resolveMode = VK_RESOLVE_MODE_NONE;
   color_attach.resolveImageView = nullptr;
   color_attach.resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  color_attach.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  color_attach.loadOp = load_op;
   color_attach.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   color_attach.clearValue.color.float32[0] = 0.3f;
   color_attach.clearValue.color.float32[1] = 0.3f;
@@ -1148,8 +1731,8 @@ begin_frame_surface() {
   depth_attach.resolveMode = VK_RESOLVE_MODE_NONE;
   depth_attach.resolveImageView = nullptr;
   depth_attach.resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depth_attach.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depth_attach.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depth_attach.loadOp = load_op;
+  depth_attach.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
   depth_attach.clearValue.depthStencil.depth = 1.0f;
   depth_attach.clearValue.depthStencil.stencil = 0u;
   VkRenderingInfo render_info = { };
@@ -1160,15 +1743,25 @@ begin_frame_surface() {
   render_info.pColorAttachments = &color_attach;
   render_info.pDepthAttachment = &depth_attach;
   render_info.pStencilAttachment = nullptr;
-  render_info.flags = 0;//VK_RENDERING_CONTENTS_INLINE_BIT_EXT;
+  render_info.flags = secondary_contents ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
   render_info.viewMask = 0;
   render_info.renderArea.offset.x = 0;
   render_info.renderArea.offset.y = 0;
   render_info.renderArea.extent.width = _surface_extents.width;
   render_info.renderArea.extent.height = _surface_extents.height;
   vkCmdBeginRendering(_current_command_buffer, &render_info);
+  _surface_secondary_contents = secondary_contents;
 
-  // Supply viewport for rendering into.
+  if (!secondary_contents) {
+    // Secondary command buffers don't inherit dynamic state, they set their
+    // own viewport.
+    set_viewport_and_scissor(_current_command_buffer);
+  }
+}
+
+// Supplies the surface viewport and scissor region for rendering into.
+void RendererVk::
+set_viewport_and_scissor(VkCommandBuffer cmd) {
   VkViewport viewport = { };
   viewport.minDepth = 0.0f;
   viewport.maxDepth = 1.0f;
@@ -1176,17 +1769,14 @@ begin_frame_surface() {
   viewport.y = 0;
   viewport.width = _surface_extents.width;
   viewport.height = _surface_extents.height;
-  vkCmdSetViewport(_current_command_buffer, 0, 1, &viewport);
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
 
-  // Scissor region.
   VkRect2D scissor = { };
   scissor.extent.width = _surface_extents.width;
   scissor.extent.height = _surface_extents.height;
   scissor.offset.x = 0;
   scissor.offset.y = 0;
-  vkCmdSetScissor(_current_command_buffer, 0, 1, &scissor);
-
-  return true;
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
 }
 
 bool RendererVk::
@@ -1194,13 +1784,15 @@ end_frame_surface() {
   // End rendering.
   vkCmdEndRendering(_current_command_buffer);
 
-  // Transition to present format.
+  // Transition to present format.  Headless, the present layout doesn't
+  // exist without the swapchain extension, the image is left to be copied
+  // out instead.
   VkImageMemoryBarrier render_barrier = { };
   render_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
   render_barrier.pNext = nullptr;
   render_barrier.image = _swapchain_images[_curr_swapchain_image_index];
   render_barrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-  render_barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  render_barrier.newLayout = _options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
   render_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   render_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   render_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1215,19 +1807,285 @@ end_frame_surface() {
   return true;
 }
 
-// Enqueues a buffer for deletion.  The current frame cycle index is noted
-// along with the request.  The buffer won't actually be deleted until the
-// the command buffer associated with the frame cycle index is no longer being
-// processed by the GPU.
+// Ends surface rendering in the middle of the frame, so that compute work
+// can read what was drawn so far, and makes the depth buffer readable by
+// compute shaders.  Rendering continues with resume_frame_surface().
+bool RendererVk::
+suspend_frame_surface() {
+  assert(!_surface_secondary_contents);
+  vkCmdEndRendering(_current_command_buffer);
+
+  VkImageMemoryBarrier depth_barrier = { };
+  depth_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  depth_barrier.pNext = nullptr;
+  depth_barrier.image = _depth_image;
+  depth_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  depth_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  depth_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  depth_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  depth_barrier.subresourceRange.baseMipLevel = 0;
+  depth_barrier.subresourceRange.levelCount = 1;
+  depth_barrier.subresourceRange.baseArrayLayer = 0;
+  depth_barrier.subresourceRange.layerCount = 1;
+  depth_barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  depth_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(_current_command_buffer,
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &depth_barrier);
+  return true;
+}
+
+// Continues surface rendering after suspend_frame_surface(), keeping what
+// was drawn before.
+bool RendererVk::
+resume_frame_surface() {
+  VkImageMemoryBarrier depth_barrier = { };
+  depth_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  depth_barrier.pNext = nullptr;
+  depth_barrier.image = _depth_image;
+  depth_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  depth_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  depth_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  depth_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  depth_barrier.subresourceRange.baseMipLevel = 0;
+  depth_barrier.subresourceRange.levelCount = 1;
+  depth_barrier.subresourceRange.baseArrayLayer = 0;
+  depth_barrier.subresourceRange.layerCount = 1;
+  depth_barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  depth_barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  vkCmdPipelineBarrier(_current_command_buffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &depth_barrier);
+
+  begin_surface_rendering(VK_ATTACHMENT_LOAD_OP_LOAD, false);
+  return true;
+}
+
+// Creates the compute pipeline that reduces the depth buffer into the depth
+// pyramid, one dispatch per level.
+bool RendererVk::
+create_depth_pyramid_pipeline() {
+  VkResult result;
+
+  VkSamplerCreateInfo sampler_info = { };
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.pNext = nullptr;
+  sampler_info.magFilter = VK_FILTER_NEAREST;
+  sampler_info.minFilter = VK_FILTER_NEAREST;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.minLod = 0.0f;
+  sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+  result = vkCreateSampler(_device, &sampler_info, nullptr, &_depth_pyramid_sampler);
+  if (!vk_error_check(result, "create depth pyramid sampler")) {
+    return false;
+  }
+
+  VkDescriptorSetLayoutBinding bindings[2] = { };
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  VkDescriptorSetLayoutCreateInfo desc_info = { };
+  desc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  desc_info.pNext = nullptr;
+  desc_info.bindingCount = 2;
+  desc_info.pBindings = bindings;
+  result = vkCreateDescriptorSetLayout(_device, &desc_info, nullptr, &_depth_pyramid_set_layout);
+  if (!vk_error_check(result, "create depth pyramid descriptor set layout")) {
+    return false;
+  }
+
+  VkPipelineLayoutCreateInfo layout_info = { };
+  layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layout_info.pNext = nullptr;
+  layout_info.setLayoutCount = 1;
+  layout_info.pSetLayouts = &_depth_pyramid_set_layout;
+  layout_info.pushConstantRangeCount = 0;
+  layout_info.pPushConstantRanges = nullptr;
+  result = vkCreatePipelineLayout(_device, &layout_info, nullptr, &_depth_pyramid_pipeline_layout);
+  if (!vk_error_check(result, "create depth pyramid pipeline layout")) {
+    return false;
+  }
+
+  // A set per level and frame in flight.  The views they point at change
+  // when the surface is resized, so each frame rewrites its own sets.
+  uint32_t num_sets = _num_frames * _max_depth_pyramid_levels;
+  VkDescriptorPoolSize pool_sizes[2];
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[0].descriptorCount = num_sets;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_sizes[1].descriptorCount = num_sets;
+  VkDescriptorPoolCreateInfo pool_info = { };
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.pNext = nullptr;
+  pool_info.maxSets = num_sets;
+  pool_info.poolSizeCount = 2;
+  pool_info.pPoolSizes = pool_sizes;
+  result = vkCreateDescriptorPool(_device, &pool_info, nullptr, &_depth_pyramid_desc_pool);
+  if (!vk_error_check(result, "create depth pyramid descriptor pool")) {
+    return false;
+  }
+
+  std::vector<VkDescriptorSetLayout> set_layouts(num_sets, _depth_pyramid_set_layout);
+  _depth_pyramid_sets.resize(num_sets);
+  VkDescriptorSetAllocateInfo alloc_info = { };
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.pNext = nullptr;
+  alloc_info.descriptorPool = _depth_pyramid_desc_pool;
+  alloc_info.descriptorSetCount = num_sets;
+  alloc_info.pSetLayouts = set_layouts.data();
+  result = vkAllocateDescriptorSets(_device, &alloc_info, _depth_pyramid_sets.data());
+  if (!vk_error_check(result, "alloc depth pyramid descriptor sets")) {
+    return false;
+  }
+
+  VkShaderModule module = make_shader_module(read_binary_file("shaders\\depth_pyramid.comp.spirv"));
+  if (module == nullptr) {
+    std::cerr << "Failed to load depth pyramid shader\n";
+    return false;
+  }
+
+  VkComputePipelineCreateInfo pipeline_info = { };
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.pNext = nullptr;
+  pipeline_info.flags = 0;
+  pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.pNext = nullptr;
+  pipeline_info.stage.flags = 0;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.stage.pSpecializationInfo = nullptr;
+  pipeline_info.layout = _depth_pyramid_pipeline_layout;
+  pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+  pipeline_info.basePipelineIndex = 0;
+  result = vkCreateComputePipelines(_device, nullptr, 1, &pipeline_info, nullptr, &_depth_pyramid_pipeline);
+  vkDestroyShaderModule(_device, module, nullptr);
+  if (!vk_error_check(result, "create depth pyramid pipeline")) {
+    return false;
+  }
+
+  return true;
+}
+
+// Records the reduction of the depth buffer into the depth pyramid.  Must be
+// called while surface rendering is suspended.  Afterwards, the pyramid is
+// in the general layout and readable by compute shaders.
+bool RendererVk::
+build_depth_pyramid() {
+  if (!_supports_depth_pyramid) {
+    return false;
+  }
+
+  VkCommandBuffer cmd = _current_command_buffer;
+  uint32_t levels = _depth_pyramid_levels;
+  VkDescriptorSet *sets = &_depth_pyramid_sets[_frame_cycle_index * _max_depth_pyramid_levels];
+
+  // Each level reads the one before it, level 0 reads the depth buffer.
+  VkDescriptorImageInfo image_infos[_max_depth_pyramid_levels * 2];
+  VkWriteDescriptorSet writes[_max_depth_pyramid_levels * 2];
+  for (uint32_t i = 0; i < levels; ++i) {
+    VkDescriptorImageInfo &src = image_infos[i * 2];
+    src.sampler = _depth_pyramid_sampler;
+    if (i == 0u) {
+      src.imageView = _depth_image_view;
+      src.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    } else {
+      src.imageView = _depth_pyramid_mip_views[i - 1];
+      src.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+    VkDescriptorImageInfo &dst = image_infos[i * 2 + 1];
+    dst.sampler = nullptr;
+    dst.imageView = _depth_pyramid_mip_views[i];
+    dst.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    for (uint32_t b = 0; b < 2; ++b) {
+      VkWriteDescriptorSet &write = writes[i * 2 + b];
+      write = { };
+      write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      write.pNext = nullptr;
+      write.dstSet = sets[i];
+      write.dstBinding = b;
+      write.dstArrayElement = 0;
+      write.descriptorCount = 1;
+      write.descriptorType = (b == 0) ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      write.pImageInfo = &image_infos[i * 2 + b];
+    }
+  }
+  vkUpdateDescriptorSets(_device, levels * 2, writes, 0, nullptr);
+
+  // The previous frame's culling may still be reading the pyramid.
+  VkImageMemoryBarrier barrier = { };
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.pNext = nullptr;
+  barrier.image = _depth_pyramid_image;
+  barrier.oldLayout = _depth_pyramid_initialized ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = levels;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &barrier);
+  _depth_pyramid_initialized = true;
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _depth_pyramid_pipeline);
+  uint32_t width = _depth_pyramid_extents.width;
+  uint32_t height = _depth_pyramid_extents.height;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  for (uint32_t i = 0; i < levels; ++i) {
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _depth_pyramid_pipeline_layout,
+                            0, 1, &sets[i], 0, nullptr);
+    vkCmdDispatch(cmd, (width + 7u) / 8u, (height + 7u) / 8u, 1);
+
+    // The level is read by the next level, or by whoever uses the pyramid.
+    barrier.subresourceRange.baseMipLevel = i;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    width = (width + 1u) / 2u;
+    height = (height + 1u) / 2u;
+  }
+
+  return true;
+}
+
+// Enqueues a buffer for deletion.  The buffer won't actually be deleted
+// until the GPU is done with all the work submitted before this point.
 void RendererVk::enqueue_buffer_deletion(VkBuffer buffer, VmaAllocation alloc) {
   VkDeletionRequest req;
   req.buffer = buffer;
   req.alloc = alloc;
-  req.wait_fence = nullptr;
   std::cout << "Enqueing buf " << buffer << " to delete\n";
-  _deletion_queue.push_back(std::move(req));
+  enqueue_deletion(req);
 }
 
+// Enqueues the objects in the request for deletion.  A fence is submitted
+// after the next frame, and the objects are destroyed once it signals.
+void RendererVk::enqueue_deletion(const VkDeletionRequest &req) {
+  _deletion_queue.push_back(req);
+  _deletion_queue.back().wait_fence = nullptr;
+}
 
 void RendererVk::process_deletions() {
   if (_deletion_queue.empty()) {
@@ -1235,30 +2093,108 @@ void RendererVk::process_deletions() {
   }
 
   for (int i = (int)_deletion_queue.size() - 1; i >= 0; --i) {
-    if (_deletion_queue[i].wait_fence == nullptr) {
+    VkDeletionRequest &req = _deletion_queue[i];
+    if (req.transfer_value != 0u) {
+      if (req.transfer_value <= _transfer_completed_value) {
+        vmaDestroyBuffer(_alloc, req.buffer, req.alloc);
+        _deletion_queue.erase(_deletion_queue.begin() + i);
+      }
+
+    } else if (req.wait_fence == nullptr) {
       VkFenceCreateInfo fence_info = {};
       fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
       fence_info.pNext = nullptr;
       fence_info.flags = 0;
       VkResult result = vkCreateFence(_device, &fence_info, nullptr,
-                                      &_deletion_queue[i].wait_fence);
+                                      &req.wait_fence);
       assert(result == VK_SUCCESS);
-      _created_deletion_fences.push_back(_deletion_queue[i].wait_fence);
-      std::cout << "Created wait fence for " << _deletion_queue[i].buffer << " to be deleted\n";
+      _created_deletion_fences.push_back(req.wait_fence);
+      if (req.buffer != nullptr) {
+        std::cout << "Created wait fence for " << req.buffer << " to be deleted\n";
+      }
 
-    } else if (vkGetFenceStatus(_device, _deletion_queue[i].wait_fence) ==
-               VK_SUCCESS) {
+    } else if (vkGetFenceStatus(_device, req.wait_fence) == VK_SUCCESS) {
       // The fence was signaled, meaning that the device is finished with the
-      // buffer.  We can go ahead and delete it now.
-      std::cout << "Deletion wait fence for " << _deletion_queue[i].buffer << " is signaled, deleting now\n";
-      vmaDestroyBuffer(_alloc, _deletion_queue[i].buffer,
-                       _deletion_queue[i].alloc);
-      vkDestroyFence(_device, _deletion_queue[i].wait_fence, nullptr);
+      // objects.  We can go ahead and delete them now.
+      if (req.image_view != nullptr) {
+        vkDestroyImageView(_device, req.image_view, nullptr);
+      }
+      if (req.image != nullptr) {
+        vmaDestroyImage(_alloc, req.image, req.alloc);
+      }
+      if (req.buffer != nullptr) {
+        std::cout << "Deletion wait fence for " << req.buffer << " is signaled, deleting now\n";
+        vmaDestroyBuffer(_alloc, req.buffer, req.alloc);
+      }
+      if (req.swapchain != nullptr) {
+        vkDestroySwapchainKHR(_device, req.swapchain, nullptr);
+      }
+      vkDestroyFence(_device, req.wait_fence, nullptr);
       _deletion_queue.erase(_deletion_queue.begin() + i);
     }
   }
 }
 
+// Records the queue family ownership acquires of the pending buffers whose
+// upload is at most up_to_value into the frame's acquire command buffer.
+// The submission running it must wait on the transfer timeline for
+// up_to_value, which orders the acquires after the matching releases.
+// cmd is set to the command buffer to submit, or null if nothing was
+// recorded.
+bool RendererVk::
+record_buffer_acquires(uint64_t up_to_value, VkCommandBuffer &cmd) {
+  cmd = nullptr;
+
+  vector<VkBufferMemoryBarrier> barriers;
+  for (size_t i = 0; i < _pending_acquires.size(); ) {
+    const VkBufferAcquire &acquire = _pending_acquires[i];
+    if (acquire.upload_value > up_to_value) {
+      ++i;
+      continue;
+    }
+    VkBufferMemoryBarrier barrier = { };
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.pNext = nullptr;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = acquire.dst_access;
+    barrier.srcQueueFamilyIndex = _transfer_queue_family_index;
+    barrier.dstQueueFamilyIndex = _gfx_queue_family_index;
+    barrier.buffer = acquire.buffer;
+    barrier.offset = 0;
+    barrier.size = acquire.size;
+    barriers.push_back(barrier);
+    _pending_acquires[i] = _pending_acquires.back();
+    _pending_acquires.pop_back();
+  }
+  if (barriers.empty()) {
+    return true;
+  }
+
+  VkCommandBuffer acquire_cmd = _acquire_command_buffers[_frame_cycle_index];
+  VkResult result = vkResetCommandBuffer(acquire_cmd, 0);
+  if (!vk_error_check(result, "reset acquire cmd buf")) {
+    return false;
+  }
+  VkCommandBufferBeginInfo begin_info = { };
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.pNext = nullptr;
+  begin_info.pInheritanceInfo = nullptr;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  result = vkBeginCommandBuffer(acquire_cmd, &begin_info);
+  if (!vk_error_check(result, "begin acquire cmd buf")) {
+    return false;
+  }
+  // The source stage matches the stage the transfer timeline is waited on.
+  vkCmdPipelineBarrier(acquire_cmd, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr);
+  result = vkEndCommandBuffer(acquire_cmd);
+  if (!vk_error_check(result, "end acquire cmd buf")) {
+    return false;
+  }
+
+  cmd = acquire_cmd;
+  return true;
+}
+
 // Submits the command buffer and queues the present operation.
 // If necessary in the future, we could split the present out into a
 // separate method that presents all windows (if we have multiple windows).
@@ -1271,24 +2207,74 @@ end_frame() {
     return false;
   }
 
+  _uniform_ring.flush();
+  _instance_ring.flush();
+
+  _frame_stats = _current_command_state->get_stats();
+  for (VkCommandState &state : _record_command_states[_frame_cycle_index]) {
+    _frame_stats += state.get_stats();
+  }
+
+  // Wait for the newest upload that the frame's draws read.  Waiting on a
+  // value the transfer queue already reached doesn't stall, so only frames
+  // drawing freshly uploaded buffers end up waiting on the DMA.
+  uint64_t transfer_wait_value = _current_command_state->get_transfer_wait_value();
+  for (VkCommandState &state : _record_command_states[_frame_cycle_index]) {
+    transfer_wait_value = std::max(transfer_wait_value, state.get_transfer_wait_value());
+  }
+
+  // Take ownership of the buffers released by the transfer queue family
+  // that this frame waits on.  The rest stay pending until a later frame.
+  VkCommandBuffer bufs[2];
+  uint32_t buf_count = 0u;
+  VkCommandBuffer acquire_cmd = nullptr;
+  if (!record_buffer_acquires(transfer_wait_value, acquire_cmd)) {
+    return false;
+  }
+  if (acquire_cmd != nullptr) {
+    bufs[buf_count++] = acquire_cmd;
+  }
+  bufs[buf_count++] = _current_command_buffer;
+
   // Now submit.
-  VkCommandBuffer bufs[] = { _current_command_buffer };
-  // Wait on the swapchain image *and* for all transfers to complete.
-  VkPipelineStageFlags pipe_flags[2] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT };
-  VkSemaphore wait_semas[2] = { _current_image_acquired_semaphore, _current_transfer_semaphore };
+  VkPipelineStageFlags pipe_flags[2];
+  VkSemaphore wait_semas[2];
+  uint64_t wait_values[2];
+  uint32_t wait_count = 0u;
+  if (transfer_wait_value > 0u) {
+    wait_semas[wait_count] = _transfer_timeline;
+    wait_values[wait_count] = transfer_wait_value;
+    pipe_flags[wait_count] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    ++wait_count;
+  }
+  if (_image_acquired) {
+    // Wait, on the gpu, for the current swapchain image to become available,
+    // before writing to the color attachment (which would be the swapchain image).
+    // If no image could be acquired this frame, there is nothing to present.
+    wait_semas[wait_count] = _current_image_acquired_semaphore;
+    wait_values[wait_count] = 0u;
+    pipe_flags[wait_count] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    ++wait_count;
+  }
+  uint64_t signal_value = 0u;
+  VkTimelineSemaphoreSubmitInfo timeline_info = { };
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.pNext = nullptr;
+  timeline_info.waitSemaphoreValueCount = wait_count;
+  timeline_info.pWaitSemaphoreValues = wait_values;
+  timeline_info.signalSemaphoreValueCount = _image_acquired ? 1 : 0;
+  timeline_info.pSignalSemaphoreValues = &signal_value;
   VkSubmitInfo submit_info = { };
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.pNext = nullptr;
-  // Wait, on the gpu, for the current swapchain image to become available,
-  // before writing to the color attachment (which would be the swapchain image).
-  submit_info.waitSemaphoreCount = 2;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = wait_count;
   submit_info.pWaitSemaphores = wait_semas;
   submit_info.pWaitDstStageMask = pipe_flags;
-  submit_info.commandBufferCount = 1;
+  submit_info.commandBufferCount = buf_count;
   submit_info.pCommandBuffers = bufs;
   // Signal this semaphore on the GPU when the command buffer finishes.
   // The present operation will wait on this semaphore.
-  submit_info.signalSemaphoreCount = 1;
+  submit_info.signalSemaphoreCount = _image_acquired ? 1 : 0;
   submit_info.pSignalSemaphores = &_current_draw_semaphore;
   // _current_draw_fence will be signaled to the CPU when the command buffer
   // is finished on the GPU side and can be re-used.
@@ -1319,6 +2305,12 @@ end_frame() {
     _created_deletion_fences.clear();
   }
 
+  if (!_image_acquired) {
+    cycle_frame();
+    return true;
+  }
+  _image_acquired = false;
+
   // Now, present!
   VkPresentInfoKHR present_info = { };
   present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1333,7 +2325,10 @@ end_frame() {
   present_info.pWaitSemaphores = &_current_draw_semaphore;
   present_info.pResults = nullptr;
   result = vkQueuePresentKHR(_present_queue, &present_info);
-  if (!vk_error_check(result, "queue present")) {
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+    // Recreate the swapchain at the start of the next frame.
+    _graphics_output_dirty = true;
+  } else if (!vk_error_check(result, "queue present")) {
     return false;
   }
 
@@ -1345,19 +2340,78 @@ end_frame() {
 }
 
 bool RendererVk::draw(const VertexData *vdata, const IndexData *idata,
-                      int first_vertex, int num_vertices) {
+                      int first_vertex, int num_vertices,
+                      const Matrix4x4 *transform) {
+  assert(!_surface_secondary_contents);
+  return draw(_current_command_state, vdata, idata, first_vertex, num_vertices,
+              transform);
+}
+
+// Records a draw into the command buffer shadowed by the given state.
+// Safe to call from multiple threads as long as each uses its own state.
+bool RendererVk::draw(VkCommandState *state, const VertexData *vdata,
+                      const IndexData *idata, int first_vertex,
+                      int num_vertices, const Matrix4x4 *transform) {
+  return record_draw(state, vdata, idata, first_vertex, num_vertices,
+                     transform, nullptr, 1u);
+}
+
+// Records num_instances copies of a draw in a single draw call, the model
+// matrix of each taken from transforms.  The transforms are copied into
+// the frame's instance ring.  Safe to call from multiple threads as long as
+// each uses its own state.
+bool RendererVk::
+draw_instanced(VkCommandState *state, const VertexData *vdata,
+               const IndexData *idata, int first_vertex, int num_vertices,
+               const Matrix4x4 *transforms, size_t num_instances) {
+  if (num_instances == 0u) {
+    return true;
+  }
+  return record_draw(state, vdata, idata, first_vertex, num_vertices,
+                     nullptr, transforms, num_instances);
+}
+
+// Shared implementation of draw() and draw_instanced().  If
+// instance_transforms is null, a single instance is drawn with transform
+// as model matrix, or the default one if that is null too.
+bool RendererVk::
+record_draw(VkCommandState *state, const VertexData *vdata,
+            const IndexData *idata, int first_vertex, int num_vertices,
+            const Matrix4x4 *transform, const Matrix4x4 *instance_transforms,
+            size_t num_instances) {
   const VkVertexData *vk_vdata = (const VkVertexData *)vdata;
   const VkIndexData *vk_idata = (const VkIndexData *)idata;
+  VkCommandBuffer cmd = state->get_command_buffer();
+  bool instanced = instance_transforms != nullptr;
+
+  uint32_t instance_offset = 0u;
+  if (instanced) {
+    size_t instance_size = sizeof(Matrix4x4) * num_instances;
+    void *instance_data = _instance_ring.allocate(instance_size, instance_offset);
+    if (instance_data == nullptr) {
+      return false;
+    }
+    memcpy(instance_data, instance_transforms, instance_size);
+  }
+
+  // Per-draw constants go in the uniform ring.
+  uint32_t params_offset;
+  CamParams *params = (CamParams *)_uniform_ring.allocate(sizeof(CamParams), params_offset);
+  if (params == nullptr) {
+    return false;
+  }
+  params->model_mat = (transform != nullptr) ? *transform : cam_params.model_mat;
+  params->view_mat = cam_params.view_mat;
+  params->proj_mat = cam_params.proj_mat;
 
-  vkCmdBindPipeline(_current_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_pipeline);
-  vkCmdBindDescriptorSets(_current_command_buffer,
-                          VK_PIPELINE_BIND_POINT_GRAPHICS, vk_pipeline_layout,
-                          0, 1, &vk_desc_set, 0, nullptr);
+  state->bind_pipeline(instanced ? vk_instanced_pipeline : vk_pipeline);
+  state->bind_descriptor_sets(vk_pipeline_layout, 0, 1, &vk_desc_set, 1, &params_offset);
 
   bool indexed = vk_idata != nullptr;
 
   if (indexed) {
-    vkCmdBindIndexBuffer(_current_command_buffer, vk_idata->gpu_buffer, 0, get_vk_index_type(vk_idata->type));
+    state->bind_index_buffer(vk_idata->gpu_buffer, 0, get_vk_index_type(vk_idata->type));
+    state->wait_for_transfer(vk_idata->upload_value);
   }
 
   if (num_vertices <= 0) {
@@ -1374,26 +2428,193 @@ bool RendererVk::draw(const VertexData *vdata, const IndexData *idata,
   VkBuffer *vkbufs = (VkBuffer *)alloca(sizeof(VkBuffer) * vbuf_count);
   for (int i = 0; i < vbuf_count; ++i) {
     vkbufs[i] = vk_vdata->vk_buffers[i].gpu_buffer;
+    state->wait_for_transfer(vk_vdata->vk_buffers[i].upload_value);
   }
   VkDeviceSize *offsets = (VkDeviceSize *)alloca(sizeof(VkDeviceSize) * vbuf_count);
   for (int i = 0; i < vbuf_count; ++i) {
     offsets[i] = 0;
   }
-  vkCmdBindVertexBuffers(_current_command_buffer, 0, vbuf_count, vkbufs, offsets);
+  state->bind_vertex_buffers(0, vbuf_count, vkbufs, offsets);
+
+  if (instanced) {
+    VkBuffer instance_buffer = _instance_ring.get_buffer();
+    VkDeviceSize instance_buffer_offset = instance_offset;
+    state->bind_vertex_buffers(instance_binding, 1, &instance_buffer, &instance_buffer_offset);
+    state->get_stats().instances_drawn += (uint32_t)num_instances;
+  }
 
   if (indexed) {
-    vkCmdDrawIndexed(_current_command_buffer, num_vertices, 1, first_vertex, 0, 0);
+    vkCmdDrawIndexed(cmd, num_vertices, (uint32_t)num_instances, first_vertex, 0, 0);
   } else {
-    vkCmdDraw(_current_command_buffer, num_vertices, 1, first_vertex, 0);
+    vkCmdDraw(cmd, num_vertices, (uint32_t)num_instances, first_vertex, 0);
   }
+  state->get_stats().draw_calls++;
 
   return true;
 }
 
-bool RendererVk::draw_mesh(const Mesh *mesh) {
+bool RendererVk::draw_mesh(const Mesh *mesh, const Matrix4x4 *transform) {
+  if (!is_mesh_resident(mesh)) {
+    // Still streaming in, skip it rather than stall on the upload.
+    _current_command_state->get_stats().meshes_not_resident++;
+    return false;
+  }
   // TODO: set primitive topology, needs pipeline switch.
   return draw(mesh->vertex_data, mesh->index_data, mesh->first_vertex,
-              mesh->num_vertices);
+              mesh->num_vertices, transform);
+}
+
+// Draws num_instances copies of the mesh with one draw call, see
+// draw_instanced().
+bool RendererVk::
+draw_mesh_instanced(const Mesh *mesh, const Matrix4x4 *transforms,
+                    size_t num_instances) {
+  assert(!_surface_secondary_contents);
+  if (!is_mesh_resident(mesh)) {
+    _current_command_state->get_stats().meshes_not_resident++;
+    return false;
+  }
+  return draw_instanced(_current_command_state, mesh->vertex_data,
+                        mesh->index_data, mesh->first_vertex,
+                        mesh->num_vertices, transforms, num_instances);
+}
+
+// Returns true if a batch of num_draws draws is big enough that recording it
+// with draw_meshes_parallel() beats recording inline.
+bool RendererVk::
+use_parallel_recording(size_t num_draws) const {
+  return _record_pool != nullptr && num_draws >= _min_draws_per_record_task * 2u;
+}
+
+// Limits draw_meshes_parallel() to as many tasks as num_threads, one per
+// thread, so the scaling of recording can be measured.  It can't go past
+// the threads of the pool the renderer was made with.
+void RendererVk::
+set_num_record_threads(int num_threads) {
+  _num_record_tasks = std::clamp(num_threads, 1, (int)_record_cmd_pools[0].size());
+}
+
+// Records the given meshes, in order, into secondary command buffers on the
+// record threads and executes them from the frame's command buffer.  The
+// surface must have been begun with secondary contents.
+//
+// If instance_counts is given, a mesh with a count above 1 is drawn
+// instanced, with transforms pointing to that many transforms.
+bool RendererVk::
+draw_meshes_parallel(const Mesh *const *meshes,
+                     const Matrix4x4 *const *transforms, size_t count,
+                     const uint32_t *instance_counts) {
+  assert(_surface_secondary_contents);
+
+  if (count == 0u) {
+    return true;
+  }
+
+  // Split into contiguous ranges so the submission order is preserved.
+  int num_tasks = (int)std::min((size_t)_num_record_tasks,
+    (count + _min_draws_per_record_task - 1u) / _min_draws_per_record_task);
+  size_t draws_per_task = (count + num_tasks - 1u) / num_tasks;
+
+  VkCommandBufferInheritanceRenderingInfo inherit_rendering = { };
+  inherit_rendering.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+  inherit_rendering.pNext = nullptr;
+  inherit_rendering.flags = 0;
+  inherit_rendering.viewMask = 0;
+  inherit_rendering.colorAttachmentCount = 1;
+  inherit_rendering.pColorAttachmentFormats = &_surface_color_format;
+  inherit_rendering.depthAttachmentFormat = _surface_depth_format;
+  inherit_rendering.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+  inherit_rendering.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+  VkCommandBufferInheritanceInfo inherit = { };
+  inherit.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inherit.pNext = &inherit_rendering;
+  inherit.renderPass = nullptr;
+  inherit.subpass = 0;
+  inherit.framebuffer = nullptr;
+  inherit.occlusionQueryEnable = VK_FALSE;
+  VkCommandBufferBeginInfo begin_info = { };
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.pNext = nullptr;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                     VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  begin_info.pInheritanceInfo = &inherit;
+
+  std::atomic<bool> success = true;
+
+  auto record_task = [&](int task) {
+    size_t begin = task * draws_per_task;
+    size_t end = std::min(count, begin + draws_per_task);
+    VkCommandState *state = &_record_command_states[_frame_cycle_index][task];
+    VkCommandBuffer cmd = state->get_command_buffer();
+
+    VkResult result = vkBeginCommandBuffer(cmd, &begin_info);
+    if (!vk_error_check(result, "begin record cmd buf")) {
+      success = false;
+      return;
+    }
+    set_viewport_and_scissor(cmd);
+    for (size_t i = begin; i < end; ++i) {
+      const Mesh *mesh = meshes[i];
+      if (!is_mesh_resident(mesh)) {
+        state->get_stats().meshes_not_resident++;
+        continue;
+      }
+      const Matrix4x4 *transform = (transforms != nullptr) ? transforms[i] : nullptr;
+      if (instance_counts != nullptr && instance_counts[i] > 1u) {
+        draw_instanced(state, mesh->vertex_data, mesh->index_data,
+                       mesh->first_vertex, mesh->num_vertices, transform,
+                       instance_counts[i]);
+      } else {
+        draw(state, mesh->vertex_data, mesh->index_data, mesh->first_vertex,
+             mesh->num_vertices, transform);
+      }
+    }
+    result = vkEndCommandBuffer(cmd);
+    if (!vk_error_check(result, "end record cmd buf")) {
+      success = false;
+    }
+  };
+
+  if (_record_pool != nullptr) {
+    _record_pool->run(num_tasks, record_task);
+  } else {
+    for (int i = 0; i < num_tasks; ++i) {
+      record_task(i);
+    }
+  }
+
+  if (!success) {
+    return false;
+  }
+
+  vkCmdExecuteCommands(_current_command_buffer, num_tasks,
+                       _record_command_buffers[_frame_cycle_index].data());
+  return true;
+}
+
+// Reads how far the transfer queue got, without waiting.
+void RendererVk::
+poll_transfer_timeline() {
+  VkResult result = vkGetSemaphoreCounterValue(_device, _transfer_timeline, &_transfer_completed_value);
+  vk_error_check(result, "get transfer timeline value");
+}
+
+// Should be called when the window the renderer outputs to is resized.
+void RendererVk::
+notify_resized() {
+  _graphics_output_dirty = true;
+}
+
+// Recreates the swapchain if the window was resized or the swapchain went
+// out of date.  Should be called before beginning a frame.  Returns false
+// if there is currently nothing to render to, such as when the window is
+// minimized, in which case the frame should be skipped.
+bool RendererVk::
+update_graphics_output() {
+  if (!_graphics_output_dirty || _options.headless) {
+    return true;
+  }
+  return recreate_graphics_output();
 }
 
 // Cycles the command buffer in use by the CPU for recording commands.
@@ -1410,19 +2631,264 @@ update_frame_objects() {
   _current_draw_fence = _draw_fences[_frame_cycle_index];
   _current_draw_semaphore = _draw_semaphores[_frame_cycle_index];
   _current_image_acquired_semaphore = _image_acquired_semaphores[_frame_cycle_index];
-  _current_transfer_semaphore = _transfer_semaphores[_frame_cycle_index];
   _current_transfer_command_buffer = _transfer_command_buffers[_frame_cycle_index];
   _current_transfer_fence = _transfer_fences[_frame_cycle_index];
+  _current_command_state = &_command_states[_frame_cycle_index];
+}
+
+// Prepares the shadow for a command buffer that just began recording.
+void VkCommandState::
+reset(VkCommandBuffer cmd) {
+  *this = VkCommandState();
+  _cmd = cmd;
+}
+
+void VkCommandState::
+bind_pipeline(VkPipeline pipeline) {
+  if (pipeline == _pipeline) {
+    _stats.binds_skipped++;
+    return;
+  }
+  vkCmdBindPipeline(_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  _pipeline = pipeline;
+  _stats.binds_issued++;
+}
+
+void VkCommandState::
+bind_descriptor_sets(VkPipelineLayout layout, uint32_t first_set,
+                     uint32_t count, const VkDescriptorSet *sets,
+                     uint32_t dynamic_offset_count,
+                     const uint32_t *dynamic_offsets) {
+  assert(first_set + count <= max_descriptor_sets);
+  assert(dynamic_offset_count <= max_dynamic_offsets);
+
+  if (layout != _pipeline_layout) {
+    // Sets bound through a different layout may have been disturbed, so
+    // forget about all of them.
+    for (uint32_t i = 0; i < max_descriptor_sets; ++i) {
+      _descriptor_sets[i] = nullptr;
+    }
+    _dynamic_offset_count = 0u;
+    _pipeline_layout = layout;
+  }
+
+  if (dynamic_offset_count > 0u) {
+    // Which offset belongs to which set depends on the set layouts, so the
+    // range can't be trimmed.  It is only skipped if it matches entirely.
+    bool same = first_set == _dynamic_first_set &&
+                count == _dynamic_set_count &&
+                dynamic_offset_count == _dynamic_offset_count;
+    for (uint32_t i = 0; same && i < count; ++i) {
+      same = _descriptor_sets[first_set + i] == sets[i];
+    }
+    for (uint32_t i = 0; same && i < dynamic_offset_count; ++i) {
+      same = _dynamic_offsets[i] == dynamic_offsets[i];
+    }
+    if (same) {
+      _stats.binds_skipped++;
+      return;
+    }
+
+    vkCmdBindDescriptorSets(_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout,
+                            first_set, count, sets, dynamic_offset_count,
+                            dynamic_offsets);
+    for (uint32_t i = 0; i < count; ++i) {
+      _descriptor_sets[first_set + i] = sets[i];
+    }
+    _dynamic_first_set = first_set;
+    _dynamic_set_count = count;
+    _dynamic_offset_count = dynamic_offset_count;
+    memcpy(_dynamic_offsets, dynamic_offsets, dynamic_offset_count * sizeof(uint32_t));
+    _stats.binds_issued++;
+    return;
+  }
+
+  // Trim the range down to the sets that actually change.
+  while (count > 0u && _descriptor_sets[first_set] == sets[0]) {
+    ++first_set;
+    ++sets;
+    --count;
+  }
+  while (count > 0u && _descriptor_sets[first_set + count - 1u] == sets[count - 1u]) {
+    --count;
+  }
+  if (count == 0u) {
+    _stats.binds_skipped++;
+    return;
+  }
+
+  vkCmdBindDescriptorSets(_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout,
+                          first_set, count, sets, 0, nullptr);
+  for (uint32_t i = 0; i < count; ++i) {
+    _descriptor_sets[first_set + i] = sets[i];
+  }
+  if (first_set < _dynamic_first_set + _dynamic_set_count &&
+      first_set + count > _dynamic_first_set) {
+    // Rebound some of the sets the dynamic offsets went with.
+    _dynamic_offset_count = 0u;
+    _dynamic_set_count = 0u;
+  }
+  _stats.binds_issued++;
+}
+
+// Creates the ring buffer, frame_size bytes for each of num_frames frames.
+// Allocations are aligned to alignment, which should be the device's
+// minUniformBufferOffsetAlignment.
+bool VkUniformRing::
+initialize(VmaAllocator alloc, size_t frame_size, uint32_t num_frames,
+           size_t alignment, VkBufferUsageFlags usage) {
+  _vma = alloc;
+  _alignment = std::max(alignment, (size_t)1u);
+  _frame_size = (frame_size + _alignment - 1u) & ~(_alignment - 1u);
+
+  VkBufferCreateInfo create_info = { };
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = nullptr;
+  create_info.usage = usage;
+  create_info.size = _frame_size * num_frames;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = nullptr;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+  alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  VmaAllocationInfo info = { };
+  VkResult result = vmaCreateBuffer(_vma, &create_info, &alloc_info, &_buffer, &_alloc, &info);
+  if (!vk_error_check(result, "create uniform ring")) {
+    return false;
+  }
+  _mapped = (ubyte *)info.pMappedData;
+  return true;
+}
+
+// Starts handing out memory from the given frame's region.  The GPU must be
+// done with the frame's previous use of it.
+void VkUniformRing::
+begin_frame(uint32_t frame) {
+  _frame_begin = _frame_size * frame;
+  _frame_used = 0u;
+  _overflowed = false;
+}
+
+// Makes the data written this frame visible to the device.  No-op for
+// host-coherent memory.
+void VkUniformRing::
+flush() {
+  size_t used = std::min((size_t)_frame_used, _frame_size);
+  if (used > 0u) {
+    vmaFlushAllocation(_vma, _alloc, _frame_begin, used);
+  }
+}
+
+// Returns size bytes to write uniform data into, valid until the end of
+// the frame.  offset is set to the offset of the data in the ring buffer,
+// to use as dynamic offset.  Returns null if the frame's region is full.
+void *VkUniformRing::
+allocate(size_t size, uint32_t &offset) {
+  size = (size + _alignment - 1u) & ~(_alignment - 1u);
+  size_t begin = _frame_used.fetch_add(size);
+  if (begin + size > _frame_size) {
+    if (!_overflowed.exchange(true)) {
+      std::cerr << "Ring buffer out of space for this frame\n";
+    }
+    return nullptr;
+  }
+  offset = (uint32_t)(_frame_begin + begin);
+  return _mapped + _frame_begin + begin;
+}
+
+void VkCommandState::
+bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType type) {
+  if (buffer == _index_buffer && offset == _index_offset && type == _index_type) {
+    _stats.binds_skipped++;
+    return;
+  }
+  vkCmdBindIndexBuffer(_cmd, buffer, offset, type);
+  _index_buffer = buffer;
+  _index_offset = offset;
+  _index_type = type;
+  _stats.binds_issued++;
+}
+
+void VkCommandState::
+bind_vertex_buffers(uint32_t first_binding, uint32_t count,
+                    const VkBuffer *buffers, const VkDeviceSize *offsets) {
+  assert(first_binding + count <= max_vertex_buffers);
+
+  // Trim the range down to the bindings that actually change.
+  while (count > 0u && _vertex_buffers[first_binding] == buffers[0] &&
+         _vertex_offsets[first_binding] == offsets[0]) {
+    ++first_binding;
+    ++buffers;
+    ++offsets;
+    --count;
+  }
+  while (count > 0u &&
+         _vertex_buffers[first_binding + count - 1u] == buffers[count - 1u] &&
+         _vertex_offsets[first_binding + count - 1u] == offsets[count - 1u]) {
+    --count;
+  }
+  if (count == 0u) {
+    _stats.binds_skipped++;
+    return;
+  }
+
+  vkCmdBindVertexBuffers(_cmd, first_binding, count, buffers, offsets);
+  for (uint32_t i = 0; i < count; ++i) {
+    _vertex_buffers[first_binding + i] = buffers[i];
+    _vertex_offsets[first_binding + i] = offsets[i];
+  }
+  _stats.binds_issued++;
 }
 
 // Initializes a VkBuffer an enqueues a transfer into device-local memory using
 // the provided client-side data buffer.  Ideal for a static vertex/index buffer.
+// Uploads the whole buffer in the current prepare phase, regardless of the
+// upload budget.
 void RendererVk::prepare_buffer(VkBufferBase *buffer, ubyte *data,
                                 size_t size, u32 buffer_usage) {
   if (buffer->gpu_buffer != nullptr) {
     return;
   }
 
+  if (!create_gpu_buffer(buffer, size, buffer_usage)) {
+    return;
+  }
+  upload_buffer_range(buffer, data, 0u, size, size, buffer_usage);
+}
+
+bool RendererVk::
+create_gpu_buffer(VkBufferBase *buffer, size_t size, u32 buffer_usage) {
+  VkBufferCreateInfo create_info = { };
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = nullptr;
+  create_info.usage = buffer_usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  create_info.size = size;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = nullptr;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.flags = 0;
+  VmaAllocationCreateInfo vbuf_alloc_info = { };
+  vbuf_alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VkResult result = vmaCreateBuffer(_alloc, &create_info, &vbuf_alloc_info, &buffer->gpu_buffer, &buffer->gpu_alloc, nullptr);
+  if (!vk_error_check(result, "create buffer")) {
+    return false;
+  }
+  buffer->uploaded_size = 0u;
+  buffer->upload_value = 0u;
+  return true;
+}
+
+// Records the upload of size bytes of data into the buffer at the given
+// offset, through a staging buffer, into the current transfer command
+// buffer.  Once the last range of the buffer is recorded, the buffer is
+// handed to the graphics queue and becomes resident when the transfer
+// completes.
+void RendererVk::
+upload_buffer_range(VkBufferBase *buffer, const ubyte *data, size_t offset,
+                    size_t size, size_t total_size, u32 buffer_usage) {
   VkResult result;
 
   VkBufferCreateInfo staging_info = { };
@@ -1439,20 +2905,7 @@ void RendererVk::prepare_buffer(VkBufferBase *buffer, ubyte *data,
   VkBuffer staging_buffer = nullptr;
   VmaAllocation staging_alloc = nullptr;
   result = vmaCreateBuffer(_alloc, &staging_info, &staging_alloc_info, &staging_buffer, &staging_alloc, nullptr);
-
-  VkBufferCreateInfo create_info = { };
-  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  create_info.pNext = nullptr;
-  create_info.usage = buffer_usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-  create_info.size = size;
-  create_info.queueFamilyIndexCount = 0;
-  create_info.pQueueFamilyIndices = nullptr;
-  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  create_info.flags = 0;
-  VmaAllocationCreateInfo vbuf_alloc_info = { };
-  vbuf_alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-  result = vmaCreateBuffer(_alloc, &create_info, &vbuf_alloc_info, &buffer->gpu_buffer, &buffer->gpu_alloc, nullptr);
-  if (!vk_error_check(result, "create buffer")) {
+  if (!vk_error_check(result, "create staging buffer")) {
     return;
   }
 
@@ -1463,22 +2916,298 @@ void RendererVk::prepare_buffer(VkBufferBase *buffer, ubyte *data,
     return;
   }
 
-  memcpy(vbuf_ptr, data, size);
+  memcpy(vbuf_ptr, data + offset, size);
   vmaUnmapMemory(_alloc, staging_alloc);
 
   // Now queue the data transfer to GPU-local.
   VkBufferCopy region = { };
   region.srcOffset = 0;
-  region.dstOffset = 0;
+  region.dstOffset = offset;
   region.size = size;
   vkCmdCopyBuffer(_current_transfer_command_buffer, staging_buffer,
                   buffer->gpu_buffer, 1, &region);
+  ++_num_prepared_uploads;
+
+  // The staging buffer is only touched by the transfer queue.
+  VkDeletionRequest req;
+  req.buffer = staging_buffer;
+  req.alloc = staging_alloc;
+  req.transfer_value = _transfer_timeline_value + 1u;
+  enqueue_deletion(req);
+
+  buffer->state = BS_uploading;
+  buffer->uploaded_size = offset + size;
+  if (buffer->uploaded_size < total_size) {
+    return;
+  }
 
-  enqueue_buffer_deletion(staging_buffer, staging_alloc);
+  // The buffer can be read once end_prepare()'s submission completes.
+  buffer->upload_value = _transfer_timeline_value + 1u;
+
+  if (has_dedicated_transfer_queue()) {
+    // Hand the buffer over to the graphics queue family.  The matching
+    // acquire is recorded by the first frame that waits on this upload.
+    VkAccessFlags dst_access = 0;
+    if (buffer_usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+      dst_access |= VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    }
+    if (buffer_usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT) {
+      dst_access |= VK_ACCESS_INDEX_READ_BIT;
+    }
+
+    VkBufferMemoryBarrier release = { };
+    release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    release.pNext = nullptr;
+    release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    release.dstAccessMask = 0;
+    release.srcQueueFamilyIndex = _transfer_queue_family_index;
+    release.dstQueueFamilyIndex = _gfx_queue_family_index;
+    release.buffer = buffer->gpu_buffer;
+    release.offset = 0;
+    release.size = total_size;
+    vkCmdPipelineBarrier(_current_transfer_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &release, 0, nullptr);
+
+    VkBufferAcquire acquire;
+    acquire.buffer = buffer->gpu_buffer;
+    acquire.size = total_size;
+    acquire.dst_access = dst_access;
+    acquire.upload_value = buffer->upload_value;
+    _pending_acquires.push_back(acquire);
+  }
+}
+
+// Queues the data for upload by process_uploads().  Buffers with a lower
+// priority value are uploaded first, so passing something like the
+// distance to the camera streams in nearby geometry first.  Queueing a
+// buffer that is already waiting updates its priority.
+void RendererVk::
+queue_buffer_upload(VkBufferBase *buffer, const vector<ubyte> *data,
+                    u32 buffer_usage, float priority) {
+  buffer->upload_priority = priority;
+  if (buffer->state != BS_empty || data->empty()) {
+    return;
+  }
+
+  buffer->state = BS_queued;
+  VkUploadRequest req;
+  req.buffer = buffer;
+  req.data = data;
+  req.buffer_usage = buffer_usage;
+  _upload_requests.push_back(req);
+}
+
+// Dynamic data skips the scheduler, it is written straight into
+// host-visible memory from begin_frame().
+void RendererVk::
+queue_vertex_data(VertexData *data, float priority) {
+  VkVertexData *vkdata = (VkVertexData *)data;
+  vkdata->vk_buffers.resize(data->array_buffers.size());
+  if (data->usage == MaterialEnums::BU_dynamic) {
+    data->dirty_ranges.resize(data->array_buffers.size());
+    for (size_t i = 0; i < data->array_buffers.size(); ++i) {
+      add_dynamic_buffer(&vkdata->vk_buffers[i], &data->array_buffers[i], &data->dirty_ranges[i], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    }
+    return;
+  }
+  for (size_t i = 0; i < data->array_buffers.size(); ++i) {
+    queue_buffer_upload(&vkdata->vk_buffers[i], &data->array_buffers[i], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, priority);
+  }
+}
+
+void RendererVk::
+queue_index_data(IndexData *data, float priority) {
+  VkIndexData *vkdata = (VkIndexData *)data;
+  if (data->usage == MaterialEnums::BU_dynamic) {
+    add_dynamic_buffer(vkdata, &data->buffer, &data->dirty_ranges, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    return;
+  }
+  queue_buffer_upload(vkdata, &data->buffer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, priority);
+}
+
+void RendererVk::
+add_dynamic_buffer(VkBufferBase *buffer, const vector<ubyte> *data,
+                   DirtyRanges *dirty, u32 buffer_usage) {
+  if (buffer->state != BS_empty) {
+    return;
+  }
+  buffer->state = BS_queued;
+
+  VkDynamicBuffer dyn;
+  dyn.buffer = buffer;
+  dyn.data = data;
+  dyn.dirty = dirty;
+  dyn.buffer_usage = buffer_usage;
+  _dynamic_buffers.push_back(dyn);
+}
+
+// Creates the per-frame copies of a dynamic buffer, replacing existing ones.
+// Host-visible memory is preferred in device-local heaps (resizable BAR),
+// and falls back to system memory otherwise.
+bool RendererVk::
+create_dynamic_buffer_copies(VkDynamicBuffer &dyn, size_t capacity) {
+  VkBufferBase *buffer = dyn.buffer;
+  for (VkBufferFrameCopy &copy : buffer->frame_copies) {
+    // May still be read by frames in flight.
+    VkDeletionRequest req;
+    req.buffer = copy.buffer;
+    req.alloc = copy.alloc;
+    enqueue_deletion(req);
+  }
+  buffer->frame_copies.clear();
+  buffer->frame_copies.resize(_num_frames);
+  buffer->gpu_buffer = nullptr;
+  buffer->gpu_alloc = nullptr;
+  buffer->capacity = capacity;
+
+  VkBufferCreateInfo create_info = { };
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.pNext = nullptr;
+  create_info.usage = dyn.buffer_usage;
+  create_info.size = capacity;
+  create_info.queueFamilyIndexCount = 0;
+  create_info.pQueueFamilyIndices = nullptr;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.flags = 0;
+  VmaAllocationCreateInfo alloc_info = { };
+  alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+  alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  for (VkBufferFrameCopy &copy : buffer->frame_copies) {
+    VmaAllocationInfo info = { };
+    VkResult result = vmaCreateBuffer(_alloc, &create_info, &alloc_info, &copy.buffer, &copy.alloc, &info);
+    if (!vk_error_check(result, "create dynamic buffer")) {
+      return false;
+    }
+    copy.mapped = (ubyte *)info.pMappedData;
+    // Every copy starts out with all of the data to write.
+    copy.pending.add(0u, dyn.data->size());
+  }
+  dyn.dirty->clear();
+  return true;
+}
+
+// Writes the changes to dynamic buffers into the current frame's copies.
+// Every copy collects the dirty ranges, but only gets written when its own
+// frame comes around and the GPU is done reading it, so a range written
+// once is copied once per frame in flight, and nothing is copied for data
+// that didn't change.  Buffers only get reallocated if their data outgrew
+// them.
+void RendererVk::
+update_dynamic_buffers() {
+  for (VkDynamicBuffer &dyn : _dynamic_buffers) {
+    VkBufferBase *buffer = dyn.buffer;
+    size_t size = dyn.data->size();
+    if (size == 0u) {
+      continue;
+    }
+
+    if (size > buffer->capacity) {
+      // Leave some room to grow.
+      if (!create_dynamic_buffer_copies(dyn, size + size / 2u)) {
+        continue;
+      }
+    } else if (!dyn.dirty->empty()) {
+      for (VkBufferFrameCopy &copy : buffer->frame_copies) {
+        copy.pending.add(*dyn.dirty);
+      }
+      dyn.dirty->clear();
+    }
+
+    VkBufferFrameCopy &copy = buffer->frame_copies[_frame_cycle_index];
+    for (const DirtyRanges::Range &range : copy.pending.get_ranges()) {
+      size_t end = std::min(range.end, size);
+      if (range.begin >= end) {
+        continue;
+      }
+      memcpy(copy.mapped + range.begin, dyn.data->data() + range.begin, end - range.begin);
+      // No-op for host-coherent memory.
+      vmaFlushAllocation(_alloc, copy.alloc, range.begin, end - range.begin);
+    }
+    copy.pending.clear();
+
+    buffer->gpu_buffer = copy.buffer;
+    buffer->gpu_alloc = copy.alloc;
+    buffer->state = BS_resident;
+  }
+}
+
+// Uploads queued buffers in priority order, up to the per-frame upload
+// budget.  A buffer larger than what is left of the budget is uploaded in
+// pieces over several frames, and isn't resident until the last piece is
+// done.  Must be called between begin_prepare() and end_prepare().
+void RendererVk::
+process_uploads() {
+  if (_upload_requests.empty()) {
+    return;
+  }
+
+  std::stable_sort(_upload_requests.begin(), _upload_requests.end(),
+    [](const VkUploadRequest &a, const VkUploadRequest &b) {
+      return a.buffer->upload_priority < b.buffer->upload_priority;
+    });
+
+  size_t budget = (_options.upload_budget != 0u) ? _options.upload_budget : SIZE_MAX;
+  size_t num_done = 0u;
+  for (const VkUploadRequest &req : _upload_requests) {
+    if (budget == 0u) {
+      break;
+    }
+    VkBufferBase *buffer = req.buffer;
+    size_t total_size = req.data->size();
+    if (buffer->gpu_buffer == nullptr &&
+        !create_gpu_buffer(buffer, total_size, req.buffer_usage)) {
+      break;
+    }
+
+    size_t size = std::min(total_size - buffer->uploaded_size, budget);
+    upload_buffer_range(buffer, req.data->data(), buffer->uploaded_size,
+                        size, total_size, req.buffer_usage);
+    budget -= size;
+    if (buffer->uploaded_size < total_size) {
+      // Continued next frame.
+      break;
+    }
+    ++num_done;
+  }
+
+  _upload_requests.erase(_upload_requests.begin(), _upload_requests.begin() + num_done);
+}
+
+// Returns the upload state of the buffer as of the start of the frame.
+VkBufferState RendererVk::
+get_buffer_state(const VkBufferBase *buffer) const {
+  if (buffer->state == BS_uploading && buffer->upload_value != 0u &&
+      buffer->upload_value <= _transfer_completed_value) {
+    return BS_resident;
+  }
+  return buffer->state;
+}
+
+// Returns true if all buffers of the mesh finished uploading, so drawing
+// it won't have to wait on the transfer queue.
+bool RendererVk::
+is_mesh_resident(const Mesh *mesh) const {
+  const VkVertexData *vk_vdata = (const VkVertexData *)mesh->vertex_data;
+  for (const VkVertexBuffer &buffer : vk_vdata->vk_buffers) {
+    if (get_buffer_state(&buffer) != BS_resident) {
+      return false;
+    }
+  }
+  if (mesh->index_data != nullptr) {
+    const VkIndexData *vk_idata = (const VkIndexData *)mesh->index_data;
+    if (get_buffer_state(vk_idata) != BS_resident) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void RendererVk::
 prepare_vertex_data(VertexData *data) {
+  if (data->usage == MaterialEnums::BU_dynamic) {
+    queue_vertex_data(data);
+    return;
+  }
   VkVertexData *vkdata = (VkVertexData *)data;
   vkdata->vk_buffers.resize(data->array_buffers.size());
   for (size_t i = 0; i < data->array_buffers.size(); ++i) {
@@ -1487,16 +3216,23 @@ prepare_vertex_data(VertexData *data) {
 }
 
 void RendererVk::prepare_index_data(IndexData *data) {
+  if (data->usage == MaterialEnums::BU_dynamic) {
+    queue_index_data(data);
+    return;
+  }
   VkIndexData *vkdata = (VkIndexData *)data;
   prepare_buffer(vkdata, data->buffer.data(), data->buffer.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
 }
 
 // Acquires an index buffer resource from the renderer.
 // The user is responsible for releasing the resource back to the renderer.
+// Touches no renderer state, so it may be called from any thread.
 IndexData *RendererVk::
-make_index_data(MaterialEnums::IndexType type, size_t initial_size) {
+make_index_data(MaterialEnums::IndexType type, size_t initial_size,
+                MaterialEnums::BufferUsage usage) {
   VkIndexData *data = new VkIndexData;
   data->type = type;
+  data->usage = usage;
   data->gpu_buffer = nullptr;
   data->gpu_alloc = nullptr;
   if (initial_size > 0u) {
@@ -1507,13 +3243,16 @@ make_index_data(MaterialEnums::IndexType type, size_t initial_size) {
 
 // Acquires a vertex data resource from the renderer.
 // The user is responsible for releasing the resource.
+// Touches no renderer state, so it may be called from any thread.
 VertexData *RendererVk::
-make_vertex_data(const VertexFormat &format, size_t initial_size) {
+make_vertex_data(const VertexFormat &format, size_t initial_size,
+                 MaterialEnums::BufferUsage usage) {
   VkVertexData *data = new VkVertexData;
   data->format = format;
+  data->usage = usage;
   data->vk_buffers.resize(format.arrays.size());
-  memset(data->vk_buffers.data(), 0, sizeof(VkVertexBuffer) * data->vk_buffers.size());
   data->array_buffers.resize(data->vk_buffers.size());
+  data->dirty_ranges.resize(data->vk_buffers.size());
   if (initial_size >= 0u) {
     for (int i = 0; i < data->array_buffers.size(); ++i) {
       data->array_buffers[i].resize(initial_size);
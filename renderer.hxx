@@ -17,19 +17,95 @@ typedef HWND WindowHandle;
 
 #include <vector>
 #include <unordered_map>
+#include <atomic>
 
 #include "material.hxx"
+#include "linmath.hxx"
+#include "thread_pool.hxx"
+
+vector<uint8_t> read_binary_file(const std::string &filename);
+bool vk_error_check(VkResult ret, const std::string &context);
+
+// Upload state of a GPU buffer.
+enum VkBufferState : uint8_t {
+  // No upload was requested.
+  BS_empty,
+  // Waiting for the upload scheduler to get to it.
+  BS_queued,
+  // Some or all of the data was handed to the transfer queue.
+  BS_uploading,
+  // The upload completed, the buffer can be drawn.
+  BS_resident,
+};
+
+// One frame in flight's copy of a dynamic buffer, persistently mapped.
+struct VkBufferFrameCopy {
+  VkBuffer buffer = nullptr;
+  VmaAllocation alloc = nullptr;
+  ubyte *mapped = nullptr;
+  // Bytes changed since this copy was last written.
+  DirtyRanges pending;
+};
 
 struct VkBufferBase {
   // This one holds the GPU-local data of the vertex buffer.
   VkBuffer gpu_buffer = nullptr;
   VmaAllocation gpu_alloc = nullptr;
+  // Transfer timeline value signaled once the last upload into gpu_buffer
+  // has completed.  0 if the buffer was never uploaded.
+  uint64_t upload_value = 0u;
+  // Upload progress.  Static buffers are never marked BS_resident, see
+  // RendererVk::get_buffer_state().  Dynamic buffers are resident once their
+  // copies exist.
+  VkBufferState state = BS_empty;
+  size_t uploaded_size = 0u;
+  // Lower values are uploaded first.
+  float upload_priority = 0.0f;
+
+  // Dynamic buffers only.  There is one copy per frame in flight, and
+  // gpu_buffer is pointed at the current frame's copy by begin_frame().
+  vector<VkBufferFrameCopy> frame_copies;
+  size_t capacity = 0u;
+};
+
+// A buffer with BU_dynamic usage, updated by the renderer every frame.
+struct VkDynamicBuffer {
+  VkBufferBase *buffer;
+  const vector<ubyte> *data;
+  DirtyRanges *dirty;
+  u32 buffer_usage;
+};
+
+// A buffer waiting to be uploaded by the upload scheduler.
+struct VkUploadRequest {
+  VkBufferBase *buffer;
+  // CPU-side data, must stay unchanged until the upload is done.
+  const vector<ubyte> *data;
+  u32 buffer_usage;
 };
 
+// Objects to destroy once the GPU is done with them.  Any of the handles
+// may be null.
 struct VkDeletionRequest {
+  VkBuffer buffer = nullptr;
+  VkImage image = nullptr;
+  VkImageView image_view = nullptr;
+  VkSwapchainKHR swapchain = nullptr;
+  // Allocation of the buffer or image.
+  VmaAllocation alloc = nullptr;
+  VkFence wait_fence = nullptr;
+  // If nonzero, the objects are only used by the transfer queue, and are
+  // deleted once the transfer timeline reaches this value.
+  uint64_t transfer_value = 0u;
+};
+
+// A buffer whose ownership was released by the transfer queue family, to be
+// acquired by the graphics queue family before it is read.
+struct VkBufferAcquire {
   VkBuffer buffer;
-  VmaAllocation alloc;
-  VkFence wait_fence;
+  VkDeviceSize size;
+  VkAccessFlags dst_access;
+  uint64_t upload_value;
 };
 
 struct VkIndexData : public VkBufferBase, public IndexData { };
@@ -39,9 +115,161 @@ struct VkVertexData : public VertexData {
   vector<VkVertexBuffer> vk_buffers;
 };
 
-//struct PipelineCacheKey {
-//  MaterialEnums::Mesh
-//};
+// Counters for the commands recorded into a command buffer.  Summed over
+// all command buffers of a frame to give the per-frame statistics.
+struct VkFrameStats {
+  uint32_t binds_issued = 0u;
+  uint32_t binds_skipped = 0u;
+  uint32_t draw_calls = 0u;
+  // Instances drawn by instanced draw calls.
+  uint32_t instances_drawn = 0u;
+  // Meshes not drawn because their buffers were still being uploaded.
+  uint32_t meshes_not_resident = 0u;
+
+  inline VkFrameStats &operator += (const VkFrameStats &other) {
+    binds_issued += other.binds_issued;
+    binds_skipped += other.binds_skipped;
+    draw_calls += other.draw_calls;
+    instances_drawn += other.instances_drawn;
+    meshes_not_resident += other.meshes_not_resident;
+    return *this;
+  }
+};
+
+// Shadows the state currently bound to a command buffer, so that binds
+// that would not change anything are never recorded.  Consecutive meshes
+// usually share the pipeline, descriptor sets and buffers, so most binds
+// end up being skipped.
+//
+// The shadow must be reset whenever the command buffer begins recording,
+// since bound state does not carry over between recordings.
+class VkCommandState {
+public:
+  static constexpr uint32_t max_descriptor_sets = 4u;
+  static constexpr uint32_t max_vertex_buffers = 8u;
+  static constexpr uint32_t max_dynamic_offsets = 8u;
+
+  void reset(VkCommandBuffer cmd);
+
+  void bind_pipeline(VkPipeline pipeline);
+  void bind_descriptor_sets(VkPipelineLayout layout, uint32_t first_set,
+                            uint32_t count, const VkDescriptorSet *sets,
+                            uint32_t dynamic_offset_count = 0u,
+                            const uint32_t *dynamic_offsets = nullptr);
+  void bind_index_buffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType type);
+  void bind_vertex_buffers(uint32_t first_binding, uint32_t count,
+                           const VkBuffer *buffers, const VkDeviceSize *offsets);
+
+  // Notes that the recorded commands read a buffer written by the transfer
+  // queue, which makes the submission wait for that upload to complete.
+  inline void wait_for_transfer(uint64_t upload_value) {
+    _transfer_wait_value = std::max(_transfer_wait_value, upload_value);
+  }
+
+  inline VkCommandBuffer get_command_buffer() const { return _cmd; }
+  inline VkFrameStats &get_stats() { return _stats; }
+  inline uint64_t get_transfer_wait_value() const { return _transfer_wait_value; }
+
+private:
+  VkCommandBuffer _cmd = nullptr;
+
+  VkPipeline _pipeline = nullptr;
+  VkPipelineLayout _pipeline_layout = nullptr;
+  VkDescriptorSet _descriptor_sets[max_descriptor_sets] = { };
+  // Dynamic offsets of the last bind that had any, and the sets they went
+  // with.
+  uint32_t _dynamic_first_set = 0u;
+  uint32_t _dynamic_set_count = 0u;
+  uint32_t _dynamic_offset_count = 0u;
+  uint32_t _dynamic_offsets[max_dynamic_offsets] = { };
+  VkBuffer _index_buffer = nullptr;
+  VkDeviceSize _index_offset = 0u;
+  VkIndexType _index_type = VK_INDEX_TYPE_UINT16;
+  VkBuffer _vertex_buffers[max_vertex_buffers] = { };
+  VkDeviceSize _vertex_offsets[max_vertex_buffers] = { };
+  uint64_t _transfer_wait_value = 0u;
+
+  VkFrameStats _stats;
+};
+
+// Hands out per-frame uniform data from a single persistently mapped
+// buffer, split into one region per frame in flight.  Allocating is an
+// atomic bump of the region's offset, so draws recorded in parallel can
+// allocate too.  A region is reused once its frame's fence has signaled.
+//
+// The buffer is meant to be bound through a UNIFORM_BUFFER_DYNAMIC
+// descriptor, with the offsets handed out here as dynamic offsets, so
+// per-draw constants never need a descriptor update.  Created with vertex
+// buffer usage instead, it holds per-instance vertex data.
+class VkUniformRing {
+public:
+  bool initialize(VmaAllocator alloc, size_t frame_size, uint32_t num_frames,
+                  size_t alignment,
+                  VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+
+  void begin_frame(uint32_t frame);
+  void flush();
+
+  void *allocate(size_t size, uint32_t &offset);
+
+  inline VkBuffer get_buffer() const { return _buffer; }
+
+private:
+  VmaAllocator _vma = nullptr;
+  VkBuffer _buffer = nullptr;
+  VmaAllocation _alloc = nullptr;
+  ubyte *_mapped = nullptr;
+  size_t _frame_size = 0u;
+  size_t _alignment = 1u;
+  // Start of the current frame's region, and how much of it is used.
+  size_t _frame_begin = 0u;
+  std::atomic<size_t> _frame_used { 0u };
+  std::atomic<bool> _overflowed { false };
+};
+
+// Runtime configuration of the renderer.  Values the device or surface
+// can't support are adjusted to the nearest supported ones at initialize().
+struct RendererOptionsVk {
+  enum PresentMode : uint8_t {
+    // Presents right away, may tear.
+    PM_immediate,
+    // Replaces the queued image, no tearing, lowest latency without tearing.
+    PM_mailbox,
+    // V-sync, always supported.
+    PM_fifo,
+    // V-sync, but presents right away if the frame came in late.
+    PM_fifo_relaxed,
+  };
+
+  // Number of frames the CPU may record ahead of the GPU.  More frames
+  // means better throughput at the cost of input latency.
+  uint32_t num_frames_in_flight = 2u;
+  // Minimum number of images requested for the swapchain.
+  uint32_t num_swapchain_images = 2u;
+  PresentMode present_mode = PM_immediate;
+  // Maximum number of bytes uploaded to the GPU by the upload scheduler per
+  // frame.  Larger buffers are uploaded over several frames.  0 means no
+  // limit.
+  size_t upload_budget = 4u << 20;
+  // Bytes of uniform data that can be allocated per frame.
+  size_t uniform_ring_size = 4u << 20;
+  // Bytes of per-instance data that can be allocated per frame, 64 bytes
+  // per instance.
+  size_t instance_ring_size = 8u << 20;
+  // Pool to record draws on in parallel, shared with the rest of the
+  // application so that there is one set of worker threads.  It must
+  // outlive the renderer.  Without one, or without workers, draws are
+  // recorded inline.
+  ThreadPool *thread_pool = nullptr;
+  // Renders into an offscreen color image of the given size instead of a
+  // window, which may then be null.  Nothing is presented.
+  bool headless = false;
+  uint32_t headless_width = 1280u;
+  uint32_t headless_height = 720u;
+  // Picks a CPU device, such as lavapipe, ahead of any GPU, so that results
+  // don't depend on the GPU of the machine.
+  bool prefer_cpu_device = false;
+};
 
 // A shader is responsible for taking in a material/vertex format and outputting
 // a graphics pipeline + descriptor sets.
@@ -76,57 +304,160 @@ public:
   VkQueue _present_queue;
   VkQueue _transfer_queue;
 
+  // Optional device features.  Multi-draw indirect includes a nonzero
+  // firstInstance in indirect draws.
+  bool _supports_multi_draw_indirect = false;
+  bool _supports_draw_indirect_count = false;
+
   VkCommandPool _cmd_pool;
   VkCommandPool _transfer_cmd_pool;
 
   VmaAllocator _alloc;
 
   // Graphics output objects.
-  VkSurfaceKHR _surface;
+  VkSurfaceKHR _surface = nullptr;
   VkExtent3D _surface_extents;
-  VkSwapchainKHR _swapchain;
+  VkSwapchainKHR _swapchain = nullptr;
   uint32_t _curr_swapchain_image_index;
   vector<VkImage> _swapchain_images;
   vector<VkImageView> _swapchain_image_views;
+  // Stands in for the swapchain when headless, as its only image.
+  VkImage _offscreen_image = nullptr;
+  VmaAllocation _offscreen_image_alloc = nullptr;
   VkImage _depth_image;
   VkImageView _depth_image_view;
   VmaAllocation _depth_image_alloc;
   VkFormat _surface_color_format;
   VkFormat _surface_depth_format;
-
-  static constexpr uint32_t _num_frames = 2u;
+  VkImageTiling _surface_depth_tiling;
+  // Max-reduced mip chain of the depth buffer, for occlusion culling.  See
+  // create_depth_pyramid().
+  static constexpr uint32_t _max_depth_pyramid_levels = 16u;
+  bool _supports_depth_pyramid = false;
+  VkImage _depth_pyramid_image = nullptr;
+  VmaAllocation _depth_pyramid_alloc = nullptr;
+  // View of all levels, and one of each level.
+  VkImageView _depth_pyramid_view = nullptr;
+  vector<VkImageView> _depth_pyramid_mip_views;
+  VkExtent2D _depth_pyramid_extents = { 0u, 0u };
+  uint32_t _depth_pyramid_levels = 0u;
+  // False until the first build, while the image has no layout yet.
+  bool _depth_pyramid_initialized = false;
+  VkSampler _depth_pyramid_sampler = nullptr;
+  VkDescriptorSetLayout _depth_pyramid_set_layout = nullptr;
+  VkPipelineLayout _depth_pyramid_pipeline_layout = nullptr;
+  VkPipeline _depth_pyramid_pipeline = nullptr;
+  VkDescriptorPool _depth_pyramid_desc_pool = nullptr;
+  // Indexed by frame, then level.
+  vector<VkDescriptorSet> _depth_pyramid_sets;
+  // Set when the swapchain no longer matches the surface and needs to be
+  // recreated before the next frame.
+  bool _graphics_output_dirty = false;
+  // True if a swapchain image was acquired for the current frame.
+  bool _image_acquired = false;
+
+  RendererOptionsVk _options;
+
+  // Per-frame objects, one of each for every frame in flight.
+  static constexpr uint32_t _max_frames = 8u;
+  uint32_t _num_frames = 2u;
   uint32_t _frame_cycle_index = 0u;
-  VkSemaphore _image_acquired_semaphores[_num_frames];
-  VkCommandBuffer _command_buffers[_num_frames];
-  VkCommandBuffer _transfer_command_buffers[_num_frames];
-  VkFence _draw_fences[_num_frames];
-  VkSemaphore _draw_semaphores[_num_frames];
-  VkSemaphore _transfer_semaphores[_num_frames];
-  VkFence _transfer_fences[_num_frames];
+  vector<VkSemaphore> _image_acquired_semaphores;
+  vector<VkCommandBuffer> _command_buffers;
+  vector<VkCommandBuffer> _transfer_command_buffers;
+  vector<VkFence> _draw_fences;
+  vector<VkSemaphore> _draw_semaphores;
+  vector<VkFence> _transfer_fences;
+  // Records the queue family ownership acquires of freshly uploaded
+  // buffers, submitted ahead of the frame's command buffer.
+  vector<VkCommandBuffer> _acquire_command_buffers;
   // Current frame.
   VkCommandBuffer _current_command_buffer;
   VkFence _current_draw_fence;
   VkSemaphore _current_draw_semaphore;
   VkSemaphore _current_image_acquired_semaphore;
-  VkSemaphore _current_transfer_semaphore;
   VkCommandBuffer _current_transfer_command_buffer;
   VkFence _current_transfer_fence;
 
+  // Every transfer submission signals the next value of this timeline, so
+  // draws can wait for exactly the uploads they read.
+  VkSemaphore _transfer_timeline;
+  // Last value submitted to the transfer queue.
+  uint64_t _transfer_timeline_value = 0u;
+  // Last value the transfer queue is known to have reached.
+  uint64_t _transfer_completed_value = 0u;
+  // Number of uploads recorded since begin_prepare().
+  uint32_t _num_prepared_uploads = 0u;
+  // Buffers released by the transfer queue family but not yet acquired by
+  // the graphics queue family.  Only used with a dedicated transfer family.
+  std::vector<VkBufferAcquire> _pending_acquires;
+
+  // Per-draw uniform data.
+  VkUniformRing _uniform_ring;
+  // Per-instance transforms of instanced draws.
+  VkUniformRing _instance_ring;
+
+  // Buffers waiting on the upload scheduler.
+  std::vector<VkUploadRequest> _upload_requests;
+  std::vector<VkDynamicBuffer> _dynamic_buffers;
+
+  // Bound state shadow of each frame's command buffer.
+  vector<VkCommandState> _command_states;
+  VkCommandState *_current_command_state;
+  // Statistics of the last frame that was submitted.
+  VkFrameStats _frame_stats;
+
+  // Parallel command recording.  Draws are split into tasks, each recorded
+  // into a secondary command buffer allocated from the task's own per-frame
+  // command pool, so tasks never touch the same pool.
+  static constexpr size_t _min_draws_per_record_task = 256u;
+  ThreadPool *_record_pool = nullptr;
+  int _num_record_tasks = 1;
+  // Indexed by frame, then task.
+  vector<vector<VkCommandPool>> _record_cmd_pools;
+  vector<vector<VkCommandBuffer>> _record_command_buffers;
+  vector<vector<VkCommandState>> _record_command_states;
+  // True if the current surface rendering takes secondary command buffers.
+  bool _surface_secondary_contents = false;
+
   std::vector<VkDeletionRequest> _deletion_queue;
   std::vector<VkFence> _created_deletion_fences;
 
 public:
-  bool initialize(WindowHandle hwnd);
+  bool initialize(WindowHandle hwnd,
+                  const RendererOptionsVk &options = RendererOptionsVk());
 
   bool create_device();
   bool create_queues();
   bool create_graphics_output(WindowHandle hwnd);
+  bool create_swapchain();
+  bool create_offscreen_image();
+  bool create_depth_buffer();
+  bool create_depth_pyramid();
+  bool create_depth_pyramid_pipeline();
+  bool recreate_graphics_output();
+  void update_surface_projection();
+
+  void notify_resized();
+  bool update_graphics_output();
+  VkPresentModeKHR choose_present_mode(const vector<VkPresentModeKHR> &supported) const;
   bool create_command_buffer();
+  bool create_record_command_buffers();
+
+  inline bool has_dedicated_transfer_queue() const {
+    return _transfer_queue_family_index != _gfx_queue_family_index;
+  }
+  void poll_transfer_timeline();
+  bool record_buffer_acquires(uint64_t up_to_value, VkCommandBuffer &cmd);
 
   void cycle_frame();
   void update_frame_objects();
 
   bool init_temp();
+  bool create_mesh_pipeline(VkPipelineLayout layout, VkShaderModule vtx_module,
+                            VkShaderModule frag_module,
+                            const VkPipelineVertexInputStateCreateInfo *vi,
+                            VkPipeline &pipeline);
 
   bool begin_frame();
   bool end_frame();
@@ -135,24 +466,78 @@ public:
   bool end_prepare();
 
   // TODO: Drawing to which framebuffer?
-  bool begin_frame_surface();
+  bool begin_frame_surface(bool secondary_contents = false);
   // Enqueue present/submit command buffer(s).
   bool end_frame_surface();
+  void begin_surface_rendering(VkAttachmentLoadOp load_op, bool secondary_contents);
+  bool suspend_frame_surface();
+  bool resume_frame_surface();
+  bool build_depth_pyramid();
 
   void enqueue_buffer_deletion(VkBuffer buffer, VmaAllocation alloc);
+  void enqueue_deletion(const VkDeletionRequest &req);
 
   void process_deletions();
 
   bool draw(const VertexData *vdata, const IndexData *idata,
-            int first_vertex = 0, int num_vertices = -1);
-  bool draw_mesh(const Mesh *mesh);
+            int first_vertex = 0, int num_vertices = -1,
+            const Matrix4x4 *transform = nullptr);
+  bool draw(VkCommandState *state, const VertexData *vdata,
+            const IndexData *idata, int first_vertex, int num_vertices,
+            const Matrix4x4 *transform);
+  bool draw_mesh(const Mesh *mesh, const Matrix4x4 *transform = nullptr);
+
+  bool record_draw(VkCommandState *state, const VertexData *vdata,
+                   const IndexData *idata, int first_vertex, int num_vertices,
+                   const Matrix4x4 *transform, const Matrix4x4 *instance_transforms,
+                   size_t num_instances);
+  bool draw_instanced(VkCommandState *state, const VertexData *vdata,
+                      const IndexData *idata, int first_vertex, int num_vertices,
+                      const Matrix4x4 *transforms, size_t num_instances);
+  bool draw_mesh_instanced(const Mesh *mesh, const Matrix4x4 *transforms,
+                           size_t num_instances);
+
+  bool use_parallel_recording(size_t num_draws) const;
+  void set_num_record_threads(int num_threads);
+  inline int get_num_record_threads() const { return _num_record_tasks; }
+  bool draw_meshes_parallel(const Mesh *const *meshes,
+                            const Matrix4x4 *const *transforms, size_t count,
+                            const uint32_t *instance_counts = nullptr);
+
+  void set_viewport_and_scissor(VkCommandBuffer cmd);
+
+  inline const VkFrameStats &get_frame_stats() const { return _frame_stats; }
+  const Matrix4x4 &get_default_model_matrix() const;
+  const Matrix4x4 &get_view_matrix() const;
+  const Matrix4x4 &get_projection_matrix() const;
 
   void prepare_buffer(VkBufferBase *buffer, ubyte *data, size_t size, u32 buffer_usage);
   void prepare_vertex_data(VertexData *data);
   void prepare_index_data(IndexData *data);
 
-  IndexData *make_index_data(MaterialEnums::IndexType type, size_t initial_size = 0u);
-  VertexData *make_vertex_data(const VertexFormat &format, size_t initial_size = 0u);
+  bool create_gpu_buffer(VkBufferBase *buffer, size_t size, u32 buffer_usage);
+  void upload_buffer_range(VkBufferBase *buffer, const ubyte *data,
+                           size_t offset, size_t size, size_t total_size,
+                           u32 buffer_usage);
+
+  void queue_buffer_upload(VkBufferBase *buffer, const vector<ubyte> *data,
+                           u32 buffer_usage, float priority);
+  void queue_vertex_data(VertexData *data, float priority = 0.0f);
+  void queue_index_data(IndexData *data, float priority = 0.0f);
+  void process_uploads();
+
+  void add_dynamic_buffer(VkBufferBase *buffer, const vector<ubyte> *data,
+                          DirtyRanges *dirty, u32 buffer_usage);
+  bool create_dynamic_buffer_copies(VkDynamicBuffer &dyn, size_t capacity);
+  void update_dynamic_buffers();
+
+  VkBufferState get_buffer_state(const VkBufferBase *buffer) const;
+  bool is_mesh_resident(const Mesh *mesh) const;
+
+  IndexData *make_index_data(MaterialEnums::IndexType type, size_t initial_size = 0u,
+                             MaterialEnums::BufferUsage usage = MaterialEnums::BU_static);
+  VertexData *make_vertex_data(const VertexFormat &format, size_t initial_size = 0u,
+                               MaterialEnums::BufferUsage usage = MaterialEnums::BU_static);
 
   VkShaderModule make_shader_module(const vector<uint8_t> &code);
 };
@@ -0,0 +1,460 @@
+#include "scene_bvh.hxx"
+#include "thread_pool.hxx"
+
+#include <atomic>
+#include <bit>
+#include <string.h>
+
+// Below this many items per task, splitting work up costs more than it
+// saves.
+static constexpr size_t min_items_per_task = 4096u;
+
+// Nodes with at most this many leaves have them all tested in SIMD batches
+// instead of being descended into, which costs more than testing a few
+// leaves needlessly.
+static constexpr u32 max_batch_cull_leaves = 32u;
+
+// Spreads the low 10 bits of v out to every third bit.
+static inline u32
+expand_bits(u32 v) {
+  v &= 0x3ffu;
+  v = (v * 0x00010001u) & 0xff0000ffu;
+  v = (v * 0x00000101u) & 0x0f00f00fu;
+  v = (v * 0x00000011u) & 0xc30c30c3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+static inline bool
+same_box(const BoundingBox &a, const BoundingBox &b) {
+  return memcmp(&a, &b, sizeof(BoundingBox)) == 0;
+}
+
+// Returns the union of two boxes.
+static inline BoundingBox
+merge_boxes(const BoundingBox &a, const BoundingBox &b) {
+  BoundingBox out = a;
+  out.extend(b);
+  return out;
+}
+
+// Builds the tree over the given boxes, indexed by object.  Empty boxes are
+// allowed, they are never visible or hit.
+void SceneBvh::
+build(const BoundingBox *boxes, size_t count, ThreadPool *pool) {
+  clear();
+  if (count == 0u) {
+    return;
+  }
+  assert(count < leaf_bit);
+
+  // Bounds of the box centers, which the Morton codes are quantized in.
+  // parallel_for() makes no more chunks than fit min_items_per_task each.
+  size_t num_parts = std::max((size_t)1u, count / min_items_per_task);
+  std::vector<BoundingBox> part_bounds(num_parts);
+  std::atomic<size_t> next_part(0u);
+  parallel_for(pool, count, min_items_per_task, [&](size_t begin, size_t end) {
+    BoundingBox &part = part_bounds[next_part++];
+    for (size_t i = begin; i < end; ++i) {
+      if (!boxes[i].is_empty()) {
+        part.extend(boxes[i].get_center());
+      }
+    }
+  });
+  BoundingBox center_bounds;
+  for (const BoundingBox &part : part_bounds) {
+    center_bounds.extend(part);
+  }
+  float scale[3];
+  for (int i = 0; i < 3; ++i) {
+    float size = center_bounds.is_empty() ? 0.0f : center_bounds.max[i] - center_bounds.min[i];
+    scale[i] = (size > FLT_EPSILON) ? 1023.0f / size : 0.0f;
+  }
+
+  _keys.resize(count);
+  parallel_for(pool, count, min_items_per_task, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      u32 code = 0u;
+      if (!boxes[i].is_empty()) {
+        Vector3 center = boxes[i].get_center();
+        u32 x = (u32)((center[0] - center_bounds.min[0]) * scale[0]);
+        u32 y = (u32)((center[1] - center_bounds.min[1]) * scale[1]);
+        u32 z = (u32)((center[2] - center_bounds.min[2]) * scale[2]);
+        code = (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+      }
+      _keys[i] = ((u64)code << 32) | (u64)i;
+    }
+  });
+
+  // LSD radix sort on the code bytes.  The keys start out in object order
+  // and the sort is stable, so the index bits are already sorted.
+  std::vector<u64> scratch(count);
+  u64 *src = _keys.data();
+  u64 *dst = scratch.data();
+  for (int shift = 32; shift < 64; shift += 8) {
+    size_t histogram[256] = { };
+    for (size_t i = 0; i < count; ++i) {
+      histogram[(src[i] >> shift) & 0xff]++;
+    }
+    if (histogram[(src[0] >> shift) & 0xff] == count) {
+      continue;
+    }
+    size_t offset = 0u;
+    for (int i = 0; i < 256; ++i) {
+      size_t bucket_count = histogram[i];
+      histogram[i] = offset;
+      offset += bucket_count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      dst[histogram[(src[i] >> shift) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+  if (src != _keys.data()) {
+    memcpy(_keys.data(), src, count * sizeof(u64));
+  }
+
+  _leaf_boxes.resize(count);
+  _leaf_cull.resize(count);
+  _leaf_objects.resize(count);
+  _leaf_parents.resize(count, UINT32_MAX);
+  _object_leaves.resize(count);
+  parallel_for(pool, count, min_items_per_task, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      u32 object = (u32)_keys[i];
+      _leaf_objects[i] = object;
+      _leaf_boxes[i] = boxes[object];
+      _leaf_cull.set(i, boxes[object], BoundingSphere());
+      _object_leaves[object] = (u32)i;
+    }
+  });
+
+  _nodes.resize(count - 1u);
+  if (!_nodes.empty()) {
+    _nodes[0].parent = UINT32_MAX;
+  }
+  parallel_for(pool, count - 1u, min_items_per_task, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      build_node((u32)i);
+    }
+  });
+
+  compute_bounds(pool);
+}
+
+void SceneBvh::
+clear() {
+  _nodes.clear();
+  _leaf_boxes.clear();
+  _leaf_cull.clear();
+  _leaf_objects.clear();
+  _leaf_parents.clear();
+  _keys.clear();
+  _object_leaves.clear();
+  _dirty_leaves.clear();
+}
+
+// Finds the range of leaves covered by internal node n and where it splits,
+// and links it with its children.  Independent of every other node.
+void SceneBvh::
+build_node(u32 n) {
+  const u64 *keys = _keys.data();
+  int count = (int)_keys.size();
+  int i = (int)n;
+
+  // Length of the common key prefix of leaves i and j, or -1 if j is out
+  // of range.  Keys are unique, so it is less than 64.
+  auto delta = [keys, count](int i, int j) -> int {
+    if (j < 0 || j >= count) {
+      return -1;
+    }
+    return std::countl_zero(keys[i] ^ keys[j]);
+  };
+
+  // The range extends towards the neighbor with the longer common prefix.
+  int d = (delta(i, i + 1) > delta(i, i - 1)) ? 1 : -1;
+
+  // Find the other end with an exponential, then binary search for the
+  // farthest leaf that still shares more than the other neighbor.
+  int delta_min = delta(i, i - d);
+  int l_max = 2;
+  while (delta(i, i + l_max * d) > delta_min) {
+    l_max *= 2;
+  }
+  int l = 0;
+  for (int t = l_max / 2; t >= 1; t /= 2) {
+    if (delta(i, i + (l + t) * d) > delta_min) {
+      l += t;
+    }
+  }
+  int j = i + l * d;
+
+  // The split is where the common prefix of the whole range ends.
+  int delta_node = delta(i, j);
+  int s = 0;
+  for (int div = 2; ; div *= 2) {
+    int t = (l + div - 1) / div;
+    if (delta(i, i + (s + t) * d) > delta_node) {
+      s += t;
+    }
+    if (t <= 1) {
+      break;
+    }
+  }
+  int split = i + s * d + std::min(d, 0);
+
+  Node &node = _nodes[n];
+  node.first_leaf = (u32)std::min(i, j);
+  node.last_leaf = (u32)std::max(i, j);
+  if ((int)node.first_leaf == split) {
+    node.children[0] = leaf_bit | (u32)split;
+    _leaf_parents[split] = n;
+  } else {
+    node.children[0] = (u32)split;
+    _nodes[split].parent = n;
+  }
+  if ((int)node.last_leaf == split + 1) {
+    node.children[1] = leaf_bit | (u32)(split + 1);
+    _leaf_parents[split + 1] = n;
+  } else {
+    node.children[1] = (u32)(split + 1);
+    _nodes[split + 1].parent = n;
+  }
+}
+
+// Recomputes the boxes of all internal nodes from the leaves, bottom up.
+// Node indices aren't in any bottom-up order, so every leaf walks up
+// towards the root, and the first child to arrive at a node leaves it to
+// the second one.
+void SceneBvh::
+compute_bounds(ThreadPool *pool) {
+  _visits.assign(_nodes.size(), 0u);
+  u32 *visits = _visits.data();
+  parallel_for(pool, _leaf_boxes.size(), min_items_per_task, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      propagate_bounds((u32)i, visits);
+    }
+  });
+  _dirty_leaves.clear();
+}
+
+void SceneBvh::
+propagate_bounds(u32 leaf, u32 *visits) {
+  u32 n = _leaf_parents[leaf];
+  while (n != UINT32_MAX) {
+    // Orders the sibling's writes before the reads below.
+    std::atomic_ref<u32> visit(visits[n]);
+    if (visit.fetch_add(1u, std::memory_order_acq_rel) == 0u) {
+      return;
+    }
+    Node &node = _nodes[n];
+    node.box = merge_boxes(get_box(node.children[0]), get_box(node.children[1]));
+    n = node.parent;
+  }
+}
+
+// Changes the box of an object.  The tree is updated by the next refit().
+void SceneBvh::
+update(u32 object, const BoundingBox &box) {
+  assert(object < _object_leaves.size());
+  u32 leaf = _object_leaves[object];
+  _leaf_boxes[leaf] = box;
+  _leaf_cull.set(leaf, box, BoundingSphere());
+  _dirty_leaves.push_back(leaf);
+}
+
+// Updates the node boxes for the objects changed with update().  A few
+// objects are refit by walking up from each of them, until a node comes out
+// the same.  If many moved, the whole tree is refit instead.
+void SceneBvh::
+refit(ThreadPool *pool) {
+  if (_dirty_leaves.empty()) {
+    return;
+  }
+  if (_dirty_leaves.size() * 16u > _leaf_boxes.size()) {
+    compute_bounds(pool);
+    return;
+  }
+
+  for (u32 leaf : _dirty_leaves) {
+    u32 n = _leaf_parents[leaf];
+    while (n != UINT32_MAX) {
+      Node &node = _nodes[n];
+      BoundingBox box = merge_boxes(get_box(node.children[0]), get_box(node.children[1]));
+      if (same_box(box, node.box)) {
+        break;
+      }
+      node.box = box;
+      n = node.parent;
+    }
+  }
+  _dirty_leaves.clear();
+}
+
+u32 SceneBvh::
+get_root() const {
+  return _nodes.empty() ? leaf_bit : 0u;
+}
+
+const BoundingBox &SceneBvh::
+get_box(u32 child) const {
+  if (child & leaf_bit) {
+    return _leaf_boxes[child & ~leaf_bit];
+  }
+  return _nodes[child].box;
+}
+
+// Fills visible with the objects whose boxes intersect the frustum, and
+// returns how many there are.  Planes a node is entirely inside of aren't
+// tested again below it, and nodes entirely inside the frustum are
+// accepted with all of their objects.  Small nodes that cross the frustum
+// have their leaves tested in batches.
+size_t SceneBvh::
+cull_frustum(const Frustum &frustum, std::vector<u32> &visible) const {
+  visible.clear();
+  if (_leaf_boxes.empty()) {
+    return 0u;
+  }
+
+  // The tree is at most as deep as the keys are long.
+  struct Entry {
+    u32 child;
+    u32 plane_mask;
+  };
+  Entry stack[130];
+  int top = 0;
+  stack[top++] = { get_root(), (1u << 6) - 1u };
+
+  while (top > 0) {
+    Entry entry = stack[--top];
+    const BoundingBox &box = get_box(entry.child);
+    if (box.is_empty()) {
+      continue;
+    }
+
+    Vector3 center = box.get_center();
+    Vector3 extents = box.get_extents();
+    u32 mask = entry.plane_mask;
+    bool outside = false;
+    for (int p = 0; p < 6 && !outside; ++p) {
+      if (!(mask & (1u << p))) {
+        continue;
+      }
+      const float *plane = frustum.planes[p];
+      float dist = plane[0] * center[0] + plane[1] * center[1] + plane[2] * center[2] + plane[3];
+      float radius = fabsf(plane[0]) * extents[0] + fabsf(plane[1]) * extents[1] + fabsf(plane[2]) * extents[2];
+      if (dist < -radius) {
+        outside = true;
+      } else if (dist >= radius) {
+        mask &= ~(1u << p);
+      }
+    }
+    if (outside) {
+      continue;
+    }
+
+    if (entry.child & leaf_bit) {
+      visible.push_back(_leaf_objects[entry.child & ~leaf_bit]);
+    } else if (mask == 0u) {
+      const Node &node = _nodes[entry.child];
+      for (u32 i = node.first_leaf; i <= node.last_leaf; ++i) {
+        if (!_leaf_boxes[i].is_empty()) {
+          visible.push_back(_leaf_objects[i]);
+        }
+      }
+    } else if (_nodes[entry.child].last_leaf - _nodes[entry.child].first_leaf < max_batch_cull_leaves) {
+      const Node &node = _nodes[entry.child];
+      size_t first = visible.size();
+      visible.resize(first + node.last_leaf - node.first_leaf + 1u);
+      size_t num_visible = ::cull_frustum(frustum, _leaf_cull, node.first_leaf, node.last_leaf + 1u,
+                                          visible.data() + first);
+      visible.resize(first + num_visible);
+      for (size_t i = first; i < visible.size(); ++i) {
+        visible[i] = _leaf_objects[visible[i]];
+      }
+    } else {
+      const Node &node = _nodes[entry.child];
+      stack[top++] = { node.children[1], mask };
+      stack[top++] = { node.children[0], mask };
+    }
+  }
+  return visible.size();
+}
+
+// Returns the distance along the ray at which it enters the box, or
+// FLT_MAX if it misses the box or enters it beyond max_t.
+static inline float
+intersect_box(const BoundingBox &box, const float origin[3],
+              const float inv_dir[3], float max_t) {
+  if (box.is_empty()) {
+    return FLT_MAX;
+  }
+  float t_near = 0.0f;
+  float t_far = max_t;
+  for (int i = 0; i < 3; ++i) {
+    float t0 = (box.min[i] - origin[i]) * inv_dir[i];
+    float t1 = (box.max[i] - origin[i]) * inv_dir[i];
+    t_near = std::max(t_near, std::min(t0, t1));
+    t_far = std::min(t_far, std::max(t0, t1));
+  }
+  return (t_near <= t_far) ? t_near : FLT_MAX;
+}
+
+// Returns the object whose box the ray enters first, and the distance to
+// it in t_hit, or UINT32_MAX if the ray misses every object.  Objects are
+// hit by their boxes, not their geometry.
+u32 SceneBvh::
+pick(const Vector3 &origin, const Vector3 &dir, float &t_hit, float max_t) const {
+  t_hit = max_t;
+  if (_leaf_boxes.empty()) {
+    return UINT32_MAX;
+  }
+
+  float org[3] = { origin[0], origin[1], origin[2] };
+  float inv_dir[3];
+  for (int i = 0; i < 3; ++i) {
+    inv_dir[i] = 1.0f / dir[i];
+  }
+
+  u32 best = UINT32_MAX;
+  u32 stack[130];
+  int top = 0;
+  if (intersect_box(get_box(get_root()), org, inv_dir, t_hit) != FLT_MAX) {
+    stack[top++] = get_root();
+  }
+
+  while (top > 0) {
+    u32 child = stack[--top];
+    if (child & leaf_bit) {
+      float t = intersect_box(_leaf_boxes[child & ~leaf_bit], org, inv_dir, t_hit);
+      if (t < t_hit) {
+        t_hit = t;
+        best = _leaf_objects[child & ~leaf_bit];
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, so the farther one is more likely to
+    // be pruned by then.
+    const Node &node = _nodes[child];
+    float t0 = intersect_box(get_box(node.children[0]), org, inv_dir, t_hit);
+    float t1 = intersect_box(get_box(node.children[1]), org, inv_dir, t_hit);
+    if (t0 > t1) {
+      std::swap(t0, t1);
+      if (t1 != FLT_MAX) {
+        stack[top++] = node.children[0];
+      }
+      if (t0 != FLT_MAX) {
+        stack[top++] = node.children[1];
+      }
+    } else {
+      if (t1 != FLT_MAX) {
+        stack[top++] = node.children[1];
+      }
+      if (t0 != FLT_MAX) {
+        stack[top++] = node.children[0];
+      }
+    }
+  }
+  return best;
+}
@@ -0,0 +1,82 @@
+#ifndef SCENE_BVH_HXX
+#define SCENE_BVH_HXX
+
+#include <vector>
+
+#include "bounds.hxx"
+#include "culling.hxx"
+#include "numeric_types.hxx"
+
+class ThreadPool;
+
+// Bounding volume hierarchy over the world space boxes of a set of objects,
+// for hierarchical frustum culling and ray picking.
+//
+// It is a linear BVH: objects are sorted along a Morton curve through their
+// box centers, and the tree is the radix tree of the sorted codes (Karras
+// 2012).  Every step of the build is either a sort or independent per node,
+// so it runs on a ThreadPool.  A tree over n objects has n - 1 internal
+// nodes, and every node covers a contiguous range of the sorted objects.
+//
+// Frustum culling descends until a node has few enough leaves, and then
+// tests them all with the SIMD kernel of culling.hxx, over boxes kept in
+// leaf order for it.
+//
+// Moving objects are handled by refitting: the boxes are updated in place
+// and the tree keeps its shape.  That gets looser the further objects move
+// from where they were at build time, after which the tree should be
+// rebuilt.
+class SceneBvh {
+public:
+  // Children at or above this are leaves, the rest internal nodes.
+  static constexpr u32 leaf_bit = 0x80000000u;
+
+  struct Node {
+    BoundingBox box;
+    u32 children[2];
+    u32 parent;
+    // Range of sorted leaves below the node, inclusive.
+    u32 first_leaf;
+    u32 last_leaf;
+  };
+
+  void build(const BoundingBox *boxes, size_t count, ThreadPool *pool = nullptr);
+  void clear();
+
+  void update(u32 object, const BoundingBox &box);
+  void refit(ThreadPool *pool = nullptr);
+
+  size_t cull_frustum(const Frustum &frustum, std::vector<u32> &visible) const;
+  u32 pick(const Vector3 &origin, const Vector3 &dir, float &t_hit,
+           float max_t = FLT_MAX) const;
+
+  inline size_t get_num_objects() const { return _leaf_objects.size(); }
+  inline size_t get_num_nodes() const { return _nodes.size(); }
+  inline const Node &get_node(u32 n) const { return _nodes[n]; }
+
+private:
+  u32 get_root() const;
+  const BoundingBox &get_box(u32 child) const;
+  void build_node(u32 n);
+  void compute_bounds(ThreadPool *pool);
+  void propagate_bounds(u32 leaf, u32 *visits);
+
+private:
+  std::vector<Node> _nodes;
+  // Per sorted leaf.
+  std::vector<BoundingBox> _leaf_boxes;
+  CullBounds _leaf_cull;
+  std::vector<u32> _leaf_objects;
+  std::vector<u32> _leaf_parents;
+  // Sorted Morton codes, with the object index in the low bits so that
+  // every key is unique.
+  std::vector<u64> _keys;
+  // Sorted leaf of each object.
+  std::vector<u32> _object_leaves;
+
+  // Leaves updated since the last refit.
+  std::vector<u32> _dirty_leaves;
+  std::vector<u32> _visits;
+};
+
+#endif // SCENE_BVH_HXX
@@ -0,0 +1,165 @@
+#include "scene_graph.hxx"
+#include "thread_pool.hxx"
+
+#include <algorithm>
+
+// Below this many nodes, a subtree is not worth splitting up further.
+static constexpr u32 min_nodes_per_job = 1024u;
+
+// Adds a node under parent, or a root with no_parent, and returns it.  The
+// parent has to be the last node added or one of its ancestors.  The new
+// node gets its world matrix on the next update().
+u32 SceneGraph::
+add_node(u32 parent, const Transform &local) {
+  u32 node = (u32)_parents.size();
+  if (parent != no_parent) {
+    // Only the last node and its ancestors have subtrees that end here.
+    assert(parent < node && _subtree_ends[parent] == node);
+    for (u32 n = parent; n != no_parent; n = _parents[n]) {
+      _subtree_ends[n] = node + 1u;
+    }
+  }
+
+  _parents.push_back(parent);
+  _subtree_ends.push_back(node + 1u);
+  _locals.push_back(local);
+  _worlds.emplace_back();
+  _dirty.push_back(1u);
+  _dirty_nodes.push_back(node);
+  return node;
+}
+
+void SceneGraph::
+clear() {
+  _parents.clear();
+  _subtree_ends.clear();
+  _locals.clear();
+  _worlds.clear();
+  _dirty.clear();
+  _dirty_nodes.clear();
+  _updated_ranges.clear();
+}
+
+void SceneGraph::
+set_local(u32 node, const Transform &local) {
+  assert(node < _parents.size());
+  _locals[node] = local;
+  if (!_dirty[node]) {
+    _dirty[node] = 1u;
+    _dirty_nodes.push_back(node);
+  }
+}
+
+// Recomputes the world matrices of the subtrees of the nodes set since the
+// last update.
+void SceneGraph::
+update(ThreadPool *pool) {
+  _updated_ranges.clear();
+  if (_dirty_nodes.empty()) {
+    return;
+  }
+
+  // In depth-first order, a dirty node either starts a new subtree or lies
+  // within the last one.
+  std::sort(_dirty_nodes.begin(), _dirty_nodes.end());
+  u32 covered = 0u;
+  u32 num_nodes = 0u;
+  for (u32 node : _dirty_nodes) {
+    _dirty[node] = 0u;
+    if (node >= covered) {
+      covered = _subtree_ends[node];
+      _updated_ranges.push_back({ node, covered });
+      num_nodes += covered - node;
+    }
+  }
+  _dirty_nodes.clear();
+
+  int num_threads = (pool != nullptr) ? pool->get_num_threads() + 1 : 1;
+  if (num_threads <= 1 || num_nodes < 2u * min_nodes_per_job) {
+    for (const NodeRange &range : _updated_ranges) {
+      update_range(range);
+    }
+    return;
+  }
+
+  // Several jobs per thread, so that they even out.  Biggest first, since
+  // the pool hands them out in order.
+  u32 max_size = std::max(min_nodes_per_job, num_nodes / (u32)(num_threads * 4));
+  _jobs.clear();
+  for (const NodeRange &range : _updated_ranges) {
+    split_range(range, max_size, _jobs);
+  }
+  std::sort(_jobs.begin(), _jobs.end(), [](const NodeRange &a, const NodeRange &b) {
+    return a.end - a.begin > b.end - b.begin;
+  });
+  pool->run((int)_jobs.size(), [this](int job) {
+    update_range(_jobs[job]);
+  });
+}
+
+// Adds range to out, a subtree or a run of sibling subtrees, after
+// breaking it into its children's subtrees while it is larger than
+// max_size.  The roots of broken subtrees are updated here, so that every
+// job only depends on nodes that are already done.
+void SceneGraph::
+split_range(NodeRange range, u32 max_size, std::vector<NodeRange> &out) {
+  while (range.end - range.begin > max_size && _subtree_ends[range.begin] == range.end) {
+    update_range({ range.begin, range.begin + 1u });
+    ++range.begin;
+    if (range.begin == range.end) {
+      return;
+    }
+    // Runs of small children are grouped into jobs of up to max_size.
+    // Large ones are split again, the last one in this loop.
+    u32 child = range.begin;
+    u32 run_begin = child;
+    while (child < range.end) {
+      u32 child_end = _subtree_ends[child];
+      if (child_end - child > max_size) {
+        if (run_begin < child) {
+          out.push_back({ run_begin, child });
+        }
+        if (child_end == range.end) {
+          break;
+        }
+        split_range({ child, child_end }, max_size, out);
+        run_begin = child_end;
+      } else if (child_end - run_begin > max_size) {
+        out.push_back({ run_begin, child });
+        run_begin = child;
+      }
+      child = child_end;
+    }
+    if (child == range.end) {
+      if (run_begin < range.end) {
+        out.push_back({ run_begin, range.end });
+      }
+      return;
+    }
+    range.begin = child;
+  }
+  out.push_back(range);
+}
+
+// Updates the given nodes, in order.  The parents of all of them must be
+// in the range or already updated.  Local transforms are converted a batch
+// at a time into a buffer that stays in cache, then put under their
+// parents.
+void SceneGraph::
+update_range(NodeRange range) {
+  constexpr u32 batch_size = 64u;
+  Matrix4x4 locals[batch_size];
+  for (u32 begin = range.begin; begin < range.end; begin += batch_size) {
+    u32 count = std::min(batch_size, range.end - begin);
+    transforms_to_matrices(std::span<const Transform>(_locals.data() + begin, count),
+                           std::span<Matrix4x4>(locals, count));
+    for (u32 i = 0u; i < count; ++i) {
+      u32 parent = _parents[begin + i];
+      if (parent != no_parent) {
+        _worlds[begin + i] = locals[i] * _worlds[parent];
+      } else {
+        _worlds[begin + i] = locals[i];
+      }
+    }
+  }
+}
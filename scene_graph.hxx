@@ -0,0 +1,77 @@
+#ifndef SCENE_GRAPH_HXX
+#define SCENE_GRAPH_HXX
+
+#include <vector>
+
+#include "numeric_types.hxx"
+#include "transform.hxx"
+
+class ThreadPool;
+
+// Hierarchy of transforms, stored flat as arrays indexed by node.
+//
+// Nodes are kept in depth-first order, so that the subtree of a node is the
+// range of nodes from it up to its subtree end, and every parent comes
+// before its children.  To keep it that way, a node can only be added under
+// the last node added or one of its ancestors, which is the order a
+// recursive walk over a scene produces.
+//
+// Nodes whose local transform changed are marked dirty, and update()
+// recomputes the world matrices of their subtrees and nothing else.  The
+// subtrees are independent of each other, and are updated in parallel on a
+// ThreadPool.  Large subtrees are split into the subtrees of their
+// children, after computing their root, so that a single moving root
+// still spreads over the threads.
+//
+// World matrices are the local transform times the parent's world matrix,
+// in the renderer's row vector convention, and are ready to hand to it as
+// per-draw or per-instance transforms.  get_updated_ranges() tells which
+// changed in the last update.
+class SceneGraph {
+public:
+  static constexpr u32 no_parent = UINT32_MAX;
+
+  // Nodes [begin, end), which are one or more whole subtrees.
+  struct NodeRange {
+    u32 begin;
+    u32 end;
+  };
+
+  u32 add_node(u32 parent, const Transform &local = Transform());
+  void clear();
+
+  void set_local(u32 node, const Transform &local);
+  void update(ThreadPool *pool = nullptr);
+
+  inline size_t get_num_nodes() const { return _parents.size(); }
+  inline u32 get_parent(u32 node) const { return _parents[node]; }
+  inline u32 get_subtree_end(u32 node) const { return _subtree_ends[node]; }
+  inline const Transform &get_local(u32 node) const { return _locals[node]; }
+  // Valid as of the last update().
+  inline const Matrix4x4 &get_world(u32 node) const { return _worlds[node]; }
+  inline const Matrix4x4 *get_worlds() const { return _worlds.data(); }
+
+  // Subtrees whose world matrices the last update() recomputed, in order.
+  inline const std::vector<NodeRange> &get_updated_ranges() const { return _updated_ranges; }
+
+private:
+  void split_range(NodeRange range, u32 max_size, std::vector<NodeRange> &out);
+  void update_range(NodeRange range);
+
+private:
+  std::vector<u32> _parents;
+  std::vector<u32> _subtree_ends;
+  std::vector<Transform> _locals;
+  std::vector<Matrix4x4> _worlds;
+
+  // Nodes set since the last update, with a flag per node to list each
+  // only once.
+  std::vector<u8> _dirty;
+  std::vector<u32> _dirty_nodes;
+
+  std::vector<NodeRange> _updated_ranges;
+  // Work items of the last update, kept to reuse their memory.
+  std::vector<NodeRange> _jobs;
+};
+
+#endif // SCENE_GRAPH_HXX
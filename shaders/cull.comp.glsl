@@ -0,0 +1,154 @@
+#version 450
+
+// Must match GpuScene::cull_group_size.
+layout(local_size_x = 64) in;
+
+struct GpuObject {
+  mat4 transform;
+  // Model space bounding sphere, center and radius.
+  vec4 bounds;
+  uint firstIndex;
+  uint indexCount;
+  int vertexOffset;
+  uint pad;
+};
+
+// VkDrawIndexedIndirectCommand.
+struct DrawCommand {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+};
+
+layout(std430, binding = 1) readonly buffer ObjectBuffer {
+  GpuObject objects[];
+};
+
+layout(std430, binding = 2) buffer DrawBuffer {
+  uint drawCount;
+  // Objects that failed the occlusion test.
+  uint occludedCount;
+  uint drawPad0;
+  uint drawPad1;
+  DrawCommand draws[];
+};
+
+layout(push_constant) uniform CullParams {
+  vec4 frustumPlanes[6];
+  uint numObjects;
+  // Nonzero to pack the visible draws and count them, otherwise every
+  // object has a draw, with no instances if it was culled.
+  uint compact;
+  // With OCCLUSION, 1 for the early pass and 2 for the late pass.
+  uint phase;
+  // Size of the depth buffer the pyramid was built from.
+  uvec2 depthSize;
+} params;
+
+#ifdef OCCLUSION
+layout(std140, binding = 0) uniform CameraStruct {
+  mat4 viewMatrix;
+  mat4 projMatrix;
+} camera;
+
+// Nonzero for objects that were visible at the end of the last frame.
+layout(std430, binding = 3) buffer VisibilityBuffer {
+  uint visibility[];
+};
+
+layout(binding = 4) uniform sampler2D depthPyramid;
+
+// Returns true if the sphere is entirely behind the depth pyramid.
+bool
+is_occluded(vec3 center, float radius) {
+  // Screen rectangle and nearest depth of the sphere's bounding box.
+  mat4 viewProj = camera.projMatrix * camera.viewMatrix;
+  vec2 lo = vec2(1.0);
+  vec2 hi = vec2(0.0);
+  float nearest = 1.0;
+  for (int i = 0; i < 8; ++i) {
+    vec3 corner = center + radius * vec3(((i & 1) != 0) ? 1.0 : -1.0,
+                                         ((i & 2) != 0) ? 1.0 : -1.0,
+                                         ((i & 4) != 0) ? 1.0 : -1.0);
+    vec4 clip = viewProj * vec4(corner, 1.0);
+    if (clip.w <= 0.0) {
+      // Reaches behind the camera, can't be projected.
+      return false;
+    }
+    vec3 ndc = clip.xyz / clip.w;
+    vec2 uv = clamp(ndc.xy * 0.5 + 0.5, 0.0, 1.0);
+    lo = min(lo, uv);
+    hi = max(hi, uv);
+    nearest = min(nearest, ndc.z);
+  }
+
+  // Texel n of pyramid level L covers depth pixels n * 2^(L+1) up to
+  // (n + 1) * 2^(L+1).  Pick the lowest level at which the rectangle
+  // spans at most 2x2 texels.
+  uvec2 p0 = min(uvec2(lo * vec2(params.depthSize)), params.depthSize - 1u);
+  uvec2 p1 = min(uvec2(hi * vec2(params.depthSize)), params.depthSize - 1u);
+  uint span = max(p1.x - p0.x, p1.y - p0.y) + 1u;
+  int level = max(findMSB(span - 1u), 0);
+  level = min(level, textureQueryLevels(depthPyramid) - 1);
+
+  uvec2 levelMax = uvec2(textureSize(depthPyramid, level)) - 1u;
+  uvec2 t0 = min(p0 >> (level + 1), levelMax);
+  uvec2 t1 = min(p1 >> (level + 1), levelMax);
+  float farthest = max(max(texelFetch(depthPyramid, ivec2(t0.x, t0.y), level).r,
+                           texelFetch(depthPyramid, ivec2(t1.x, t0.y), level).r),
+                       max(texelFetch(depthPyramid, ivec2(t0.x, t1.y), level).r,
+                           texelFetch(depthPyramid, ivec2(t1.x, t1.y), level).r));
+  return nearest > farthest;
+}
+#endif
+
+void
+main() {
+  uint id = gl_GlobalInvocationID.x;
+  if (id >= params.numObjects) {
+    return;
+  }
+
+  GpuObject obj = objects[id];
+  vec3 center = (obj.transform * vec4(obj.bounds.xyz, 1.0)).xyz;
+  float scale = max(max(length(obj.transform[0].xyz), length(obj.transform[1].xyz)),
+                    length(obj.transform[2].xyz));
+  float radius = obj.bounds.w * scale;
+
+  bool visible = true;
+  for (int i = 0; i < 6; ++i) {
+    visible = visible && dot(params.frustumPlanes[i].xyz, center) + params.frustumPlanes[i].w >= -radius;
+  }
+
+#ifdef OCCLUSION
+  // The early pass draws what was visible last frame.  The late pass tests
+  // everything in the frustum against the depth of what the early pass drew,
+  // and draws what became visible.  What it finds is what the next frame's
+  // early pass draws.
+  if (params.phase == 1u) {
+    visible = visible && visibility[id] != 0u;
+  } else {
+    bool drawn = visibility[id] != 0u;
+    if (visible && is_occluded(center, radius)) {
+      atomicAdd(occludedCount, 1u);
+      visible = false;
+    }
+    visibility[id] = visible ? 1u : 0u;
+    visible = visible && !drawn;
+  }
+#endif
+
+  // The object index goes in firstInstance, for the vertex shader to fetch
+  // the transform with.
+  if (params.compact != 0u) {
+    if (!visible) {
+      return;
+    }
+    uint slot = atomicAdd(drawCount, 1u);
+    draws[slot] = DrawCommand(obj.indexCount, 1u, obj.firstIndex, obj.vertexOffset, id);
+  } else {
+    draws[id] = DrawCommand(obj.indexCount, visible ? 1u : 0u, obj.firstIndex, obj.vertexOffset, id);
+  }
+}
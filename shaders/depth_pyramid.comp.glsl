@@ -0,0 +1,38 @@
+#version 450
+
+// Reduces one level of the depth pyramid from the level above it, or from
+// the depth buffer for level 0.  Each texel keeps the farthest depth of the
+// source texels it covers.
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(binding = 0) uniform sampler2D srcDepth;
+layout(binding = 1, r32f) uniform writeonly image2D dstLevel;
+
+void
+main() {
+  ivec2 dstSize = imageSize(dstLevel);
+  ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+  if (pos.x >= dstSize.x || pos.y >= dstSize.y) {
+    return;
+  }
+
+  // Every texel covers a 2x2 block.  Levels are rounded up, so with an odd
+  // source size, the last texel also takes in the leftover row or column.
+  ivec2 srcSize = textureSize(srcDepth, 0);
+  ivec2 first = pos * 2;
+  ivec2 last = min(first + 1, srcSize - 1);
+  if (pos.x == dstSize.x - 1) {
+    last.x = srcSize.x - 1;
+  }
+  if (pos.y == dstSize.y - 1) {
+    last.y = srcSize.y - 1;
+  }
+
+  float depth = 0.0;
+  for (int y = first.y; y <= last.y; ++y) {
+    for (int x = first.x; x <= last.x; ++x) {
+      depth = max(depth, texelFetch(srcDepth, ivec2(x, y), 0).r);
+    }
+  }
+  imageStore(dstLevel, pos, vec4(depth));
+}
@@ -0,0 +1,33 @@
+#version 450
+
+layout(location = 0) in vec3 vtx_position;
+layout(location = 1) in vec2 vtx_texcoord;
+layout(location = 2) in vec3 vtx_normal;
+
+struct GpuObject {
+  mat4 transform;
+  vec4 bounds;
+  uint firstIndex;
+  uint indexCount;
+  int vertexOffset;
+  uint pad;
+};
+
+layout(std140, binding = 0) uniform CameraStruct {
+  mat4 viewMatrix;
+  mat4 projMatrix;
+} camera;
+
+layout(std430, binding = 1) readonly buffer ObjectBuffer {
+  GpuObject objects[];
+};
+
+layout(location = 0) out vec4 l_vtxColor;
+
+void
+main() {
+  // The culling shader put the object index in firstInstance.
+  mat4 modelMatrix = objects[gl_InstanceIndex].transform;
+  gl_Position = camera.projMatrix * camera.viewMatrix * modelMatrix * vec4(vtx_position, 1.0);
+  l_vtxColor = vec4(vtx_normal * 0.5 + 0.5, 1.0);
+}
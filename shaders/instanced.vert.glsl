@@ -0,0 +1,26 @@
+#version 430
+
+layout(location = 0) in vec3 vtx_position;
+layout(location = 1) in vec2 vtx_texcoord;
+layout(location = 2) in vec3 vtx_normal;
+
+// Per-instance model matrix, one attribute per row of the CPU-side matrix.
+layout(location = 3) in vec4 inst_model0;
+layout(location = 4) in vec4 inst_model1;
+layout(location = 5) in vec4 inst_model2;
+layout(location = 6) in vec4 inst_model3;
+
+layout(std140, binding = 0) uniform CamParamsStruct {
+  mat4 modelMatrix;
+  mat4 viewMatrix;
+  mat4 projMatrix;
+} camParams;
+
+layout(location = 0) out vec4 l_vtxColor;
+
+void
+main() {
+  mat4 modelMatrix = mat4(inst_model0, inst_model1, inst_model2, inst_model3);
+  gl_Position = camParams.projMatrix * camParams.viewMatrix * modelMatrix * vec4(vtx_position, 1.0);
+  l_vtxColor = vec4(vtx_normal * 0.5 + 0.5, 1.0);
+}
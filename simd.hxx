@@ -0,0 +1,393 @@
+#ifndef SIMD_HXX
+#define SIMD_HXX
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <stdint.h>
+
+// Detects the widest SIMD instruction set enabled at compile time.  MSVC
+// only defines __AVX2__ with /arch:AVX2, and always has SSE2 on x64.
+//
+//   SIMD_AVX2         8-wide float vectors in __m256
+//   SIMD_SSE2         4-wide float vectors in __m128
+//   SIMD_NEON         4-wide float vectors in float32x4_t, on ARM64
+//   SIMD_FMA          fused multiply-add on x86 vectors
+//   SIMD_FLOAT_WIDTH  floats per vector of the widest x86 set, 1 without
+//                     one.  Code written against it uses x86 intrinsics.
+#if defined(__AVX2__)
+#define SIMD_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#endif
+#if !defined(SIMD_SSE2) && (defined(__aarch64__) || defined(_M_ARM64))
+#define SIMD_NEON 1
+#endif
+
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define SIMD_FMA 1
+#endif
+
+#if defined(SIMD_AVX2) || defined(SIMD_FMA)
+#include <immintrin.h>
+#endif
+#if defined(SIMD_AVX2)
+#define SIMD_FLOAT_WIDTH 8
+#elif defined(SIMD_SSE2)
+#include <emmintrin.h>
+#define SIMD_FLOAT_WIDTH 4
+#else
+#define SIMD_FLOAT_WIDTH 1
+#endif
+
+#if defined(SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
+// Four floats, in an SSE or NEON register where there is one.  For code
+// that wants the same 4-wide math on every target rather than the widest
+// vectors of one.
+//
+// Every operation but f32x4_madd() is a plain per-lane IEEE operation, so
+// a sequence of them rounds exactly like the same sequence on scalars.
+//
+// Comparisons return masks, with all bits of a lane set where true.
+struct f32x4 {
+#if defined(SIMD_SSE2)
+  __m128 v;
+#elif defined(SIMD_NEON)
+  float32x4_t v;
+#else
+  float v[4];
+#endif
+};
+
+// Loads from and stores to 16-byte aligned memory.
+inline f32x4
+f32x4_load(const float *p) {
+#if defined(SIMD_SSE2)
+  return { _mm_load_ps(p) };
+#elif defined(SIMD_NEON)
+  return { vld1q_f32(p) };
+#else
+  return { { p[0], p[1], p[2], p[3] } };
+#endif
+}
+
+inline void
+f32x4_store(float *p, f32x4 a) {
+#if defined(SIMD_SSE2)
+  _mm_store_ps(p, a.v);
+#elif defined(SIMD_NEON)
+  vst1q_f32(p, a.v);
+#else
+  for (int i = 0; i < 4; ++i) {
+    p[i] = a.v[i];
+  }
+#endif
+}
+
+// Loads from and stores to memory with any alignment.
+inline f32x4
+f32x4_loadu(const float *p) {
+#if defined(SIMD_SSE2)
+  return { _mm_loadu_ps(p) };
+#elif defined(SIMD_NEON)
+  return { vld1q_f32(p) };
+#else
+  return { { p[0], p[1], p[2], p[3] } };
+#endif
+}
+
+inline void
+f32x4_storeu(float *p, f32x4 a) {
+#if defined(SIMD_SSE2)
+  _mm_storeu_ps(p, a.v);
+#elif defined(SIMD_NEON)
+  vst1q_f32(p, a.v);
+#else
+  for (int i = 0; i < 4; ++i) {
+    p[i] = a.v[i];
+  }
+#endif
+}
+
+inline f32x4
+f32x4_set1(float x) {
+#if defined(SIMD_SSE2)
+  return { _mm_set1_ps(x) };
+#elif defined(SIMD_NEON)
+  return { vdupq_n_f32(x) };
+#else
+  return { { x, x, x, x } };
+#endif
+}
+
+inline f32x4
+f32x4_set(float x, float y, float z, float w) {
+#if defined(SIMD_SSE2)
+  return { _mm_setr_ps(x, y, z, w) };
+#elif defined(SIMD_NEON)
+  const float lanes[4] = { x, y, z, w };
+  return { vld1q_f32(lanes) };
+#else
+  return { { x, y, z, w } };
+#endif
+}
+
+// Returns the first lane.
+inline float
+f32x4_get_x(f32x4 a) {
+#if defined(SIMD_SSE2)
+  return _mm_cvtss_f32(a.v);
+#elif defined(SIMD_NEON)
+  return vgetq_lane_f32(a.v, 0);
+#else
+  return a.v[0];
+#endif
+}
+
+#if defined(SIMD_SSE2)
+#define F32X4_LANEWISE(name, sse, neon, op) \
+  inline f32x4 name(f32x4 a, f32x4 b) { return { sse(a.v, b.v) }; }
+#elif defined(SIMD_NEON)
+#define F32X4_LANEWISE(name, sse, neon, op) \
+  inline f32x4 name(f32x4 a, f32x4 b) { return { neon(a.v, b.v) }; }
+#else
+#define F32X4_LANEWISE(name, sse, neon, op) \
+  inline f32x4 name(f32x4 a, f32x4 b) { \
+    f32x4 out; \
+    for (int i = 0; i < 4; ++i) { \
+      out.v[i] = op(a.v[i], b.v[i]); \
+    } \
+    return out; \
+  }
+#endif
+
+#define F32X4_ADD(a, b) ((a) + (b))
+#define F32X4_SUB(a, b) ((a) - (b))
+#define F32X4_MUL(a, b) ((a) * (b))
+#define F32X4_DIV(a, b) ((a) / (b))
+F32X4_LANEWISE(operator +, _mm_add_ps, vaddq_f32, F32X4_ADD)
+F32X4_LANEWISE(operator -, _mm_sub_ps, vsubq_f32, F32X4_SUB)
+F32X4_LANEWISE(operator *, _mm_mul_ps, vmulq_f32, F32X4_MUL)
+F32X4_LANEWISE(operator /, _mm_div_ps, vdivq_f32, F32X4_DIV)
+F32X4_LANEWISE(f32x4_min, _mm_min_ps, vminq_f32, std::min)
+F32X4_LANEWISE(f32x4_max, _mm_max_ps, vmaxq_f32, std::max)
+#undef F32X4_ADD
+#undef F32X4_SUB
+#undef F32X4_MUL
+#undef F32X4_DIV
+#undef F32X4_LANEWISE
+
+// Returns (a[i0], a[i1], b[i2], b[i3]), like _mm_shuffle_ps().
+template<int i0, int i1, int i2, int i3>
+inline f32x4
+f32x4_shuffle(f32x4 a, f32x4 b) {
+#if defined(SIMD_SSE2)
+  return { _mm_shuffle_ps(a.v, b.v, _MM_SHUFFLE(i3, i2, i1, i0)) };
+#elif defined(SIMD_NEON)
+  float32x4_t out = vdupq_n_f32(vgetq_lane_f32(a.v, i0));
+  out = vsetq_lane_f32(vgetq_lane_f32(a.v, i1), out, 1);
+  out = vsetq_lane_f32(vgetq_lane_f32(b.v, i2), out, 2);
+  out = vsetq_lane_f32(vgetq_lane_f32(b.v, i3), out, 3);
+  return { out };
+#else
+  return { { a.v[i0], a.v[i1], b.v[i2], b.v[i3] } };
+#endif
+}
+
+// Returns (a[i0], a[i1], a[i2], a[i3]).
+template<int i0, int i1, int i2, int i3>
+inline f32x4
+f32x4_swizzle(f32x4 a) {
+  return f32x4_shuffle<i0, i1, i2, i3>(a, a);
+}
+
+// Returns lane i of a in every lane.
+template<int i>
+inline f32x4
+f32x4_splat(f32x4 a) {
+#if defined(SIMD_NEON)
+  return { vdupq_laneq_f32(a.v, i) };
+#else
+  return f32x4_swizzle<i, i, i, i>(a);
+#endif
+}
+
+// Transposes the 4x4 matrix with rows r0-r3 in place.
+inline void
+f32x4_transpose(f32x4 &r0, f32x4 &r1, f32x4 &r2, f32x4 &r3) {
+#if defined(SIMD_SSE2)
+  _MM_TRANSPOSE4_PS(r0.v, r1.v, r2.v, r3.v);
+#elif defined(SIMD_NEON)
+  float32x4x2_t t01 = vtrnq_f32(r0.v, r1.v);
+  float32x4x2_t t23 = vtrnq_f32(r2.v, r3.v);
+  r0.v = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+  r1.v = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+  r2.v = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+  r3.v = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+#else
+  f32x4 *rows[4] = { &r0, &r1, &r2, &r3 };
+  for (int i = 0; i < 4; ++i) {
+    for (int j = i + 1; j < 4; ++j) {
+      std::swap(rows[i]->v[j], rows[j]->v[i]);
+    }
+  }
+#endif
+}
+
+inline f32x4
+f32x4_sqrt(f32x4 a) {
+#if defined(SIMD_SSE2)
+  return { _mm_sqrt_ps(a.v) };
+#elif defined(SIMD_NEON)
+  return { vsqrtq_f32(a.v) };
+#else
+  f32x4 out;
+  for (int i = 0; i < 4; ++i) {
+    out.v[i] = std::sqrt(a.v[i]);
+  }
+  return out;
+#endif
+}
+
+// Returns a * b + c, fused where the target has it.
+inline f32x4
+f32x4_madd(f32x4 a, f32x4 b, f32x4 c) {
+#if defined(SIMD_FMA)
+  return { _mm_fmadd_ps(a.v, b.v, c.v) };
+#elif defined(SIMD_NEON)
+  return { vfmaq_f32(c.v, a.v, b.v) };
+#else
+  return a * b + c;
+#endif
+}
+
+inline f32x4
+f32x4_cmpgt(f32x4 a, f32x4 b) {
+#if defined(SIMD_SSE2)
+  return { _mm_cmpgt_ps(a.v, b.v) };
+#elif defined(SIMD_NEON)
+  return { vreinterpretq_f32_u32(vcgtq_f32(a.v, b.v)) };
+#else
+  f32x4 out;
+  for (int i = 0; i < 4; ++i) {
+    out.v[i] = std::bit_cast<float>(a.v[i] > b.v[i] ? 0xffffffffu : 0u);
+  }
+  return out;
+#endif
+}
+
+// Returns a where the mask is set and b elsewhere.
+inline f32x4
+f32x4_select(f32x4 mask, f32x4 a, f32x4 b) {
+#if defined(SIMD_SSE2)
+  return { _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)) };
+#elif defined(SIMD_NEON)
+  return { vbslq_f32(vreinterpretq_u32_f32(mask.v), a.v, b.v) };
+#else
+  f32x4 out;
+  for (int i = 0; i < 4; ++i) {
+    out.v[i] = (std::bit_cast<uint32_t>(mask.v[i]) != 0u) ? a.v[i] : b.v[i];
+  }
+  return out;
+#endif
+}
+
+// Eight floats, in an AVX register with AVX2 and as two f32x4 halves
+// otherwise.  Same operations and rounding as f32x4.
+struct f32x8 {
+#if defined(SIMD_AVX2)
+  __m256 v;
+#else
+  f32x4 lo;
+  f32x4 hi;
+#endif
+};
+
+#if defined(SIMD_AVX2)
+#define F32X8_UNARY(name, avx, f32x4_func) \
+  inline f32x8 name(f32x8 a) { return { avx(a.v) }; }
+#define F32X8_BINARY(name, avx, f32x4_func) \
+  inline f32x8 name(f32x8 a, f32x8 b) { return { avx(a.v, b.v) }; }
+#else
+#define F32X8_UNARY(name, avx, f32x4_func) \
+  inline f32x8 name(f32x8 a) { return { f32x4_func(a.lo), f32x4_func(a.hi) }; }
+#define F32X8_BINARY(name, avx, f32x4_func) \
+  inline f32x8 name(f32x8 a, f32x8 b) { return { f32x4_func(a.lo, b.lo), f32x4_func(a.hi, b.hi) }; }
+#endif
+
+#define F32X8_ADD(a, b) ((a) + (b))
+#define F32X8_SUB(a, b) ((a) - (b))
+#define F32X8_MUL(a, b) ((a) * (b))
+#define F32X8_DIV(a, b) ((a) / (b))
+#define F32X8_CMPGT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+F32X8_BINARY(operator +, _mm256_add_ps, F32X8_ADD)
+F32X8_BINARY(operator -, _mm256_sub_ps, F32X8_SUB)
+F32X8_BINARY(operator *, _mm256_mul_ps, F32X8_MUL)
+F32X8_BINARY(operator /, _mm256_div_ps, F32X8_DIV)
+F32X8_BINARY(f32x8_min, _mm256_min_ps, f32x4_min)
+F32X8_BINARY(f32x8_max, _mm256_max_ps, f32x4_max)
+F32X8_BINARY(f32x8_cmpgt, F32X8_CMPGT, f32x4_cmpgt)
+F32X8_UNARY(f32x8_sqrt, _mm256_sqrt_ps, f32x4_sqrt)
+#undef F32X8_ADD
+#undef F32X8_SUB
+#undef F32X8_MUL
+#undef F32X8_DIV
+#undef F32X8_CMPGT
+#undef F32X8_UNARY
+#undef F32X8_BINARY
+
+inline f32x8
+f32x8_loadu(const float *p) {
+#if defined(SIMD_AVX2)
+  return { _mm256_loadu_ps(p) };
+#else
+  return { f32x4_loadu(p), f32x4_loadu(p + 4) };
+#endif
+}
+
+inline void
+f32x8_storeu(float *p, f32x8 a) {
+#if defined(SIMD_AVX2)
+  _mm256_storeu_ps(p, a.v);
+#else
+  f32x4_storeu(p, a.lo);
+  f32x4_storeu(p + 4, a.hi);
+#endif
+}
+
+inline f32x8
+f32x8_set1(float x) {
+#if defined(SIMD_AVX2)
+  return { _mm256_set1_ps(x) };
+#else
+  return { f32x4_set1(x), f32x4_set1(x) };
+#endif
+}
+
+// Returns a * b + c, fused where the target has it.
+inline f32x8
+f32x8_madd(f32x8 a, f32x8 b, f32x8 c) {
+#if defined(SIMD_AVX2) && defined(SIMD_FMA)
+  return { _mm256_fmadd_ps(a.v, b.v, c.v) };
+#elif defined(SIMD_AVX2)
+  return a * b + c;
+#else
+  return { f32x4_madd(a.lo, b.lo, c.lo), f32x4_madd(a.hi, b.hi, c.hi) };
+#endif
+}
+
+// Returns a where the mask is set and b elsewhere.
+inline f32x8
+f32x8_select(f32x8 mask, f32x8 a, f32x8 b) {
+#if defined(SIMD_AVX2)
+  return { _mm256_blendv_ps(b.v, a.v, mask.v) };
+#else
+  return { f32x4_select(mask.lo, a.lo, b.lo), f32x4_select(mask.hi, a.hi, b.hi) };
+#endif
+}
+
+#endif // SIMD_HXX
@@ -0,0 +1,327 @@
+#include "thread_pool.hxx"
+
+// Pool and worker index of the current thread, if it is a worker.
+static thread_local const ThreadPool *t_pool = nullptr;
+static thread_local int t_worker = -1;
+
+// Recycled jobs of the current thread.  Jobs are freed by whichever thread
+// ran them, so the caches drift, and are capped.
+static constexpr size_t max_cached_jobs = 1024u;
+struct JobCache {
+  std::vector<Job *> jobs;
+
+  ~JobCache() {
+    for (Job *job : jobs) {
+      delete job;
+    }
+  }
+};
+static thread_local JobCache t_job_cache;
+
+// Tries to steal this many times over the other workers before sleeping.
+static constexpr int steal_rounds = 64;
+
+bool WorkStealingDeque::
+push(Job *job) {
+  int64_t b = _bottom.load(std::memory_order_relaxed);
+  int64_t t = _top.load(std::memory_order_acquire);
+  if (b - t >= capacity) {
+    return false;
+  }
+  _jobs[b & (capacity - 1)].store(job, std::memory_order_relaxed);
+  _bottom.store(b + 1, std::memory_order_release);
+  return true;
+}
+
+Job *WorkStealingDeque::
+pop() {
+  int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+  _bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = _top.load(std::memory_order_relaxed);
+  if (t > b) {
+    // Empty.
+    _bottom.store(b + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  Job *job = _jobs[b & (capacity - 1)].load(std::memory_order_relaxed);
+  if (t == b) {
+    // Last job, which a thief may be taking at the same time.
+    if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      job = nullptr;
+    }
+    _bottom.store(b + 1, std::memory_order_relaxed);
+  }
+  return job;
+}
+
+Job *WorkStealingDeque::
+steal() {
+  int64_t t = _top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t b = _bottom.load(std::memory_order_acquire);
+  if (t >= b) {
+    return nullptr;
+  }
+
+  Job *job = _jobs[t & (capacity - 1)].load(std::memory_order_relaxed);
+  if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return job;
+}
+
+ThreadPool::
+ThreadPool(int num_threads) {
+  for (int i = 0; i < num_threads; ++i) {
+    _workers.push_back(std::make_unique<Worker>());
+  }
+  // Started once all deques exist, since workers steal from each other.
+  for (int i = 0; i < num_threads; ++i) {
+    _workers[i]->thread = std::thread(&ThreadPool::worker_main, this, i);
+  }
+}
+
+// Jobs still queued are dropped, without running.
+ThreadPool::
+~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(_sleep_lock);
+    _shutdown = true;
+  }
+  _sleep_cvar.notify_all();
+  for (std::unique_ptr<Worker> &worker : _workers) {
+    worker->thread.join();
+  }
+}
+
+// Runs func(task) for every task in [0, num_tasks) and returns once all of
+// them have finished.  The order in which tasks run is unspecified, and
+// tasks may run concurrently with each other.
+void ThreadPool::
+run(int num_tasks, const TaskFunc &func) {
+  if (num_tasks <= 0) {
+    return;
+  }
+  if (num_tasks == 1 || _workers.empty()) {
+    for (int i = 0; i < num_tasks; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  // Tasks are handed out one by one from a shared counter, to as many jobs
+  // as there are threads, which keeps uneven tasks balanced.
+  std::atomic<int> next_task(0);
+  auto run_tasks = [&func, &next_task, num_tasks]() {
+    int task;
+    while ((task = next_task.fetch_add(1)) < num_tasks) {
+      func(task);
+    }
+  };
+  JobCounter counter;
+  int num_jobs = std::min(num_tasks, get_num_threads() + 1);
+  for (int i = 1; i < num_jobs; ++i) {
+    submit(run_tasks, &counter, "run");
+  }
+  run_tasks();
+  wait(counter);
+}
+
+// Runs jobs until the counter is done.
+void ThreadPool::
+wait(JobCounter &counter) {
+  int worker = get_worker_index();
+  while (!counter.is_done()) {
+    Job *job = find_job(worker);
+    if (job != nullptr) {
+      execute(job, worker);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+bool ThreadPool::
+should_split() const {
+  int worker = get_worker_index();
+  if (worker >= 0) {
+    return _workers[worker]->deque.get_size() < 2;
+  } else {
+    return _num_injected.load(std::memory_order_relaxed) < _workers.size();
+  }
+}
+
+// Must not be called while jobs are running.  Idle workers read the sleep
+// hooks under the sleep lock.
+void ThreadPool::
+set_trace_hooks(const JobTraceHooks &hooks) {
+  std::lock_guard<std::mutex> guard(_sleep_lock);
+  _hooks = hooks;
+}
+
+Job *ThreadPool::
+alloc_job() {
+  if (!t_job_cache.jobs.empty()) {
+    Job *job = t_job_cache.jobs.back();
+    t_job_cache.jobs.pop_back();
+    return job;
+  }
+  return new Job;
+}
+
+void ThreadPool::
+free_job(Job *job) {
+  if (t_job_cache.jobs.size() < max_cached_jobs) {
+    t_job_cache.jobs.push_back(job);
+  } else {
+    delete job;
+  }
+}
+
+// Queues a job on the current worker's deque, or the shared queue from
+// other threads, and wakes up a worker to steal it.
+void ThreadPool::
+push_job(Job *job) {
+  int worker = get_worker_index();
+  if (worker >= 0) {
+    if (!_workers[worker]->deque.push(job)) {
+      // Full, which only deep recursion gets to.
+      execute(job, worker);
+      return;
+    }
+  } else {
+    std::lock_guard<std::mutex> guard(_inject_lock);
+    _injected.push_back(job);
+    _num_injected.fetch_add(1);
+  }
+  notify_workers();
+}
+
+// Returns a job for the given worker, or -1 for another thread, to run:
+// the newest of its own, the oldest of the shared queue, or one stolen
+// from another worker.  Null if none was found.
+Job *ThreadPool::
+find_job(int worker) {
+  if (worker >= 0) {
+    Job *job = _workers[worker]->deque.pop();
+    if (job != nullptr) {
+      return job;
+    }
+  }
+
+  if (_num_injected.load() > 0u) {
+    std::lock_guard<std::mutex> guard(_inject_lock);
+    if (!_injected.empty()) {
+      Job *job = _injected.front();
+      _injected.pop_front();
+      _num_injected.fetch_sub(1);
+      return job;
+    }
+  }
+
+  // Start with the next worker over, so that thieves spread out.
+  int num_workers = (int)_workers.size();
+  for (int i = 1; i <= num_workers; ++i) {
+    int victim = (worker + i) % num_workers;
+    if (victim < 0 || victim == worker) {
+      continue;
+    }
+    Job *job = _workers[victim]->deque.steal();
+    if (job != nullptr) {
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+void ThreadPool::
+execute(Job *job, int worker) {
+  if (_hooks.job_begin != nullptr) {
+    _hooks.job_begin(_hooks.user, job->name, worker);
+  }
+  job->invoke(job);
+  if (_hooks.job_end != nullptr) {
+    _hooks.job_end(_hooks.user, job->name, worker);
+  }
+
+  JobCounter *counter = job->counter;
+  job->destroy(job);
+  free_job(job);
+
+  if (counter != nullptr) {
+    // Keeps the counter from reading as done, and being destroyed, until
+    // its continuations are taken off it.  Once they are, the counter is
+    // not touched again, since the continuations may finish and their
+    // waiter destroy it before they are even queued.
+    std::vector<Job *> continuations;
+    counter->_finishing.fetch_add(1);
+    if (counter->_count.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> guard(counter->_lock);
+      continuations.swap(counter->_continuations);
+    }
+    counter->_finishing.fetch_sub(1);
+    for (Job *next : continuations) {
+      push_job(next);
+    }
+  }
+}
+
+void ThreadPool::
+notify_workers() {
+  _epoch.fetch_add(1u);
+  if (_num_sleeping.load() > 0) {
+    // Taking the lock makes sure that a worker about to sleep either sees
+    // the new epoch or is already waiting.
+    { std::lock_guard<std::mutex> guard(_sleep_lock); }
+    _sleep_cvar.notify_one();
+  }
+}
+
+int ThreadPool::
+get_worker_index() const {
+  return (t_pool == this) ? t_worker : -1;
+}
+
+void ThreadPool::
+worker_main(int worker) {
+  t_pool = this;
+  t_worker = worker;
+
+  while (true) {
+    unsigned int epoch = _epoch.load();
+    Job *job = nullptr;
+    for (int i = 0; i < steal_rounds && job == nullptr; ++i) {
+      job = find_job(worker);
+    }
+    if (job != nullptr) {
+      execute(job, worker);
+      continue;
+    }
+
+    // Nothing pushed since the epoch was read means nothing to steal.
+    std::unique_lock<std::mutex> guard(_sleep_lock);
+    if (_shutdown) {
+      return;
+    }
+    _num_sleeping.fetch_add(1);
+    if (_epoch.load() == epoch) {
+      if (_hooks.worker_sleep != nullptr) {
+        _hooks.worker_sleep(_hooks.user, worker);
+      }
+      _sleep_cvar.wait(guard, [this, epoch] {
+        return _shutdown || _epoch.load() != epoch;
+      });
+      if (_hooks.worker_wake != nullptr) {
+        _hooks.worker_wake(_hooks.user, worker);
+      }
+    }
+    _num_sleeping.fetch_sub(1);
+    if (_shutdown) {
+      return;
+    }
+  }
+}
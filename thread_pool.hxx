@@ -0,0 +1,261 @@
+#ifndef THREAD_POOL_HXX
+#define THREAD_POOL_HXX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <type_traits>
+
+class ThreadPool;
+
+// A unit of work.  The callable is stored inline, so jobs don't allocate
+// beyond the Job itself, which is recycled.
+struct Job {
+  static constexpr size_t max_func_size = 48u;
+
+  void (*invoke)(Job *job);
+  void (*destroy)(Job *job);
+  class JobCounter *counter;
+  const char *name;
+  alignas(std::max_align_t) unsigned char func[max_func_size];
+};
+
+// Counts unfinished jobs.  Jobs submitted with a counter add one to it and
+// take it off when they finish, and wait() returns when it reaches zero.
+// Continuations submitted with submit_after() run once it does.
+//
+// A counter has to be done, either waited on or checked with is_done(),
+// before it is destroyed or reused.
+class JobCounter {
+public:
+  JobCounter() = default;
+  JobCounter(const JobCounter &) = delete;
+  JobCounter &operator = (const JobCounter &) = delete;
+
+  // Also false while the job that took it to zero is still taking the
+  // continuations off it.
+  inline bool is_done() const {
+    return _count.load() == 0 && _finishing.load() == 0;
+  }
+
+private:
+  friend class ThreadPool;
+
+  std::atomic<int> _count { 0 };
+  std::atomic<int> _finishing { 0 };
+  std::mutex _lock;
+  std::vector<Job *> _continuations;
+};
+
+// Chase-Lev work-stealing deque of jobs, with a fixed capacity.  The
+// owning thread pushes and pops at the bottom, other threads steal from the
+// top.  Follows the memory orderings of Le et al. 2013, with a release
+// store in place of push()'s fence.
+class WorkStealingDeque {
+public:
+  static constexpr int64_t capacity = 4096;
+
+  // Owner only.  Returns false if the deque is full.
+  bool push(Job *job);
+  Job *pop();
+  // Any thread.  May fail when racing another thief or the owner.
+  Job *steal();
+
+  inline int64_t get_size() const {
+    return std::max((int64_t)0, _bottom.load(std::memory_order_relaxed) - _top.load(std::memory_order_relaxed));
+  }
+
+private:
+  alignas(64) std::atomic<int64_t> _top { 0 };
+  alignas(64) std::atomic<int64_t> _bottom { 0 };
+  alignas(64) std::atomic<Job *> _jobs[capacity];
+};
+
+// Called around every job with its name, and the index of the worker that
+// runs it, or -1 for a thread outside the pool.  Also called when a worker
+// goes to sleep for lack of work, and when it wakes back up.  The hooks
+// run on the threads they report on, and must be thread-safe.
+struct JobTraceHooks {
+  void *user = nullptr;
+  void (*job_begin)(void *user, const char *name, int worker) = nullptr;
+  void (*job_end)(void *user, const char *name, int worker) = nullptr;
+  void (*worker_sleep)(void *user, int worker) = nullptr;
+  void (*worker_wake)(void *user, int worker) = nullptr;
+};
+
+// A set of worker threads that run jobs, scheduled by work stealing.
+//
+// Each worker has its own deque of jobs.  It runs the newest job of its
+// own deque first, and when that is empty steals the oldest job of another
+// worker's.  Jobs submitted from threads outside the pool go to a shared
+// queue instead.  Workers sleep when there is nothing to steal.
+//
+// Any thread can submit jobs and wait for them.  A waiting thread runs jobs
+// until its counter is done, instead of blocking, so waiting from within a
+// job is fine, and the thread that submits a batch takes part in running
+// it: a pool with N threads executes with N + 1 threads.
+class ThreadPool {
+public:
+  typedef std::function<void(int)> TaskFunc;
+
+  ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  void run(int num_tasks, const TaskFunc &func);
+
+  template<class Func>
+  inline void submit(const Func &func, JobCounter *counter = nullptr, const char *name = nullptr);
+  template<class Func>
+  inline void submit_after(JobCounter &dependencies, const Func &func,
+                           JobCounter *counter = nullptr, const char *name = nullptr);
+  void wait(JobCounter &counter);
+
+  // True if the calling thread had better split its work up further, since
+  // its queue is running low and idle threads have little to steal.
+  bool should_split() const;
+
+  void set_trace_hooks(const JobTraceHooks &hooks);
+
+  inline int get_num_threads() const { return (int)_workers.size(); }
+
+private:
+  struct Worker {
+    WorkStealingDeque deque;
+    std::thread thread;
+  };
+
+  template<class Func>
+  Job *make_job(const Func &func, JobCounter *counter, const char *name);
+  static Job *alloc_job();
+  static void free_job(Job *job);
+
+  void push_job(Job *job);
+  Job *find_job(int worker);
+  void execute(Job *job, int worker);
+  void notify_workers();
+  int get_worker_index() const;
+
+  void worker_main(int worker);
+
+private:
+  std::vector<std::unique_ptr<Worker>> _workers;
+
+  // Jobs submitted from outside the pool.
+  std::mutex _inject_lock;
+  std::deque<Job *> _injected;
+  std::atomic<size_t> _num_injected { 0 };
+
+  // Sleeping workers wait for the epoch to change, which it does whenever
+  // a job is pushed.
+  std::mutex _sleep_lock;
+  std::condition_variable _sleep_cvar;
+  std::atomic<unsigned int> _epoch { 0u };
+  std::atomic<int> _num_sleeping { 0 };
+  bool _shutdown = false;
+
+  JobTraceHooks _hooks;
+};
+
+template<class Func>
+inline Job *ThreadPool::
+make_job(const Func &func, JobCounter *counter, const char *name) {
+  static_assert(sizeof(Func) <= Job::max_func_size,
+                "Job function too large, capture by reference");
+  static_assert(alignof(Func) <= alignof(std::max_align_t));
+
+  Job *job = alloc_job();
+  new (job->func) Func(func);
+  job->invoke = [](Job *job) {
+    (*std::launder((Func *)job->func))();
+  };
+  job->destroy = [](Job *job) {
+    std::launder((Func *)job->func)->~Func();
+  };
+  job->counter = counter;
+  job->name = name;
+  if (counter != nullptr) {
+    counter->_count.fetch_add(1);
+  }
+  return job;
+}
+
+// Queues func() to run on some thread of the pool, counted by counter if
+// there is one.
+template<class Func>
+inline void ThreadPool::
+submit(const Func &func, JobCounter *counter, const char *name) {
+  push_job(make_job(func, counter, name));
+}
+
+// Queues func() to run once dependencies is done.  It is counted by counter
+// from now on, so waiting on counter also waits for dependencies.
+template<class Func>
+inline void ThreadPool::
+submit_after(JobCounter &dependencies, const Func &func, JobCounter *counter, const char *name) {
+  Job *job = make_job(func, counter, name);
+  {
+    std::lock_guard<std::mutex> guard(dependencies._lock);
+    if (dependencies._count.load() != 0) {
+      dependencies._continuations.push_back(job);
+      return;
+    }
+  }
+  push_job(job);
+}
+
+// Runs func(begin, end) over ranges of [begin, end), by lazy binary
+// splitting: the range is halved, and the upper half handed off as a job,
+// only as long as should_split() says that other threads need work.  So the
+// grain adapts to how busy the pool is, down to min_per_task.
+template<class Func>
+struct ParallelForJob {
+  ThreadPool *pool;
+  const Func *func;
+  JobCounter *counter;
+  size_t min_per_task;
+  size_t begin;
+  size_t end;
+
+  inline void operator () () const {
+    size_t split_end = end;
+    while (split_end - begin >= 2u * min_per_task && pool->should_split()) {
+      size_t mid = begin + (split_end - begin) / 2u;
+      ParallelForJob upper = *this;
+      upper.begin = mid;
+      upper.end = split_end;
+      pool->submit(upper, counter, "parallel_for");
+      split_end = mid;
+    }
+    (*func)(begin, split_end);
+  }
+};
+
+// Runs func(begin, end) over [0, count) in chunks of at least min_per_task
+// items, on the pool if there is one and there is enough work.  There are
+// at most count / min_per_task chunks, or a single one if that is zero.
+template<class Func>
+inline void
+parallel_for(ThreadPool *pool, size_t count, size_t min_per_task, const Func &func) {
+  min_per_task = std::max(min_per_task, (size_t)1u);
+  if (pool == nullptr || pool->get_num_threads() == 0 || count < 2u * min_per_task) {
+    if (count > 0u) {
+      func((size_t)0u, count);
+    }
+    return;
+  }
+  JobCounter counter;
+  ParallelForJob<Func> job { pool, &func, &counter, min_per_task, 0u, count };
+  job();
+  pool->wait(counter);
+}
+
+#endif // THREAD_POOL_HXX
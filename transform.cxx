@@ -0,0 +1,82 @@
+#include "transform.hxx"
+#include "linmath_simd.hxx"
+
+static_assert(sizeof(Transform) == 10 * sizeof(float), "transforms_to_matrices() reads Transforms as floats");
+
+// Compile-time checks of composition, with exact values.
+namespace {
+constexpr Quaternion half_up(0.0f, 0.0f, 1.0f, 0.0f);
+constexpr Transform a(Vector3(1.0f, 2.0f, 3.0f), half_up, Vector3(2.0f));
+constexpr Transform b(Vector3(-4.0f, 0.0f, 0.5f), Quaternion(), Vector3(0.5f, 0.25f, 1.0f));
+static_assert(a.transform_point(Vector3::right()) == Vector3(-1.0f, 2.0f, 3.0f));
+static_assert((a * b).transform_point(Vector3::right()) == b.transform_point(a.transform_point(Vector3::right())));
+static_assert((a * b).to_matrix() == a.to_matrix() * b.to_matrix());
+static_assert(a.inverted().transform_point(a.transform_point(Vector3(3.0f, -1.0f, 0.5f))) == Vector3(3.0f, -1.0f, 0.5f));
+static_assert((a * a.inverted()).to_matrix() == Matrix4x4::identity());
+}
+
+// Transposes the cells of a row, given one column per vector, into that
+// row of four matrices.
+static inline void
+store_row(Matrix4x4 *m, int row, f32x4 c0, f32x4 c1, f32x4 c2, f32x4 c3) {
+  f32x4_transpose(c0, c1, c2, c3);
+  m[0].set_row_x4(row, c0);
+  m[1].set_row_x4(row, c1);
+  m[2].set_row_x4(row, c2);
+  m[3].set_row_x4(row, c3);
+}
+
+// Every lane computes what Transform::to_matrix() does, so that both give
+// the same matrices.  Four transforms at a time are transposed into one
+// vector per component, the rows of their matrices are built one column
+// per vector, and transposed back into a row of each of the four matrices.
+void
+transforms_to_matrices(std::span<const Transform> in, std::span<Matrix4x4> out) {
+  assert(out.size() >= in.size());
+  size_t count = in.size();
+  size_t i = 0u;
+
+  const f32x4 one = f32x4_set1(1.0f);
+  const f32x4 two = f32x4_set1(2.0f);
+  const f32x4 zero = f32x4_set1(0.0f);
+
+  for (; i + 4u <= count; i += 4u) {
+    // Each transform is the floats (qx qy qz qw tx ty tz sx sy sz).
+    const float *t[4];
+    for (int j = 0; j < 4; ++j) {
+      t[j] = (const float *)&in[i + j];
+    }
+    f32x4 x = f32x4_loadu(t[0]);
+    f32x4 y = f32x4_loadu(t[1]);
+    f32x4 z = f32x4_loadu(t[2]);
+    f32x4 w = f32x4_loadu(t[3]);
+    f32x4_transpose(x, y, z, w);
+    f32x4 tx = f32x4_loadu(t[0] + 4);
+    f32x4 ty = f32x4_loadu(t[1] + 4);
+    f32x4 tz = f32x4_loadu(t[2] + 4);
+    f32x4 sx = f32x4_loadu(t[3] + 4);
+    f32x4_transpose(tx, ty, tz, sx);
+    // Only the last two of (tz sx sy sz) are new.
+    f32x4 unused0 = f32x4_loadu(t[0] + 6);
+    f32x4 unused1 = f32x4_loadu(t[1] + 6);
+    f32x4 sy = f32x4_loadu(t[2] + 6);
+    f32x4 sz = f32x4_loadu(t[3] + 6);
+    f32x4_transpose(unused0, unused1, sy, sz);
+
+    Matrix4x4 *m = out.data() + i;
+    store_row(m, 0, (one - two * (y * y + z * z)) * sx,
+                    (two * (x * y + w * z)) * sx,
+                    (two * (x * z - w * y)) * sx, zero);
+    store_row(m, 1, (two * (x * y - w * z)) * sy,
+                    (one - two * (x * x + z * z)) * sy,
+                    (two * (y * z + w * x)) * sy, zero);
+    store_row(m, 2, (two * (x * z + w * y)) * sz,
+                    (two * (y * z - w * x)) * sz,
+                    (one - two * (x * x + y * y)) * sz, zero);
+    store_row(m, 3, tx, ty, tz, one);
+  }
+
+  for (; i < count; ++i) {
+    out[i] = in[i].to_matrix();
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef TRANSFORM_HXX
+#define TRANSFORM_HXX
+
+#include <span>
+
+#include "linmath.hxx"
+
+// Translation, rotation and per-axis scale.  Points are scaled, then
+// rotated, then translated, which is the matrix scale * rotate * translate
+// on row vectors.
+//
+// Transforms compose and invert directly, without building 4x4 matrices,
+// and are only turned into matrices where those are needed, such as for
+// upload.  A * b applies a, then b, like the product of their matrices.
+// TRS is not closed under composition when a rotated transform is followed
+// by a non-uniform scale, which would take a shear to represent.  The
+// scales are then simply multiplied per axis; it is exact whenever the
+// second transform's scale is uniform, and likewise for inverting a
+// transform.
+class Transform {
+public:
+  Transform() = default;
+  constexpr Transform(const Vector3 &translation, const Quaternion &rotation,
+                      const Vector3 &scale = Vector3(1.0f)) :
+    _rotation(rotation), _translation(translation), _scale(scale) { }
+
+  constexpr static Transform identity() { return Transform(); }
+
+  /**
+   * The same transform as Matrix4x4::from_components() with no shear.
+   */
+  inline static Transform from_components(const Vector3 &scale,
+                                          const Vector3 &hpr,
+                                          const Vector3 &translate) {
+    return Transform(translate, Quaternion::from_hpr(hpr), scale);
+  }
+
+  constexpr const Vector3 &get_translation() const { return _translation; }
+  constexpr const Quaternion &get_rotation() const { return _rotation; }
+  constexpr const Vector3 &get_scale() const { return _scale; }
+  constexpr void set_translation(const Vector3 &translation) { _translation = translation; }
+  constexpr void set_rotation(const Quaternion &rotation) { _rotation = rotation; }
+  constexpr void set_scale(const Vector3 &scale) { _scale = scale; }
+
+  constexpr Vector3 transform_point(const Vector3 &point) const {
+    return _rotation.rotate(scaled(point, _scale)) + _translation;
+  }
+  constexpr Vector3 transform_vector(const Vector3 &vec) const {
+    return _rotation.rotate(scaled(vec, _scale));
+  }
+
+  constexpr Transform operator * (const Transform &other) const {
+    Transform out;
+    out._rotation = _rotation * other._rotation;
+    out._translation = other.transform_point(_translation);
+    out._scale = scaled(_scale, other._scale);
+    return out;
+  }
+  constexpr Transform &operator *= (const Transform &other) {
+    *this = *this * other;
+    return *this;
+  }
+
+  constexpr Transform inverted() const {
+    Transform out;
+    out._rotation = _rotation.conjugate();
+    out._scale = Vector3(1.0f / _scale[0], 1.0f / _scale[1], 1.0f / _scale[2]);
+    out._translation = scaled(out._rotation.rotate(_translation), out._scale) * -1.0f;
+    return out;
+  }
+
+  /**
+   * Returns the matrix of the transform, the same that
+   * transforms_to_matrices() produces for it.
+   */
+  constexpr Matrix4x4 to_matrix() const {
+    float x = _rotation.get_x();
+    float y = _rotation.get_y();
+    float z = _rotation.get_z();
+    float w = _rotation.get_w();
+
+    Matrix4x4 out;
+    out.set_row(0, (1.0f - 2.0f * (y * y + z * z)) * _scale[0],
+                   (2.0f * (x * y + w * z)) * _scale[0],
+                   (2.0f * (x * z - w * y)) * _scale[0], 0.0f);
+    out.set_row(1, (2.0f * (x * y - w * z)) * _scale[1],
+                   (1.0f - 2.0f * (x * x + z * z)) * _scale[1],
+                   (2.0f * (y * z + w * x)) * _scale[1], 0.0f);
+    out.set_row(2, (2.0f * (x * z + w * y)) * _scale[2],
+                   (2.0f * (y * z - w * x)) * _scale[2],
+                   (1.0f - 2.0f * (x * x + y * y)) * _scale[2], 0.0f);
+    out.set_row(3, _translation[0], _translation[1], _translation[2], 1.0f);
+    return out;
+  }
+
+private:
+  constexpr static Vector3 scaled(const Vector3 &vec, const Vector3 &scale) {
+    return Vector3(vec[0] * scale[0], vec[1] * scale[1], vec[2] * scale[2]);
+  }
+
+private:
+  // The rotation comes first, so that it loads as a 4-wide vector.
+  Quaternion _rotation;
+  Vector3 _translation = Vector3(0.0f);
+  Vector3 _scale = Vector3(1.0f);
+};
+
+// Converts many transforms to matrices at once, four at a time with SIMD.
+void transforms_to_matrices(std::span<const Transform> in, std::span<Matrix4x4> out);
+
+#endif // TRANSFORM_HXX